@@ -0,0 +1,176 @@
+/*                                             -*- mode:C++; fill-column:100 -*-
+  MFMBenchmark.h - Host-side timing of packet layer operations
+  Copyright (C) 2013 The Regents of the University of New Mexico.  All rights reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301
+  USA
+*/
+
+/**
+  \file MFMBenchmark.h Host-side timing of packet layer operations
+  \author David H. Ackley.
+  \date (C) 2013 All rights reserved.
+  \lgpl
+
+  A #Benchmark times operations on the host, in \c HOST_MODE only, and reports them as text, CSV,
+  or JSON, each compared against a baseline saved from an earlier run.  MFMBenchmark.cpp, built
+  with \c -DBENCH_PACKET_SUITE, uses it to time the packet layer -- see <tt>make bench</tt> for the
+  sim tile -- so that any change to that layer can be checked against numbers from before it.
+ */
+#ifndef MFMBENCHMARK_H_
+#define MFMBENCHMARK_H_
+
+#include "MFMTypes.h"
+
+#ifdef HOST_MODE
+
+#include <stdio.h>         /* For FILE */
+
+/** The most operations one #Benchmark can time, or read from a baseline */
+#define BENCH_MAX_RESULTS 64
+
+/** The longest operation name, plus its null */
+#define BENCH_NAME_BYTES 40
+
+/**
+   Nanoseconds per operation a result may exceed its baseline by, on top of the relative
+   tolerance, before it counts as a regression: a few-ns operation swings by more than any sane
+   percentage from timer and scheduling noise alone.
+ */
+#define BENCH_ALLOWANCE_NS 1.0
+
+/**
+   The signature of a routine that #Benchmark::run() times: Perform the operation being measured
+   \a reps times, and return something that depends on every result, so none of them can be
+   optimized away.
+ */
+typedef u32 BenchBody(u32 reps, void * arg);
+
+/** The formats #Benchmark::write() can produce */
+enum BenchFormat {
+  BENCH_TEXT,        /**< A table for people */
+  BENCH_CSV,         /**< A header line, then a line per operation, as read by
+                          #Benchmark::loadBaseline() */
+  BENCH_JSON         /**< An object with a "results" array of one object per operation */
+};
+
+/** The timing of one operation */
+struct BenchResult {
+  char name[BENCH_NAME_BYTES];
+  u32 bytes;         /**< The bytes each operation handles, for its bytes per second; 0 if none */
+  u32 reps;          /**< The operations in each trial */
+  double ns;         /**< Nanoseconds per operation in the fastest trial */
+
+  /** Megabytes (10^6 bytes) handled per second, or 0 if #bytes is 0 */
+  double megabytesPerSecond() const { return ns > 0 ? bytes*1e3/ns : 0; }
+};
+
+/**
+   A Benchmark times each operation it is given by running it in trials long enough to be measured
+   reliably, and keeping the fastest, which is the least disturbed by everything else the host is
+   doing.
+
+   \usage
+   \code
+    u32 lengths(u32 reps, void * arg) {
+      u8 * packet = (u8 *) arg;
+      u32 sum = 0;
+      for (u32 i = 0; i < reps; ++i) sum += packetLength(packet);
+      return sum;
+    }
+    Benchmark bench;
+    bench.loadBaseline("baseline.csv");
+    bench.run("packetLength", 0, lengths, packet);
+    bench.repeat(2);
+    bench.write(stdout, BENCH_CSV);
+    if (bench.regressions(0.25) > 0) ..something got more than 25% slower..
+   \endcode
+
+   \since 0.9.21
+ */
+class Benchmark {
+public:
+
+  /** Run trials of at least \a seconds each, keeping the fastest of \a trials of them */
+  Benchmark(double seconds = 0.05, u32 trials = 5) ;
+
+  /**
+     Time \a body, called with \a arg, as the operation \a name, handling \a bytes bytes each time.
+
+     \return nanoseconds per operation in the fastest trial.
+
+     \blinks #E_API_MAX_RANGE if #BENCH_MAX_RESULTS operations have already been run, and
+     #E_API_NULL_HANDLER if \a body is null.
+   */
+  double run(const char * name, u32 bytes, BenchBody * body, void * arg = 0) ;
+
+  /**
+     Time every operation run so far again, \a passes more times, in the order they were first run,
+     keeping each one's fastest trial.  So a stretch of the host being busy, long enough to spoil
+     every trial of an operation timed back to back, spoils only those of one pass.
+   */
+  void repeat(u32 passes) ;
+
+  /**
+     Read the nanoseconds per operation of each operation in the CSV file at \a path, as written
+     by #write(), to compare against.
+
+     \return the number of operations read, 0 if \a path couldn't be read.
+   */
+  u32 loadBaseline(const char * path) ;
+
+  /** The baseline nanoseconds per operation for \a name, or 0 if the baseline has none */
+  double getBaseline(const char * name) const ;
+
+  /**
+     Write every result so far to \a out in \a format, with its baseline and ratio if a baseline
+     was loaded.  (Without one, the CSV and JSON have no baseline or ratio columns at all, so a
+     baseline saved from them holds nothing but timings.)
+   */
+  void write(FILE * out, BenchFormat format) const ;
+
+  /**
+     The number of operations more than \a tolerance (0.1 for 10%), plus #BENCH_ALLOWANCE_NS,
+     slower than their baseline, each reported on \a log if it is non-null.
+   */
+  u32 regressions(double tolerance, FILE * log = 0) const ;
+
+  /** The number of operations timed */
+  u32 getCount() const { return count; }
+
+  /** The result of the \a index'th operation timed */
+  const BenchResult & getResult(u32 index) const ;
+
+  /** The combined returns of every #BenchBody, of no interest except to the optimizer */
+  u32 getSink() const { return sink; }
+
+private:
+  /** The fastest of #trials runs of \a body, \a reps at a time, in seconds */
+  double time(u32 reps, BenchBody * body, void * arg) ;
+
+  double seconds;
+  u32 trials;
+  u32 count;
+  u32 sink;
+  BenchResult results[BENCH_MAX_RESULTS];
+  BenchBody * bodies[BENCH_MAX_RESULTS];
+  void * args[BENCH_MAX_RESULTS];
+  u32 baselineCount;
+  BenchResult baseline[BENCH_MAX_RESULTS];
+};
+
+#endif /* HOST_MODE */
+
+#endif /* MFMBENCHMARK_H_ */
@@ -157,14 +157,14 @@
 #define PK_BREAK      0x10   /**< Break interrupt occurred during packet byte(s) */
 #define PK_BUFFER     0x20   /**< Packet exceeded max length, or packet buffer space exhausted */
 #define PK_BAD_ESCAPE 0x40   /**< Packet had invalid escaping on some byte(s) */
-#define PK_RESERVED8  0x80   /**< Reserved; should be zero; should not be read */
+#define PK_CRC        0x80   /**< Packet failed its integrity check; see #packetCrcVerify() */
 
 /** \name Packet flag combinations */
 /*@{*/
 #define PK_BYTE_ERROR (PK_OVERRUN|PK_PARITY|PK_FRAMING|PK_BREAK) /**< If nonzero, some hardware UART
                                                                       per-byte error(s) occurred */
-#define PK_PACKET_ERROR (PK_BUFFER|PK_BAD_ESCAPE)   /**< If nonzero, some protocol or packet level
-                                                         error(s) occurred */
+#define PK_PACKET_ERROR (PK_BUFFER|PK_BAD_ESCAPE|PK_CRC) /**< If nonzero, some protocol or packet
+                                                              level error(s) occurred */
 #define PK_BROKEN (PK_PACKET_ERROR|PK_BYTE_ERROR)   /**< If nonzero, some error(s) of any kind
                                                          occurred in the packet */
 /*@}*/
@@ -0,0 +1,91 @@
+/*                                             -*- mode:C++; fill-column:100 -*-
+  MFMFraming.h - Bulk PFSC packet framing and deframing
+  Copyright (C) 2013 The Regents of the University of New Mexico.  All rights reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301
+  USA
+*/
+
+/**
+  \file MFMFraming.h Bulk PFSC packet framing and deframing
+  \author David H. Ackley.
+  \date (C) 2013 All rights reserved.
+  \lgpl
+ */
+#ifndef MFMFRAMING_H_
+#define MFMFRAMING_H_
+
+#include "MFMTypes.h"
+#include "MFMConstants.h"
+#include "MFMPacket.h"
+
+/**
+   The most bytes that #frameEncode() can produce from \a length data bytes: every byte escaped,
+   plus the terminating #PFSC_END.
+ */
+#define FRAME_ENCODE_MAX_BYTES(length) (2*(length)+1)
+
+/**
+   Frame the \a length bytes at \a data for the wire, escaping each #PFSC_END and #PFSC_ESC, and
+   append a #PFSC_END.  \a dest must have room for #FRAME_ENCODE_MAX_BYTES(\a length) bytes.
+
+   Runs of bytes needing no escapes are found a word or a vector at a time and copied in bulk.
+
+   \return the number of bytes written to \a dest
+
+   \since 0.9.21
+ */
+extern u32 frameEncode(u8 * dest, const u8 * data, u32 length) ;
+
+/**
+   The deframing state carried between calls to #frameDecode(), so that wire bytes may be supplied
+   in arbitrary chunks -- including with an escape sequence split across two chunks.
+
+   \since 0.9.21
+ */
+struct FrameDecodeState {
+  u8 flags;      /**< #PK_BAD_ESCAPE accumulated for the packet being decoded */
+  bool escape;   /**< The last wire byte consumed was an unresolved #PFSC_ESC */
+  bool end;      /**< A #PFSC_END has been consumed; the packet is complete */
+
+  FrameDecodeState() : flags(0), escape(false), end(false) { }
+
+  /** Prepare for the next packet, after the caller has dealt with a completed one */
+  void nextPacket() { flags = 0; end = false; }
+};
+
+/**
+   Deframe up to \a wireLength bytes from \a wire into \a dest, which has room for \a destLength
+   bytes.  Decoding stops after consuming a #PFSC_END (setting \a state.end), when the wire bytes
+   run out, or just before a data byte that would not fit in \a dest.  On return \a destLength
+   holds the number of data bytes actually written.
+
+   Escapes are handled exactly as the byte-at-a-time #MFMPacketIO::storeByte() does: ESC EEND and
+   ESC EESC produce END and ESC data bytes, ESC END sets #PK_BAD_ESCAPE and still ends the packet,
+   and ESC followed by anything else sets #PK_BAD_ESCAPE and keeps that byte as data.  A caller
+   that runs out of room should mark the packet #PK_BUFFER and drop data bytes until the END, as
+   #MFMPacketIO::storeBytes() does.
+
+   In host mode, runs between special bytes are found with SSE2 (or AVX2, when compiled for it);
+   otherwise a word at a time.  Either way they are copied with memcpy.
+
+   \return the number of wire bytes consumed
+
+   \since 0.9.21
+ */
+extern u32 frameDecode(FrameDecodeState & state, u8 * dest, u32 & destLength,
+                       const u8 * wire, u32 wireLength) ;
+
+#endif /* MFMFRAMING_H_ */
@@ -0,0 +1,220 @@
+/*                                             -*- mode:C++; fill-column:100 -*-
+  MFMIntegrity.h - CRC-32C packet trailers and per-face integrity modes
+  Copyright (C) 2013 The Regents of the University of New Mexico.  All rights reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301
+  USA
+*/
+
+/**
+  \file MFMIntegrity.h CRC-32C packet trailers and per-face integrity modes
+  \author David H. Ackley.
+  \date (C) 2013 All rights reserved.
+  \lgpl
+ */
+#ifndef MFMINTEGRITY_H_
+#define MFMINTEGRITY_H_
+
+#include "MFMTypes.h"
+#include "MFMConstants.h"
+#include "MFMPacket.h"
+
+class PacketWriter;  // Forward
+
+/** The bytes a CRC-32C trailer adds to a packet */
+#define CRC32C_TRAILER_BYTES 4
+
+/**
+   Extend the CRC-32C (Castagnoli) \a crc of some data by the \a length bytes at \a data.  Start
+   with a \a crc of 0; crc32c(0,"123456789",9) is 0xE3069283.  On the tile this uses slicing-by-8
+   tables (8KB, built on first use); on a host with SSE4.2 it uses the \c crc32 instruction.
+   \since 0.9.21
+ */
+extern u32 crc32c(u32 crc, const u8 * data, u32 length) ;
+
+/** As #crc32c(), but always using the slicing-by-8 tables.  \since 0.9.21 */
+extern u32 crc32cSlicing8(u32 crc, const u8 * data, u32 length) ;
+
+/**
+   Determine if \a packet ends with a valid #CRC32C_TRAILER_BYTES byte big endian CRC-32C of the rest
+   of its contents.  Like #packetCheckByteValid(), this ignores the #packetCursor().
+
+   \blinks #E_API_INVALID_PACKET if \a packet is null or pointing at something that is detectably
+   corrupt or not a packet.
+
+   \since 0.9.21
+ */
+extern bool packetCrcValid(const u8 * packet) ;
+
+/**
+   Verify the CRC-32C trailer of \a packet in place.  If it is valid, the trailer is removed from
+   the packet, so handlers see only the data it protected; if not, #PK_CRC is set in the packet's
+   #packetFlags(), so reflexes that don't accept #PK_BROKEN packets will ignore it.
+
+   \return true if the trailer was valid.
+
+   \blinks #E_API_INVALID_PACKET if \a packet is null or pointing at something that is detectably
+   corrupt or not a packet.
+
+   \since 0.9.21
+ */
+extern bool packetCrcVerify(u8 * packet) ;
+
+/** \name Face integrity modes, in increasing order of strength */
+/*@{*/
+#define INTEGRITY_NONE       0u   /**< No trailer */
+#define INTEGRITY_CHECK_BYTE 1u   /**< A one byte #CHECK_BYTE_UPDATE trailer */
+#define INTEGRITY_CRC32C     2u   /**< A #CRC32C_TRAILER_BYTES byte CRC-32C trailer */
+#define INTEGRITY_MODE_COUNT 3u
+
+#define INTEGRITY_MODE_BIT(mode) ((u8) (1u<<(mode)))   /**< A mode's bit in a supported-modes mask */
+#define INTEGRITY_ALL_MODES ((u8) ((1u<<INTEGRITY_MODE_COUNT)-1))
+/*@}*/
+
+/** The first byte of an integrity mode offer, or confirmation, packet */
+#define INTEGRITY_OFFER_TAG ((u8) '~')
+
+/** Verification counts kept by each #FaceIntegrity.  \since 0.9.21 */
+struct IntegrityStats {
+  u32 verified;     /**< Packets whose trailer checked out */
+  u32 failed;       /**< Packets whose trailer didn't; each was flagged #PK_CRC */
+  u32 offers;       /**< Offers accepted from the other side */
+  u32 confirms;     /**< Confirmations accepted from the other side */
+};
+
+/**
+   A FaceIntegrity holds the integrity mode negotiated for one face, and counts the results of
+   verifying the packets received on it.  Each side sends an offer listing the modes it supports;
+   on receiving the other side's offer, each side independently settles on the strongest mode both
+   support, so both arrive at the same mode.
+
+   The two directions switch separately, each at a point in its own packet stream, so traffic can
+   keep flowing while they do: after accepting an offer, a side owes the other a confirmation
+   packet naming the agreed mode (#writeConfirm()).  It keeps sealing in its old mode until it
+   writes that, and in the agreed mode from then on; and the other side, which gets the packets in
+   the same order, verifies in its old mode until the confirmation arrives, and in the mode it
+   names from then on.  Until then both modes are #INTEGRITY_NONE.  Offers and confirmations
+   themselves always travel without a trailer.
+
+   Outgoing packets get their trailer with #seal(); incoming packets are checked and stripped of it
+   by #verify().  With the failure counts kept per face, a long or noisy link can run CRC-32C while
+   short links keep the one byte check, or nothing.
+
+   \usage
+   \code
+    FaceIntegrity eastIntegrity;
+    void setup() {
+      PacketWriter w(eastOut);
+      eastIntegrity.writeOffer(w);
+      w.commit();
+    }
+    void eastDispatch(u8 * packet, u8 source) {
+      if (eastIntegrity.acceptOffer(packet)) {             // Negotiation traffic
+        if (eastIntegrity.isConfirmPending()) {
+          PacketWriter w(eastOut);
+          if (eastIntegrity.writeConfirm(w)) w.commit();   // Seal in the agreed mode from here
+        }
+        return;
+      }
+      if (!eastIntegrity.verify(packet)) return;           // Flagged PK_CRC and counted
+      reflexes.dispatch(packet, source);
+    }
+    void sendEast(..) {
+      PacketWriter w(eastOut);
+      ..
+      eastIntegrity.seal(w);
+      w.commit();
+    }
+   \endcode
+
+   \since 0.9.21
+ */
+class FaceIntegrity {
+public:
+
+  /** A face supporting the modes in the mask \a supported.  #INTEGRITY_NONE is always supported. */
+  FaceIntegrity(u8 supported = INTEGRITY_ALL_MODES) ;
+
+  /** The modes this side supports */
+  u8 getSupported() const { return supported; }
+
+  /** The mode agreed on, from the last offer accepted */
+  u8 getMode() const { return mode; }
+
+  /** The mode #seal() uses: the agreed one once confirmed to the other side */
+  u8 getSealMode() const { return sealMode; }
+
+  /** The mode #verify() uses: the one the other side last confirmed */
+  u8 getVerifyMode() const { return verifyMode; }
+
+  /**
+     Force every mode to \a mode, as when both ends are configured alike.
+
+     \blinks #E_API_MAX_RANGE if \a mode is not a mode.
+   */
+  void setMode(u8 mode) ;
+
+  /**
+     Write an offer packet -- #INTEGRITY_OFFER_TAG, 'I', then #getSupported() -- into \a w.
+
+     \return false if it didn't fit.
+   */
+  bool writeOffer(PacketWriter & w) const ;
+
+  /**
+     If \a packet is an offer from the other side, settle on the strongest mode both sides support,
+     and owe the other side a confirmation of it.  If it is a confirmation from the other side,
+     verify in the mode it names from now on.
+
+     \return false, doing nothing, if \a packet is neither.
+   */
+  bool acceptOffer(const u8 * packet) ;
+
+  /** Whether an offer has been accepted since the last #writeConfirm() */
+  bool isConfirmPending() const { return confirmPending; }
+
+  /**
+     Write a confirmation packet -- #INTEGRITY_OFFER_TAG, 'C', then #getMode() -- into \a w, and
+     seal in that mode from now on.  \a w must be committed before anything else is sealed.
+
+     \return false, sealing in the old mode still, if it didn't fit.
+   */
+  bool writeConfirm(PacketWriter & w) ;
+
+  /** Append the seal mode's trailer to what \a w holds.  \return false if it didn't fit. */
+  bool seal(PacketWriter & w) const ;
+
+  /**
+     Check and remove the verify mode's trailer from \a packet, in place.  A packet that fails is
+     flagged #PK_CRC.
+
+     \return false if the packet failed.
+   */
+  bool verify(u8 * packet) ;
+
+  const IntegrityStats & getStats() const { return stats; }
+
+  void resetStats() ;
+
+private:
+  IntegrityStats stats;
+  u8 supported;
+  u8 mode;
+  u8 sealMode;
+  u8 verifyMode;
+  bool confirmPending;
+};
+
+#endif /* MFMINTEGRITY_H_ */
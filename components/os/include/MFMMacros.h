@@ -593,4 +593,23 @@ extern const char * const faceNames[];
 
 #endif
 
+/****************** Memory ordering macros ******************/
+
+/**
+   Keep loads and stores from moving across this point.  Used by single-producer/single-consumer
+   structures (such as #MFMPacketIO) that are shared between interrupt level and background code
+   without masking interrupts: The producer fills in data, does a MEMORY_BARRIER(), and only then
+   publishes the index that makes the data visible; the consumer reads the index, does a
+   MEMORY_BARRIER(), and only then reads the data.
+
+   On the tile there is one core, so it suffices to stop the compiler from reordering.  In host
+   mode the producer and consumer may be real threads on different cores, so a full hardware fence
+   is used.
+ */
+#ifndef HOST_MODE
+#define MEMORY_BARRIER() __asm__ __volatile__ ("" : : : "memory")
+#else
+#define MEMORY_BARRIER() __sync_synchronize()
+#endif
+
 #endif /*MFMMACROS_H_*/
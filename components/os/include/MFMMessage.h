@@ -0,0 +1,213 @@
+/*                                             -*- mode:C++; fill-column:100 -*-
+  MFMMessage.h - Messages larger than a packet, as sequences of fragment packets
+  Copyright (C) 2013 The Regents of the University of New Mexico.  All rights reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301
+  USA
+*/
+
+/**
+  \file MFMMessage.h Messages larger than a packet, as sequences of fragment packets
+  \author David H. Ackley.
+  \date (C) 2013 All rights reserved.
+  \lgpl
+ */
+#ifndef MFMMESSAGE_H_
+#define MFMMESSAGE_H_
+
+#include "MFMTypes.h"
+#include "MFMConstants.h"
+#include "MFMPacket.h"
+
+class PacketWriter;  // Forward
+
+/** The largest message that can be sent as fragments */
+#define MAX_MESSAGE_LENGTH (64u*1024u)
+
+/**
+   The bytes at the front of every fragment packet: The message tag byte (for reflex dispatch), the
+   message id, the fragment index as a #BESHORT, and the total message length as a #BELONG.
+ */
+#define MESSAGE_FRAGMENT_HEADER_BYTES 8
+
+/** The most message bytes carried by one fragment */
+#define MESSAGE_FRAGMENT_PAYLOAD_BYTES (MAX_PACKET_LENGTH-MESSAGE_FRAGMENT_HEADER_BYTES)
+
+/** The most fragments in one message */
+#define MAX_MESSAGE_FRAGMENTS \
+  ((MAX_MESSAGE_LENGTH+MESSAGE_FRAGMENT_PAYLOAD_BYTES-1)/MESSAGE_FRAGMENT_PAYLOAD_BYTES)
+
+/** The default first byte of a fragment packet */
+#define MESSAGE_DEFAULT_TAG ((u8) 'M')
+
+/**
+   One fragment of a message, ready for transmission: #MESSAGE_FRAGMENT_HEADER_BYTES of header
+   followed by \a length bytes at \a data, which points into the message being sent.  \since 0.9.21
+ */
+struct MessageFragment {
+  u8 header[MESSAGE_FRAGMENT_HEADER_BYTES];
+  const u8 * data;
+  u32 length;
+};
+
+/**
+   Called once when the sender is done with a message: its last fragment has been written by
+   #MessageSender::writeNext(), or reported sent after #MessageSender::next().  The message may be
+   reused from then on.  \since 0.9.21
+ */
+typedef void MessageSent(const u8 * message, u32 length, void * arg);
+
+/**
+   A MessageSender splits one message of up to #MAX_MESSAGE_LENGTH bytes into sequence-numbered
+   fragment packets.  It never copies the message: each #MessageFragment refers to a slice of the
+   caller's message, which must therefore stay put until the completion callback.  A face's
+   transmit side pulls fragments with #next() -- or #writeNext() straight into a #PacketWriter --
+   as it has room for them.  A fragment from #next() still refers to the message after it's
+   handed out, so the callback waits until the caller says it's sent: by calling #next() again, or
+   #fragmentSent().
+
+   \usage
+   \code
+    static MessageSender eastSender;
+    void sendWindow(const u8 * window, u32 len) {
+      eastSender.start(window, len, windowSent, 0);  // One call for the whole message..
+    }
+    void eastTXReady() {                             // ..pumped by the face as it has room
+      PacketWriter w(eastOut);
+      if (eastSender.writeNext(w)) w.commit();
+    }
+   \endcode
+
+   \since 0.9.21
+ */
+class MessageSender {
+public:
+
+  MessageSender(u8 tag = MESSAGE_DEFAULT_TAG) ;
+
+  /**
+     Begin sending the \a length bytes at \a message.  \a done, if non-null, is called with \a arg
+     once the last fragment is written by #writeNext(), or reported sent after #next().
+
+     \return false if a message is already being sent.
+
+     \blinks #E_API_MAX_RANGE if \a length exceeds #MAX_MESSAGE_LENGTH, and #E_API_NULL_POINTER if
+     \a message is null but \a length isn't zero.
+   */
+  bool start(const u8 * message, u32 length, MessageSent * done = 0, void * arg = 0) ;
+
+  /** True from #start() until the sender is done with the message */
+  bool isBusy() const { return message != 0; }
+
+  /** How many fragments the current message has in all */
+  u32 fragmentCount() const { return count; }
+
+  /**
+     Fill in \a fragment with the next fragment.  \return false if there are no more, in which
+     case the last one is taken as sent.
+   */
+  bool next(MessageFragment & fragment) ;
+
+  /** Report the fragment from the latest #next() sent; if it was the last, the message is done */
+  void fragmentSent() ;
+
+  /** Write the next fragment into \a writer.  \return false if there are no more, or it didn't
+      fit, in which case the fragment will be offered again. */
+  bool writeNext(PacketWriter & writer) ;
+
+private:
+  const u8 * message;
+  u32 length;
+  u32 count;
+  u32 index;
+  MessageSent * done;
+  void * arg;
+  u8 tag;
+  u8 id;
+};
+
+/** Called with each completely reassembled message.  \since 0.9.21 */
+typedef void MessageReceived(u8 * message, u32 length, u8 face, void * arg);
+
+/** Reassembly statistics kept by each #MessageReassembler.  \since 0.9.21 */
+struct MessageStats {
+  u32 fragments;    /**< Fragments accepted into a message */
+  u32 duplicates;   /**< Fragments already received, ignored */
+  u32 malformed;    /**< Fragment packets with inconsistent headers, ignored */
+  u32 messages;     /**< Messages completely reassembled */
+  u32 abandoned;    /**< Partial messages dropped when a different message started */
+  u32 timeouts;     /**< Partial messages dropped by #MessageReassembler::poll() */
+};
+
+/**
+   A MessageReassembler puts the fragments of messages arriving from one face back together,
+   directly in their final positions in a contiguous caller-supplied buffer, so fragments may
+   arrive in any order.  A partial message is dropped if a fragment of a different message
+   arrives, or if no fragment arrives for longer than the timeout.
+
+   Each fragment costs one copy, from the packet to its place in the buffer; the completed message
+   is handed to the #MessageReceived callback where it sits.
+
+   \since 0.9.21
+ */
+class MessageReassembler {
+public:
+
+  /**
+     Reassemble messages of up to \a capacity bytes into \a buffer, calling \a received for each
+     complete one.  A partial message that sees no new fragment for more than \a timeout ticks (in
+     whatever units the caller passes to #accept() and #poll()) is dropped.
+   */
+  MessageReassembler(u8 * buffer, u32 capacity, MessageReceived * received, void * arg = 0,
+                     u32 timeout = 1000, u8 tag = MESSAGE_DEFAULT_TAG) ;
+
+  /**
+     Take in the fragment packet \a packet, received from \a face at time \a now.  The packet is
+     read from its beginning regardless of #packetCursor(), and is not modified.
+
+     \return false if \a packet was not a usable fragment.
+   */
+  bool accept(u8 * packet, u8 face, u32 now) ;
+
+  /** Drop the partial message, if any, if it has timed out as of \a now */
+  void poll(u32 now) ;
+
+  /** True if part of a message has arrived */
+  bool isBusy() const { return active; }
+
+  const MessageStats & getStats() const { return stats; }
+
+  void resetStats() ;
+
+private:
+  u8 * buffer;
+  u32 capacity;
+  MessageReceived * received;
+  void * arg;
+  u32 timeout;
+  u32 length;       /* Of the message being reassembled */
+  u32 missing;      /* Fragments not yet received */
+  u32 lastActivity;
+  MessageStats stats;
+  u8 have[(MAX_MESSAGE_FRAGMENTS+7)/8];   /* Bitmap of received fragment indices */
+  u8 tag;
+  u8 id;
+  u8 face;
+  bool active;
+
+  void begin(u8 id, u8 face, u32 length, u32 now) ;
+};
+
+#endif /* MFMMESSAGE_H_ */
@@ -29,6 +29,7 @@
 
 #include "MFMTypes.h"
 #include "MFMAssert.h"
+#include "MFMPacketTrace.h"
 
 /**
    The information associated with a packet, when it is stored in memory only -- there is no
@@ -39,7 +40,7 @@ struct PacketHeader {
   u8 f[4];
   enum Fields {
     SOURCE,                   /* NORTH, SOUTH, EAST, WEST, or some more exotic source */ 
-    FLAGS,                    /* PK_OVERRUN|PK_PARITY|PK_FRAMING|PK_BREAK|PK_BUFFER|PK_BAD_ESCAPE */
+    FLAGS,                    /* PK_OVERRUN|PK_PARITY|PK_FRAMING|PK_BREAK|PK_BUFFER|PK_BAD_ESCAPE|PK_CRC */
     CURSOR,                   /* Current read index within the packet */ 
     LENGTH,                   /* Overall packet data length (excluding header and trailing null) */ 
     FIELD_COUNT
@@ -48,6 +49,9 @@ struct PacketHeader {
 
 /** \cond */
 struct PacketBuffer {
+#ifdef MFM_PACKET_TRACE
+  PacketTrace t;
+#endif
   union {
     u32 wh;
     PacketHeader ph;
@@ -65,6 +69,65 @@ struct PacketBuffer {
 #define CHECK_BYTE_INIT_VALUE (0xF0)
 #define CHECK_BYTE_UPDATE(v,d) ((v) =  ((v<<1)|((v>>7)&1))^d)
 
+/**
+   Fold the \a length bytes at \a data into the check byte value \a check, with exactly the result
+   of applying #CHECK_BYTE_UPDATE to each byte in turn.  Since each update is a rotation and an xor,
+   a data byte's contribution depends only on its distance from the end modulo 8, so the data is
+   xored together a word (or, on the host, a vector) at a time and rotated into place once at the
+   end.  \since 0.9.21
+ */
+extern u8 checkByteUpdate(u8 check, const u8 * data, u32 length) ;
+
+/**
+   Determine if the \a length bytes at \a a and at \a b are the same.  When \a a and \a b are
+   equally aligned, all but the first and last few bytes are compared a word at a time.  This is
+   the comparison underneath #packetEqual(), #zpacketPrefix(), and #PacketView.  \since 0.9.21
+ */
+extern bool packetBytesEqual(const u8 * a, const u8 * b, u32 length) ;
+
+/**
+   The check byte of data as it is being produced, so a sender can keep it up to date while writing
+   and append it at no extra cost.
+
+   \usage
+   \code
+    CheckByteAccumulator cba;
+    cba.update(header, sizeof(header));
+    cba.update(payload, payloadLength);
+    ..send header, payload, then cba.get()..
+   \endcode
+
+   \since 0.9.21
+ */
+class CheckByteAccumulator {
+public:
+  CheckByteAccumulator() : value(CHECK_BYTE_INIT_VALUE) { }
+
+  /** Start over, as if nothing had been written */
+  void reset() { value = CHECK_BYTE_INIT_VALUE; }
+
+  /** Account for one more byte */
+  void update(u8 byte) { CHECK_BYTE_UPDATE(value,byte); }
+
+  /** Account for \a length more bytes */
+  void update(const u8 * data, u32 length) { value = checkByteUpdate(value, data, length); }
+
+  /**
+     Account for xoring \a bits into a byte already counted, \a distance bytes before the last one
+     counted (so 0 is the last byte itself).
+   */
+  void amend(u8 bits, u32 distance) {
+    distance &= 7;
+    value ^= (u8) ((bits<<distance)|(bits>>((8-distance)&7)));
+  }
+
+  /** The check byte of everything so far */
+  u8 get() const { return value; }
+
+private:
+  u8 value;
+};
+
 /** Low-level packet handling methods 
     @{
 */
@@ -103,6 +166,8 @@ extern u8 packetCursor(const u8 * packet);
 
 extern bool packetCheckByteValid(const u8 * packet);
 
+extern u32 packetCheckByteValidBatch(const u8 * const * packets, u32 count, bool * results) ;
+
 #define API_ASSERT_VALID_PACKET(u8ptr) API_ASSERT(validPacket(u8ptr),E_API_INVALID_PACKET)
 
 extern bool validPacket(const u8 * packet) ;
@@ -117,6 +182,10 @@ extern bool packetRead(u8 * packet, u64 &result) ;
 
 extern bool packetRead(u8 * packet, u8 * result, u32 length) ;
 
+extern u32 packetReadArray(u8 * packet, int * results, u32 maxCount, int code = DEC, u32 maxLen = MAX_PACKET_LENGTH) ;
+
+extern u32 packetReadArray(u8 * packet, u32 * results, u32 maxCount, int code = DEC, u32 maxLen = MAX_PACKET_LENGTH) ;
+
 extern bool packetReadCheckByte(u8 * packet) ;
 
 extern bool packetReadEOF(u8 * packet) ;
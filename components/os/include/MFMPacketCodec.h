@@ -0,0 +1,304 @@
+/*                                             -*- mode:C++; fill-column:100 -*-
+  MFMPacketCodec.h - Binary packet payloads described by compile-time schemas
+  Copyright (C) 2013 The Regents of the University of New Mexico.  All rights reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301
+  USA
+*/
+
+/**
+  \file MFMPacketCodec.h Binary packet payloads described by compile-time schemas
+  \author David H. Ackley.
+  \date (C) 2013 All rights reserved.
+  \lgpl
+ */
+#ifndef MFMPACKETCODEC_H_
+#define MFMPACKETCODEC_H_
+
+#include <string.h>        /* For memcpy */
+#include "MFMTypes.h"
+#include "MFMConstants.h"
+#include "MFMPacket.h"
+#include "MFMPacketReader.h"
+#include "MFMPacketWriter.h"
+
+/* Whether big endian words can be had by byte-swapping native unaligned loads */
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && defined(__ORDER_LITTLE_ENDIAN__)
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__ && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 8))
+#define MFM_CODEC_BSWAP 1
+#endif
+#endif
+
+/** \cond */
+
+/* Big endian loads and stores of BYTES bytes at a possibly unaligned address.  The general case
+   goes a byte at a time; the power-of-two sizes use one native load or store where that helps. */
+template <u32 BYTES> struct CodecWord {
+  typedef u64 Type;
+  static Type load(const u8 * p) {
+    Type v = 0;
+    for (u32 i = 0; i < BYTES; ++i) v = (v<<8) | p[i];
+    return v;
+  }
+  static void store(u8 * p, Type v) {
+    for (u32 i = BYTES; i-- > 0; v >>= 8) p[i] = (u8) v;
+  }
+};
+
+template <> struct CodecWord<1> {
+  typedef u8 Type;
+  static Type load(const u8 * p) { return *p; }
+  static void store(u8 * p, Type v) { *p = v; }
+};
+
+#ifdef MFM_CODEC_BSWAP
+template <> struct CodecWord<2> {
+  typedef u16 Type;
+  static Type load(const u8 * p) { Type v; memcpy(&v, p, 2); return __builtin_bswap16(v); }
+  static void store(u8 * p, Type v) { v = __builtin_bswap16(v); memcpy(p, &v, 2); }
+};
+template <> struct CodecWord<4> {
+  typedef u32 Type;
+  static Type load(const u8 * p) { Type v; memcpy(&v, p, 4); return __builtin_bswap32(v); }
+  static void store(u8 * p, Type v) { v = __builtin_bswap32(v); memcpy(p, &v, 4); }
+};
+template <> struct CodecWord<8> {
+  typedef u64 Type;
+  static Type load(const u8 * p) { Type v; memcpy(&v, p, 8); return __builtin_bswap64(v); }
+  static void store(u8 * p, Type v) { v = __builtin_bswap64(v); memcpy(p, &v, 8); }
+};
+#endif
+
+/* The scalar types a field may have; others are deliberately left undefined */
+template <class T> struct CodecScalar ;
+template <> struct CodecScalar<u8>  { enum { BYTES = 1 }; };
+template <> struct CodecScalar<s8>  { enum { BYTES = 1 }; };
+template <> struct CodecScalar<u16> { enum { BYTES = 2 }; };
+template <> struct CodecScalar<s16> { enum { BYTES = 2 }; };
+template <> struct CodecScalar<u32> { enum { BYTES = 4 }; };
+template <> struct CodecScalar<s32> { enum { BYTES = 4 }; };
+template <> struct CodecScalar<u64> { enum { BYTES = 8 }; };
+template <> struct CodecScalar<s64> { enum { BYTES = 8 }; };
+
+/* Compiles only if a schema's constraints hold */
+template <bool SCHEMA_CONSTRAINT_HOLDS> struct CodecCheck ;
+template <> struct CodecCheck<true> { enum { OK = 1 }; };
+
+/** \endcond */
+
+/** An unused schema or #CodecBitGroup slot.  \since 0.9.21 */
+struct CodecNone {
+  enum { WIDTH = 0 };
+  template <class S> static u64 pack(u64 word, const S &) { return word; }
+  template <class S> static u64 unpack(u64 word, S &) { return word; }
+};
+
+/**
+   A schema field: member \a M of \a S, of scalar type \a T (u8, s8, u16, s16, u32, s32, u64, or
+   s64), sent big endian in sizeof(\a T) bytes.  \since 0.9.21
+ */
+template <class S, class T, T S::*M>
+struct CodecBE {
+  enum { BYTES = CodecScalar<T>::BYTES };
+  typedef CodecWord<BYTES> Word;
+  static void encode(u8 * p, const S & s) { Word::store(p, (typename Word::Type) (s.*M)); }
+  static void decode(const u8 * p, S & s) { s.*M = (T) Word::load(p); }
+};
+
+/**
+   A schema field: the \a N element array member \a M of \a S, each element sent as by #CodecBE.
+   \since 0.9.21
+ */
+template <class S, class T, u32 N, T (S::*M)[N]>
+struct CodecArray {
+  enum { ELEMENT_BYTES = CodecScalar<T>::BYTES, BYTES = N*ELEMENT_BYTES };
+  typedef CodecWord<ELEMENT_BYTES> Word;
+  static void encode(u8 * p, const S & s) {
+    if (ELEMENT_BYTES == 1) memcpy(p, s.*M, N);
+    else for (u32 i = 0; i < N; ++i)
+      Word::store(p+i*ELEMENT_BYTES, (typename Word::Type) (s.*M)[i]);
+  }
+  static void decode(const u8 * p, S & s) {
+    if (ELEMENT_BYTES == 1) memcpy(s.*M, p, N);
+    else for (u32 i = 0; i < N; ++i)
+      (s.*M)[i] = (T) Word::load(p+i*ELEMENT_BYTES);
+  }
+};
+
+/**
+   A #CodecBitGroup member: the low \a WIDTH bits of member \a M of \a S, taken as unsigned.
+   \since 0.9.21
+ */
+template <class S, class T, T S::*M, u32 BITS>
+struct CodecBits {
+  enum { WIDTH = BITS };
+  static u64 pack(u64 word, const S & s) {
+    return (word<<(WIDTH-1)<<1) | ((u64) (s.*M) & MASK());
+  }
+  static u64 unpack(u64 word, S & s) {
+    s.*M = (T) (word & MASK());
+    return word>>(WIDTH-1)>>1;
+  }
+private:
+  /* Shifting in two steps keeps WIDTH == 64 defined */
+  static u64 MASK() { return (((u64) 1)<<(WIDTH-1)<<1)-1; }
+};
+
+/**
+   A schema field: up to eight #CodecBits packed into one big endian word, first member in the most
+   significant bits.  The widths must total a whole number of bytes, at most 8.  \since 0.9.21
+ */
+template <class B0,              class B1 = CodecNone, class B2 = CodecNone, class B3 = CodecNone,
+          class B4 = CodecNone,  class B5 = CodecNone, class B6 = CodecNone, class B7 = CodecNone>
+struct CodecBitGroup {
+  enum { WIDTH = B0::WIDTH + B1::WIDTH + B2::WIDTH + B3::WIDTH +
+                 B4::WIDTH + B5::WIDTH + B6::WIDTH + B7::WIDTH,
+         BYTES = WIDTH/8 };
+  typedef CodecWord<BYTES> Word;
+  enum { CHECK = CodecCheck<(WIDTH%8 == 0 && WIDTH > 0 && WIDTH <= 64)>::OK };
+
+  template <class S> static void encode(u8 * p, const S & s) {
+    u64 w = 0;
+    w = B0::pack(w, s); w = B1::pack(w, s); w = B2::pack(w, s); w = B3::pack(w, s);
+    w = B4::pack(w, s); w = B5::pack(w, s); w = B6::pack(w, s); w = B7::pack(w, s);
+    Word::store(p, (typename Word::Type) w);
+  }
+  template <class S> static void decode(const u8 * p, S & s) {
+    u64 w = Word::load(p);
+    w = B7::unpack(w, s); w = B6::unpack(w, s); w = B5::unpack(w, s); w = B4::unpack(w, s);
+    w = B3::unpack(w, s); w = B2::unpack(w, s); w = B1::unpack(w, s); B0::unpack(w, s);
+  }
+};
+
+/** \cond */
+
+/* A schema is turned into a list of its fields, as ScanFormat is, and the list is walked at
+   compile time with each field's offset known, so encoding and decoding are straight-line code. */
+struct CodecEnd { enum { BYTES = 0 }; };
+template <class F, class Rest> struct CodecField { enum { BYTES = F::BYTES + Rest::BYTES }; };
+
+template <class F, class Rest> struct CodecCons { typedef CodecField<F,Rest> List; };
+template <class Rest> struct CodecCons<CodecNone,Rest> { typedef CodecEnd List; };
+
+template <class List, u32 OFFSET> struct CodecRun ;
+template <u32 OFFSET> struct CodecRun<CodecEnd,OFFSET> {
+  template <class S> static void encode(u8 *, const S &) { }
+  template <class S> static void decode(const u8 *, S &) { }
+};
+template <class F, class Rest, u32 OFFSET> struct CodecRun<CodecField<F,Rest>,OFFSET> {
+  template <class S> static void encode(u8 * p, const S & s) {
+    F::encode(p+OFFSET, s);
+    CodecRun<Rest,OFFSET+F::BYTES>::encode(p, s);
+  }
+  template <class S> static void decode(const u8 * p, S & s) {
+    F::decode(p+OFFSET, s);
+    CodecRun<Rest,OFFSET+F::BYTES>::decode(p, s);
+  }
+};
+
+/** \endcond */
+
+/**
+   A fixed binary packet layout for the struct \a S, as a list of up to twelve fields -- #CodecBE,
+   #CodecArray, and #CodecBitGroup -- sent in order with no padding.  The layout is worked out at
+   compile time: decoding checks the packet length once for the whole message, then loads each
+   field from its fixed offset with a word load (and a byte swap, on little endian hosts) rather
+   than a byte at a time, and moves the packet cursor once.
+
+   \usage
+   \code
+    struct SiteUpdate { u16 x, y; u64 atom; u8 type, face; };
+    typedef PacketCodec<SiteUpdate,
+                        CodecBE<SiteUpdate,u16,&SiteUpdate::x>,
+                        CodecBE<SiteUpdate,u16,&SiteUpdate::y>,
+                        CodecBE<SiteUpdate,u64,&SiteUpdate::atom>,
+                        CodecBitGroup<CodecBits<SiteUpdate,u8,&SiteUpdate::type,5>,
+                                      CodecBits<SiteUpdate,u8,&SiteUpdate::face,3> > >
+      SiteUpdateCodec;                     // SiteUpdateCodec::BYTES == 13
+
+    void myHandler(u8 * packet) {
+      SiteUpdate su;
+      if (!SiteUpdateCodec::decode(packet, su)) return;     // Too short
+      ..
+    }
+   \endcode
+
+   A layout longer than #MAX_PACKET_LENGTH is a compile-time error.
+
+   \since 0.9.21
+ */
+template <class S,
+          class F0,             class F1 = CodecNone,  class F2 = CodecNone,  class F3 = CodecNone,
+          class F4 = CodecNone, class F5 = CodecNone,  class F6 = CodecNone,  class F7 = CodecNone,
+          class F8 = CodecNone, class F9 = CodecNone,  class F10 = CodecNone, class F11 = CodecNone>
+struct PacketCodec {
+  /** \cond */
+  typedef typename CodecCons<F0, typename PacketCodec<S,F1,F2,F3,F4,F5,F6,F7,F8,F9,F10,F11,
+                                                      CodecNone>::List>::List List;
+  /** \endcond */
+
+  /** The encoded length in bytes */
+  enum { BYTES = List::BYTES };
+
+  /** Encode \a s into the #BYTES bytes at \a dest */
+  static void encode(u8 * dest, const S & s) {
+    (void) CodecCheck<BYTES <= MAX_PACKET_LENGTH>::OK;
+    CodecRun<List,0>::encode(dest, s);
+  }
+
+  /** Encode \a s into \a w.  \return false, writing nothing, if it didn't fit */
+  static bool encode(PacketWriter & w, const S & s) {
+    u8 buf[BYTES+1];               /* +1 keeps an empty layout legal */
+    encode(buf, s);
+    return w.put(buf, BYTES);
+  }
+
+  /**
+     Decode \a s from the next #BYTES of \a r.
+
+     \return false, leaving \a s and the cursor of \a r untouched, if fewer than #BYTES remain.
+   */
+  static bool decode(PacketReader & r, S & s) {
+    if (r.readLength() < (u32) BYTES) return false;
+    CodecRun<List,0>::decode(r.getPacket()+r.cursor(), s);
+    r.reread(r.cursor()+BYTES);
+    return true;
+  }
+
+  /**
+     Decode \a s from \a packet starting at its #packetCursor(), advancing the cursor past it.
+
+     \return false, leaving \a s and the cursor untouched, if fewer than #BYTES remain.
+
+     \blinks #E_API_INVALID_PACKET if \a packet is null or pointing at something that is detectably
+     corrupt or not a packet.
+   */
+  static bool decode(u8 * packet, S & s) {
+    PacketReader r(packet);
+    if (!decode(r, s)) return false;
+    r.commit();
+    return true;
+  }
+};
+
+/** \cond */
+template <class S>
+struct PacketCodec<S,CodecNone,CodecNone,CodecNone,CodecNone,CodecNone,CodecNone,
+                   CodecNone,CodecNone,CodecNone,CodecNone,CodecNone,CodecNone> {
+  typedef CodecEnd List;
+};
+/** \endcond */
+
+#endif /* MFMPACKETCODEC_H_ */
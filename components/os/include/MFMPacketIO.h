@@ -0,0 +1,321 @@
+/*                                             -*- mode:C++; fill-column:100 -*-
+  MFMPacketIO.h - Rolling packet buffer between interrupt level and background
+  Copyright (C) 2009-2013 The Regents of the University of New Mexico.  All rights reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301
+  USA
+*/
+
+/**
+  \file MFMPacketIO.h Rolling packet buffer between interrupt level and background
+  \author David H. Ackley.
+  \date (C) 2009-2013 All rights reserved.
+  \lgpl
+ */
+#ifndef MFMPACKETIO_H_
+#define MFMPACKETIO_H_
+
+#include "MFMTypes.h"
+#include "MFMConstants.h"
+#include "MFMPacket.h"
+
+/** The size of the byte buffer that must be supplied to each #MFMPacketIO */
+#define MFMPACKETIO_BUFFER_SIZE_BYTES BYTE_BUFFER_BYTES
+
+/** The size of a packet header in an #MFMPacketIO buffer */
+#define MFMPACKETIO_HEADER_BYTES 4
+
+#ifndef MFMPACKETIO_DISPATCH_SLOTS
+/**
+   The number of packets each #MFMPacketIO can have under dispatch at once; see
+   #MFMPacketIO::holdPacket().  Each slot costs a #PacketBuffer, which holds its packet only if
+   the packet has to be copied out of the rolling buffer.  \since 0.9.21
+ */
+#define MFMPACKETIO_DISPATCH_SLOTS 1
+#endif
+
+/** The bytes before each packet's data in an #MFMPacketIO buffer: its #PacketTrace, if tracing,
+    and its header */
+#define MFMPACKETIO_PREFIX_BYTES (PACKET_TRACE_BYTES+MFMPACKETIO_HEADER_BYTES)
+
+/**
+   The signature of a routine that #MFMPacketIO::dispatchPacket() can hand a packet to.  \a packet
+   is valid only for the duration of the call.
+ */
+typedef void PacketDispatcher(u8 * packet, u8 source);
+
+/**
+   An MFMPacketIO is a rolling byte buffer of packets, with exactly one producer -- normally an
+   interrupt handler receiving bytes from a face -- and exactly one consumer -- normally background
+   code dispatching the received packets.  The two sides share no locks and never mask interrupts:
+   each side owns its own indices and only reads the other's, with a #MEMORY_BARRIER() between
+   writing packet data and publishing it.
+
+   Packets are packed solidly into the buffer, each one a 4 byte #PacketHeader followed by the
+   packet data.  The first byte of each header (the #PacketHeader::SOURCE byte) is kept zero until
+   its packet is dispatched, so it doubles as the 'packet zero' terminating the packet before it.
+   When built with \c MFM_PACKET_TRACE (see MFMPacketTrace.h), each header is preceded by a
+   #PacketTrace, whose #PacketTrace::zero byte plays that part instead.
+   The producer deframes incoming bytes incrementally, as they arrive, so the buffer only ever holds
+   unescaped packet data.
+
+   The consumer dispatches packets in place, handing the dispatcher a pointer directly into the
+   rolling buffer.  The one exception is a packet that wraps around the end of the buffer, which
+   is copied into the #PacketBuffer of its dispatch slot.  There are #MFMPACKETIO_DISPATCH_SLOTS
+   slots, so that many packets can be under dispatch at once: A dispatcher that can't finish with a
+   packet right away can #holdPacket() it and return, and #releasePacket() it later, while later
+   packets are dispatched.  Buffer space is released in arrival order, as the packets holding it
+   are released.  Since a dispatched packet's #PacketHeader::SOURCE byte is no longer zero, a packet
+   dispatched while the packet just before it is held in place is copied too, leaving that packet
+   its terminating null (with \c MFM_PACKET_TRACE the #PacketTrace::zero byte makes that copy
+   unnecessary).
+
+   Counts of packets and bytes are kept in free-running u32's, so \c newPHIndex-oldPHIndex is the
+   number of bytes held by completed packets, regardless of wraparound.
+ */
+class MFMPacketIO {
+public:
+
+  /** How bytes are framed into packets */
+  enum Framing {
+    PACKETS,                  /**< #PFSC_END terminates a packet; #PFSC_ESC introduces escapes */
+    BYTES                     /**< Each byte is a complete packet by itself */
+  };
+
+  /** Create an MFMPacketIO using \a buffer, which must hold #MFMPACKETIO_BUFFER_SIZE_BYTES */
+  MFMPacketIO(u8 * buffer) ;
+
+  /** Discard all packets, and return to the unsynchronized state.  Not safe to call while
+      either side is active. */
+  void reset() ;
+
+  /** Declare that the input is now at a packet boundary, without waiting for a #PFSC_END */
+  void forceSync() { bflags |= BFLAG_SYNCED; }
+
+  void setInputFraming(Framing f) { inputFraming = f; }
+  void setOutputFraming(Framing f) { outputFraming = f; }
+  Framing getInputFraming() const { return (Framing) inputFraming; }
+  Framing getOutputFraming() const { return (Framing) outputFraming; }
+
+  /** \name Producer (interrupt level) side */
+  /*@{*/
+
+  /** True if there is room for at least one more data byte in the packet being received */
+  bool canAddByte() const {
+    return MFMPACKETIO_BUFFER_SIZE_BYTES - (newPHIndex - oldPHIndex)
+      >= 2*MFMPACKETIO_PREFIX_BYTES + newPacketLength + 1;
+  }
+
+  /** True if the packet being received has no room for another byte */
+  bool isFull() const { return !canAddByte(); }
+
+  /** Deframe one byte, as received from the wire, according to the input framing */
+  void storeByte(u8 wireByte) ;
+
+  /** Deframe \a length bytes, as received from the wire, exactly as that many #storeByte() calls
+      would, but copying runs of unescaped data into the buffer in bulk via #frameDecode().
+      \since 0.9.21 */
+  void storeBytes(const u8 * wireBytes, u32 length) ;
+
+  /** Add one already-deframed byte to the packet being received */
+  void storeData(u8 dataByte) ;
+
+  /** Accumulate \a flags (e.g., #PK_BYTE_ERROR bits from the UART) into the packet being received */
+  void storeFlags(u8 flags) { this->flags |= flags; }
+
+  /** Complete the packet being received and make it visible to the consumer */
+  void storeEnd() ;
+
+  /** Frame \a dataByte according to the output framing and feed the result through #storeByte().
+      Used to inject locally-generated packets, and for loopback testing. */
+  void putByte(u8 dataByte) ;
+
+  /** End a locally-generated packet begun with #putByte() */
+  void terpri() ;
+
+  /**
+     Reserve all the space currently available for a locally-generated packet, to be written in
+     place and then published with #publishReserved().  On return \a start is the (unmasked) buffer
+     index of the first data byte and \a room is the most data bytes that may be written there;
+     data byte \c i goes at \c buffer[(start+i)&#BYTE_BUFFER_MASK].  Nothing is visible to the
+     consumer until #publishReserved(), and simply never publishing abandons the reservation.
+
+     Producer side only, and not while a packet is partly received.  Normally used via a
+     #PacketWriter.
+
+     \return the buffer, or null if there is no room even for an empty packet.
+     \since 0.9.21
+   */
+  u8 * reserve(u32 & start, u32 & room) ;
+
+  /** Publish the first \a length data bytes written into the space from #reserve(), as a packet
+      with \a flags.  \since 0.9.21 */
+  void publishReserved(u32 length, u8 flags = 0) ;
+
+  /*@}*/
+
+  /** \name Consumer (background) side */
+  /*@{*/
+
+  /** How many complete packets are waiting to be dispatched */
+  u32 packetsRemovable() const { return packetsIn - packetsOut; }
+
+  bool isEmptyOfPackets() const { return packetsRemovable() == 0; }
+
+  /**
+     Hand the oldest waiting packet to \a dispatcher, as having come from \a source, and then
+     discard it -- unless \a dispatcher called #holdPacket().  \return false if there was no packet
+     to dispatch, or no free dispatch slot.
+   */
+  bool dispatchPacket(u8 source, PacketDispatcher * dispatcher) ;
+
+  /**
+     Called by a dispatcher during #dispatchPacket(): Keep the packet being dispatched intact, where
+     it is, after the dispatcher returns, until it is passed to #releasePacket().  It keeps its
+     dispatch slot until then.  \return the packet.
+
+     \blinks #E_API_ILLEGAL_STATE if not called during #dispatchPacket().
+     \since 0.9.21
+   */
+  u8 * holdPacket() ;
+
+  /**
+     Take the oldest waiting packet, as having come from \a source, and hold it as #holdPacket()
+     does, without calling any dispatcher.  \return the packet, or null if there was no packet
+     waiting or no free dispatch slot.  \since 0.9.21
+   */
+  u8 * takePacket(u8 source) ;
+
+  /**
+     Finish with a packet held by #holdPacket() or #takePacket(), freeing its dispatch slot and --
+     once all packets before it have been released -- its buffer space.
+
+     \blinks #E_API_ILLEGAL_STATE if \a packet is not held.
+     \since 0.9.21
+   */
+  void releasePacket(u8 * packet) ;
+
+  /**
+     Copy the oldest waiting packet into \a pb and discard it from the buffer.  \return the packet
+     within \a pb, or null if there was no packet to copy or no free dispatch slot.
+   */
+  u8 * copyPacketAndDiscard(PacketBuffer & pb) ;
+
+  /*@}*/
+
+  /** Die with #E_BUG_INCONSISTENT_STATE if the buffer structure is detectably corrupt.  Only safe
+      when neither side is active. */
+  void bufferCheck() ;
+
+  /** \name Statistics */
+  /*@{*/
+  u32 getPacketsDropped() const { return packetsDropped; } /**< Completed packets with no room at all */
+  u32 getPacketsWrapped() const { return packetsWrapped; } /**< Packets copied out because they wrapped */
+  u32 getPacketsCopied() const { return packetsCopied; }   /**< Packets dispatched from a slot copy */
+  u32 getPacketsInPlace() const { return packetsInPlace; } /**< Packets dispatched in place */
+  u32 getSlotsInUse() const { return packetsOut - slotsFreed; } /**< Dispatch slots not yet free */
+  u32 getMaxSlotsInUse() const { return maxSlotsInUse; }   /**< The most slots ever in use at once */
+  u32 getSlotStalls() const { return slotStalls; }         /**< Times a packet waited for a slot */
+#ifdef MFM_PACKET_TRACE
+  /** Latencies of the packets dispatched so far.  \since 0.9.21 */
+  const PacketLatency & getLatency() const { return latency; }
+  void resetLatency() { latency.reset(); }
+#endif
+  /*@}*/
+
+private:
+  enum {
+    BFLAG_SYNCED = 0x01,      /**< Have seen a packet boundary on input */
+    BFLAG_ESCAPE = 0x02       /**< Last input byte was #PFSC_ESC */
+  };
+
+  u8 * buf;
+
+  /* Producer owned */
+  u32 newPHIndex;             /* Header of the packet being received; end of completed packets */
+  u32 newPacketLength;        /* Data bytes so far in the packet being received */
+  u8 flags;                   /* PK_ flags for the packet being received */
+  u8 bflags;                  /* BFLAG_ state of the deframer */
+  u8 inputFraming;
+  u8 outputFraming;
+  volatile u32 packetsIn;
+  u32 packetsDropped;
+#ifdef MFM_PACKET_TRACE
+  TraceStamp traceStarted;    /* When the packet being received started */
+#endif
+
+  /* Consumer owned */
+  volatile u32 oldPHIndex;    /* Header of the oldest packet whose space isn't released */
+  u32 nextPHIndex;            /* Header of the oldest packet not yet dispatched */
+  volatile u32 packetsOut;    /* Packets taken for dispatch; slot packetsOut%SLOTS is the next */
+  u32 packetsReleased;        /* ..whose space has been released */
+  u32 slotsFreed;             /* ..whose slot is free again */
+  u32 packetsWrapped;
+  u32 packetsCopied;
+  u32 packetsInPlace;
+  u32 maxSlotsInUse;
+  u32 slotStalls;
+
+  struct DispatchSlot {
+    u8 * packet;              /* In the rolling buffer, or in 'buffer' if 'copied' */
+    u32 length;
+    bool held;                /* Not yet released */
+    bool copied;
+    PacketBuffer buffer;
+  };
+  DispatchSlot slots[MFMPACKETIO_DISPATCH_SLOTS];
+  DispatchSlot * dispatching; /* The slot under dispatchPacket, if any */
+  bool holding;               /* ..and its dispatcher called holdPacket */
+#ifdef MFM_PACKET_TRACE
+  PacketLatency latency;
+#endif
+
+  u8 & at(u32 index) { return buf[index & BYTE_BUFFER_MASK]; }
+
+  u32 dataRoom() const ;
+
+#ifdef MFM_PACKET_TRACE
+  void storeTrace() ;
+#endif
+
+  DispatchSlot & slot(u32 count) { return slots[count % MFMPACKETIO_DISPATCH_SLOTS]; }
+
+  DispatchSlot * takeSlot(u8 source, PacketBuffer * copy) ;
+  void finish(DispatchSlot & s) ;
+  void releaseSlots() ;
+};
+
+/**
+   Relay \a packet -- its data from index \a from on, which by default is all of it -- to \a out, normally
+   the outbound #MFMPacketIO of another face, as a new packet written in place by the producer side
+   of \a out.  The data is copied as is, in at most two block copies, without being parsed,
+   formatted, or escaped; it is framed, if at all, as it goes onto the wire, as any packet in
+   \a out would be.  A relay that consumes some routing bytes can forward the rest with
+   \c packetForward(packet,out,packetCursor(packet)).
+
+   The new packet's source is whatever \a out's consumer dispatches it as, and \a packet's flags
+   are not carried along, since they describe the link it arrived on; whether a packet with errors
+   should be relayed at all is up to the caller.
+
+   \return false, with nothing written, if \a out doesn't have room.
+
+   \blinks #E_API_INVALID_PACKET if \a packet is not a packet, #E_API_MAX_RANGE if \a from is
+   beyond its end, and #E_API_ILLEGAL_STATE if \a out is partway through receiving a packet.
+
+   \since 0.9.21
+ */
+extern bool packetForward(const u8 * packet, MFMPacketIO & out, u32 from = 0) ;
+
+#endif /* MFMPACKETIO_H_ */
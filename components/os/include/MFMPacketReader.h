@@ -0,0 +1,216 @@
+/*                                             -*- mode:C++; fill-column:100 -*-
+  MFMPacketReader.h - Validate-once cursor caching packet reader
+  Copyright (C) 2013 The Regents of the University of New Mexico.  All rights reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301
+  USA
+*/
+
+/**
+  \file MFMPacketReader.h Validate-once cursor caching packet reader
+  \author David H. Ackley.
+  \date (C) 2013 All rights reserved.
+  \lgpl
+ */
+#ifndef MFMPACKETREADER_H_
+#define MFMPACKETREADER_H_
+
+#include "MFMTypes.h"
+#include "MFMConstants.h"
+#include "MFMPacket.h"
+
+/**
+   A PacketReader performs the #packetRead() family of operations on a single packet, but checks
+   the packet for validity only once, when the reader is constructed, and then keeps the read
+   cursor and the packet length in locals rather than going back to the #PacketHeader for every
+   byte.  The cursor is written back to the packet header only by #commit().
+
+   The free functions #packetRead(), #packetReadCheckByte(), #packetReadPacket(), and so forth,
+   are all implemented as a PacketReader plus a #commit(), so a sequence of reads done via a
+   PacketReader leaves \a packet in exactly the same state as the equivalent sequence of free
+   function calls -- including the partially-advanced cursor on some failure paths.
+
+   \usage
+   \code
+    void myHandler(u8 * packet) {
+      PacketReader r(packet);              // Validates packet once
+      int x, y;
+      if (!r.read(x,DEC) || !r.read(y,DEC)) return;  // Packet header untouched on failure
+      r.commit();                          // Now packetCursor(packet) reflects the two reads
+      ...
+    }
+   \endcode
+
+   \since 0.9.21
+ */
+class PacketReader {
+public:
+
+  /**
+     Set up to read \a packet, starting from its current #packetCursor().
+
+     \blinks #E_API_INVALID_PACKET if \a packet is null or pointing at something that is detectably
+     corrupt or not a packet.
+   */
+  PacketReader(u8 * packet) ;
+
+  /** The packet being read */
+  u8 * getPacket() const { return packet; }
+
+  /** The reader's cursor; may differ from #packetCursor() until #commit() */
+  u32 cursor() const { return index; }
+
+  /** The #packetLength() of the packet being read */
+  u32 length() const { return limit; }
+
+  /** How many bytes remain to be read */
+  u32 readLength() const { return limit - index; }
+
+  /** True if no bytes remain to be read */
+  bool eof() const { return index >= limit; }
+
+  /** Move the reader's cursor to \a newIndex, or to #length(), whichever is smaller */
+  void reread(u32 newIndex = 0) {
+    index = newIndex > limit ? limit : newIndex;
+  }
+
+  /** Store the reader's cursor back into the packet header. */
+  void commit() {
+    packetHeaderInternalUnsafe(packet).f[PacketHeader::CURSOR] = (u8) index;
+  }
+
+  /** Read the next byte, if any, without regard to any \c maxLen limit */
+  bool readByte(u8 & result) {
+    if (index >= limit) return false;
+    result = packet[index++];
+    return true;
+  }
+
+  /** As #packetRead(u8 * packet, int &result, int code, u32 maxLen) */
+  bool read(int & result, int code = DEC, u32 maxLen = MAX_PACKET_LENGTH) ;
+
+  /** As #packetRead(u8 * packet, u32 &result, int code, u32 maxLen) */
+  bool read(u32 & result, int code = DEC, u32 maxLen = MAX_PACKET_LENGTH) {
+    return read(*(int*)&result, code, maxLen);
+  }
+
+  /** As #packetRead(u8 * packet, u64 &result) */
+  bool read(u64 & result) ;
+
+  /** As #packetRead(u8 * packet, u8 * buffer, u32 length) */
+  bool read(u8 * buffer, u32 length) ;
+
+  /** As #packetReadArray(u8 * packet, int * results, u32 maxCount, int code, u32 maxLen) */
+  u32 readArray(int * results, u32 maxCount, int code = DEC, u32 maxLen = MAX_PACKET_LENGTH) ;
+
+  /** As #packetReadArray(u8 * packet, u32 * results, u32 maxCount, int code, u32 maxLen) */
+  u32 readArray(u32 * results, u32 maxCount, int code = DEC, u32 maxLen = MAX_PACKET_LENGTH) {
+    return readArray((int*) results, maxCount, code, maxLen);
+  }
+
+  /** As #packetReadPacket(u8 * packet, u8 *& subpacket) */
+  bool readPacket(u8 *& subpacket) ;
+
+  /** As #packetReadCheckByte(u8 * packet) */
+  bool readCheckByte() ;
+
+  /**
+     As #read(int &result, int code, u32 maxLen) with no \c maxLen limit, but with \a CODE fixed at
+     compile time, so there is no dispatch on the code, and the digit loop is compiled for the
+     specific base.  Used by #packetScanf().  \since 0.9.21
+   */
+  template <int CODE> bool readCode(int & result) {
+    (void) sizeof(char[(CODE >= BELONG && CODE <= BYTE) || (CODE >= 2 && CODE <= 36) ? 1 : -1]);
+    if (CODE <= BYTE && CODE >= BELONG)
+      return readBigEndian(result, CODE, limit);
+    return readDigits(result, limit, ConstantBase<(CODE <= BYTE ? 10 : CODE)>());
+  }
+
+private:
+  u8 * packet;
+  u32 index;
+  u32 limit;
+
+  struct VariableBase {
+    const u32 base;
+    VariableBase(u32 base) : base(base) { }
+    u32 value() const { return base; }
+  };
+
+  template <u32 BASE> struct ConstantBase {
+    u32 value() const { return BASE; }
+  };
+
+  bool readBigEndian(int & result, int code, u32 maxPosition) ;
+
+  template <class Base> bool readDigits(int & result, u32 maxPosition, const Base & base) ;
+};
+
+/* In the header so that a ConstantBase can make the digit loop compile for a single base */
+template <class Base>
+inline bool PacketReader::readDigits(int & result, u32 maxPosition, const Base & base) {
+  const u8 * p = packet;
+  u32 i = index;
+  u8 ch;
+
+  // Skip leading spaces (only, not other 'whitespace')
+  do {
+    if (i >= maxPosition) {
+      index = i;
+      return false;             // Can't get started
+    }
+    ch = p[i++];
+  } while (ch==' ');
+
+  // ch is now a non-whitespace
+  bool negative;
+  if ((negative = ch=='-') || ch=='+') {
+    if (i >= maxPosition) {
+      index = i;
+      return false;             // Can't get started
+    }
+    ch = p[i++];
+  }
+
+  u32 num = 0;
+  bool readSome = false;
+  for (;;) {
+    u32 val;
+    if (ch >= '0' && ch <= '9') val = ch-'0';
+    else {
+      ch |= 0x20;  // standardize on lowercase
+      if (ch >= 'a' && ch <= 'z') val = ch-('a'-10);
+      else val = base.value();  // Invalid in any base
+    }
+    if (val < base.value()) {
+      num = num*base.value()+val;
+      readSome = true;
+    } else if (readSome) {
+      --i;                      // Read one too far, back up
+      break;
+    } else {
+      index = i;
+      return false;
+    }
+    if (i >= maxPosition)
+      break;
+    ch = p[i++];
+  }
+  index = i;
+  result = (int) (negative ? 0u-num : num);
+  return true;
+}
+
+#endif /* MFMPACKETREADER_H_ */
@@ -0,0 +1,262 @@
+/*                                             -*- mode:C++; fill-column:100 -*-
+  MFMPacketScanf.h - Packet scanning with formats compiled at compile time
+  Copyright (C) 2013 The Regents of the University of New Mexico.  All rights reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301
+  USA
+*/
+
+/**
+  \file MFMPacketScanf.h Packet scanning with formats compiled at compile time
+  \author David H. Ackley.
+  \date (C) 2013 All rights reserved.
+  \lgpl
+ */
+#ifndef MFMPACKETSCANF_H_
+#define MFMPACKETSCANF_H_
+
+#include "MFMTypes.h"
+#include "MFMConstants.h"
+#include "MFMPacket.h"
+#include "MFMPacketReader.h"
+
+/**
+   A #packetScanf() format, spelled out one character per template argument (up to 16), since the
+   tile compilers predate \c constexpr.  For example, the format \p "0x%x\n" is written
+
+   \code
+     ScanFormat<'0','x','%','x','\n'>
+   \endcode
+
+   Format characters are:
+
+   - \p %d, \p %x, \p %o, \p %b, \p %t: Read a number in decimal, hex, octal, binary, or base 36, as
+     #packetRead() would with #DEC, #HEX, #OCT, #BIN, or #B36
+   - \p %c, \p %h, \p %l: Read a #BYTE, a #BESHORT, or a #BELONG
+   - \p %\\n: Read the packet's check byte, as #packetReadCheckByte() would
+   - \p %%: Match a literal \p '%'
+   - \p \\n: Match the end of the packet
+   - Anything else: Match that byte literally
+
+   Any other character after a \p '%' is a compile-time error, rather than an
+   #E_API_BAD_FORMAT_CODE at run time.
+
+   \since 0.9.21
+ */
+template <char C0,     char C1 = 0,  char C2 = 0,  char C3 = 0,
+          char C4 = 0,  char C5 = 0,  char C6 = 0,  char C7 = 0,
+          char C8 = 0,  char C9 = 0,  char C10 = 0, char C11 = 0,
+          char C12 = 0, char C13 = 0, char C14 = 0, char C15 = 0>
+struct ScanFormat ;
+
+/** \cond */
+
+/* A format is turned into a list of its characters, and the list is 'interpreted' by partial
+   specialization on its first character or two, so each format compiles into a straight-line
+   sequence of PacketReader calls. */
+struct ScanEnd { };
+template <char C, class Rest> struct ScanChar { };
+
+template <char C, class Rest> struct ScanCons { typedef ScanChar<C,Rest> List; };
+template <class Rest> struct ScanCons<0,Rest> { typedef ScanEnd List; };
+
+template <char C0, char C1, char C2, char C3, char C4, char C5, char C6, char C7,
+          char C8, char C9, char C10, char C11, char C12, char C13, char C14, char C15>
+struct ScanFormat {
+  typedef typename ScanCons<C0, typename ScanFormat<C1,C2,C3,C4,C5,C6,C7,C8,C9,C10,C11,C12,C13,
+                                                    C14,C15,0>::List>::List List;
+};
+
+template <>
+struct ScanFormat<0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0> {
+  typedef ScanEnd List;
+};
+
+/* The packetRead code for each conversion character; others are deliberately left undefined */
+template <char C> struct ScanCode ;
+template <> struct ScanCode<'d'> { enum { CODE = DEC }; };
+template <> struct ScanCode<'x'> { enum { CODE = HEX }; };
+template <> struct ScanCode<'o'> { enum { CODE = OCT }; };
+template <> struct ScanCode<'b'> { enum { CODE = BIN }; };
+template <> struct ScanCode<'t'> { enum { CODE = B36 }; };
+template <> struct ScanCode<'c'> { enum { CODE = BYTE }; };
+template <> struct ScanCode<'h'> { enum { CODE = BESHORT }; };
+template <> struct ScanCode<'l'> { enum { CODE = BELONG }; };
+
+/* How many arguments a format list consumes */
+template <class List> struct ScanArgs { enum { COUNT = 0 }; };
+template <char C, class Rest> struct ScanArgs< ScanChar<C,Rest> > {
+  enum { COUNT = ScanArgs<Rest>::COUNT };
+};
+template <char C, class Rest> struct ScanArgs< ScanChar<'%',ScanChar<C,Rest> > > {
+  enum { COUNT = ScanArgs<Rest>::COUNT + 1 + 0*ScanCode<C>::CODE };
+};
+template <class Rest> struct ScanArgs< ScanChar<'%',ScanChar<'%',Rest> > > {
+  enum { COUNT = ScanArgs<Rest>::COUNT };
+};
+template <class Rest> struct ScanArgs< ScanChar<'%',ScanChar<'\n',Rest> > > {
+  enum { COUNT = ScanArgs<Rest>::COUNT };
+};
+
+/* Compiles only if a format's conversions and the supplied arguments agree in number */
+template <bool ARG_COUNT_MATCHES_FORMAT> struct ScanArgCheck ;
+template <> struct ScanArgCheck<true> { enum { OK = 1 }; };
+
+/* What packetScanf arguments may point at */
+template <class T> struct ScanTarget ;
+template <> struct ScanTarget<int> { static int * of(int * p) { return p; } };
+template <> struct ScanTarget<u32> { static int * of(u32 * p) { return (int *) p; } };
+
+/* Each step returns the number of items matched from here on, stopping at the first mismatch */
+template <class List, u32 ARG> struct ScanStep ;
+
+template <u32 ARG> struct ScanStep<ScanEnd,ARG> {
+  static u32 run(PacketReader &, int * const *) { return 0; }
+};
+
+template <char C, class Rest, u32 ARG> struct ScanLiteral {
+  static u32 run(PacketReader & r, int * const * args) {
+    const u32 at = r.cursor();
+    u8 ch;
+    if (!r.readByte(ch) || ch != (u8) C) {
+      r.reread(at);             // A failed literal consumes nothing
+      return 0;
+    }
+    return 1 + ScanStep<Rest,ARG>::run(r, args);
+  }
+};
+
+template <char C, class Rest, u32 ARG> struct ScanStep<ScanChar<C,Rest>,ARG>
+  : ScanLiteral<C,Rest,ARG> { };
+
+template <class Rest, u32 ARG> struct ScanStep<ScanChar<'\n',Rest>,ARG> {
+  static u32 run(PacketReader & r, int * const * args) {
+    if (!r.eof()) return 0;
+    return 1 + ScanStep<Rest,ARG>::run(r, args);
+  }
+};
+
+template <char C, class Rest, u32 ARG> struct ScanStep<ScanChar<'%',ScanChar<C,Rest> >,ARG> {
+  static u32 run(PacketReader & r, int * const * args) {
+    if (!r.template readCode<ScanCode<C>::CODE>(*args[ARG])) return 0;
+    return 1 + ScanStep<Rest,ARG+1>::run(r, args);
+  }
+};
+
+template <class Rest, u32 ARG> struct ScanStep<ScanChar<'%',ScanChar<'%',Rest> >,ARG>
+  : ScanLiteral<'%',Rest,ARG> { };
+
+template <u32 ARG> struct ScanStep<ScanChar<'%',ScanEnd>,ARG> ;   // A format can't end in '%'
+
+template <class Rest, u32 ARG> struct ScanStep<ScanChar<'%',ScanChar<'\n',Rest> >,ARG> {
+  static u32 run(PacketReader & r, int * const * args) {
+    if (!r.readCheckByte()) return 0;
+    return 1 + ScanStep<Rest,ARG>::run(r, args);
+  }
+};
+
+/** \endcond */
+
+/**
+   Scan \a packet, starting from its #packetCursor(), according to the #ScanFormat \a Format,
+   storing each converted value through the corresponding argument, which must point at an \c int
+   or a \c u32.  The format is interpreted entirely at compile time, so the call expands into a
+   straight-line sequence of #PacketReader reads -- there is no format string at run time, and no
+   varargs.  Supplying the wrong number of arguments for \a Format is a compile-time error.
+
+   \return the number of format items matched -- each literal byte, conversion, \p \\n, or \p %\\n
+   counts as one -- stopping at the first item that does not match.  So a return equal to the number
+   of items in \a Format means the whole format matched.
+
+   \sideeffect #packetCursor() of \a packet is advanced past the matched items.  As with
+   #packetRead(), a failed conversion may leave it partly advanced; a failed literal does not.
+
+   \blinks #E_API_INVALID_PACKET if \a packet is null or pointing at something that is detectably
+   corrupt or not a packet.
+
+   \usage
+   \code
+    void myHandler(u8 * packet) {
+      u32 serialNumber;
+      if (packetScanf<ScanFormat<'x','%','d',':'> >(packet,&serialNumber) != 3) return;
+
+      u32 index = packetCursor(packet);              // Now remember where we are
+      u32 val;
+      if (packetScanf<ScanFormat<'0','x','%','x','\n'> >(packet,&val) != 4) {
+        packetReread(packet,index);                  // But if that fails, back up..
+        if (packetScanf<ScanFormat<'%','d','\n'> >(packet,&val) != 2)
+          return;                                    // And if that fails, punt
+      }
+      ..
+    }
+   \endcode
+
+   \since 0.9.21
+ */
+template <class Format>
+u32 packetScanf(u8 * packet) {
+  (void) ScanArgCheck<ScanArgs<typename Format::List>::COUNT == 0>::OK;
+  PacketReader r(packet);
+  const u32 matched = ScanStep<typename Format::List,0>::run(r, 0);
+  r.commit();
+  return matched;
+}
+
+/** As #packetScanf(u8 *) for a format with one conversion */
+template <class Format, class A0>
+u32 packetScanf(u8 * packet, A0 * a0) {
+  (void) ScanArgCheck<ScanArgs<typename Format::List>::COUNT == 1>::OK;
+  int * const args[] = { ScanTarget<A0>::of(a0) };
+  PacketReader r(packet);
+  const u32 matched = ScanStep<typename Format::List,0>::run(r, args);
+  r.commit();
+  return matched;
+}
+
+/** As #packetScanf(u8 *) for a format with two conversions */
+template <class Format, class A0, class A1>
+u32 packetScanf(u8 * packet, A0 * a0, A1 * a1) {
+  (void) ScanArgCheck<ScanArgs<typename Format::List>::COUNT == 2>::OK;
+  int * const args[] = { ScanTarget<A0>::of(a0), ScanTarget<A1>::of(a1) };
+  PacketReader r(packet);
+  const u32 matched = ScanStep<typename Format::List,0>::run(r, args);
+  r.commit();
+  return matched;
+}
+
+/** As #packetScanf(u8 *) for a format with three conversions */
+template <class Format, class A0, class A1, class A2>
+u32 packetScanf(u8 * packet, A0 * a0, A1 * a1, A2 * a2) {
+  (void) ScanArgCheck<ScanArgs<typename Format::List>::COUNT == 3>::OK;
+  int * const args[] = { ScanTarget<A0>::of(a0), ScanTarget<A1>::of(a1), ScanTarget<A2>::of(a2) };
+  PacketReader r(packet);
+  const u32 matched = ScanStep<typename Format::List,0>::run(r, args);
+  r.commit();
+  return matched;
+}
+
+/** As #packetScanf(u8 *) for a format with four conversions */
+template <class Format, class A0, class A1, class A2, class A3>
+u32 packetScanf(u8 * packet, A0 * a0, A1 * a1, A2 * a2, A3 * a3) {
+  (void) ScanArgCheck<ScanArgs<typename Format::List>::COUNT == 4>::OK;
+  int * const args[] = { ScanTarget<A0>::of(a0), ScanTarget<A1>::of(a1), ScanTarget<A2>::of(a2),
+                         ScanTarget<A3>::of(a3) };
+  PacketReader r(packet);
+  const u32 matched = ScanStep<typename Format::List,0>::run(r, args);
+  r.commit();
+  return matched;
+}
+
+#endif /* MFMPACKETSCANF_H_ */
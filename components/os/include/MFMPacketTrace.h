@@ -0,0 +1,181 @@
+/*                                             -*- mode:C++; fill-column:100 -*-
+  MFMPacketTrace.h - Optional per-packet timestamps and latency histograms
+  Copyright (C) 2013 The Regents of the University of New Mexico.  All rights reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301
+  USA
+*/
+
+/**
+  \file MFMPacketTrace.h Optional per-packet timestamps and latency histograms
+  \author David H. Ackley.
+  \date (C) 2013 All rights reserved.
+  \lgpl
+
+  Packet tracing is a compile time option: build everything with \c -DMFM_PACKET_TRACE to have
+  each #MFMPacketIO stamp every packet it handles with the time it started arriving, was completed,
+  and was dispatched, and accumulate per-face histograms of the intervals between those stages.
+
+  The stamps live in a #PacketTrace placed immediately \e before each packet's #PacketHeader --
+  in the #MFMPacketIO buffer and in a #PacketBuffer -- so the header is still the four bytes before
+  the packet data, and #packetHeaderInternalUnsafe(), #validPacket() and everything built on them
+  are unchanged.  Without \c MFM_PACKET_TRACE, #PACKET_TRACE_BYTES is zero and no tracing code or
+  storage exists at all.
+ */
+#ifndef MFMPACKETTRACE_H_
+#define MFMPACKETTRACE_H_
+
+#include "MFMTypes.h"
+
+/** A timestamp, in ticks of the tile's TSC (or the host's), modulo 2^32 */
+typedef u32 TraceStamp;
+
+/** The stages of a packet's life that a #PacketTrace can record */
+enum TraceStage {
+  TRACE_STARTED,     /**< Its first byte arrived (or, for a locally written packet, space for it was
+                          reserved) */
+  TRACE_RECEIVED,    /**< It was completed and made visible to the consumer */
+  TRACE_DISPATCHED,  /**< It was handed to its dispatcher */
+  TRACE_STAGE_COUNT
+};
+
+/**
+   The timestamps of a traced packet, stored byte by byte in little-endian order, since in an
+   #MFMPacketIO buffer it may fall at any alignment.
+ */
+struct PacketTrace {
+  u8 zero;           /**< In an #MFMPacketIO buffer, the previous packet's trailing null */
+  u8 stages;         /**< Bit (1<<s) is set if stage \c s has been stamped */
+  u8 reserved[2];
+  u8 stamp[TRACE_STAGE_COUNT][4];
+
+  /** True if \a stage has been stamped */
+  bool has(u32 stage) const { return stage < TRACE_STAGE_COUNT && ((stages>>stage)&1); }
+
+  /** The stamp for \a stage; zero if it hasn't been stamped */
+  TraceStamp get(u32 stage) const {
+    if (!has(stage)) return 0;
+    const u8 * s = stamp[stage];
+    return s[0]|(s[1]<<8)|(s[2]<<16)|((u32) s[3]<<24);
+  }
+
+  /** Stamp \a stage with \a when */
+  void set(u32 stage, TraceStamp when) {
+    if (stage >= TRACE_STAGE_COUNT) return;
+    u8 * s = stamp[stage];
+    s[0] = (u8) when; s[1] = (u8) (when>>8); s[2] = (u8) (when>>16); s[3] = (u8) (when>>24);
+    stages |= (u8) (1<<stage);
+  }
+};
+
+#ifdef MFM_PACKET_TRACE
+
+/** The bytes of #PacketTrace preceding each packet header */
+#define PACKET_TRACE_BYTES (sizeof(PacketTrace))
+
+#ifndef HOST_MODE
+#include "register.h"      /* For TIMERTSC */
+/** The current time stamp */
+inline TraceStamp traceNow() { return TIMERTSC; }
+#elif defined(__i386__) || defined(__x86_64__)
+inline TraceStamp traceNow() { return (TraceStamp) __builtin_ia32_rdtsc(); }
+#else
+#include <time.h>          /* For clock_gettime */
+inline TraceStamp traceNow() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (TraceStamp) (ts.tv_sec*1000000000u + ts.tv_nsec);
+}
+#endif
+
+/**
+   The #PacketTrace of \a packet, which must live in an #MFMPacketIO buffer or a #PacketBuffer --
+   as any packet handed to a #PacketDispatcher does -- and not, for example, be a subpacket or a
+   packet made by #makePacket() in a plain byte array.
+ */
+inline PacketTrace & packetTraceInternalUnsafe(u8 * packet) {
+  return *(PacketTrace *) (packet-4-PACKET_TRACE_BYTES);
+}
+
+inline const PacketTrace & packetTraceInternalUnsafeConst(const u8 * packet) {
+  return *(const PacketTrace *) (packet-4-PACKET_TRACE_BYTES);
+}
+
+#else
+
+#define PACKET_TRACE_BYTES 0
+
+#endif /* MFM_PACKET_TRACE */
+
+/** The intervals between stages that a #PacketLatency accumulates */
+enum TraceInterval {
+  TRACE_ARRIVING,    /**< From #TRACE_STARTED to #TRACE_RECEIVED: time on the wire */
+  TRACE_WAITING,     /**< From #TRACE_RECEIVED to #TRACE_DISPATCHED: time queued */
+  TRACE_HANDLING,    /**< From #TRACE_DISPATCHED until the dispatcher returned */
+  TRACE_INTERVAL_COUNT
+};
+
+#ifndef PACKET_LATENCY_BINS
+/** The bins in each #PacketLatency histogram; the last holds everything 2^(BINS-1) ticks or more */
+#define PACKET_LATENCY_BINS 24
+#endif
+
+/**
+   Histograms of how long packets spent in each #TraceInterval, in power of two bins: bin 0 counts
+   intervals of 0 or 1 ticks, and bin \c b > 0 counts intervals from 2^b up to 2^(b+1) ticks.  With
+   \c MFM_PACKET_TRACE each #MFMPacketIO keeps one for its face, updated as it dispatches.
+
+   \since 0.9.21
+ */
+class PacketLatency {
+public:
+  PacketLatency() { reset(); }
+
+  void reset() ;
+
+  /** The bin that an interval of \a ticks falls in */
+  static u32 binOf(u32 ticks) ;
+
+  /** Count an interval of \a ticks in \a interval's histogram */
+  void add(u32 interval, u32 ticks) ;
+
+  /** Count every interval of \a trace that was stamped at both ends, finishing at \a done */
+  void record(const PacketTrace & trace, TraceStamp done) ;
+
+  /** The number of intervals counted in \a interval's histogram */
+  u32 getCount(u32 interval) const { return interval < TRACE_INTERVAL_COUNT ? counts[interval] : 0; }
+
+  /** The count in \a bin of \a interval's histogram */
+  u32 getBin(u32 interval, u32 bin) const {
+    return interval < TRACE_INTERVAL_COUNT && bin < PACKET_LATENCY_BINS ? bins[interval][bin] : 0;
+  }
+
+  /** The longest interval counted in \a interval's histogram */
+  u32 getMax(u32 interval) const { return interval < TRACE_INTERVAL_COUNT ? maxima[interval] : 0; }
+
+  /**
+     An upper bound on the \a percent'th percentile of \a interval: the top of the first bin at
+     which at least \a percent percent of the counts have been seen, capped by #getMax().  Zero if
+     nothing has been counted.
+   */
+  u32 getPercentile(u32 interval, u32 percent) const ;
+
+private:
+  u32 bins[TRACE_INTERVAL_COUNT][PACKET_LATENCY_BINS];
+  u32 counts[TRACE_INTERVAL_COUNT];
+  u32 maxima[TRACE_INTERVAL_COUNT];
+};
+
+#endif /* MFMPACKETTRACE_H_ */
@@ -0,0 +1,237 @@
+/*                                             -*- mode:C++; fill-column:100 -*-
+  MFMPacketView.h - Non-owning views of packet contents, and packets of packets
+  Copyright (C) 2013 The Regents of the University of New Mexico.  All rights reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301
+  USA
+*/
+
+/**
+  \file MFMPacketView.h Non-owning views of packet contents, and packets of packets
+  \author David H. Ackley.
+  \date (C) 2013 All rights reserved.
+  \lgpl
+ */
+#ifndef MFMPACKETVIEW_H_
+#define MFMPACKETVIEW_H_
+
+#include "MFMTypes.h"
+#include "MFMConstants.h"
+#include "MFMPacket.h"
+#include "MFMAssert.h"
+
+class PacketWriter;  // Forward
+
+/** The bytes a subpacket adds to its container beyond its own data: its header and null */
+#define SUBPACKET_OVERHEAD_BYTES 5
+
+/**
+   A PacketView is a pointer and a length naming some stretch of a packet's data -- all of it, the
+   part after the #packetCursor(), or any slice -- without copying or owning it.  A view stays valid
+   only as long as the packet it looks into.
+
+   A view whose bytes are a sequence of subpackets -- each a #PacketHeader, data, and a null, as
+   #packetReadPacket() recognizes -- is a \e container, and its subpackets can be visited in order
+   with a #PacketView::iterator.  Each subpacket is a complete packet in place, so it can be handed
+   straight to a packet handler.  Containers are built with a #ContainerWriter.
+
+   \usage
+   \code
+    void batchHandler(u8 * packet) {
+      PacketView batch = PacketView::unread(packet);   // After a one byte type, say
+      for (PacketView::iterator i = batch.begin(); i != batch.end(); ++i)
+        reflexes.dispatch(*i, packetSource(packet));
+    }
+   \endcode
+
+   \since 0.9.21
+ */
+class PacketView {
+public:
+
+  /** An empty view */
+  PacketView() : data(0), length(0) { }
+
+  /**
+     A view of all of \a packet's data.
+
+     \blinks #E_API_INVALID_PACKET if \a packet is null or pointing at something that is detectably
+     corrupt or not a packet.
+   */
+  explicit PacketView(u8 * packet) ;
+
+  /**
+     A view of the \a length bytes at \a data.
+
+     \blinks #E_API_NULL_POINTER if \a data is null and \a length isn't zero.
+   */
+  PacketView(u8 * data, u32 length) : data(data), length(length) {
+    API_ASSERT(data || !length, E_API_NULL_POINTER);
+  }
+
+  /** A view of the data of \a packet from its #packetCursor() to its end */
+  static PacketView unread(u8 * packet) ;
+
+  u8 * getData() const { return data; }
+
+  u32 getLength() const { return length; }
+
+  bool isEmpty() const { return length == 0; }
+
+  /** Byte \a index of the view.  \blinks #E_API_MAX_RANGE if \a index is not in the view. */
+  u8 operator[](u32 index) const {
+    API_ASSERT(index < length, E_API_MAX_RANGE);
+    return data[index];
+  }
+
+  /**
+     The view of bytes \a from up to but not including \a to.  Cursor positions make good slice
+     bounds: #slice(#packetCursor(p),#packetLength(p)) of a whole packet view is #unread(p).
+
+     \blinks #E_API_MAX_RANGE unless \a from <= \a to <= #getLength().
+   */
+  PacketView slice(u32 from, u32 to) const {
+    API_ASSERT(from <= to && to <= length, E_API_MAX_RANGE);
+    return PacketView(data+from, to-from);
+  }
+
+  /** The view of bytes \a from to the end.  \blinks #E_API_MAX_RANGE if \a from > #getLength(). */
+  PacketView slice(u32 from) const { return slice(from, length); }
+
+  /** True if the views hold the same bytes, wherever they are */
+  bool operator==(const PacketView & other) const {
+    return length == other.length && packetBytesEqual(data, other.data, length);
+  }
+
+  bool operator!=(const PacketView & other) const { return !(*this == other); }
+
+  /** True if the view begins with the bytes of \a prefix */
+  bool startsWith(const PacketView & prefix) const {
+    return prefix.length <= length && packetBytesEqual(data, prefix.data, prefix.length);
+  }
+
+  /** True if the view begins with the non-null bytes of \a prefix, as #zpacketPrefix() checks */
+  bool startsWith(const char * prefix) const ;
+
+  /**
+     True if the whole view is a sequence of zero or more subpackets, so iterating it will visit
+     every byte.  Iteration stops early, silently, at anything that isn't a valid subpacket.
+   */
+  bool isContainer() const ;
+
+  /** The number of subpackets iteration will visit */
+  u32 subpacketCount() const ;
+
+  /** Steps through the subpackets of a container view; dereferences to each in turn */
+  class iterator {
+  public:
+    iterator() : at(0), end(0) { }
+
+    /** The current subpacket: a packet, living inside the container */
+    u8 * operator*() const { return at+sizeof(PacketHeader); }
+
+    iterator & operator++() ;
+
+    bool operator==(const iterator & other) const { return at == other.at; }
+    bool operator!=(const iterator & other) const { return at != other.at; }
+
+  private:
+    friend class PacketView;
+    iterator(u8 * at, u8 * end) : at(at), end(end) { settle(); }
+    void settle() ;    /* Stop at end unless 'at' starts a complete valid subpacket */
+    u8 * at;           /* The current subpacket's header */
+    u8 * end;
+  };
+
+  iterator begin() const { return iterator(data, data+length); }
+
+  iterator end() const { return iterator(data+length, data+length); }
+
+private:
+  u8 * data;
+  u32 length;
+};
+
+/**
+   A ContainerWriter fills the packet being written by a #PacketWriter with subpackets, in place,
+   for a #PacketView to iterate at the other end.  Each subpacket costs #SUBPACKET_OVERHEAD_BYTES
+   more than its data, so a physical packet can carry several small messages -- from different
+   virtual sources, even -- for about what one costs in wire framing and dispatch.
+
+   A subpacket can be copied in whole with #append(), or written piece by piece: #begin() it, write
+   its data through the #PacketWriter as usual, and #end() it, which fills in the length.
+
+   \usage
+   \code
+    PacketWriter w(pio);
+    w.put('B');                         // A batch
+    ContainerWriter c(w);
+    c.append(someQueuedPacket);
+    c.begin(BRAIN);
+    w.put('s'); w.put(speed, DEC);
+    c.end();
+    w.commit();
+   \endcode
+
+   \since 0.9.21
+ */
+class ContainerWriter {
+public:
+
+  /** Write subpackets into \a w, from its current #PacketWriter::length() on */
+  ContainerWriter(PacketWriter & w) : w(w), header(0), count(0), open(false) { }
+
+  /**
+     Append a copy of \a packet, keeping its #packetSource() and #packetFlags(), with its cursor at
+     zero.
+
+     \return false if it didn't fit.
+
+     \blinks #E_API_INVALID_PACKET if \a packet is not a packet, and #E_API_ILLEGAL_STATE if a
+     subpacket is open.
+   */
+  bool append(const u8 * packet) ;
+
+  /**
+     Open a subpacket from \a source; its data is whatever is written to the #PacketWriter until
+     #end().
+
+     \return false if even its header didn't fit.
+
+     \blinks #E_API_BAD_FACE if \a source is not a valid extended face, and #E_API_ILLEGAL_STATE
+     if a subpacket is already open.
+   */
+  bool begin(u8 source, u8 flags = 0) ;
+
+  /**
+     Close the open subpacket, filling in its length and adding its null.
+
+     \return false if it didn't fit.
+
+     \blinks #E_API_ILLEGAL_STATE if no subpacket is open.
+   */
+  bool end() ;
+
+  /** The number of subpackets written so far */
+  u32 getCount() const { return count; }
+
+private:
+  PacketWriter & w;
+  u32 header;        /* The open subpacket's header position in w */
+  u32 count;
+  bool open;
+};
+
+#endif /* MFMPACKETVIEW_H_ */
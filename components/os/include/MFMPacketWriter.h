@@ -0,0 +1,191 @@
+/*                                             -*- mode:C++; fill-column:100 -*-
+  MFMPacketWriter.h - Build packets in place in their final storage
+  Copyright (C) 2013 The Regents of the University of New Mexico.  All rights reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301
+  USA
+*/
+
+/**
+  \file MFMPacketWriter.h Build packets in place in their final storage
+  \author David H. Ackley.
+  \date (C) 2013 All rights reserved.
+  \lgpl
+ */
+#ifndef MFMPACKETWRITER_H_
+#define MFMPACKETWRITER_H_
+
+#include "MFMTypes.h"
+#include "MFMConstants.h"
+#include "MFMPacket.h"
+
+class MFMPacketIO;  // Forward
+
+/**
+   A PacketWriter formats a packet directly into the storage it will be delivered from -- either a
+   caller-supplied buffer, as #makePacket() produces, or space reserved in an #MFMPacketIO ring --
+   so there is no separate formatting buffer and no second copy.  The bytes written are run
+   through a #CheckByteAccumulator as they go, so #putCheckByte() costs nothing extra.
+
+   Nothing is visible until #commit(); #abort() (or just never committing) returns the
+   reservation.  If the packet overflows its space, further writes are ignored, the write
+   functions return false, and #commit() fails.
+
+   \usage
+   \code
+    PacketWriter w(pio);                   // Reserve space in pio's ring
+    w.put('m');
+    w.put(x,DEC); w.put(' '); w.put(y,HEX);
+    w.putCheckByte();
+    if (!w.commit()) ...                   // Didn't fit
+   \endcode
+
+   \since 0.9.21
+ */
+class PacketWriter {
+public:
+
+  /**
+     Write a packet from \a face into \a buffer, which has room for \a bufferLength bytes including
+     the #PacketHeader and the trailing null, exactly as #makePacket() would lay it out.  If
+     \a bufferLength is too small even for an empty packet, the writer starts out overflowed.
+
+     \blinks #E_API_NULL_POINTER if \a buffer is null, and #E_API_BAD_FACE if \a face is not a
+     valid extended face.
+   */
+  PacketWriter(u8 * buffer, u32 bufferLength, u8 face) ;
+
+  /**
+     Write a locally-generated packet directly into the ring of \a pio, as its producer, via
+     #MFMPacketIO::reserve().  If the ring is full, the writer starts out overflowed.
+   */
+  PacketWriter(MFMPacketIO & pio) ;
+
+  /** Data bytes written so far */
+  u32 length() const { return index; }
+
+  /** Data bytes that may still be written */
+  u32 room() const { return limit - index; }
+
+  /** True if some write didn't fit */
+  bool overflowed() const { return overflow; }
+
+  /** The check byte of the data written so far */
+  u8 checkByte() const { return check.get(); }
+
+  /**
+     The data written so far, as \a firstLength bytes at \a first followed by \a secondLength bytes
+     at \a second.  The second stretch is empty unless the packet wraps around the end of an
+     #MFMPacketIO ring.
+   */
+  void written(const u8 *& first, u32 & firstLength, const u8 *& second, u32 & secondLength) const {
+    const u32 at = start&mask;
+    first = base+at;
+    firstLength = index;
+    second = base;
+    secondLength = 0;
+    if (pio && at+index > mask+1) {
+      firstLength = mask+1-at;
+      secondLength = index-firstLength;
+    }
+  }
+
+  /** Write one raw byte */
+  bool put(u8 byte) {
+    if (index >= limit) {
+      overflow = true;
+      return false;
+    }
+    base[(start+index++)&mask] = byte;
+    check.update(byte);
+    return true;
+  }
+
+  /** Write one raw char */
+  bool put(char ch) { return put((u8) ch); }
+
+  /**
+     Write \a value in the format given by \a code, which may be #BYTE, #BESHORT, #BELONG, or a base
+     from 2 to 36 -- the format codes #packetRead() reads back.  Only #DEC is written signed; other
+     bases write the u32 bit pattern of \a value.  Digits past 9 are upper case.
+
+     \blinks #E_API_FORMAT_ARG if \a code is not a legal format code.
+   */
+  bool put(int value, int code = DEC) {
+    if (code == DEC && value < 0)
+      return put('-') && putNumber(0u-(u32) value, DEC);
+    return putNumber((u32) value, code);
+  }
+
+  /** As #put(int value, int code), but #DEC is unsigned too */
+  bool put(u32 value, int code = DEC) { return putNumber(value, code); }
+
+  /** Write the 8 bytes of \a value in big endian order, as #packetRead(u8*,u64&) reads */
+  bool put(u64 value) ;
+
+  /** Write \a length raw bytes from \a bytes */
+  bool put(const u8 * bytes, u32 length) ;
+
+  /** Write the bytes of the null-terminated \a str, excluding the null */
+  bool put(const char * str) ;
+
+  /**
+     Overwrite data byte \a at, already written, with \a byte, keeping #checkByte() up to date --
+     as when a count is only known after what it counts has been written.
+
+     \return false, changing nothing, if byte \a at hasn't been written.
+   */
+  bool patch(u32 at, u8 byte) {
+    if (at >= index) return false;
+    u8 & b = base[(start+at)&mask];
+    check.amend((u8) (b ^ byte), index-1-at);
+    b = byte;
+    return true;
+  }
+
+  /** Write the check byte of everything written so far */
+  bool putCheckByte() { return put(check.get()); }
+
+  /**
+     Make the packet visible: Fill in the header and trailing null of a buffer packet, or publish
+     the packet to its #MFMPacketIO.  A writer can commit at most once.
+
+     \return false, and publish nothing, if the packet overflowed or was already committed or
+     aborted.
+   */
+  bool commit() ;
+
+  /** Abandon the packet, returning its reserved space */
+  void abort() { limit = index = 0; overflow = true; }
+
+  /** The packet, once a buffer packet has been committed; else null */
+  u8 * getPacket() const { return packet; }
+
+private:
+  u8 * base;         /* Where data byte i goes: base[(start+i)&mask] */
+  u32 start;
+  u32 mask;
+  u32 index;
+  u32 limit;
+  MFMPacketIO * pio; /* Null if writing into a buffer */
+  u8 * packet;       /* The committed buffer packet */
+  u8 face;
+  CheckByteAccumulator check;
+  bool overflow;
+
+  bool putNumber(u32 num, int code) ;
+};
+
+#endif /* MFMPACKETWRITER_H_ */
@@ -0,0 +1,162 @@
+/*                                             -*- mode:C++; fill-column:100 -*-
+  MFMReflex.h - Selecting packet handlers by packet prefix and source face
+  Copyright (C) 2013 The Regents of the University of New Mexico.  All rights reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301
+  USA
+*/
+
+/**
+  \file MFMReflex.h Selecting packet handlers by packet prefix and source face
+  \author David H. Ackley.
+  \date (C) 2013 All rights reserved.
+  \lgpl
+ */
+#ifndef MFMREFLEX_H_
+#define MFMREFLEX_H_
+
+#include "MFMTypes.h"
+#include "MFMConstants.h"
+#include "MFMPacket.h"
+
+/** The signature of a reflex handler.  \a packet is valid only for the duration of the call. */
+typedef void PacketHandler(u8 * packet);
+
+/** The most reflexes one #ReflexTable can hold */
+#define MAX_REFLEXES 48
+
+/** The most prefix trie nodes one #ReflexTable can hold, beyond the first byte of each prefix */
+#define MAX_REFLEX_NODES 128
+
+/** The #ReflexTable face mask bit for face code \a face */
+#define REFLEX_FACE(face) (((u64) 1)<<(face))
+
+/** A #ReflexTable face mask of #NORTH, #SOUTH, #EAST, and #WEST */
+#define REFLEX_PHYSICAL_FACES \
+  (REFLEX_FACE(NORTH)|REFLEX_FACE(SOUTH)|REFLEX_FACE(EAST)|REFLEX_FACE(WEST))
+
+/** A #ReflexTable face mask of every face code, physical, extended, and virtual */
+#define REFLEX_ANY_FACE (REFLEX_FACE(MAX_FACE_INDEX)-1)
+
+/**
+   A ReflexTable picks the handler for each packet in one pass over the packet's leading bytes.
+   Each reflex is a prefix -- one byte, as in the classic \p reflex('a',handler), or several -- a
+   handler, the set of source faces it applies to, and whether it accepts packets with #PK_BROKEN
+   flags.  The prefixes are kept as a byte trie under a 256 entry first-byte jump table, built as
+   reflexes are defined, so dispatch costs one step per prefix byte no matter how many reflexes there
+   are, and handlers never need to recheck a longer prefix with #zpacketPrefix().
+
+   When several prefixes match a packet, the longest one whose face mask includes the packet source,
+   and that accepts the packet's flags, wins.  Each reflex counts its hits.
+
+   \usage
+   \code
+    ReflexTable reflexes;
+    void setup() {
+      reflexes.define('a', myAHandler);                               // Any face, no broken packets
+      reflexes.define("foo", myFooHandler, REFLEX_PHYSICAL_FACES);    // Beats 'f' for "foo.."
+      reflexes.define('f', myFHandler, REFLEX_FACE(BRAIN), true);     // Broken packets too
+    }
+    void dispatch(u8 * packet, u8 source) { reflexes.dispatch(packet, source); }
+   \endcode
+
+   \since 0.9.21
+ */
+class ReflexTable {
+public:
+
+  ReflexTable() ;
+
+  /**
+     Define a reflex calling \a handler for packets that begin with the \a length bytes at \a prefix
+     and come from a face in \a faces.  Packets with any #PK_BROKEN flag set are passed to
+     \a handler only if \a acceptBroken is true.
+
+     \return the new reflex's number, for #getHits().
+
+     \blinks #E_API_BAD_REFLEX if \a length is zero or exceeds #MAX_PACKET_LENGTH, or \a faces is
+     zero; #E_API_NULL_HANDLER if \a handler is null; #E_API_REFLEX_REDEF if a reflex with the same
+     prefix already covers one of \a faces; and #E_API_REFLEX_FULL if there is no room for it.
+   */
+  u32 define(const u8 * prefix, u32 length, PacketHandler * handler,
+             u64 faces = REFLEX_ANY_FACE, bool acceptBroken = false) ;
+
+  /** As #define(const u8 *,u32,PacketHandler*,u64,bool), with the prefix a null-terminated string */
+  u32 define(const char * prefix, PacketHandler * handler,
+             u64 faces = REFLEX_ANY_FACE, bool acceptBroken = false) ;
+
+  /** As #define(const u8 *,u32,PacketHandler*,u64,bool), with the prefix a single byte */
+  u32 define(u8 type, PacketHandler * handler,
+             u64 faces = REFLEX_ANY_FACE, bool acceptBroken = false) ;
+
+  /** As #define(u8,PacketHandler*,u64,bool) */
+  u32 define(char type, PacketHandler * handler,
+             u64 faces = REFLEX_ANY_FACE, bool acceptBroken = false) {
+    return define((u8) type, handler, faces, acceptBroken);
+  }
+
+  /**
+     Find the reflex for \a packet from \a source, as described for the class, without calling it.
+     The packet is matched from its beginning regardless of #packetCursor().
+
+     \return the reflex's number, or -1 if none applies.
+
+     \blinks #E_API_BAD_FACE if \a source is not a valid extended face.
+   */
+  int lookup(const u8 * packet, u8 source) const ;
+
+  /**
+     Hand \a packet from \a source to its reflex's handler, counting the hit.
+
+     \return false if no reflex applies, counting a miss.
+   */
+  bool dispatch(u8 * packet, u8 source) ;
+
+  /** The number of reflexes defined */
+  u32 getCount() const { return reflexCount; }
+
+  /** How many packets have been handed to reflex number \a reflex */
+  u32 getHits(u32 reflex) const ;
+
+  /** How many packets #dispatch() found no reflex for */
+  u32 getMisses() const { return misses; }
+
+private:
+  struct Reflex {
+    PacketHandler * handler;
+    u64 faces;
+    u32 hits;
+    u8 reject;       /* Packet flags that keep this reflex from firing */
+    u8 next;         /* Another reflex on the same prefix, plus one, or 0 */
+  };
+
+  struct Node {
+    u8 byte;         /* The prefix byte this node matches */
+    u8 child;        /* First node matching the byte after this one, or 0 */
+    u8 sibling;      /* Next node matching an alternative to 'byte', or 0 */
+    u8 reflex;       /* First reflex ending here, plus one, or 0 */
+  };
+
+  Reflex reflexes[MAX_REFLEXES];
+  Node nodes[MAX_REFLEX_NODES+1];   /* nodes[0] is unused, so 0 can mean none */
+  u8 first[256];                    /* The node for each possible first byte, or 0 */
+  u32 reflexCount;
+  u32 nodeCount;
+  u32 misses;
+
+  u32 newNode(u8 byte) ;
+};
+
+#endif /* MFMREFLEX_H_ */
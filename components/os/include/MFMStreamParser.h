@@ -0,0 +1,141 @@
+/*                                             -*- mode:C++; fill-column:100 -*-
+  MFMStreamParser.h - Parsing text fields that run across packet boundaries
+  Copyright (C) 2013 The Regents of the University of New Mexico.  All rights reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301
+  USA
+*/
+
+/**
+  \file MFMStreamParser.h Parsing text fields that run across packet boundaries
+  \author David H. Ackley.
+  \date (C) 2013 All rights reserved.
+  \lgpl
+ */
+#ifndef MFMSTREAMPARSER_H_
+#define MFMSTREAMPARSER_H_
+
+#include "MFMTypes.h"
+#include "MFMConstants.h"
+#include "MFMPacket.h"
+
+/** The default byte ending a #StreamParser record */
+#define STREAM_DEFAULT_TERMINATOR ((u8) ';')
+
+/**
+   A piece of a field, as reported by a #StreamParser.  A field split across packets arrives as
+   several pieces, in order, the last with #complete set; the field's text is the concatenation of
+   their bytes.
+ */
+struct StreamField {
+  u32 record;        /**< How many records were completed before this field's */
+  u32 index;         /**< The field's position in its record, from 0 */
+  const u8 * bytes;  /**< This piece of the field's text; valid only during the call */
+  u32 length;        /**< The bytes in this piece; may be 0 in a final piece */
+  bool complete;     /**< True if this is the field's last piece */
+  bool number;       /**< If #complete, true if the whole field is a number in the parser's base */
+  int value;         /**< If #number, its value, exactly as #packetRead() would read it */
+};
+
+/** The signature of a #StreamParser field handler */
+typedef void StreamFieldHandler(const StreamField & field, void * arg);
+
+/** The signature of a #StreamParser record handler, called after a record's last field */
+typedef void StreamRecordHandler(u32 record, u32 fields, void * arg);
+
+/**
+   A StreamParser splits text arriving in any number of packets into fields separated by spaces,
+   grouped into records ended by a terminator byte, without regard to where the packet boundaries
+   fall.  The parse state -- including a number half read when its packet ended -- is kept between
+   packets, so nothing is copied or reassembled: each field is handed to the field handler as
+   pieces pointing into the packets themselves, and a numeric field's value is accumulated as its
+   digits go by.
+
+   A field is a number if it is an optional sign followed by one or more digits in the parser's
+   base, and nothing else; its value is computed exactly as #packetRead() would compute it,
+   overflow included.
+
+   \usage
+   \code
+    void logField(const StreamField & f, void * arg) {
+      if (f.index == 0) ..accumulate the name from f.bytes, f.length..
+      else if (f.complete && f.number) ..store f.value..
+    }
+    StreamParser logParser(logField);
+    void logHandler(u8 * packet) {
+      logParser.feed(packet);             // Takes the packet from its cursor on
+    }
+   \endcode
+
+   \since 0.9.21
+ */
+class StreamParser {
+public:
+
+  /**
+     Report fields to \a fieldHandler and finished records to \a recordHandler (if non-null), each
+     called with \a arg.  Numbers are read in base \a base, and records end at \a terminator.
+
+     \blinks #E_API_NULL_HANDLER if \a fieldHandler is null, and #E_API_FORMAT_ARG if \a base is not
+     in 2..36.
+   */
+  StreamParser(StreamFieldHandler * fieldHandler, void * arg = 0, int base = DEC,
+               u8 terminator = STREAM_DEFAULT_TERMINATOR, StreamRecordHandler * recordHandler = 0) ;
+
+  /** Parse the \a length bytes at \a data as the next part of the stream */
+  void feed(const u8 * data, u32 length) ;
+
+  /**
+     Parse \a packet, from its #packetCursor() to its end, as the next part of the stream, and
+     leave its cursor at its end.
+
+     \blinks #E_API_INVALID_PACKET if \a packet is null or pointing at something that is detectably
+     corrupt or not a packet.
+   */
+  void feed(u8 * packet) ;
+
+  /** End the stream: complete any field and record in progress, as if the terminator arrived */
+  void finish() ;
+
+  /** Forget any field and record in progress, and start counting records from 0 again */
+  void reset() ;
+
+  /** True if a field has been started but not completed */
+  bool inField() const { return field; }
+
+  /** How many records have been completed */
+  u32 getRecords() const { return record; }
+
+private:
+  StreamFieldHandler * fieldHandler;
+  StreamRecordHandler * recordHandler;
+  void * arg;
+  u32 base;
+  u32 record;
+  u32 index;         /* Fields completed in the current record */
+  u32 num;           /* The current field's value so far */
+  u8 terminator;
+  bool field;        /* In a field */
+  bool numeric;      /* The current field could still be a number */
+  bool digits;       /* ..and has some digits */
+  bool negative;
+  bool signable;     /* At the current field's first byte */
+
+  void report(const u8 * bytes, u32 length, bool complete) ;
+  void endField(const u8 * bytes, u32 length) ;
+  void endRecord() ;
+};
+
+#endif /* MFMSTREAMPARSER_H_ */
@@ -0,0 +1,586 @@
+/*                                             -*- mode:C++; fill-column:100 -*-
+  MFMBenchmark.cpp - Host-side timing of packet layer operations
+  Copyright (C) 2013 The Regents of the University of New Mexico.  All rights reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301
+  USA
+*/
+
+/*
+  TO COMPILE FOR BENCHMARKING (or see 'make bench' with CONFIG_TILE_TYPE=sim):
+
+  g++ -O2 -Wall -pedantic -Werror -Wundef -I../include -DHOST_MODE -DBENCH_PACKET_SUITE -o"./benchpackets" MFMBenchmark.cpp MFMPacket.cpp MFMPacketReader.cpp MFMPacketWriter.cpp MFMPacketView.cpp MFMPacketIO.cpp MFMFraming.cpp;./benchpackets -csv -baseline ../../tiles/sim/bench-baseline.csv
+*/
+
+#include "MFMBenchmark.h"
+
+#ifdef HOST_MODE
+
+#include <string.h>        /* For strncpy, strcmp */
+#include <time.h>          /* For clock_gettime */
+#include "MFMAssert.h"
+
+static double nowSeconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+Benchmark::Benchmark(double seconds, u32 trials)
+  : seconds(seconds), trials(trials ? trials : 1), count(0), sink(0), baselineCount(0)
+{ }
+
+double Benchmark::run(const char * name, u32 bytes, BenchBody * body, void * arg) {
+  API_ASSERT_MAX(count, BENCH_MAX_RESULTS);
+  API_ASSERT(body != 0, E_API_NULL_HANDLER);
+
+  /* Find a rep count that takes long enough, warming the caches on the way */
+  u32 reps = 1;
+  for (;;) {
+    const double start = nowSeconds();
+    sink += body(reps, arg);
+    const double elapsed = nowSeconds() - start;
+    if (elapsed >= seconds || reps >= 0x40000000) break;
+    reps = elapsed*4 < seconds ? reps*4 : reps*2;
+  }
+
+  bodies[count] = body;
+  args[count] = arg;
+  BenchResult & r = results[count++];
+  strncpy(r.name, name, BENCH_NAME_BYTES-1);
+  r.name[BENCH_NAME_BYTES-1] = 0;
+  r.bytes = bytes;
+  r.reps = reps;
+  r.ns = time(reps, body, arg)*1e9/reps;
+  return r.ns;
+}
+
+double Benchmark::time(u32 reps, BenchBody * body, void * arg) {
+  double best = 0;
+  for (u32 t = 0; t < trials; ++t) {
+    const double start = nowSeconds();
+    sink += body(reps, arg);
+    const double elapsed = nowSeconds() - start;
+    if (t == 0 || elapsed < best) best = elapsed;
+  }
+  return best;
+}
+
+void Benchmark::repeat(u32 passes) {
+  for (u32 pass = 0; pass < passes; ++pass)
+    for (u32 i = 0; i < count; ++i) {
+      BenchResult & r = results[i];
+      const double ns = time(r.reps, bodies[i], args[i])*1e9/r.reps;
+      if (ns < r.ns) r.ns = ns;
+    }
+}
+
+u32 Benchmark::loadBaseline(const char * path) {
+  FILE * in = fopen(path, "r");
+  if (!in) return 0;
+  baselineCount = 0;
+  char line[200];
+  while (baselineCount < BENCH_MAX_RESULTS && fgets(line, sizeof(line), in)) {
+    BenchResult & r = baseline[baselineCount];
+    /* name,bytes,reps,ns_per_op,...; the header line doesn't scan */
+    if (sscanf(line, "%39[^,],%u,%u,%lf", r.name, &r.bytes, &r.reps, &r.ns) == 4 && r.ns > 0)
+      ++baselineCount;
+  }
+  fclose(in);
+  return baselineCount;
+}
+
+double Benchmark::getBaseline(const char * name) const {
+  for (u32 i = 0; i < baselineCount; ++i)
+    if (!strcmp(baseline[i].name, name)) return baseline[i].ns;
+  return 0;
+}
+
+const BenchResult & Benchmark::getResult(u32 index) const {
+  API_ASSERT_MAX(index, count);
+  return results[index];
+}
+
+void Benchmark::write(FILE * out, BenchFormat format) const {
+  const bool compared = baselineCount > 0;
+  if (format == BENCH_CSV)
+    fprintf(out, "name,bytes,reps,ns_per_op,mb_per_s%s\n",
+            compared ? ",baseline_ns_per_op,ratio" : "");
+  else if (format == BENCH_JSON)
+    fprintf(out, "{\"results\":[");
+  else
+    fprintf(out, "%-32s %6s %10s %10s %10s %6s\n",
+            "operation", "bytes", "ns/op", "MB/s", "baseline", "ratio");
+
+  for (u32 i = 0; i < count; ++i) {
+    const BenchResult & r = results[i];
+    const double base = getBaseline(r.name);
+    const double ratio = base > 0 ? r.ns/base : 0;
+    switch (format) {
+    case BENCH_CSV:
+      fprintf(out, "%s,%u,%u,%.3f,%.3f", r.name, r.bytes, r.reps, r.ns, r.megabytesPerSecond());
+      if (compared) fprintf(out, ",%.3f,%.3f", base, ratio);
+      fprintf(out, "\n");
+      break;
+    case BENCH_JSON:
+      fprintf(out, "%s\n {\"name\":\"%s\",\"bytes\":%u,\"reps\":%u,\"ns_per_op\":%.3f,"
+              "\"mb_per_s\":%.3f", i ? "," : "", r.name, r.bytes, r.reps, r.ns,
+              r.megabytesPerSecond());
+      if (compared) fprintf(out, ",\"baseline_ns_per_op\":%.3f,\"ratio\":%.3f", base, ratio);
+      fprintf(out, "}");
+      break;
+    default:
+      fprintf(out, "%-32s %6u %10.1f %10.1f", r.name, r.bytes, r.ns, r.megabytesPerSecond());
+      if (base > 0) fprintf(out, " %10.1f %6.2f\n", base, ratio);
+      else fprintf(out, " %10s %6s\n", "-", "-");
+      break;
+    }
+  }
+  if (format == BENCH_JSON) fprintf(out, "\n]}\n");
+}
+
+u32 Benchmark::regressions(double tolerance, FILE * log) const {
+  u32 slower = 0;
+  for (u32 i = 0; i < count; ++i) {
+    const BenchResult & r = results[i];
+    const double base = getBaseline(r.name);
+    if (base > 0 && r.ns > base*(1+tolerance) + BENCH_ALLOWANCE_NS) {
+      ++slower;
+      if (log) fprintf(log, "SLOWER: %s %.1f ns/op vs %.1f baseline (%+.0f%%)\n",
+                       r.name, r.ns, base, (r.ns/base-1)*100);
+    }
+  }
+  return slower;
+}
+
+#endif /* HOST_MODE */
+
+#ifdef BENCH_PACKET_SUITE
+
+#include <stdlib.h>        /* For exit, random, atof */
+#include "MFMPacket.h"
+#include "MFMPacketWriter.h"
+#include "MFMPacketView.h"
+#include "MFMPacketIO.h"
+#include "MFMFraming.h"
+
+void _apiError_(u32 code,const char * file, int lineno) {
+  fprintf(stderr,"APIERROR %d %s:%d\n",code,file,lineno);
+  exit(code);
+}
+
+static void die(const char * msg) {
+  fprintf(stderr,"%s\n",msg);
+  exit(2);
+}
+
+/* Each operation cycles through this many packets, so no one of them is special to the cache or
+   the branch predictors */
+#define SUITE_PACKETS 64
+#define SUITE_MASK (SUITE_PACKETS-1)
+
+#define SUITE_BUFFER_BYTES (4+MAX_PACKET_LENGTH+1)
+
+/* The packets an operation is timed on, and the total of their lengths */
+struct SuiteSet {
+  u8 bufs[SUITE_PACKETS][SUITE_BUFFER_BYTES];
+  u8 * packets[SUITE_PACKETS];
+  u32 totalBytes;
+  int code;
+  u32 values;        /* The numbers in each packet, for the packetRead sets */
+
+  u32 averageLength() const { return totalBytes/SUITE_PACKETS; }
+};
+
+/* Fill 'set' with packets of 'len' random data bytes, the last of them a check byte */
+static void makeRandom(SuiteSet & set, u32 len) {
+  set.totalBytes = 0;
+  for (u32 p = 0; p < SUITE_PACKETS; ++p) {
+    u8 data[MAX_PACKET_LENGTH];
+    CheckByteAccumulator cba;
+    for (u32 i = 0; i+1 < len; ++i) cba.update(data[i] = (u8) random());
+    data[len-1] = cba.get();
+    set.packets[p] = makePacket(set.bufs[p], SUITE_BUFFER_BYTES, EAST, data, len);
+    set.totalBytes += len;
+  }
+}
+
+/* Fill 'set' with packets of 'values' random numbers written in 'code', space separated if text */
+static void makeNumbers(SuiteSet & set, int code, u32 values) {
+  set.totalBytes = 0;
+  set.code = code;
+  set.values = values;
+  for (u32 p = 0; p < SUITE_PACKETS; ++p) {
+    PacketWriter w(set.bufs[p], SUITE_BUFFER_BYTES, EAST);
+    for (u32 i = 0; i < values; ++i) {
+      u32 val = (u32) random();
+      if (code == BYTE) val &= 0xff;
+      else if (code == BESHORT) val &= 0xffff;
+      else if (code == DEC) val = (u32) (int) (val%2000001) - 1000000;
+      if (i && code > BYTE) w.put(' ');
+      w.put(val, code);
+    }
+    if (!w.commit()) die("number packet overflowed");
+    set.packets[p] = w.getPacket();
+    u32 back, read = 0;         /* Make sure it's timing the reads it means to */
+    while (packetRead(set.packets[p], back, code)) ++read;
+    if (read != values || !packetReadEOF(set.packets[p])) die("number packet misread");
+    set.totalBytes += packetLength(set.packets[p]);
+  }
+}
+
+static u32 benchLength(u32 reps, void * arg) {
+  u8 ** packets = ((SuiteSet *) arg)->packets;
+  u32 sum = 0;
+  for (u32 r = 0; r < reps; ++r) sum += packetLength(packets[r&SUITE_MASK]);
+  return sum;
+}
+
+static u32 benchCursor(u32 reps, void * arg) {
+  u8 ** packets = ((SuiteSet *) arg)->packets;
+  u32 sum = 0;
+  for (u32 r = 0; r < reps; ++r) sum += packetCursor(packets[r&SUITE_MASK]);
+  return sum;
+}
+
+/* One op: read every number in one packet */
+static u32 benchRead(u32 reps, void * arg) {
+  SuiteSet & set = *(SuiteSet *) arg;
+  u32 sum = 0;
+  for (u32 r = 0; r < reps; ++r) {
+    u8 * packet = set.packets[r&SUITE_MASK];
+    packetReread(packet);
+    u32 val;
+    while (packetRead(packet, val, set.code)) sum += val;
+  }
+  return sum;
+}
+
+static u32 benchReadArray(u32 reps, void * arg) {
+  SuiteSet & set = *(SuiteSet *) arg;
+  u32 sum = 0;
+  u32 vals[MAX_PACKET_LENGTH];
+  for (u32 r = 0; r < reps; ++r) {
+    u8 * packet = set.packets[r&SUITE_MASK];
+    packetReread(packet);
+    const u32 n = packetReadArray(packet, vals, MAX_PACKET_LENGTH, set.code);
+    sum += n + vals[n-1];
+  }
+  return sum;
+}
+
+static u32 benchReadU64(u32 reps, void * arg) {
+  SuiteSet & set = *(SuiteSet *) arg;
+  u64 sum = 0;
+  for (u32 r = 0; r < reps; ++r) {
+    u8 * packet = set.packets[r&SUITE_MASK];
+    packetReread(packet);
+    u64 val;
+    while (packetRead(packet, val)) sum += val;
+  }
+  return (u32) sum;
+}
+
+static u32 benchReadBytes(u32 reps, void * arg) {
+  SuiteSet & set = *(SuiteSet *) arg;
+  u8 dest[MAX_PACKET_LENGTH];
+  u32 sum = 0;
+  for (u32 r = 0; r < reps; ++r) {
+    u8 * packet = set.packets[r&SUITE_MASK];
+    packetReread(packet);
+    sum += packetRead(packet, dest, packetLength(packet)) + dest[r&15];
+  }
+  return sum;
+}
+
+static u32 benchReadCheckByte(u32 reps, void * arg) {
+  SuiteSet & set = *(SuiteSet *) arg;
+  u32 sum = 0;
+  for (u32 r = 0; r < reps; ++r) {
+    u8 * packet = set.packets[r&SUITE_MASK];
+    packetReread(packet, packetLength(packet)-1);
+    sum += packetReadCheckByte(packet);
+  }
+  return sum;
+}
+
+static u32 benchCheckByteValid(u32 reps, void * arg) {
+  u8 ** packets = ((SuiteSet *) arg)->packets;
+  u32 sum = 0;
+  for (u32 r = 0; r < reps; ++r) sum += packetCheckByteValid(packets[r&SUITE_MASK]);
+  return sum;
+}
+
+static u32 benchMakePacket(u32 reps, void * arg) {
+  SuiteSet & set = *(SuiteSet *) arg;
+  const u32 len = set.averageLength();
+  u8 buf[SUITE_BUFFER_BYTES];
+  u32 sum = 0;
+  for (u32 r = 0; r < reps; ++r)
+    sum += makePacket(buf, sizeof(buf), WEST, set.packets[r&SUITE_MASK], len)[r&7];
+  return sum;
+}
+
+static const char * PREFIX = "zpacket prefix ";
+
+static u32 benchPrefix(u32 reps, void * arg) {
+  u8 ** packets = ((SuiteSet *) arg)->packets;
+  u32 sum = 0;
+  for (u32 r = 0; r < reps; ++r) sum += zpacketPrefix(packets[r&SUITE_MASK], PREFIX);
+  return sum;
+}
+
+/* One op: compare two equal packets, in different buffers */
+static u32 benchEqual(u32 reps, void * arg) {
+  u8 ** packets = ((SuiteSet *) arg)->packets;
+  u32 sum = 0;
+  for (u32 r = 0; r < reps; ++r)
+    sum += packetEqual(packets[r&SUITE_MASK], packets[(r+SUITE_PACKETS/2)&SUITE_MASK]);
+  return sum;
+}
+
+/* One op: read every subpacket of one container */
+static u32 benchReadPacket(u32 reps, void * arg) {
+  u8 ** packets = ((SuiteSet *) arg)->packets;
+  u32 sum = 0;
+  for (u32 r = 0; r < reps; ++r) {
+    u8 * packet = packets[r&SUITE_MASK];
+    packetReread(packet);
+    u8 * sub;
+    while (packetReadPacket(packet, sub)) sum += packetLength(sub);
+  }
+  return sum;
+}
+
+static u32 benchFrameEncode(u32 reps, void * arg) {
+  SuiteSet & set = *(SuiteSet *) arg;
+  static u8 wire[FRAME_ENCODE_MAX_BYTES(MAX_PACKET_LENGTH)];
+  u32 sum = 0;
+  for (u32 r = 0; r < reps; ++r) {
+    const u8 * packet = set.packets[r&SUITE_MASK];
+    sum += frameEncode(wire, packet, packetLength(packet));
+  }
+  return sum;
+}
+
+/* The framed wire bytes of each packet of a set, for the receiving side */
+struct SuiteWire {
+  SuiteSet * set;
+  u8 wire[SUITE_PACKETS][FRAME_ENCODE_MAX_BYTES(MAX_PACKET_LENGTH)];
+  u32 length[SUITE_PACKETS];
+
+  void frame(SuiteSet & s) {
+    set = &s;
+    for (u32 p = 0; p < SUITE_PACKETS; ++p)
+      length[p] = frameEncode(wire[p], s.packets[p], packetLength(s.packets[p]));
+  }
+};
+
+static u32 benchFrameDecode(u32 reps, void * arg) {
+  SuiteWire & sw = *(SuiteWire *) arg;
+  u8 dest[MAX_PACKET_LENGTH];
+  u32 sum = 0;
+  for (u32 r = 0; r < reps; ++r) {
+    FrameDecodeState state;
+    u32 destLength = sizeof(dest);
+    sum += frameDecode(state, dest, destLength, sw.wire[r&SUITE_MASK], sw.length[r&SUITE_MASK]);
+  }
+  return sum;
+}
+
+static u32 dispatched;
+static void countDispatch(u8 * packet, u8) { dispatched += packetLength(packet); }
+
+/* One op: deframe one packet into an MFMPacketIO and dispatch it */
+static u32 benchReceive(u32 reps, void * arg) {
+  SuiteWire & sw = *(SuiteWire *) arg;
+  static u8 buf[MFMPACKETIO_BUFFER_SIZE_BYTES];
+  MFMPacketIO pio(buf);
+  pio.forceSync();
+  dispatched = 0;
+  for (u32 r = 0; r < reps; ++r) {
+    pio.storeBytes(sw.wire[r&SUITE_MASK], sw.length[r&SUITE_MASK]);
+    pio.dispatchPacket(NORTH, countDispatch);
+  }
+  return dispatched;
+}
+
+/* One op: write one packet into an outbound MFMPacketIO and take it out again */
+static u32 benchSend(u32 reps, void * arg) {
+  SuiteSet & set = *(SuiteSet *) arg;
+  const u32 len = set.averageLength();
+  static u8 buf[MFMPACKETIO_BUFFER_SIZE_BYTES];
+  MFMPacketIO pio(buf);
+  dispatched = 0;
+  for (u32 r = 0; r < reps; ++r) {
+    PacketWriter w(pio);
+    w.put(set.packets[r&SUITE_MASK], len);
+    w.commit();
+    pio.dispatchPacket(SOUTH, countDispatch);
+  }
+  return dispatched;
+}
+
+/* One op: relay one received packet into another face's outbound MFMPacketIO */
+static MFMPacketIO * relayOut;
+static void relayDispatch(u8 * packet, u8) { dispatched += packetForward(packet, *relayOut); }
+
+static u32 benchForward(u32 reps, void * arg) {
+  SuiteWire & sw = *(SuiteWire *) arg;
+  static u8 inBuf[MFMPACKETIO_BUFFER_SIZE_BYTES], outBuf[MFMPACKETIO_BUFFER_SIZE_BYTES];
+  MFMPacketIO in(inBuf), out(outBuf);
+  in.forceSync();
+  relayOut = &out;
+  dispatched = 0;
+  for (u32 r = 0; r < reps; ++r) {
+    in.storeBytes(sw.wire[r&SUITE_MASK], sw.length[r&SUITE_MASK]);
+    in.dispatchPacket(NORTH, relayDispatch);
+    out.dispatchPacket(SOUTH, countDispatch);
+  }
+  relayOut = 0;
+  return dispatched;
+}
+
+static void usage(const char * prog) {
+  fprintf(stderr,
+          "Usage: %s [-csv|-json] [-baseline FILE] [-tolerance PERCENT] [-seconds S] [-trials N]\n"
+          "          [-passes N]\n"
+          "Time the packet layer on this host, in N passes (default 3) of the whole suite,\n"
+          "keeping each operation's fastest trial.  With a baseline (CSV from an earlier -csv\n"
+          "run), report each operation's ratio to it, and exit 1 if any is more than PERCENT\n"
+          "(default 25) slower, plus %.0f ns, even after up to N more passes.\n",
+          prog, BENCH_ALLOWANCE_NS);
+  exit(2);
+}
+
+int main(int argc, char ** argv) {
+  BenchFormat format = BENCH_TEXT;
+  const char * baselinePath = 0;
+  double tolerance = 0.25, seconds = 0.05;
+  u32 trials = 5, passes = 3;
+  for (int i = 1; i < argc; ++i) {
+    const char * a = argv[i];
+    const bool more = i+1 < argc;
+    if (!strcmp(a, "-csv")) format = BENCH_CSV;
+    else if (!strcmp(a, "-json")) format = BENCH_JSON;
+    else if (!strcmp(a, "-baseline") && more) baselinePath = argv[++i];
+    else if (!strcmp(a, "-tolerance") && more) tolerance = atof(argv[++i])/100;
+    else if (!strcmp(a, "-seconds") && more) seconds = atof(argv[++i]);
+    else if (!strcmp(a, "-trials") && more) trials = (u32) atoi(argv[++i]);
+    else if (!strcmp(a, "-passes") && more) passes = (u32) atoi(argv[++i]);
+    else usage(argv[0]);
+  }
+
+  Benchmark bench(seconds, trials);
+  if (baselinePath && !bench.loadBaseline(baselinePath))
+    fprintf(stderr, "No baseline read from %s\n", baselinePath);
+
+  srandom(21);
+  static SuiteSet short16, long250, equal250, prefix, container;
+  static SuiteWire wire16, wire250;
+  makeRandom(short16, 16);
+  makeRandom(long250, MAX_PACKET_LENGTH-2);
+
+  bench.run("packetLength", 0, benchLength, &short16);
+  bench.run("packetCursor", 0, benchCursor, &short16);
+
+  {
+    static SuiteSet sets[8];
+    static const struct { int code; u32 values; const char * name; } readers[] = {
+      { BYTE, 64, "packetRead.BYTE" },
+      { BESHORT, 64, "packetRead.BESHORT" },
+      { BELONG, 48, "packetRead.BELONG" },
+      { DEC, 24, "packetRead.DEC" },
+      { HEX, 24, "packetRead.HEX" },
+      { OCT, 16, "packetRead.OCT" },
+      { BIN, 6, "packetRead.BIN" },
+      { B36, 24, "packetRead.B36" }
+    };
+    for (u32 i = 0; i < sizeof(readers)/sizeof(readers[0]); ++i) {
+      makeNumbers(sets[i], readers[i].code, readers[i].values);
+      bench.run(readers[i].name, sets[i].averageLength(), benchRead, &sets[i]);
+    }
+    bench.run("packetReadArray.DEC", sets[3].averageLength(), benchReadArray, &sets[3]);
+    bench.run("packetReadArray.HEX", sets[4].averageLength(), benchReadArray, &sets[4]);
+    bench.run("packetRead.u64", long250.averageLength(), benchReadU64, &long250);
+    bench.run("packetRead.bytes", long250.averageLength(), benchReadBytes, &long250);
+    bench.run("packetReadCheckByte", long250.averageLength(), benchReadCheckByte, &long250);
+  }
+
+  bench.run("packetCheckByteValid.16", 16, benchCheckByteValid, &short16);
+  bench.run("packetCheckByteValid.250", long250.averageLength(), benchCheckByteValid, &long250);
+  bench.run("makePacket.16", 16, benchMakePacket, &short16);
+  bench.run("makePacket.250", long250.averageLength(), benchMakePacket, &long250);
+
+  {
+    const u32 plen = strlen(PREFIX);
+    prefix.totalBytes = 0;
+    for (u32 p = 0; p < SUITE_PACKETS; ++p) {
+      u8 data[64];
+      memcpy(data, PREFIX, plen);
+      for (u32 i = plen; i < sizeof(data); ++i) data[i] = (u8) ('a'+random()%26);
+      prefix.packets[p] = makePacket(prefix.bufs[p], SUITE_BUFFER_BYTES, EAST, data, sizeof(data));
+      prefix.totalBytes += plen;
+    }
+    bench.run("zpacketPrefix", plen, benchPrefix, &prefix);
+  }
+
+  for (u32 p = 0; p < SUITE_PACKETS; ++p) {   /* Each packet equals the one half a cycle away */
+    const u8 * from = long250.packets[p&(SUITE_PACKETS/2-1)];
+    equal250.packets[p] =
+      makePacket(equal250.bufs[p], SUITE_BUFFER_BYTES, EAST, from, packetLength(from));
+  }
+  equal250.totalBytes = long250.totalBytes;
+  bench.run("packetEqual.250", equal250.averageLength(), benchEqual, &equal250);
+
+  container.totalBytes = 0;
+  for (u32 p = 0; p < SUITE_PACKETS; ++p) {   /* Eight subpackets of 24 bytes */
+    PacketWriter w(container.bufs[p], SUITE_BUFFER_BYTES, EAST);
+    ContainerWriter c(w);
+    for (u32 s = 0; s < 8; ++s) {
+      if (!c.begin(WEST)) die("container overflowed");
+      w.put(short16.packets[(p+s)&SUITE_MASK], 16);
+      w.put(" subpacket");
+      c.end();
+    }
+    if (!w.commit()) die("container overflowed");
+    container.packets[p] = w.getPacket();
+    container.totalBytes += packetLength(container.packets[p]);
+  }
+  bench.run("packetReadPacket.8", container.averageLength(), benchReadPacket, &container);
+
+  wire16.frame(short16);
+  wire250.frame(long250);
+  bench.run("frameEncode.250", long250.averageLength(), benchFrameEncode, &long250);
+  bench.run("frameDecode.250", long250.averageLength(), benchFrameDecode, &wire250);
+  bench.run("MFMPacketIO.receive.16", 16, benchReceive, &wire16);
+  bench.run("MFMPacketIO.receive.250", long250.averageLength(), benchReceive, &wire250);
+  bench.run("MFMPacketIO.send.16", 16, benchSend, &short16);
+  bench.run("MFMPacketIO.send.250", long250.averageLength(), benchSend, &long250);
+  bench.run("packetForward.250", long250.averageLength(), benchForward, &wire250);
+
+  if (passes > 1) bench.repeat(passes-1);
+
+  /* Anything can look slower for a while on a busy host; a real regression still does after as
+     many passes again */
+  for (u32 pass = 0; pass < passes && bench.regressions(tolerance) > 0; ++pass)
+    bench.repeat(1);
+
+  bench.write(stdout, format);
+  if (bench.getSink() == 1) printf("\n");   /* Keep the sink, without printing it */
+  return bench.regressions(tolerance, stderr) > 0 ? 1 : 0;
+}
+
+#endif /* BENCH_PACKET_SUITE */
@@ -0,0 +1,425 @@
+/*                                              -*- mode:C++; fill-column:100 -*-
+  MFMFraming.cpp - Bulk PFSC packet framing and deframing
+  Copyright (C) 2013 The Regents of the University of New Mexico.  All rights reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301
+  USA
+*/
+
+/* TO COMPILE FOR TESTING:
+  g++ -O0 -g3 -Wall -pedantic -Werror -Wundef -I../include -DHOST_MODE -DTEST_FRAMING -o"./testframing" MFMFraming.cpp MFMPacketIO.cpp MFMPacket.cpp MFMPacketReader.cpp;./testframing
+
+   TO COMPILE FOR BENCHMARKING (add -mavx2 to try the AVX2 scanner):
+  g++ -O2 -Wall -pedantic -Werror -Wundef -I../include -DHOST_MODE -DBENCH_FRAMING -o"./benchframing" MFMFraming.cpp MFMPacketIO.cpp MFMPacket.cpp MFMPacketReader.cpp;./benchframing
+*/
+
+#include <string.h>        /* For memcpy */
+#include "MFMFraming.h"
+#include "MFMAssert.h"
+
+#if defined(HOST_MODE) && defined(__AVX2__)
+#include <immintrin.h>
+#define FRAMING_SCAN_AVX2 1
+#elif defined(HOST_MODE) && defined(__SSE2__)
+#include <emmintrin.h>
+#define FRAMING_SCAN_SSE2 1
+#endif
+
+static inline bool isSpecial(u8 b) {
+  return b == PFSC_END || b == PFSC_ESC;
+}
+
+#if defined(FRAMING_SCAN_AVX2) || defined(FRAMING_SCAN_SSE2)
+
+/* Return the index of the first PFSC_END or PFSC_ESC in p[0..n), or n if there are none */
+static u32 findSpecial(const u8 * p, u32 n) {
+  u32 i = 0;
+#ifdef FRAMING_SCAN_AVX2
+  const __m256i end32 = _mm256_set1_epi8((char) PFSC_END);
+  const __m256i esc32 = _mm256_set1_epi8((char) PFSC_ESC);
+  for (; i + 32 <= n; i += 32) {
+    const __m256i v = _mm256_loadu_si256((const __m256i *) (p+i));
+    const u32 hits = (u32) _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v,end32),
+                                                                _mm256_cmpeq_epi8(v,esc32)));
+    if (hits) return i + __builtin_ctz(hits);
+  }
+#endif
+  const __m128i end16 = _mm_set1_epi8((char) PFSC_END);
+  const __m128i esc16 = _mm_set1_epi8((char) PFSC_ESC);
+  for (; i + 16 <= n; i += 16) {
+    const __m128i v = _mm_loadu_si128((const __m128i *) (p+i));
+    const u32 hits = (u32) _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v,end16),
+                                                          _mm_cmpeq_epi8(v,esc16)));
+    if (hits) return i + __builtin_ctz(hits);
+  }
+  for (; i < n; ++i)
+    if (isSpecial(p[i])) break;
+  return i;
+}
+
+#else /* Word at a time */
+
+typedef u32 __attribute__((__may_alias__)) FramingWord;
+
+#define FRAMING_ONES  0x01010101u
+#define FRAMING_HIGHS 0x80808080u
+
+/* Nonzero iff some byte of w is zero.  Byte order independent, so no endianness concerns */
+static inline u32 hasZeroByte(u32 w) {
+  return (w - FRAMING_ONES) & ~w & FRAMING_HIGHS;
+}
+
+/* Return the index of the first PFSC_END or PFSC_ESC in p[0..n), or n if there are none */
+static u32 findSpecial(const u8 * p, u32 n) {
+  u32 i = 0;
+  for (; i < n && (((uptr) (p+i)) & (sizeof(u32)-1)); ++i)   /* Align the word loads */
+    if (isSpecial(p[i])) return i;
+
+  const u32 endWord = PFSC_END*FRAMING_ONES;
+  const u32 escWord = PFSC_ESC*FRAMING_ONES;
+  for (; i + sizeof(u32) <= n; i += sizeof(u32)) {
+    const u32 w = *(const FramingWord *) (p+i);
+    if (hasZeroByte(w^endWord) | hasZeroByte(w^escWord))
+      break;                    /* Some byte of this word is special; find which below */
+  }
+
+  for (; i < n; ++i)
+    if (isSpecial(p[i])) break;
+  return i;
+}
+
+#endif
+
+u32 frameEncode(u8 * dest, const u8 * data, u32 length) {
+  API_ASSERT_NONNULL(dest);
+  API_ASSERT(data || !length, E_API_NULL_POINTER);
+
+  u8 * out = dest;
+  u32 i = 0;
+  while (i < length) {
+    const u32 run = findSpecial(data+i, length-i);
+    memcpy(out, data+i, run);
+    out += run;
+    i += run;
+    if (i < length) {
+      *out++ = PFSC_ESC;
+      *out++ = data[i++] == PFSC_END ? PFSC_EEND : PFSC_EESC;
+    }
+  }
+  *out++ = PFSC_END;
+  return (u32) (out - dest);
+}
+
+u32 frameDecode(FrameDecodeState & state, u8 * dest, u32 & destLength,
+                const u8 * wire, u32 wireLength) {
+  API_ASSERT(dest || !destLength, E_API_NULL_POINTER);
+  API_ASSERT(wire || !wireLength, E_API_NULL_POINTER);
+
+  const u32 room = destLength;
+  u32 out = 0;
+  u32 i = 0;
+
+  while (i < wireLength && !state.end) {
+    u8 b = wire[i];
+
+    if (state.escape) {
+      if (b == PFSC_END) {      /* ESC END: Still ends the packet, but it's broken */
+        state.flags |= PK_BAD_ESCAPE;
+        state.escape = false;
+        state.end = true;
+        ++i;
+        break;
+      }
+      if (out >= room) break;   /* Leave the escape pending for whoever has room */
+      if (b == PFSC_EEND) b = PFSC_END;
+      else if (b == PFSC_EESC) b = PFSC_ESC;
+      else state.flags |= PK_BAD_ESCAPE;   /* Keep the byte itself as data */
+      dest[out++] = b;
+      state.escape = false;
+      ++i;
+      continue;
+    }
+
+    if (b == PFSC_END) {
+      state.end = true;
+      ++i;
+      break;
+    }
+
+    if (b == PFSC_ESC) {
+      state.escape = true;
+      ++i;
+      continue;
+    }
+
+    /* Here b begins a clean run; copy as much of it as fits */
+    u32 limit = wireLength - i;
+    if (limit > room - out) limit = room - out;
+    if (limit == 0) break;
+    const u32 run = findSpecial(wire+i, limit);
+    memcpy(dest+out, wire+i, run);
+    out += run;
+    i += run;
+  }
+
+  destLength = out;
+  return i;
+}
+
+#if defined(TEST_FRAMING) || defined(BENCH_FRAMING)
+
+#include <stdio.h>
+#include <stdlib.h> // for exit, random
+#include "MFMPacketIO.h"
+
+void _apiError_(u32 code,const char * file, int lineno) {
+  fprintf(stderr,"APIERROR %d %s:%d\n",code,file,lineno);
+  exit(code);
+}
+
+/* Fill buffer with random bytes, making roughly one in every 'oneIn' of them special */
+static void randomFill(u8 * buffer, u32 length, u32 oneIn) {
+  for (u32 i = 0; i < length; ++i) {
+    u8 b = (u8) random();
+    if (random()%oneIn == 0) {
+      const u8 specials[] = { PFSC_END, PFSC_ESC, PFSC_EEND, PFSC_EESC };
+      b = specials[random()%4];
+    } else if (isSpecial(b)) b = 'x';
+    buffer[i] = b;
+  }
+}
+
+#endif
+
+#ifdef TEST_FRAMING
+
+static void die(const char * file, int line, const char * msg) {
+  fprintf(stderr,"%s:%d: %s\n",file, line, msg);
+  exit(100);
+}
+
+#define TEST(condition) do { if (!(condition)) die(__FILE__,__LINE__,#condition); } while (0)
+
+/* The byte-at-a-time framer, for reference */
+static u32 slowEncode(u8 * dest, const u8 * data, u32 length) {
+  u32 o = 0;
+  for (u32 i = 0; i < length; ++i) {
+    if (data[i] == PFSC_END) { dest[o++] = PFSC_ESC; dest[o++] = PFSC_EEND; }
+    else if (data[i] == PFSC_ESC) { dest[o++] = PFSC_ESC; dest[o++] = PFSC_EESC; }
+    else dest[o++] = data[i];
+  }
+  dest[o++] = PFSC_END;
+  return o;
+}
+
+static void test1() {           /* frameEncode matches the byte-at-a-time framer */
+  u8 data[600], fast[FRAME_ENCODE_MAX_BYTES(600)], slow[FRAME_ENCODE_MAX_BYTES(600)];
+  for (u32 rep = 0; rep < 20000; ++rep) {
+    const u32 off = random()%8;  /* Exercise unaligned starts */
+    const u32 len = random()%(sizeof(data)-off+1);
+    randomFill(data, sizeof(data), 1+random()%50);
+    const u32 flen = frameEncode(fast, data+off, len);
+    const u32 slen = slowEncode(slow, data+off, len);
+    TEST(flen == slen);
+    TEST(memcmp(fast,slow,flen) == 0);
+  }
+}
+
+static void test2() {           /* Encode then decode in random chunks round trips */
+  u8 data[MAX_PACKET_LENGTH], wire[FRAME_ENCODE_MAX_BYTES(MAX_PACKET_LENGTH)], back[MAX_PACKET_LENGTH];
+  for (u32 rep = 0; rep < 20000; ++rep) {
+    const u32 len = random()%(MAX_PACKET_LENGTH+1);
+    randomFill(data, len, 1+random()%20);
+    const u32 wlen = frameEncode(wire, data, len);
+
+    FrameDecodeState fds;
+    u32 got = 0, w = 0;
+    while (!fds.end) {
+      TEST(w < wlen);
+      u32 chunk = 1+random()%8;
+      if (chunk > wlen-w) chunk = wlen-w;
+      u32 dl = sizeof(back)-got;
+      w += frameDecode(fds, back+got, dl, wire+w, chunk);
+      got += dl;
+    }
+    TEST(w == wlen);
+    TEST(got == len);
+    TEST(fds.flags == 0);
+    TEST(memcmp(data,back,len) == 0);
+  }
+}
+
+static void test3() {           /* Bad escapes flag and keep data as storeByte does */
+  const u8 wire[] = { 'a', PFSC_ESC, 'b', PFSC_ESC, PFSC_ESC, 'c', PFSC_ESC, PFSC_END, 'd' };
+  u8 out[10];
+  FrameDecodeState fds;
+  u32 dl = sizeof(out);
+  TEST(frameDecode(fds, out, dl, wire, sizeof(wire)) == 8);
+  TEST(fds.end && fds.flags == PK_BAD_ESCAPE && !fds.escape);
+  TEST(dl == 4);
+  TEST(out[0]=='a' && out[1]=='b' && out[2]==PFSC_ESC && out[3]=='c');
+
+  fds.nextPacket();             /* Stops before a data byte that won't fit, escape still pending */
+  const u8 wire2[] = { 'x', 'y', PFSC_ESC, PFSC_EEND, PFSC_END };
+  dl = 2;
+  TEST(frameDecode(fds, out, dl, wire2, sizeof(wire2)) == 3);
+  TEST(dl == 2 && fds.escape && !fds.end);
+  dl = 1;
+  TEST(frameDecode(fds, out, dl, wire2+3, 2) == 2);
+  TEST(dl == 1 && out[0] == PFSC_END && fds.end && fds.flags == 0);
+}
+
+static u8 ringA[MFMPACKETIO_BUFFER_SIZE_BYTES], ringB[MFMPACKETIO_BUFFER_SIZE_BYTES];
+
+static void test4() {  /* MFMPacketIO::storeBytes matches storeByte, including overflow and wrap */
+  MFMPacketIO a(ringA), b(ringB);
+  u8 wire[2000];
+  PacketBuffer pa, pb;
+  u32 packets = 0, broken = 0;
+  for (u32 rep = 0; rep < 3000; ++rep) {
+    const u32 len = random()%sizeof(wire);
+    randomFill(wire, len, 1+random()%60);
+    for (u32 i = 0; i < len; ++i)
+      a.storeByte(wire[i]);
+    for (u32 i = 0; i < len; ) {
+      const u32 chunk = 1+random()%(len-i);
+      b.storeBytes(wire+i, chunk);
+      i += chunk;
+    }
+    TEST(a.packetsRemovable() == b.packetsRemovable());
+    TEST(a.getPacketsDropped() == b.getPacketsDropped());
+    a.bufferCheck();
+    b.bufferCheck();
+    u32 drain = random()%(a.packetsRemovable()+1);
+    while (drain-- > 0) {
+      u8 * x = a.copyPacketAndDiscard(pa);
+      u8 * y = b.copyPacketAndDiscard(pb);
+      TEST(x && y);
+      TEST(packetLength(x) == packetLength(y));
+      TEST(packetFlags(x) == packetFlags(y));
+      TEST(memcmp(x,y,packetLength(x)) == 0);
+      ++packets;
+      if (packetFlags(x)) ++broken;
+    }
+  }
+  printf("4 packets=%u broken=%u dropped=%u\n", packets, broken, a.getPacketsDropped());
+}
+
+int main() {
+  test1();
+  test2();
+  test3();
+  test4();
+  return 0;
+}
+
+#endif /* TEST_FRAMING */
+
+#ifdef BENCH_FRAMING
+
+#include <time.h>   // for clock_gettime
+
+static double nowSeconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+static u8 benchRing[MFMPACKETIO_BUFFER_SIZE_BYTES];
+
+static void benchOne(const char * label, u32 oneIn) {
+  enum { PACKETS = 4096, REPS = 200 };
+  static u8 data[MAX_PACKET_LENGTH];
+  static u8 wire[PACKETS*FRAME_ENCODE_MAX_BYTES(MAX_PACKET_LENGTH)];
+  static u8 sink[MAX_PACKET_LENGTH];
+  u32 wlen = 0, dlen = 0;
+  for (u32 p = 0; p < PACKETS; ++p) {
+    randomFill(data, sizeof(data), oneIn);
+    wlen += frameEncode(wire+wlen, data, sizeof(data));
+    dlen += sizeof(data);
+  }
+  const double bytes = (double) wlen * REPS;
+  u32 check = 0;
+
+  double start = nowSeconds();
+  for (u32 rep = 0; rep < REPS; ++rep) {
+    for (u32 w = 0; w + sizeof(sink) <= wlen; w += sizeof(sink))
+      memcpy(sink, wire+w, sizeof(sink));
+    check += sink[0];
+  }
+  const double tcopy = nowSeconds()-start;
+
+  MFMPacketIO pio(benchRing);
+  PacketBuffer pb;
+  start = nowSeconds();
+  for (u32 rep = 0; rep < REPS; ++rep) {
+    for (u32 w = 0; w < wlen; ++w) {
+      pio.storeByte(wire[w]);
+      if (!pio.isEmptyOfPackets()) check += packetLength(pio.copyPacketAndDiscard(pb));
+    }
+  }
+  const double tbyte = nowSeconds()-start;
+
+  start = nowSeconds();
+  for (u32 rep = 0; rep < REPS; ++rep) {
+    for (u32 w = 0; w < wlen; w += 64) {
+      pio.storeBytes(wire+w, wlen-w < 64 ? wlen-w : 64);
+      while (!pio.isEmptyOfPackets()) check += packetLength(pio.copyPacketAndDiscard(pb));
+    }
+  }
+  const double tbulk = nowSeconds()-start;
+
+  start = nowSeconds();
+  for (u32 rep = 0; rep < REPS; ++rep) {
+    FrameDecodeState fds;
+    for (u32 w = 0; w < wlen; ) {
+      u32 dl = sizeof(sink);
+      w += frameDecode(fds, sink, dl, wire+w, wlen-w);
+      fds.nextPacket();
+      check += dl;
+    }
+  }
+  const double tdecode = nowSeconds()-start;
+
+  start = nowSeconds();
+  u32 elen = 0;
+  for (u32 rep = 0; rep < REPS; ++rep)
+    for (u32 p = 0; p < PACKETS; ++p)
+      elen += frameEncode(wire, data, sizeof(data));
+  const double tencode = nowSeconds()-start;
+
+  printf("%s (check %u %u)\n", label, check, elen);
+  printf("  %-26s %8.1f MB/s\n", "memcpy", bytes/tcopy/1e6);
+  printf("  %-26s %8.1f MB/s\n", "storeByte", bytes/tbyte/1e6);
+  printf("  %-26s %8.1f MB/s\n", "storeBytes", bytes/tbulk/1e6);
+  printf("  %-26s %8.1f MB/s\n", "frameDecode", bytes/tdecode/1e6);
+  printf("  %-26s %8.1f MB/s\n", "frameEncode", (double) dlen*REPS/tencode/1e6);
+}
+
+int main() {
+#if defined(FRAMING_SCAN_AVX2)
+  printf("Scanner: AVX2\n");
+#elif defined(FRAMING_SCAN_SSE2)
+  printf("Scanner: SSE2\n");
+#else
+  printf("Scanner: word at a time\n");
+#endif
+  benchOne("Binary, ~1 special per 1000 bytes", 1000);
+  benchOne("Binary, ~1 special per 100 bytes", 100);
+  benchOne("Binary, ~1 special per 10 bytes", 10);
+  return 0;
+}
+
+#endif /* BENCH_FRAMING */
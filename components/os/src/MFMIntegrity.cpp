@@ -0,0 +1,495 @@
+/*                                              -*- mode:C++; fill-column:100 -*-
+  MFMIntegrity.cpp - CRC-32C packet trailers and per-face integrity modes
+  Copyright (C) 2013 The Regents of the University of New Mexico.  All rights reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301
+  USA
+*/
+
+/* TO COMPILE FOR TESTING:
+  g++ -O0 -g3 -Wall -pedantic -Werror -Wundef -I../include -DHOST_MODE -DTEST_INTEGRITY -o"./testintegrity" MFMIntegrity.cpp MFMPacketWriter.cpp MFMPacketIO.cpp MFMFraming.cpp MFMPacketReader.cpp MFMPacket.cpp;./testintegrity
+
+   TO COMPILE FOR BENCHMARKING (add -msse4.2 for the crc32 instruction):
+  g++ -O2 -Wall -pedantic -Werror -Wundef -I../include -DHOST_MODE -DBENCH_INTEGRITY -o"./benchintegrity" MFMIntegrity.cpp MFMPacketWriter.cpp MFMPacketIO.cpp MFMFraming.cpp MFMPacketReader.cpp MFMPacket.cpp;./benchintegrity
+*/
+
+#include <string.h>        /* For memcpy */
+#include "MFMIntegrity.h"
+#include "MFMPacketWriter.h"
+#include "MFMAssert.h"
+
+#if defined(HOST_MODE) && defined(__SSE4_2__)
+#include <nmmintrin.h>
+#define CRC32C_SSE42 1
+#endif
+
+#define CRC32C_POLY 0x82F63B78u    /* Castagnoli, bit reversed */
+
+/****************** CRC-32C ******************/
+
+/* crc32cTable[k][b] is the CRC of byte b followed by k zero bytes */
+static u32 crc32cTable[8][256];
+static bool crc32cTableBuilt = false;
+
+static void crc32cBuildTable() {
+  for (u32 b = 0; b < 256; ++b) {
+    u32 c = b;
+    for (u32 bit = 0; bit < 8; ++bit)
+      c = (c>>1) ^ ((c&1) ? CRC32C_POLY : 0);
+    crc32cTable[0][b] = c;
+  }
+  for (u32 b = 0; b < 256; ++b)
+    for (u32 k = 1; k < 8; ++k) {
+      const u32 c = crc32cTable[k-1][b];
+      crc32cTable[k][b] = (c>>8) ^ crc32cTable[0][c&0xff];
+    }
+  crc32cTableBuilt = true;
+}
+
+u32 crc32cSlicing8(u32 crc, const u8 * data, u32 length) {
+  API_ASSERT(data || !length, E_API_NULL_POINTER);
+  if (!crc32cTableBuilt) crc32cBuildTable();
+
+  crc = ~crc;
+  for (; length >= 8; data += 8, length -= 8) {
+    const u32 lo = crc ^ (data[0] | (data[1]<<8) | (data[2]<<16) | ((u32) data[3]<<24));
+    const u32 hi = data[4] | (data[5]<<8) | (data[6]<<16) | ((u32) data[7]<<24);
+    crc =
+      crc32cTable[7][lo&0xff] ^ crc32cTable[6][(lo>>8)&0xff] ^
+      crc32cTable[5][(lo>>16)&0xff] ^ crc32cTable[4][lo>>24] ^
+      crc32cTable[3][hi&0xff] ^ crc32cTable[2][(hi>>8)&0xff] ^
+      crc32cTable[1][(hi>>16)&0xff] ^ crc32cTable[0][hi>>24];
+  }
+  while (length--)
+    crc = crc32cTable[0][(crc ^ *data++)&0xff] ^ (crc>>8);
+  return ~crc;
+}
+
+u32 crc32c(u32 crc, const u8 * data, u32 length) {
+#ifdef CRC32C_SSE42
+  API_ASSERT(data || !length, E_API_NULL_POINTER);
+  crc = ~crc;
+#ifdef __x86_64__
+  for (; length >= 8; data += 8, length -= 8) {
+    u64 w;
+    memcpy(&w, data, 8);
+    crc = (u32) _mm_crc32_u64(crc, w);
+  }
+#endif
+  for (; length >= 4; data += 4, length -= 4) {
+    u32 w;
+    memcpy(&w, data, 4);
+    crc = _mm_crc32_u32(crc, w);
+  }
+  while (length--)
+    crc = _mm_crc32_u8(crc, *data++);
+  return ~crc;
+#else
+  return crc32cSlicing8(crc, data, length);
+#endif
+}
+
+/****************** Packet trailers ******************/
+
+/* Drop the last 'bytes' bytes of packet, keeping the trailing null and the cursor in range */
+static void packetTrim(u8 * packet, u32 bytes) {
+  PacketHeader & ph = packetHeaderInternalUnsafe(packet);
+  const u8 len = (u8) (ph.f[PacketHeader::LENGTH] - bytes);
+  ph.f[PacketHeader::LENGTH] = len;
+  if (ph.f[PacketHeader::CURSOR] > len) ph.f[PacketHeader::CURSOR] = len;
+  packet[len] = 0;
+}
+
+static void packetFlag(u8 * packet, u8 flag) {
+  packetHeaderInternalUnsafe(packet).f[PacketHeader::FLAGS] |= flag;
+}
+
+bool packetCrcValid(const u8 * packet) {
+  API_ASSERT_VALID_PACKET(packet);
+  const u32 len = packetLength(packet);
+  if (len < CRC32C_TRAILER_BYTES) return false;
+  const u32 dataLen = len - CRC32C_TRAILER_BYTES;
+  const u8 * t = packet + dataLen;
+  const u32 trailer = ((u32) t[0]<<24) | (t[1]<<16) | (t[2]<<8) | t[3];
+  return crc32c(0, packet, dataLen) == trailer;
+}
+
+bool packetCrcVerify(u8 * packet) {
+  if (!packetCrcValid(packet)) {
+    packetFlag(packet, PK_CRC);
+    return false;
+  }
+  packetTrim(packet, CRC32C_TRAILER_BYTES);
+  return true;
+}
+
+/****************** Per-face modes ******************/
+
+FaceIntegrity::FaceIntegrity(u8 supported)
+  : supported((u8) ((supported & INTEGRITY_ALL_MODES) | INTEGRITY_MODE_BIT(INTEGRITY_NONE)))
+  , mode(INTEGRITY_NONE)
+  , sealMode(INTEGRITY_NONE)
+  , verifyMode(INTEGRITY_NONE)
+  , confirmPending(false)
+{
+  resetStats();
+}
+
+void FaceIntegrity::resetStats() {
+  memset(&stats, 0, sizeof(stats));
+}
+
+void FaceIntegrity::setMode(u8 mode) {
+  API_ASSERT_MAX(mode, INTEGRITY_MODE_COUNT);
+  this->mode = sealMode = verifyMode = mode;
+  confirmPending = false;
+}
+
+bool FaceIntegrity::writeOffer(PacketWriter & w) const {
+  return w.put(INTEGRITY_OFFER_TAG) && w.put('I') && w.put(supported);
+}
+
+bool FaceIntegrity::acceptOffer(const u8 * packet) {
+  if (packetLength(packet) != 3 || packet[0] != INTEGRITY_OFFER_TAG) return false;
+  if (packet[1] == 'C') {
+    /* The other side seals in this mode from here on.  It's one we offered, unless corrupt */
+    if (packet[2] < INTEGRITY_MODE_COUNT && (supported & INTEGRITY_MODE_BIT(packet[2]))) {
+      verifyMode = packet[2];
+      ++stats.confirms;
+    }
+    return true;
+  }
+  if (packet[1] != 'I') return false;
+  const u8 common = (u8) (packet[2] & supported);
+  mode = INTEGRITY_NONE;
+  for (u32 m = INTEGRITY_MODE_COUNT; m-- > 0; )
+    if (common & INTEGRITY_MODE_BIT(m)) {
+      mode = (u8) m;
+      break;
+    }
+  confirmPending = true;   /* Even if unchanged: the other side may have started over */
+  ++stats.offers;
+  return true;
+}
+
+bool FaceIntegrity::writeConfirm(PacketWriter & w) {
+  if (!(w.put(INTEGRITY_OFFER_TAG) && w.put('C') && w.put(mode))) return false;
+  sealMode = mode;
+  confirmPending = false;
+  return true;
+}
+
+bool FaceIntegrity::seal(PacketWriter & w) const {
+  switch (sealMode) {
+  case INTEGRITY_CHECK_BYTE:
+    return w.putCheckByte();
+  case INTEGRITY_CRC32C: {
+    const u8 * first, * second;
+    u32 firstLength, secondLength;
+    w.written(first, firstLength, second, secondLength);
+    const u32 crc = crc32c(crc32c(0, first, firstLength), second, secondLength);
+    return w.put(crc, BELONG);
+  }
+  default:
+    return true;
+  }
+}
+
+bool FaceIntegrity::verify(u8 * packet) {
+  bool ok;
+  switch (verifyMode) {
+  case INTEGRITY_CHECK_BYTE:
+    ok = packetCheckByteValid(packet);
+    if (ok) packetTrim(packet, 1);
+    else packetFlag(packet, PK_CRC);
+    break;
+  case INTEGRITY_CRC32C:
+    ok = packetCrcVerify(packet);
+    break;
+  default:
+    return true;
+  }
+  if (ok) ++stats.verified;
+  else ++stats.failed;
+  return ok;
+}
+
+#if defined(TEST_INTEGRITY) || defined(BENCH_INTEGRITY)
+
+#include <stdio.h>
+#include <stdlib.h> // for exit, random
+
+void _apiError_(u32 code,const char * file, int lineno) {
+  fprintf(stderr,"APIERROR %d %s:%d\n",code,file,lineno);
+  exit(code);
+}
+
+#endif
+
+#ifdef TEST_INTEGRITY
+
+#include "MFMPacketIO.h"
+
+static void die(const char * file, int line, const char * msg) {
+  fprintf(stderr,"%s:%d: %s\n",file, line, msg);
+  exit(100);
+}
+
+#define TEST(condition) do { if (!(condition)) die(__FILE__,__LINE__,#condition); } while (0)
+
+/* One bit at a time, straight from the definition */
+static u32 crc32cBitwise(const u8 * data, u32 length) {
+  u32 crc = ~0u;
+  while (length--) {
+    crc ^= *data++;
+    for (u32 bit = 0; bit < 8; ++bit)
+      crc = (crc>>1) ^ ((crc&1) ? CRC32C_POLY : 0);
+  }
+  return ~crc;
+}
+
+static void test1() {           /* Known values, and every implementation agrees */
+  TEST(crc32c(0, (const u8 *) "123456789", 9) == 0xE3069283u);
+  u8 data[300];
+  memset(data, 0, 32);
+  TEST(crc32c(0, data, 32) == 0x8A9136AAu);             /* RFC 3720 B.4 */
+  memset(data, 0xff, 32);
+  TEST(crc32cSlicing8(0, data, 32) == 0x62A8AB43u);
+  for (u32 i = 0; i < 32; ++i) data[i] = (u8) i;
+  TEST(crc32c(0, data, 32) == 0x46DD794Eu);
+
+  for (u32 rep = 0; rep < 5000; ++rep) {
+    const u32 off = random()%8;
+    const u32 len = random()%(sizeof(data)-off);
+    for (u32 i = 0; i < len; ++i) data[off+i] = (u8) random();
+    const u32 expect = crc32cBitwise(data+off, len);
+    TEST(crc32c(0, data+off, len) == expect);
+    TEST(crc32cSlicing8(0, data+off, len) == expect);
+    const u32 split = len ? random()%len : 0;
+    TEST(crc32c(crc32cSlicing8(0, data+off, split), data+off+split, len-split) == expect);
+  }
+}
+
+static u8 ring[MFMPACKETIO_BUFFER_SIZE_BYTES];
+static FaceIntegrity * rxIntegrity;
+static u32 received, flagged;
+
+static void dispatch(u8 * packet, u8) {
+  if (rxIntegrity->acceptOffer(packet)) return;
+  const u32 len = packetLength(packet);
+  if (!rxIntegrity->verify(packet)) {
+    TEST(packetFlags(packet) & PK_CRC);
+    TEST(packetFlags(packet) & PK_BROKEN);
+    ++flagged;
+    return;
+  }
+  TEST(packetFlags(packet) == 0);
+  const u32 trailer = rxIntegrity->getVerifyMode() == INTEGRITY_CRC32C ? 4 :
+    rxIntegrity->getVerifyMode() == INTEGRITY_CHECK_BYTE ? 1 : 0;
+  TEST(packetLength(packet) == len-trailer && packet[packetLength(packet)] == 0);
+  for (u32 i = 0; i < packetLength(packet); ++i) TEST(packet[i] == (u8) (i*7+len));
+  ++received;
+}
+
+static void test2() {           /* Negotiate, seal, and verify through a ring, with corruption */
+  const u8 masks[] = { INTEGRITY_ALL_MODES, INTEGRITY_MODE_BIT(INTEGRITY_CHECK_BYTE), 0 };
+  const u8 expect[] = { INTEGRITY_CRC32C, INTEGRITY_CHECK_BYTE, INTEGRITY_NONE };
+  for (u32 t = 0; t < 3; ++t) {
+    FaceIntegrity tx, rx(masks[t]);
+    rxIntegrity = &rx;
+    MFMPacketIO pio(ring);
+    TEST(rx.getMode() == INTEGRITY_NONE);
+    u8 offer[4+3+1];
+    PacketWriter ow(offer, sizeof(offer), EAST);
+    TEST(rx.writeOffer(ow) && ow.commit());
+    TEST(tx.acceptOffer(ow.getPacket()));
+    PacketWriter ow2(offer, sizeof(offer), WEST);
+    TEST(tx.writeOffer(ow2) && ow2.commit());
+    TEST(rx.acceptOffer(ow2.getPacket()));
+    TEST(tx.getMode() == expect[t] && rx.getMode() == expect[t]);
+    TEST(tx.getSealMode() == INTEGRITY_NONE && rx.getVerifyMode() == INTEGRITY_NONE);
+    PacketWriter cw(offer, sizeof(offer), WEST);
+    TEST(tx.isConfirmPending() && tx.writeConfirm(cw) && cw.commit());
+    TEST(!tx.isConfirmPending() && tx.getSealMode() == expect[t]);
+    TEST(rx.acceptOffer(cw.getPacket()) && rx.getVerifyMode() == expect[t]);
+
+    received = flagged = 0;
+    u32 corrupted = 0;
+    const u32 trailer = expect[t] == INTEGRITY_CRC32C ? 4 : expect[t] == INTEGRITY_CHECK_BYTE ? 1 : 0;
+    for (u32 rep = 0; rep < 5000; ++rep) {
+      const u32 len = random()%200;
+      PacketWriter w(pio);
+      for (u32 i = 0; i < len; ++i) w.put((u8) (i*7+len+trailer));
+      TEST(tx.seal(w));
+      if (expect[t] != INTEGRITY_NONE && random()%5 == 0) {
+        /* Flip one bit of the sealed packet in the ring, as the wire might */
+        const u8 * first, * second;
+        u32 fl, sl;
+        w.written(first, fl, second, sl);
+        const u32 at = random()%(fl+sl);
+        u8 * p = (u8 *) (at < fl ? first+at : second+at-fl);
+        *p ^= (u8) (1u<<(random()%8));
+        ++corrupted;
+      }
+      TEST(w.commit());
+      while (pio.dispatchPacket(EAST, dispatch)) ;
+    }
+    TEST(flagged == corrupted);
+    TEST(received == 5000-corrupted);
+    TEST(rx.getStats().failed == flagged);
+    TEST(rx.getStats().verified == (expect[t] == INTEGRITY_NONE ? 0 : received));
+    printf("2 mode=%u received=%u flagged=%u wrapped=%u\n", expect[t], received, flagged,
+           pio.getPacketsWrapped());
+  }
+}
+
+/* Two sides, each with a ring to the other, sending all through the negotiation */
+static FaceIntegrity * sides[2];
+static MFMPacketIO * toOther[2];
+static u32 sideReceived[2];
+
+static void sideDispatch(u32 k, u8 * packet) {
+  FaceIntegrity & fi = *sides[k];
+  if (fi.acceptOffer(packet)) {
+    if (fi.isConfirmPending()) {
+      PacketWriter w(*toOther[k]);
+      TEST(fi.writeConfirm(w) && w.commit());
+    }
+    return;
+  }
+  TEST(fi.verify(packet));                       /* Never a mismatch, so never flagged */
+  const u32 len = packetLength(packet);          /* And never a trailer left behind */
+  for (u32 i = 0; i < len; ++i) TEST(packet[i] == (u8) (i*7+len));
+  ++sideReceived[k];
+}
+static void dispatch0(u8 * packet, u8) { sideDispatch(0, packet); }
+static void dispatch1(u8 * packet, u8) { sideDispatch(1, packet); }
+
+static void test4() {           /* Traffic both ways while the offers and confirmations cross */
+  static u8 rings[2][MFMPACKETIO_BUFFER_SIZE_BYTES];
+  const u8 masks[] = { INTEGRITY_ALL_MODES, INTEGRITY_MODE_BIT(INTEGRITY_CHECK_BYTE), 0 };
+  const u8 expect[] = { INTEGRITY_CRC32C, INTEGRITY_CHECK_BYTE, INTEGRITY_NONE };
+  PacketDispatcher * dispatchers[2] = { dispatch0, dispatch1 };
+  for (u32 rep = 0; rep < 300; ++rep) {
+    const u32 t = rep%3;
+    FaceIntegrity a, b(masks[t]);
+    MFMPacketIO ab(rings[0]), ba(rings[1]);
+    sides[0] = &a;
+    sides[1] = &b;
+    toOther[0] = &ab;
+    toOther[1] = &ba;
+    MFMPacketIO * fromOther[2] = { &ba, &ab };
+    u32 sent[2] = { 0, 0 };
+    sideReceived[0] = sideReceived[1] = 0;
+    const u32 offerAt[2] = { (u32) random()%200, (u32) random()%200 };
+
+    for (u32 step = 0; step < 400; ++step) {
+      for (u32 j = 0; j < 2; ++j)
+        if (step == offerAt[j]) {
+          PacketWriter w(*toOther[j]);
+          TEST(sides[j]->writeOffer(w) && w.commit());
+        }
+      const u32 k = random()%2;
+      if (random()%2) {
+        const u32 len = random()%40;
+        PacketWriter w(*toOther[k]);
+        for (u32 i = 0; i < len; ++i) w.put((u8) (i*7+len));
+        if (sides[k]->seal(w) && w.commit()) ++sent[k];
+      } else fromOther[k]->dispatchPacket(EAST, dispatchers[k]);
+    }
+    for (u32 pass = 0; pass < 2; ++pass)     /* The second for confirmations the first sent */
+      for (u32 k = 0; k < 2; ++k) while (fromOther[k]->dispatchPacket(EAST, dispatchers[k])) ;
+
+    TEST(sideReceived[0] == sent[1] && sideReceived[1] == sent[0]);
+    for (u32 k = 0; k < 2; ++k) {
+      const FaceIntegrity & fi = *sides[k];
+      TEST(fi.getMode() == expect[t] && fi.getSealMode() == expect[t]);
+      TEST(fi.getVerifyMode() == expect[t] && !fi.isConfirmPending());
+      TEST(fi.getStats().failed == 0 && fi.getStats().confirms == 1);
+    }
+  }
+  printf("4 negotiated under traffic, nothing flagged\n");
+}
+
+static void test3() {           /* CRC-32C catches the multi-bit errors the check byte misses */
+  u8 data[64];
+  u32 checkMissed = 0, crcMissed = 0;
+  for (u32 rep = 0; rep < 100000; ++rep) {
+    for (u32 i = 0; i < sizeof(data); ++i) data[i] = (u8) random();
+    const u8 check = checkByteUpdate(CHECK_BYTE_INIT_VALUE, data, sizeof(data));
+    const u32 crc = crc32c(0, data, sizeof(data));
+    const u32 a = random()%sizeof(data);
+    const u32 b = (a+8*(1+random()%7))%sizeof(data);  /* Same lane, so the xors can cancel */
+    const u8 bit = (u8) (1u<<(random()%8));
+    data[a] ^= bit;
+    data[b] ^= bit;
+    if (a == b) continue;
+    if (checkByteUpdate(CHECK_BYTE_INIT_VALUE, data, sizeof(data)) == check) ++checkMissed;
+    if (crc32c(0, data, sizeof(data)) == crc) ++crcMissed;
+  }
+  TEST(checkMissed > 0 && crcMissed == 0);
+  printf("3 two-bit errors missed: check byte %u, CRC-32C %u\n", checkMissed, crcMissed);
+}
+
+int main() {
+  test1();
+  test2();
+  test3();
+  test4();
+  return 0;
+}
+
+#endif /* TEST_INTEGRITY */
+
+#ifdef BENCH_INTEGRITY
+
+#include <time.h>   // for clock_gettime
+
+static double nowSeconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+int main() {
+  static u8 data[1024];
+  for (u32 i = 0; i < sizeof(data); ++i) data[i] = (u8) random();
+  const u32 REPS = 200000;
+  u32 sink = 0;
+
+  double start = nowSeconds();
+  for (u32 rep = 0; rep < REPS; ++rep) sink += checkByteUpdate((u8) rep, data, sizeof(data));
+  const double check = nowSeconds()-start;
+
+  start = nowSeconds();
+  for (u32 rep = 0; rep < REPS; ++rep) sink += crc32cSlicing8(rep, data, sizeof(data));
+  const double sliced = nowSeconds()-start;
+
+  start = nowSeconds();
+  for (u32 rep = 0; rep < REPS; ++rep) sink += crc32c(rep, data, sizeof(data));
+  const double best = nowSeconds()-start;
+
+  printf("%u reps over 1KB (sink %u)\n", REPS, sink);
+  printf("%-28s %8.1f ns/KB\n", "check byte", check*1e9/REPS);
+  printf("%-28s %8.1f ns/KB\n", "CRC-32C slicing-by-8", sliced*1e9/REPS);
+#ifdef CRC32C_SSE42
+  printf("%-28s %8.1f ns/KB\n", "CRC-32C SSE4.2 crc32", best*1e9/REPS);
+#else
+  printf("%-28s %8.1f ns/KB\n", "CRC-32C (no SSE4.2)", best*1e9/REPS);
+#endif
+  return 0;
+}
+
+#endif /* BENCH_INTEGRITY */
@@ -0,0 +1,366 @@
+/*                                              -*- mode:C++; fill-column:100 -*-
+  MFMMessage.cpp - Messages larger than a packet, as sequences of fragment packets
+  Copyright (C) 2013 The Regents of the University of New Mexico.  All rights reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301
+  USA
+*/
+
+/* TO COMPILE FOR TESTING:
+  g++ -O0 -g3 -Wall -pedantic -Werror -Wundef -I../include -DHOST_MODE -DTEST_MESSAGE -o"./testmessage" MFMMessage.cpp MFMPacketWriter.cpp MFMPacketIO.cpp MFMFraming.cpp MFMPacketReader.cpp MFMPacket.cpp;./testmessage
+*/
+
+#include <string.h>        /* For memcpy, memset */
+#include "MFMMessage.h"
+#include "MFMPacketReader.h"
+#include "MFMPacketWriter.h"
+#include "MFMAssert.h"
+
+/* The number of fragments a message of 'length' bytes travels in; even an empty one needs one */
+static u32 fragmentsFor(u32 length) {
+  if (length == 0) return 1;
+  return (length+MESSAGE_FRAGMENT_PAYLOAD_BYTES-1)/MESSAGE_FRAGMENT_PAYLOAD_BYTES;
+}
+
+/****************** Sending ******************/
+
+MessageSender::MessageSender(u8 tag)
+  : message(0)
+  , length(0)
+  , count(0)
+  , index(0)
+  , done(0)
+  , arg(0)
+  , tag(tag)
+  , id(0)
+{ }
+
+bool MessageSender::start(const u8 * message, u32 length, MessageSent * done, void * arg) {
+  API_ASSERT(message || !length, E_API_NULL_POINTER);
+  API_ASSERT(length <= MAX_MESSAGE_LENGTH, E_API_MAX_RANGE);
+  if (isBusy()) return false;
+
+  static const u8 empty = 0;
+  this->message = message ? message : &empty;
+  this->length = length;
+  this->done = done;
+  this->arg = arg;
+  count = fragmentsFor(length);
+  index = 0;
+  ++id;
+  return true;
+}
+
+bool MessageSender::next(MessageFragment & frag) {
+  if (!isBusy()) return false;
+  if (index == count) {         /* The last one went out with the previous call */
+    fragmentSent();
+    return false;
+  }
+
+  const u32 offset = index*MESSAGE_FRAGMENT_PAYLOAD_BYTES;
+  frag.header[0] = tag;
+  frag.header[1] = id;
+  frag.header[2] = (u8) (index>>8);
+  frag.header[3] = (u8) index;
+  frag.header[4] = (u8) (length>>24);
+  frag.header[5] = (u8) (length>>16);
+  frag.header[6] = (u8) (length>>8);
+  frag.header[7] = (u8) length;
+  frag.data = message+offset;
+  frag.length = length-offset > MESSAGE_FRAGMENT_PAYLOAD_BYTES ?
+    MESSAGE_FRAGMENT_PAYLOAD_BYTES : length-offset;
+
+  ++index;
+  return true;
+}
+
+void MessageSender::fragmentSent() {
+  if (!isBusy() || index < count) return;
+  const u8 * sent = message;    /* That was the last one: the message is free */
+  message = 0;
+  if (done) done(sent, length, arg);
+}
+
+bool MessageSender::writeNext(PacketWriter & w) {
+  if (!isBusy()) return false;
+  if (index == count) {         /* Handed out by #next(), and not reported sent */
+    fragmentSent();
+    return false;
+  }
+  const u32 fragLength = length-index*MESSAGE_FRAGMENT_PAYLOAD_BYTES;
+  if (w.room() < MESSAGE_FRAGMENT_HEADER_BYTES +
+      (fragLength > MESSAGE_FRAGMENT_PAYLOAD_BYTES ? MESSAGE_FRAGMENT_PAYLOAD_BYTES : fragLength))
+    return false;               /* Leave it for a writer with more room */
+
+  MessageFragment frag;
+  next(frag);
+  w.put(frag.header, MESSAGE_FRAGMENT_HEADER_BYTES);
+  w.put(frag.data, frag.length);
+  fragmentSent();               /* Copied into the packet now */
+  return true;
+}
+
+/****************** Receiving ******************/
+
+MessageReassembler::MessageReassembler(u8 * buffer, u32 capacity, MessageReceived * received,
+                                       void * arg, u32 timeout, u8 tag)
+  : buffer(buffer)
+  , capacity(capacity)
+  , received(received)
+  , arg(arg)
+  , timeout(timeout)
+  , length(0)
+  , missing(0)
+  , lastActivity(0)
+  , tag(tag)
+  , id(0)
+  , face(0)
+  , active(false)
+{
+  API_ASSERT_NONNULL(buffer);
+  API_ASSERT_NONNULL(received);
+  resetStats();
+}
+
+void MessageReassembler::resetStats() {
+  memset(&stats, 0, sizeof(stats));
+}
+
+void MessageReassembler::begin(u8 id, u8 face, u32 length, u32 now) {
+  if (active) ++stats.abandoned;
+  this->id = id;
+  this->face = face;
+  this->length = length;
+  missing = fragmentsFor(length);
+  memset(have, 0, (missing+7)/8);
+  lastActivity = now;
+  active = true;
+}
+
+bool MessageReassembler::accept(u8 * packet, u8 face, u32 now) {
+  PacketReader r(packet);
+  r.reread(0);
+
+  u8 ptag, pid;
+  int pindex, plength;
+  if (!r.readByte(ptag) || ptag != tag ||
+      !r.readByte(pid) ||
+      !r.read(pindex, BESHORT) ||
+      !r.read(plength, BELONG) ||
+      (u32) plength > MAX_MESSAGE_LENGTH || (u32) plength > capacity) {
+    ++stats.malformed;
+    return false;
+  }
+
+  const u32 index = (u32) pindex;
+  const u32 len = (u32) plength;
+  const u32 offset = index*MESSAGE_FRAGMENT_PAYLOAD_BYTES;
+  const u32 expected = len-offset > MESSAGE_FRAGMENT_PAYLOAD_BYTES ?
+    MESSAGE_FRAGMENT_PAYLOAD_BYTES : len-offset;
+  if (index >= fragmentsFor(len) || r.readLength() != expected) {
+    ++stats.malformed;
+    return false;
+  }
+
+  if (active && now-lastActivity > timeout) {
+    ++stats.timeouts;
+    active = false;
+  }
+
+  if (!active || pid != id || face != this->face || len != length)
+    begin(pid, face, len, now);
+
+  const u8 bit = (u8) (1u<<(index&7));
+  if (have[index>>3] & bit) {
+    ++stats.duplicates;
+    return true;
+  }
+
+  r.read(buffer+offset, expected);
+  have[index>>3] |= bit;
+  lastActivity = now;
+  ++stats.fragments;
+
+  if (--missing == 0) {
+    active = false;
+    ++stats.messages;
+    received(buffer, length, face, arg);
+  }
+  return true;
+}
+
+void MessageReassembler::poll(u32 now) {
+  if (active && now-lastActivity > timeout) {
+    ++stats.timeouts;
+    active = false;
+  }
+}
+
+#ifdef TEST_MESSAGE
+
+#include <stdio.h>
+#include <stdlib.h> // for exit, random
+#include "MFMPacketIO.h"
+
+void _apiError_(u32 code,const char * file, int lineno) {
+  fprintf(stderr,"APIERROR %d %s:%d\n",code,file,lineno);
+  exit(code);
+}
+
+static void die(const char * file, int line, const char * msg) {
+  fprintf(stderr,"%s:%d: %s\n",file, line, msg);
+  exit(100);
+}
+
+#define TEST(condition) do { if (!(condition)) die(__FILE__,__LINE__,#condition); } while (0)
+
+static u8 sendBuf[MAX_MESSAGE_LENGTH];
+static u8 recvBuf[MAX_MESSAGE_LENGTH];
+static u8 expectBuf[MAX_MESSAGE_LENGTH];  /* What was sent, since sentDone() scribbles on sendBuf */
+static u32 sentCount, rcvdCount, rcvdLength;
+
+static void sentDone(const u8 * message, u32 length, void * arg) {
+  TEST(message == sendBuf || length == 0);
+  TEST(arg == (void *) &sentCount);
+  memset(sendBuf, 0xa5, sizeof(sendBuf));   /* The message is ours again: poison it */
+  ++sentCount;
+}
+
+static void rcvdDone(u8 * message, u32 length, u8 face, void *) {
+  TEST(message == recvBuf);
+  TEST(face == EAST);
+  TEST(memcmp(message, expectBuf, length) == 0);
+  rcvdLength = length;
+  ++rcvdCount;
+}
+
+static u8 * fragmentPacket(u8 * buf, u32 size, const MessageFragment & f) {
+  PacketWriter w(buf, size, EAST);
+  TEST(w.put(f.header, MESSAGE_FRAGMENT_HEADER_BYTES) && w.put(f.data, f.length));
+  TEST(w.commit());
+  return w.getPacket();
+}
+
+static void test1() {           /* In order, out of order, with duplicates, various lengths */
+  MessageSender s;
+  MessageReassembler ra(recvBuf, sizeof(recvBuf), rcvdDone);
+  static u8 packets[MAX_MESSAGE_FRAGMENTS][4+MAX_PACKET_LENGTH+1];
+  static u8 * order[MAX_MESSAGE_FRAGMENTS];
+  const u32 lengths[] = { 0, 1, MESSAGE_FRAGMENT_PAYLOAD_BYTES, MESSAGE_FRAGMENT_PAYLOAD_BYTES+1,
+                          444, MAX_MESSAGE_LENGTH };
+  for (u32 rep = 0; rep < 60; ++rep) {
+    const u32 len = rep < 6 ? lengths[rep] : random()%(MAX_MESSAGE_LENGTH+1);
+    for (u32 i = 0; i < len; ++i) expectBuf[i] = sendBuf[i] = (u8) random();
+    const u32 before = sentCount;
+    TEST(s.start(sendBuf, len, sentDone, &sentCount));
+    TEST(!s.start(sendBuf, len));
+    const u32 n = s.fragmentCount();
+    MessageFragment f;
+    for (u32 i = 0; i < n; ++i) {
+      TEST(sentCount == before);
+      TEST(s.next(f));
+      TEST(f.data >= sendBuf && f.data+f.length <= sendBuf+len+(len==0)); /* Slices, not copies */
+      order[i] = fragmentPacket(packets[i], sizeof(packets[i]), f);
+    }
+    TEST(sentCount == before && s.isBusy());   /* Not till we say the last one's sent */
+    if (rep%3 == 0) s.fragmentSent();
+    else TEST(!s.next(f));
+    TEST(sentCount == before+1 && !s.isBusy());
+    TEST(!s.next(f) && sentCount == before+1);
+
+    if (rep&1)                  /* Shuffle */
+      for (u32 i = n; i > 1; --i) {
+        const u32 j = random()%i;
+        u8 * t = order[i-1]; order[i-1] = order[j]; order[j] = t;
+      }
+
+    const u32 got = rcvdCount;
+    for (u32 i = 0; i < n; ++i) {
+      TEST(rcvdCount == got);
+      TEST(ra.accept(order[i], EAST, rep));
+      if (i == 0 && n > 1) TEST(ra.accept(order[i], EAST, rep));  /* Duplicate */
+    }
+    TEST(rcvdCount == got+1 && rcvdLength == len);
+  }
+  const MessageStats & st = ra.getStats();
+  TEST(st.messages == 60 && st.malformed == 0 && st.abandoned == 0 && st.timeouts == 0);
+  printf("1 fragments=%u duplicates=%u\n", st.fragments, st.duplicates);
+}
+
+static void test2() {           /* Timeouts, abandonment, and garbage */
+  MessageSender s;
+  MessageReassembler ra(recvBuf, sizeof(recvBuf), rcvdDone, 0, 10);
+  u8 pk[4+MAX_PACKET_LENGTH+1];
+  MessageFragment f;
+  for (u32 i = 0; i < 1000; ++i) expectBuf[i] = sendBuf[i] = (u8) i;
+
+  TEST(s.start(sendBuf, 1000));
+  TEST(s.next(f) && ra.accept(fragmentPacket(pk, sizeof(pk), f), EAST, 100));
+  ra.poll(105);
+  TEST(ra.isBusy());
+  ra.poll(111);
+  TEST(!ra.isBusy() && ra.getStats().timeouts == 1);
+  while (s.next(f)) ;
+
+  TEST(s.start(sendBuf, 1000));
+  TEST(s.next(f) && ra.accept(fragmentPacket(pk, sizeof(pk), f), EAST, 200));
+  MessageSender s2;             /* Different id stream, so a different message */
+  TEST(s2.start(sendBuf, 1000));
+  TEST(s2.next(f) && s2.next(f) && ra.accept(fragmentPacket(pk, sizeof(pk), f), EAST, 201));
+  TEST(ra.getStats().abandoned == 1);
+
+  TEST(!ra.accept(makePacket(pk, sizeof(pk), EAST, "hello"), EAST, 202));
+  const u8 badIndex[] = { 'M', 1, 0, 63, 0, 0, 1000>>8, 1000&0xff };
+  TEST(!ra.accept(makePacket(pk, sizeof(pk), EAST, badIndex, sizeof(badIndex)), EAST, 202));
+  TEST(ra.getStats().malformed == 2);
+}
+
+static u8 ring[MFMPACKETIO_BUFFER_SIZE_BYTES];
+static MessageReassembler * ringRA;
+static u32 ringNow;
+
+static void ringDispatch(u8 * packet, u8 source) {
+  TEST(ringRA->accept(packet, source, ringNow));
+}
+
+static void test3() {           /* One call to send, pumped through an MFMPacketIO */
+  MessageSender s;
+  MessageReassembler ra(recvBuf, sizeof(recvBuf), rcvdDone);
+  ringRA = &ra;
+  MFMPacketIO pio(ring);
+  const u32 len = 111*4;        /* A corner event window update */
+  for (u32 i = 0; i < len; ++i) expectBuf[i] = sendBuf[i] = (u8) (i*3);
+
+  const u32 got = rcvdCount, sent = sentCount;
+  TEST(s.start(sendBuf, len, sentDone, &sentCount));
+  while (s.isBusy() || !pio.isEmptyOfPackets()) {
+    PacketWriter w(pio);
+    if (s.writeNext(w)) TEST(w.commit());       /* Already copied, out of reach of the poison */
+    TEST(sentCount == sent + !s.isBusy());
+    pio.dispatchPacket(EAST, ringDispatch);
+    ++ringNow;
+  }
+  TEST(rcvdCount == got+1 && rcvdLength == len);
+}
+
+int main() {
+  test1();
+  test2();
+  test3();
+  return 0;
+}
+
+#endif /* TEST_MESSAGE */
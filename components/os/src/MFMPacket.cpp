@@ -19,14 +19,29 @@
 */
 
 /* TO COMPILE FOR TESTING:
-  g++ -O0 -g3 -Wall -pedantic -Werror -Wundef    -I../../../src/include  -DHOST_MODE -DTEST_PACKET_BUFFER -o"./testsfbpacketio" MFMPacket.cpp MFMReactor.cpp random.c;./testsfbpacketio
+  g++ -O0 -g3 -Wall -pedantic -Werror -Wundef -I../include -DHOST_MODE -DTEST_PACKET_BUFFER -o"./testsfbpacketio" MFMPacket.cpp MFMPacketReader.cpp MFMPacketIO.cpp MFMFraming.cpp -lpthread;./testsfbpacketio
+
+   TO COMPILE FOR BENCHMARKING:
+  g++ -O2 -Wall -pedantic -Werror -Wundef -I../include -DHOST_MODE -DBENCH_CHECK_BYTE -o"./benchcheckbyte" MFMPacket.cpp MFMPacketReader.cpp;./benchcheckbyte
 */
 
 
 #include <string.h>        /* For memcpy */ 
 #include "MFMPacket.h"
+#include "MFMPacketReader.h"
 #include "MFMAssert.h"
 
+#if defined(HOST_MODE) && defined(__AVX2__)
+#include <immintrin.h>
+#define CHECK_BYTE_FOLD_AVX2 1
+#elif defined(HOST_MODE) && defined(__SSE2__)
+#include <emmintrin.h>
+#define CHECK_BYTE_FOLD_SSE2 1
+#endif
+
+/* Packets #packetCheckByteValidBatch() folds side by side, on the host */
+#define CHECK_BYTE_BATCH_WAYS 4
+
 /**
   Access the length of \a packet.
  
@@ -88,7 +103,7 @@ u8 packetReadLength(const u8 * packet) {
   \param packet The packet whose flags are to be read.
  
   \return a bitwise-OR of these possible flag values: #PK_DELETED, #PK_OVERRUN, #PK_PARITY,
-  #PK_BREAK, #PK_BUFFER, #PK_BAD_ESCAPE.
+  #PK_BREAK, #PK_BUFFER, #PK_BAD_ESCAPE, #PK_CRC.
  
   \blinks #E_API_INVALID_PACKET if \a packet is null or pointing at something that is detectably
   corrupt or not a packet.
@@ -203,12 +218,11 @@ u8 packetCursor(const u8 * packet) {
 bool zpacketPrefix(u8 * packet, const char * to) {
   API_ASSERT_VALID_PACKET(packet);
   API_ASSERT_NONNULL(to);
-  u32 plen = packetLength(packet);
-  while (plen-- && *to) {
-    if (*packet++ != (u8) *to++)
-      return false;
-  }
-  return *to == 0;
+  const u32 plen = packetLength(packet);
+  u32 tlen;
+  for (tlen = 0; to[tlen]; ++tlen)
+    if (tlen >= plen) return false;
+  return packetBytesEqual(packet, (const u8 *) to, tlen);
 }
 
 /**
@@ -252,11 +266,186 @@ bool packetCheckByteValid(const u8 * packet) {
   API_ASSERT_VALID_PACKET(packet);
   u32 len = packetLength(packet);
   if (len-- == 0) return false;
-  u8 checkByte = CHECK_BYTE_INIT_VALUE;
-  for (u32 i = 0; i < len; ++i) {
-    CHECK_BYTE_UPDATE(checkByte,packet[i]);
+  return checkByteUpdate(CHECK_BYTE_INIT_VALUE, packet, len)==packet[len];
+}
+
+static inline u8 checkByteRotate(u8 v, u32 r) {
+  r &= 7;
+  return (u8) ((v<<r)|(v>>((8-r)&7)));
+}
+
+#if defined(CHECK_BYTE_FOLD_AVX2) || defined(CHECK_BYTE_FOLD_SSE2)
+/* Xor the rest of the \a length bytes at \a data, from \a i on, into the 16 lanes of \a acc, and
+   fold them to 8: the low 8 bytes of the result are the lanes of #checkByteFromLanes() */
+static inline __m128i checkByteFoldRest(__m128i acc, const u8 * data, u32 i, u32 length) {
+  for (; i+16 <= length; i += 16)
+    acc = _mm_xor_si128(acc, _mm_loadu_si128((const __m128i *) (data+i)));
+  acc = _mm_xor_si128(acc, _mm_srli_si128(acc, 8));
+  u64 tail = 0;                 /* Fewer than 16 left, as lanes */
+  if (i+8 <= length) {
+    memcpy(&tail, data+i, 8);
+    i += 8;
   }
-  return checkByte==packet[len];
+  for (; i < length; ++i) tail ^= (u64) data[i] << 8*(i&7);
+  return _mm_xor_si128(acc, _mm_loadl_epi64((const __m128i *) &tail));
+}
+
+/* Given the 8 lanes of one packet in the low half of \a a, and of another in the low half of \a b,
+   xor together each lane j rotated right by j, for each packet.  Rotating that left by the data
+   length less one finishes what #checkByteFromLanes() does lane by lane, since every lane's
+   rotation is that plus its own; and in this form it's the same for every packet, so it can be
+   done to both at once, in three steps of a rotation by one, two and four bits. */
+static inline __m128i checkByteSpin(__m128i a, __m128i b) {
+  __m128i v = _mm_unpacklo_epi64(a, b);
+  static const u32 BITS[] = { 1, 2, 4 };
+  for (u32 s = 0; s < 3; ++s) {
+    const u32 r = BITS[s];
+    const __m128i low = _mm_set1_epi8((char) (0xff>>r));    /* Where >>r leaves each byte's own */
+    const int hi = r == 1 ? 0xff00ff00 : r == 2 ? 0xffff0000 : 0xffffffff;  /* Lanes j&r */
+    const int lo = r == 4 ? 0 : hi;
+    const __m128i lanes = _mm_set_epi32(hi, lo, hi, lo);
+    const __m128i rot = _mm_or_si128(_mm_and_si128(_mm_srli_epi64(v, r), low),
+                                     _mm_andnot_si128(low, _mm_slli_epi64(v, 8-r)));
+    v = _mm_xor_si128(v, _mm_and_si128(_mm_xor_si128(v, rot), lanes));
+  }
+  v = _mm_xor_si128(v, _mm_srli_epi64(v, 32));
+  v = _mm_xor_si128(v, _mm_srli_epi64(v, 16));
+  return _mm_xor_si128(v, _mm_srli_epi64(v, 8));
+}
+#endif
+
+/* The check byte of \a length bytes of data, starting from \a check, given their folded lanes:
+   lanes[j] is the xor of every data byte with index i%8 == j */
+static inline u8 checkByteFromLanes(u8 check, const u8 * lanes, u32 length) {
+  check = checkByteRotate(check, length);
+  for (u32 j = 0; j < 8; ++j)
+    check ^= checkByteRotate(lanes[j], length-1-j);
+  return check;
+}
+
+u8 checkByteUpdate(u8 check, const u8 * data, u32 length) {
+  if (length < 16) {            /* Not worth folding */
+    for (u32 i = 0; i < length; ++i)
+      CHECK_BYTE_UPDATE(check,data[i]);
+    return check;
+  }
+
+  /* lanes[j] gets the xor of every data[i] with i%8 == j */
+  u8 lanes[8];
+  u32 i = 0;
+#if defined(CHECK_BYTE_FOLD_AVX2) || defined(CHECK_BYTE_FOLD_SSE2)
+  __m128i acc = _mm_setzero_si128();
+#ifdef CHECK_BYTE_FOLD_AVX2
+  if (length >= 32) {
+    __m256i acc2 = _mm256_setzero_si256();
+    for (; i+32 <= length; i += 32)
+      acc2 = _mm256_xor_si256(acc2, _mm256_loadu_si256((const __m256i *) (data+i)));
+    acc = _mm_xor_si128(_mm256_castsi256_si128(acc2), _mm256_extracti128_si256(acc2, 1));
+  }
+#endif
+  for (; i+16 <= length; i += 16)
+    acc = _mm_xor_si128(acc, _mm_loadu_si128((const __m128i *) (data+i)));
+  u8 wide[16];
+  _mm_storeu_si128((__m128i *) wide, acc);
+  for (u32 j = 0; j < 8; ++j) lanes[j] = wide[j]^wide[j+8];
+#else /* Word at a time */
+  u32 w0 = 0, w1 = 0;
+  for (; i+8 <= length; i += 8) {
+    u32 a, b;
+    memcpy(&a, data+i, 4);
+    memcpy(&b, data+i+4, 4);
+    w0 ^= a;
+    w1 ^= b;
+  }
+  memcpy(lanes, &w0, 4);
+  memcpy(lanes+4, &w1, 4);
+#endif
+  for (; i < length; ++i) lanes[i&7] ^= data[i];
+  return checkByteFromLanes(check, lanes, length);
+}
+
+/**
+  Determine, as #packetCheckByteValid() would, whether each of the \a count packets at \a packets
+  ends with a valid check byte, storing the answers in \a results.  On the host with SSE2 the
+  packets are folded #CHECK_BYTE_BATCH_WAYS at a time, in one pass over all of them together:
+  each 16 bytes of each is xored into its own vector, so the loads of different packets overlap,
+  and then each two packets' lanes are rotated into place together in one vector (see
+  checkByteSpin()) rather than byte by byte.  Elsewhere this is just a loop.
+
+  \return the number of packets with valid check bytes.
+
+  \blinks #E_API_INVALID_PACKET if any of \a packets is null or pointing at something that is
+  detectably corrupt or not a packet.\par
+  \blinks #E_API_NULL_POINTER if \a packets or \a results is null and \a count isn't zero.
+
+  \since 0.9.21
+ */
+u32 packetCheckByteValidBatch(const u8 * const * packets, u32 count, bool * results) {
+  API_ASSERT((packets && results) || !count, E_API_NULL_POINTER);
+  u32 valid = 0;
+  u32 p = 0;
+#if defined(CHECK_BYTE_FOLD_AVX2) || defined(CHECK_BYTE_FOLD_SSE2)
+  for (; p+CHECK_BYTE_BATCH_WAYS <= count; p += CHECK_BYTE_BATCH_WAYS) {
+    const u8 * data[CHECK_BYTE_BATCH_WAYS];
+    u32 length[CHECK_BYTE_BATCH_WAYS];       /* Of each's data before its check byte */
+    u32 common = MAX_PACKET_LENGTH;          /* The shortest of those */
+    for (u32 k = 0; k < CHECK_BYTE_BATCH_WAYS; ++k) {
+      data[k] = packets[p+k];
+      API_ASSERT_VALID_PACKET(data[k]);
+      const u32 len = packetLength(data[k]);
+      length[k] = len ? len-1 : 0;
+      if (length[k] < common) common = length[k];
+    }
+
+    /* Together as far as they all go, then each the rest of its own way */
+    __m128i acc0 = _mm_setzero_si128(), acc1 = acc0, acc2 = acc0, acc3 = acc0;
+    u32 i = 0;
+    for (; i+16 <= common; i += 16) {
+      acc0 = _mm_xor_si128(acc0, _mm_loadu_si128((const __m128i *) (data[0]+i)));
+      acc1 = _mm_xor_si128(acc1, _mm_loadu_si128((const __m128i *) (data[1]+i)));
+      acc2 = _mm_xor_si128(acc2, _mm_loadu_si128((const __m128i *) (data[2]+i)));
+      acc3 = _mm_xor_si128(acc3, _mm_loadu_si128((const __m128i *) (data[3]+i)));
+    }
+    const __m128i spun01 = checkByteSpin(checkByteFoldRest(acc0, data[0], i, length[0]),
+                                         checkByteFoldRest(acc1, data[1], i, length[1]));
+    const __m128i spun23 = checkByteSpin(checkByteFoldRest(acc2, data[2], i, length[2]),
+                                         checkByteFoldRest(acc3, data[3], i, length[3]));
+    u8 spun[CHECK_BYTE_BATCH_WAYS];
+    spun[0] = (u8) _mm_cvtsi128_si32(spun01);
+    spun[1] = (u8) _mm_cvtsi128_si32(_mm_srli_si128(spun01, 8));
+    spun[2] = (u8) _mm_cvtsi128_si32(spun23);
+    spun[3] = (u8) _mm_cvtsi128_si32(_mm_srli_si128(spun23, 8));
+
+    for (u32 k = 0; k < CHECK_BYTE_BATCH_WAYS; ++k) {
+      const u32 len = length[k];
+      const u8 check = checkByteRotate(CHECK_BYTE_INIT_VALUE, len) ^
+        checkByteRotate(spun[k], len-1);
+      const bool ok = packetLength(data[k]) > 0 && check == data[k][len];
+      valid += (results[p+k] = ok);
+    }
+  }
+#endif
+  for (; p < count; ++p)
+    valid += (results[p] = packetCheckByteValid(packets[p]));
+  return valid;
+}
+
+bool packetBytesEqual(const u8 * a, const u8 * b, u32 length) {
+  if ((((uptr) a ^ (uptr) b) & 3) == 0) {
+    for (; length > 0 && ((uptr) a & 3); --length)   /* Head, to the first word boundary */
+      if (*a++ != *b++) return false;
+    for (; length >= 8; a += 8, b += 8, length -= 8) {
+      u32 a0, a1, b0, b1;
+      memcpy(&a0, a, 4);
+      memcpy(&a1, a+4, 4);
+      memcpy(&b0, b, 4);
+      memcpy(&b1, b+4, 4);
+      if ((a0 ^ b0) | (a1 ^ b1)) return false;
+    }
+  }
+  for (; length > 0; --length)
+    if (*a++ != *b++) return false;
+  return true;
 }
 
 
@@ -307,15 +496,6 @@ bool packetRead(u8 * packet, u32 &result, int code, u32 maxLen) {
   return packetRead(packet,*(int*)&result,code,maxLen);
 }
 
-static bool packetReadByte(u8 * packet, u8 & result, u32 maxPosition) {
-  u32 position = packetCursor(packet);
-  if (position >= maxPosition || packetReadEOF(packet))
-    return false;
-  result = packet[position];
-  packetReread(packet,position+1);
-  return true;
-}
-
 /**
   Starting from the #packetCursor() position of \a packet, read a big-endian network order u64 into
   \a result.  Reads values output by #facePrintBinary(u8 face,u64 value).
@@ -336,15 +516,9 @@ static bool packetReadByte(u8 * packet, u8 & result, u32 maxPosition) {
   \since 0.9.20
  */
 bool packetRead(u8 * packet, u64 &result) {
-  API_ASSERT_VALID_PACKET(packet);
-  if (packetReadLength(packet) < 8) return false;
-  u64 val = 0;
-  for (u32 i = 0; i < 8; ++i) {
-    u8 ch;
-    packetReadByte(packet,ch,MAX_PACKET_LENGTH);
-    val = (val<<8)|ch;
-  }
-  result = val;
+  PacketReader r(packet);
+  if (!r.read(result)) return false;
+  r.commit();
   return true;
 }
 
@@ -423,11 +597,10 @@ bool validPacket(const u8 * packet) {
   \endcode
  */
 bool packetReadCheckByte(u8 * packet) {
-  API_ASSERT_VALID_PACKET(packet);
-  if (packetReadLength(packet) != 1 || !packetCheckByteValid(packet))
+  PacketReader r(packet);
+  if (!r.readCheckByte())
     return false;
-  u8 res;
-  packetReadByte(packet,res,packetLength(packet));
+  r.commit();
   return true;
 }
 
@@ -449,13 +622,14 @@ bool packetReadCheckByte(u8 * packet) {
   \code
     void myHandler(u8 * packet) {
       u32 serialNumber;
-      if (packetScanf(packet,"x%d:",&serialNumber) != 3) return; // Bail unless good start..
+      if (packetScanf<ScanFormat<'x','%','d',':'> >(packet,&serialNumber) != 3)
+        return;                                      // Bail unless good start..
 
       u32 index = packetCursor(packet);              // Now remember where we are
-      u32 val;
-      if (packetScanf(packet,"0x%x\n", &val) != 4) { // Try for "0x" plus a hexadecimal..
+      u32 val;                                       // Try for "0x" plus a hexadecimal..
+      if (packetScanf<ScanFormat<'0','x','%','x','\n'> >(packet,&val) != 4) {
         packetReread(packet,index);                  // But if that fails, back up..
-        if (packetScanf(packet,"%d\n",&val) != 2)    // and try for a decimal instead
+        if (packetScanf<ScanFormat<'%','d','\n'> >(packet,&val) != 2) // and try for a decimal
           return;                                    // And if that fails, punt
       }
       ..
@@ -496,27 +670,62 @@ void packetReread(u8 * packet, u32 newIndex) {
   \since 0.9.10
  */
 bool packetRead(u8 * packet, u8 * buffer, u32 length) {
-  API_ASSERT_VALID_PACKET(packet);
-  API_ASSERT_NONNULL(buffer);
-  u32 prl = packetReadLength(packet);
-  if (prl < length)
+  PacketReader r(packet);
+  if (!r.read(buffer,length))
     return false;
-  u32 pc = packetCursor(packet);
-  memcpy((void*) buffer, (void*) &packet[pc], length);
-  packetReread(packet,pc+length);
+  r.commit();
   return true;
 }
 
+/**
+  Starting from #packetCursor() of \a packet, read up to \a maxCount integers in the format given by
+  \a code into \a results, exactly as that many calls of #packetRead(u8 * packet, int &result, int
+  code, u32 maxLen) would, stopping at the first that would fail.  Each number gets its own \a maxLen
+  limit, and overflow, signs, and the final #packetCursor() -- including the partial advance of the
+  failing read, if any -- all match the one-at-a-time calls.
+
+  Runs of #DEC and #HEX numbers, such as diagnostic packets are made of, are parsed in bulk: digits
+  are classified sixteen at a time with SSE2 on the host, and converted eight (on the host) or four
+  (on the tile) at a time with in-register multiply-adds.  Other codes read one number at a time.
+
+  \param packet The packet to read.
+
+  \param results Where to store the numbers read; must have room for \a maxCount of them.
+
+  \param maxCount The most numbers to read.
+
+  \param code The format of each number; see #packetRead(u8 * packet, int &result, int code, u32 maxLen).
+
+  \param maxLen The most bytes to consume for each number.
+
+  \return How many numbers were read and stored in \a results.
+
+  \blinks #E_API_INVALID_PACKET if \a packet is null or pointing at something that is detectably
+  corrupt or not a packet.
+
+  \blinks #E_API_NULL_POINTER if \a results is null and \a maxCount isn't zero.
+
+  \blinks #E_API_FORMAT_ARG if \a code is not a valid format code.
+
+  \since 0.9.21
+ */
+u32 packetReadArray(u8 * packet, int * results, u32 maxCount, int code, u32 maxLen) {
+  PacketReader r(packet);
+  const u32 count = r.readArray(results, maxCount, code, maxLen);
+  r.commit();                   // Even the failing read may have advanced the cursor
+  return count;
+}
+
+/** As #packetReadArray(u8 * packet, int * results, u32 maxCount, int code, u32 maxLen) */
+u32 packetReadArray(u8 * packet, u32 * results, u32 maxCount, int code, u32 maxLen) {
+  return packetReadArray(packet, (int *) results, maxCount, code, maxLen);
+}
+
 bool packetReadPacket(u8 * packet, u8 *& subp) {
-  API_ASSERT_VALID_PACKET(packet);
-  u32 prl = packetReadLength(packet);
-  if (prl < 4+1) return false;  // 4 for header before, 1 for null after
-  u8 * possible = packet+packetCursor(packet)+4;
-  if (!validPacket(possible)) return false;
-  u32 len = packetLength(possible);
-  if (prl-4-1 < len) return false;
-  subp = possible;
-  packetReread(packet,packetCursor(packet)+len+4+1);
+  PacketReader r(packet);
+  if (!r.readPacket(subp))
+    return false;
+  r.commit();
   return true;
 }
 
@@ -549,69 +758,17 @@ bool packetReadPacket(u8 * packet, u8 *& subp) {
 
  */
 bool packetRead(u8 * packet, int & result, int code, u32 maxLen) {
-  API_ASSERT_VALID_PACKET(packet);
-
-  u32 maxPosition = packetCursor(packet) + maxLen;
-  if (code <= BYTE && code >= BELONG) {  // Handle BYTE, BESHORT, and BELONG
-    int num = 0;
-    for (int i = 1<<-code; i>0; --i) {
-      u8 ch;
-      if (!packetReadByte(packet,ch,maxPosition)) return false;
-      num = (num<<8)|ch;
-    }
-    result = num;
-    return true;
-  }
-
-  // Here to read in base 2..36
-  API_ASSERT(code >= 2 && code <= 36, E_API_FORMAT_ARG);
-
-  // Skip leading spaces (only, not other 'whitespace')
-  u8 ch;
-  do {
-    if (!packetReadByte(packet,ch,maxPosition))
-      return false;             // Can't get started
-  } while (ch==' ');
-
-  // ch is now a non-whitespace
-  bool negative;
-  if ((negative = ch=='-') || ch=='+') {
-    if (!packetReadByte(packet,ch,maxPosition))
-      return false;             // Can't get started
-  } 
-
-  int num = 0;
-  bool readSome = false;
-  do {
-    bool valid = true;
-    u8 val = 0;  // Needlessly initted to quiet compiler warning
-    if (ch >= '0' && ch <= '9') val = ch-'0';
-    else {
-      ch |= 0x20;  // standardize on lowercase
-      if (ch >= 'a' && ch <= 'z') val = ch-('a'-10);
-      else 
-        valid = false;
-    }
-    if (valid && val < code) {
-      num = num*code+val;
-      readSome = true;
-    } else if (readSome) {
-      packetReread(packet,packetCursor(packet)-1); // Read one too far, back up
-      break;
-    } else
-      return false;
-  } while (packetReadByte(packet,ch,maxPosition));
-  result = negative?-num:num;
-  return true;
+  PacketReader r(packet);
+  bool ret = r.read(result,code,maxLen);
+  r.commit();                   // Even on failure, the cursor may have advanced
+  return ret;
 }
 
 bool packetEqual(const u8 * p1, const u8 * p2) {
   API_ASSERT_VALID_PACKET(p1);
   API_ASSERT_VALID_PACKET(p2);
-  if (packetLength(p1) != packetLength(p2)) return false;
-  for (u32 i = packetLength(p1); i > 0; --i) 
-    if (*p1++ != *p2++) return false;
-  return true;
+  const u32 len = packetLength(p1);
+  return len == packetLength(p2) && packetBytesEqual(p1, p2, len);
 }
 
 u8 * makePacket(u8 * buffer, u32 bufferLength, u8 face, const char * packetData) {
@@ -648,63 +805,13 @@ u8 * makePacket(u8 * buffer, u32 bufferLength,u8 face, const u8 * packetData, u3
 
 #include <stdio.h>
 #include <stdlib.h> // for exit, random
+#include <pthread.h> // for test13
+#include <sched.h>   // for sched_yield
+#include "MFMPacketIO.h"
+#include "MFMFraming.h"  // for test17
 
 u32 reflexLibraryFlags = 0;
 
-#if 0
-void MFMPacketIO::bufferCheck() {
-
-  if (bflags&BFLAG_FULL)
-    API_ASSERT_TRUE(newPHIndex <= oldPHIndex && newPHIndex+sizeof(PacketHeader) > oldPHIndex);
-
-  u16 idx = oldPHIndex;
-  int packets = 0;
-
-  while (idx != newPHIndex && packets < 10000) {
-    PacketHeader & ph = getPacketHeader(idx);
-    API_ASSERT_LESS(ph.f[SOURCE],MAX_FACE_INDEX);
-    API_ASSERT_LESS_EQUAL(ph.f[LENGTH],MAX_PACKET_LENGTH);
-    API_ASSERT_LESS_EQUAL(ph.f[CURSOR],ph.f[LENGTH]);
-    API_ASSERT_TRUE(ph.f[FLAGS]==0 || ph.f[FLAGS]==PK_BUFFER);
-
-    idx = skipOverPacket(idx);
-    packets++;
-  }
-  API_ASSERT_LESS(packets,10000);
-}
-
-void MFMPacketIO::printBuffer() {
-
-  u16 idx = oldPHIndex;
-  bool full = bflags&BFLAG_FULL;
-  u32 totalLen = 0;
-  u32 totalPackets = 0;
-  while (full || idx != newPHIndex) {
-    ++totalPackets;
-    full = false;
-    PacketHeader & ph = getPacketHeader(idx);
-    printf("%4d@ %3dF %3dL [", 
-           idx, ph.flags, ph.length);
-    totalLen += (ph.length+3)&~3;
-
-    int which = forwardBytes(idx,4);
-    for (int i = 0; i < ph.length; ++i) {
-      printf("%c",buf[which]);
-      which = nextByte(which);
-    }
-    printf("]\n");
-    idx = skipOverPacket(idx);
-  }
-  printf("%4d %4d %4d\n",totalPackets*4+totalLen, totalPackets, totalLen);
-  printf("%4d@ %3dF/%3dBF %3dL %4d@@[", newPHIndex, flags, bflags, newPacketLength, forwardBytes(newPHIndex,4+newPacketLength));
-  int which = newPHIndex+4;
-  for (int i = 0; i < newPacketLength; ++i) {
-    printf("%c",buf[which]);
-    which = nextByte(which);
-  }
-  printf("]\n");
-}
-#endif
 
 void _apiError_(u32 code,const char * file, int lineno) { 
   fprintf(stderr,"APIERROR %d %s:%d\n",code,file,lineno);
@@ -793,6 +900,10 @@ void test2() {
   TEST(test.packetsRemovable()==0);
 }
 
+/* How many length 1 packets fit, at 5 bytes each (more if tracing), while leaving room for a header */
+#define PACKETS_OF_LENGTH_1 \
+  ((MFMPACKETIO_BUFFER_SIZE_BYTES-2*MFMPACKETIO_PREFIX_BYTES-1)/(MFMPACKETIO_PREFIX_BYTES+1)+1)
+
 void test3() {
   MFMPacketIO test(testIn);
   test.reset();
@@ -807,7 +918,7 @@ void test3() {
   TEST(!test.isEmptyOfPackets());  
 
   /* At 5 bytes per packet.. */ 
-  TEST(test.packetsRemovable()==(MFMPACKETIO_BUFFER_SIZE_BYTES/5));
+  TEST(test.packetsRemovable()==PACKETS_OF_LENGTH_1);
 
   while (!test.isEmptyOfPackets()) {
 
@@ -840,7 +951,7 @@ void test4() {
   TEST(!test.isEmptyOfPackets());  
 
   /* At 5 bytes per packet */ 
-  TEST(test.packetsRemovable()==(MFMPACKETIO_BUFFER_SIZE_BYTES/5));
+  TEST(test.packetsRemovable()==PACKETS_OF_LENGTH_1);
 
   while (!test.isEmptyOfPackets()) {
 
@@ -1421,7 +1532,375 @@ void test12() {
   printf("12b=%d in=%d out=%d\n",dispatch12blown,dispatch12sent,dispatch12rcvd);
 }
 
+/* test13: The producer and consumer sides on two real threads, with no locking.  The producer
+   waits for room rather than blowing packets, so every packet must arrive, in order, intact. */
+
+static const u32 PACKETS13 = 200000;
+static MFMPacketIO * p13;
+static u32 rcvd13 = 0;
+
+static u8 byte13(u32 seq, u32 i) {
+  return (u8) (seq*7+i*13);     /* Hits PFSC_END and PFSC_ESC regularly, so exercises escaping */
+}
+
+static u32 len13(u32 seq) {
+  return 4+(seq*31)%(MAX_PACKET_LENGTH-3);
+}
+
+static void * producer13(void *) {
+  for (u32 seq = 0; seq < PACKETS13; ++seq) {
+    u32 len = len13(seq);
+    for (u32 i = 0; i < len; ++i) {
+      u8 b = i < 4 ? (u8) (seq>>(24-8*i)) : byte13(seq,i);
+      while (!p13->canAddByte()) sched_yield();
+      p13->putByte(b);
+    }
+    while (!p13->canAddByte()) sched_yield();
+    p13->terpri();
+  }
+  return 0;
+}
+
+void dispatch13(u8 * packet,u8 source) {
+  TEST(packetFlags(packet)==0);
+  TEST(packetSource(packet)==source);
+  u32 seq;
+  TEST(packetRead(packet,seq,BELONG));
+  TEST(seq==rcvd13);
+  u32 len = packetLength(packet);
+  TEST(len==len13(seq));
+  for (u32 i = 4; i < len; ++i)
+    TEST(packet[i]==byte13(seq,i));
+  TEST(packet[len]==0);
+  ++rcvd13;
+}
+
+void test13() {
+  static u8 buffer13[MFMPACKETIO_BUFFER_SIZE_BYTES];
+  MFMPacketIO test(buffer13);
+  p13 = &test;
+  test.forceSync();
+
+  pthread_t producer;
+  TEST(pthread_create(&producer,0,producer13,0)==0);
+  while (rcvd13 < PACKETS13) {
+    if (!test.dispatchPacket(EAST,dispatch13))
+      sched_yield();
+  }
+  TEST(pthread_join(producer,0)==0);
+  TEST(test.isEmptyOfPackets());
+  TEST(test.getPacketsDropped()==0);
+  test.bufferCheck();
+  printf("13 in=%d out=%d wrapped=%d\n",PACKETS13,rcvd13,test.getPacketsWrapped());
+}
+
+void test14() {  /* checkByteUpdate agrees with CHECK_BYTE_UPDATE byte by byte */
+  u8 data[300];
+  for (u32 rep = 0; rep < 20000; ++rep) {
+    const u32 off = random()%8;
+    const u32 len = random()%(sizeof(data)-off);
+    for (u32 i = 0; i < len; ++i) data[off+i] = (u8) random();
+    u8 serial = (u8) random();
+    const u8 start = serial;
+    for (u32 i = 0; i < len; ++i) CHECK_BYTE_UPDATE(serial,data[off+i]);
+    TEST(checkByteUpdate(start, data+off, len) == serial);
+
+    CheckByteAccumulator cba;
+    const u32 split = len ? random()%len : 0;
+    cba.update(data+off, split);
+    if (split < len) cba.update(data[off+split]);
+    if (split+1 < len) cba.update(data+off+split+1, len-split-1);
+    u8 fresh = CHECK_BYTE_INIT_VALUE;
+    for (u32 i = 0; i < len; ++i) CHECK_BYTE_UPDATE(fresh,data[off+i]);
+    TEST(cba.get() == fresh);
+  }
+
+  u8 bufs[23][4+MAX_PACKET_LENGTH+1];
+  const u8 * packets[23];
+  bool results[23];
+  u32 expect = 0;
+  for (u32 p = 0; p < 23; ++p) {
+    const u32 len = random()%(MAX_PACKET_LENGTH-2);  /* makePacket takes 250, with the check byte */
+    CheckByteAccumulator cba;
+    for (u32 i = 0; i < len; ++i) {
+      data[i] = (u8) random();
+      cba.update(data[i]);
+    }
+    data[len] = cba.get();
+    if (p%3 == 0) data[len] ^= 1<<(random()%8);
+    else ++expect;
+    packets[p] = makePacket(bufs[p], sizeof(bufs[p]), EAST, data, len+1);
+  }
+  TEST(packetCheckByteValidBatch(packets, 23, results) == expect);
+  for (u32 p = 0; p < 23; ++p)
+    TEST(results[p] == (p%3 != 0) && results[p] == packetCheckByteValid(packets[p]));
+  packets[5] = makePacket(bufs[5], sizeof(bufs[5]), EAST, data, 0);  /* Empty: never valid */
+  TEST(packetCheckByteValidBatch(packets, 8, results) == 4 && !results[5]);
+}
+
+void test15() {  /* packetReadArray matches packetRead calls exactly, cursor and all */
+  static const char alphabet[] = "0123456789999999abcdefABCDEFxyz   --++\n\377";
+  static const int codes[] = { DEC, DEC, HEX, HEX, BIN, 36, BYTE, BELONG };
+  u8 bufa[4+MAX_PACKET_LENGTH+1], bufb[4+MAX_PACKET_LENGTH+1], data[MAX_PACKET_LENGTH];
+  for (u32 rep = 0; rep < 50000; ++rep) {
+    const u32 len = random()%(MAX_PACKET_LENGTH-2);
+    for (u32 i = 0; i < len; ++i) data[i] = alphabet[random()%(sizeof(alphabet)-1)];
+    u8 * pa = makePacket(bufa, sizeof(bufa), NORTH, data, len);
+    u8 * pb = makePacket(bufb, sizeof(bufb), NORTH, data, len);
+    const u32 start = len ? random()%len : 0;
+    packetReread(pa, start);
+    packetReread(pb, start);
+    const int code = codes[random()%(sizeof(codes)/sizeof(codes[0]))];
+    const u32 maxLens[] = { MAX_PACKET_LENGTH, (u32) (1+random()%12), 0xfffffff0u, 0 };
+    const u32 maxLen = maxLens[random()%4];
+    const u32 maxCount = random()%40;
+
+    int expect[40], got[40];
+    u32 count = 0;
+    while (count < maxCount && packetRead(pa, expect[count], code, maxLen)) ++count;
+    TEST(packetReadArray(pb, got, maxCount, code, maxLen) == count);
+    TEST(packetCursor(pa) == packetCursor(pb));
+    for (u32 i = 0; i < count; ++i) TEST(got[i] == expect[i]);
+  }
+
+  u8 * packet = makePacket("P 3902831 7D00 7E00 4a0c8a7676961058 0");
+  u32 vals[5];
+  TEST(packetReadArray(packet, vals, 5, BYTE) == 5 && vals[0] == 'P' && vals[4] == '0');
+  packetReread(packet, 1);
+  TEST(packetReadArray(packet, vals, 1, DEC) == 1 && vals[0] == 3902831);
+  TEST(packetReadArray(packet, vals, 5, HEX) == 4);
+  TEST(vals[0] == 0x7d00 && vals[1] == 0x7e00 && vals[2] == 0x76961058 && vals[3] == 0);
+  TEST(packetReadEOF(packet));
+  packet = makePacket("-12 +345678901234 -2147483648 99999999999");
+  int ints[5];
+  TEST(packetReadArray(packet, ints, 5, DEC) == 4);
+  TEST(ints[0] == -12 && ints[1] == (int) (345678u*1000000u+901234u));
+  TEST(ints[2] == (int) 0x80000000u && ints[3] == (int) (99999u*1000000u+999999u));
+}
+
+/* test16: Dispatchers that hold packets.  Held packets stay intact until released, in any order,
+   later packets keep being dispatched meanwhile, and all the space comes back in the end. */
+
+static MFMPacketIO * p16;
+static u32 sent16, rcvd16;
+static u8 * held16[MFMPACKETIO_DISPATCH_SLOTS];
+static u32 heldSeq16[MFMPACKETIO_DISPATCH_SLOTS];
+static u32 heldCount16;
+static bool mayHold16;
+
+static u32 len16(u32 seq) {
+  return 4+(seq*37)%61;
+}
+
+static void check16(u8 * packet, u32 seq) {
+  TEST(packetFlags(packet)==0);
+  TEST(packetSource(packet)==WEST);
+  const u32 len = packetLength(packet);
+  TEST(len==len16(seq));
+  for (u32 i = 0; i < len; ++i)
+    TEST(packet[i]==(i < 4 ? (u8) (seq>>(24-8*i)) : byte13(seq,i)));
+  TEST(packet[len]==0);
+}
+
+static void hold16(u8 * packet, u32 seq) {
+  TEST(heldCount16 < MFMPACKETIO_DISPATCH_SLOTS);
+  held16[heldCount16] = packet;
+  heldSeq16[heldCount16] = seq;
+  ++heldCount16;
+}
+
+static void release16(u32 which) {
+  check16(held16[which],heldSeq16[which]);
+  p16->releasePacket(held16[which]);
+  --heldCount16;
+  held16[which] = held16[heldCount16];
+  heldSeq16[which] = heldSeq16[heldCount16];
+}
+
+static void dispatch16(u8 * packet, u8 source) {
+  TEST(source==WEST);
+  u32 seq;
+  TEST(packetRead(packet,seq,BELONG));
+  TEST(seq==rcvd16++);
+  packetReread(packet);
+  check16(packet,seq);
+  if (mayHold16 && random()%2) {
+    TEST(p16->holdPacket()==packet);
+    hold16(packet,seq);
+  }
+}
+
+static void send16(MFMPacketIO & test) {
+  const u32 len = len16(sent16);
+  for (u32 i = 0; i <= len; ++i) {
+    while (!test.canAddByte()) {  /* Make room: release something, or dispatch something */
+      if (heldCount16 > 0) release16(random()%heldCount16);
+      else TEST(test.dispatchPacket(WEST,dispatch16));
+    }
+    if (i < len) test.putByte(i < 4 ? (u8) (sent16>>(24-8*i)) : byte13(sent16,i));
+    else test.terpri();
+  }
+  ++sent16;
+}
+
+void test16() {
+  MFMPacketIO test(testIn);
+  p16 = &test;
+  test.forceSync();
+  srandom(16);
+  mayHold16 = true;
+
+  for (u32 rep = 0; rep < 300000; ++rep) {
+    const bool waiting = !test.isEmptyOfPackets();
+    const bool slotFree = test.getSlotsInUse() < MFMPACKETIO_DISPATCH_SLOTS;
+    switch (random()%5) {
+    case 0:
+    case 1:
+      send16(test);
+      break;
+    case 2:
+      TEST(test.dispatchPacket(WEST,dispatch16) == (waiting && slotFree));
+      break;
+    case 3:
+      {
+        u8 * packet = test.takePacket(WEST);
+        TEST((packet != 0) == (waiting && slotFree));
+        if (packet) {
+          u32 seq;
+          TEST(packetRead(packet,seq,BELONG) && seq==rcvd16++);
+          hold16(packet,seq);
+        }
+      }
+      break;
+    case 4:
+      if (heldCount16 > 0) release16(random()%heldCount16);
+      break;
+    }
+    TEST(test.getSlotsInUse() >= heldCount16);
+    TEST(test.getSlotsInUse() <= MFMPACKETIO_DISPATCH_SLOTS);
+    if (rep%16 == 0) test.bufferCheck();
+  }
+
+  mayHold16 = false;
+  while (heldCount16 > 0) release16(random()%heldCount16);
+  while (test.dispatchPacket(WEST,dispatch16)) { }
+  test.bufferCheck();
+  TEST(rcvd16==sent16);
+  TEST(test.isEmptyOfPackets() && test.getSlotsInUse()==0);
+  TEST(test.getPacketsInPlace()+test.getPacketsCopied()==rcvd16);
+  TEST(test.getPacketsCopied() >= test.getPacketsWrapped() && test.getPacketsWrapped() > 0);
+  TEST(test.getMaxSlotsInUse()==MFMPACKETIO_DISPATCH_SLOTS && test.getSlotStalls() > 0);
+
+  for (u32 i = 0; i < 3; ++i) {  /* All the space is back: three max length packets fit */
+    for (u32 j = 0; j < MAX_PACKET_LENGTH; ++j) {
+      TEST(test.canAddByte());
+      test.storeByte('m');
+    }
+    test.storeByte('\012');
+  }
+  test.bufferCheck();
+  printf("16 slots=%d in=%d inplace=%d copied=%d wrapped=%d\n",MFMPACKETIO_DISPATCH_SLOTS,sent16,
+         test.getPacketsInPlace(),test.getPacketsCopied(),test.getPacketsWrapped());
+}
+
+/* test17: packetForward relays packets across a chain of tiles -- each a receive ring whose
+   dispatcher forwards into its outbound ring, which is framed onto the wire to the next -- with
+   the data arriving intact, and stripped of each hop's routing byte when asked. */
+
+static MFMPacketIO * out17;
+static u32 hop17, forwarded17, refused17;
+
+static void relay17(u8 * packet, u8) {
+  u32 hops;
+  TEST(packetRead(packet,hops,BYTE));
+  if (hops == 'x') {            /* Forward whole, routing byte and all */
+    packetReread(packet);
+    if (packetForward(packet,*out17)) ++forwarded17;
+    else ++refused17;
+  } else if (packetForward(packet,*out17,packetCursor(packet))) ++forwarded17;
+  else ++refused17;
+}
+
+static u32 wire17(MFMPacketIO & out, u8 * wire) {
+  PacketBuffer pb;
+  u32 len = 0;
+  u8 * packet;
+  while ((packet = out.copyPacketAndDiscard(pb))) {
+    TEST(packetFlags(packet)==0);
+    len += frameEncode(wire+len,packet,packetLength(packet));
+  }
+  return len;
+}
+
+void test17() {
+  static u8 bufs17[4][2][MFMPACKETIO_BUFFER_SIZE_BYTES];
+  static u8 wire[2*MFMPACKETIO_BUFFER_SIZE_BYTES*2];
+  srandom(17);
+  for (u32 rep = 0; rep < 2000; ++rep) {
+    /* A packet with one routing byte per hop ahead of its payload, or 'x' to go whole */
+    const bool whole = rep%5 == 0;
+    u8 data[MAX_PACKET_LENGTH];
+    u32 len = 0;
+    for (u32 h = 0; h < 4; ++h) data[len++] = whole ? 'x' : (u8) ('0'+h);
+    const u32 payload = random()%(MAX_PACKET_LENGTH-2-len);
+    for (u32 i = 0; i < payload; ++i) data[len++] = (u8) random();  /* Specials and all */
+
+    u32 wlen = frameEncode(wire,data,len);
+    for (u32 hop = 0; hop < 4; ++hop) {
+      MFMPacketIO in(bufs17[hop][0]), out(bufs17[hop][1]);
+      in.forceSync();
+      out17 = &out;
+      in.storeBytes(wire,wlen);
+      TEST(in.dispatchPacket(WEST,relay17));
+      TEST(!in.dispatchPacket(WEST,relay17));
+      out.bufferCheck();
+      wlen = wire17(out,wire);
+      hop17 = hop;
+    }
+    /* Last stop: what arrives is the payload, or the whole thing */
+    MFMPacketIO in(bufs17[0][0]);
+    in.forceSync();
+    in.storeBytes(wire,wlen);
+    PacketBuffer pb;
+    u8 * packet = in.copyPacketAndDiscard(pb);
+    TEST(packet && packetFlags(packet)==0);
+    const u32 skip = whole ? 0 : 4;
+    TEST(packetLength(packet)==len-skip);
+    TEST(memcmp(packet,data+skip,len-skip)==0);
+  }
+  TEST(forwarded17==4*2000 && refused17==0 && hop17==3);
+
+  /* Forwarding fails cleanly when the outbound ring is full, and wraps around its end */
+  MFMPacketIO in(bufs17[0][0]), out(bufs17[0][1]);
+  in.forceSync();
+  out17 = &out;
+  u8 data[200];
+  for (u32 i = 0; i < sizeof(data); ++i) data[i] = (u8) ('x'+i%3);
+  data[0] = 'x';
+  const u32 wlen = frameEncode(wire,data,sizeof(data));
+  forwarded17 = refused17 = 0;
+  for (u32 rep = 0; rep < 40; ++rep) {
+    in.storeBytes(wire,wlen);
+    TEST(in.dispatchPacket(EAST,relay17));
+    if (rep%8 == 7) {           /* Drain now and then, so the ring wraps */
+      PacketBuffer pb;
+      u8 * packet;
+      while ((packet = out.copyPacketAndDiscard(pb))) {
+        TEST(packetLength(packet)==sizeof(data) && memcmp(packet,data,sizeof(data))==0);
+      }
+    }
+    out.bufferCheck();
+  }
+  TEST(forwarded17 > 0 && refused17 > 0 && forwarded17+refused17 == 40);
+  TEST(out.getPacketsWrapped() > 0);
+}
+
 int main() {
+  test17();
+  test16();
+  test15();
+  test14();
+  test13();
   test12();
   test11();
   test10();
@@ -1437,3 +1916,67 @@ int main() {
   return 0;
 }
 #endif
+
+#ifdef BENCH_CHECK_BYTE
+
+#include <stdio.h>
+#include <stdlib.h> // for exit, random
+#include <time.h>   // for clock_gettime
+
+void _apiError_(u32 code,const char * file, int lineno) {
+  fprintf(stderr,"APIERROR %d %s:%d\n",code,file,lineno);
+  exit(code);
+}
+
+static double nowSeconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+/* packetCheckByteValid as of 0.9.20, retained here for comparison */
+static bool legacyCheckByteValid(const u8 * packet) {
+  u32 len = packetLength(packet);
+  if (len-- == 0) return false;
+  u8 checkByte = CHECK_BYTE_INIT_VALUE;
+  for (u32 i = 0; i < len; ++i) {
+    CHECK_BYTE_UPDATE(checkByte,packet[i]);
+  }
+  return checkByte==packet[len];
+}
+
+int main() {
+  const u32 COUNT = 64;
+  static u8 bufs[COUNT][4+MAX_PACKET_LENGTH+1];
+  const u8 * packets[COUNT];
+  bool results[COUNT];
+  const u32 lengths[] = { 16, 32, 64, MAX_PACKET_LENGTH-3 };
+  for (u32 l = 0; l < sizeof(lengths)/sizeof(lengths[0]); ++l) {
+    const u32 len = lengths[l];
+    for (u32 p = 0; p < COUNT; ++p) {
+      u8 data[MAX_PACKET_LENGTH];
+      CheckByteAccumulator cba;
+      for (u32 i = 0; i < len; ++i) cba.update(data[i] = (u8) random());
+      data[len] = cba.get();
+      packets[p] = makePacket(bufs[p], sizeof(bufs[p]), EAST, data, len+1);
+    }
+    const u32 REPS = 200000;
+    u32 sink = 0;
+    double start = nowSeconds();
+    for (u32 rep = 0; rep < REPS; ++rep)
+      for (u32 p = 0; p < COUNT; ++p) sink += legacyCheckByteValid(packets[p]);
+    const double legacy = nowSeconds()-start;
+
+    start = nowSeconds();
+    for (u32 rep = 0; rep < REPS; ++rep)
+      sink += packetCheckByteValidBatch(packets, COUNT, results);
+    const double batch = nowSeconds()-start;
+
+    printf("%u byte packets (sink %u)\n", len+1, sink);
+    printf("  %-22s %8.1f ns/packet\n", "bytewise", legacy*1e9/REPS/COUNT);
+    printf("  %-22s %8.1f ns/packet\n", "folded, batched", batch*1e9/REPS/COUNT);
+  }
+  return 0;
+}
+
+#endif /* BENCH_CHECK_BYTE */
@@ -0,0 +1,262 @@
+/*                                              -*- mode:C++; fill-column:100 -*-
+  MFMPacketCodec.cpp - Binary packet payloads described by compile-time schemas
+  Copyright (C) 2013 The Regents of the University of New Mexico.  All rights reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301
+  USA
+*/
+
+/* PacketCodec is entirely templates, in MFMPacketCodec.h; this file holds only its tests and
+   benchmark.
+
+   TO COMPILE FOR TESTING:
+  g++ -O0 -g3 -Wall -pedantic -Werror -Wundef -I../include -DHOST_MODE -DTEST_PACKET_CODEC -o"./testpacketcodec" MFMPacketCodec.cpp MFMPacketWriter.cpp MFMPacketIO.cpp MFMFraming.cpp MFMPacketReader.cpp MFMPacket.cpp;./testpacketcodec
+
+   TO COMPILE FOR BENCHMARKING:
+  g++ -O2 -Wall -pedantic -Werror -Wundef -I../include -DHOST_MODE -DBENCH_PACKET_CODEC -o"./benchpacketcodec" MFMPacketCodec.cpp MFMPacketWriter.cpp MFMPacketIO.cpp MFMFraming.cpp MFMPacketReader.cpp MFMPacket.cpp;./benchpacketcodec
+*/
+
+#include "MFMPacketCodec.h"
+
+#if defined(TEST_PACKET_CODEC) || defined(BENCH_PACKET_CODEC)
+
+#include <stdio.h>
+#include <stdlib.h> // for exit, random
+
+void _apiError_(u32 code,const char * file, int lineno) {
+  fprintf(stderr,"APIERROR %d %s:%d\n",code,file,lineno);
+  exit(code);
+}
+
+/* A site update, roughly as an event window exchange might send one */
+struct SiteUpdate {
+  u16 x, y;
+  u64 atom;
+  u32 counter;
+  s16 delta;
+  u8 type, face, flag;
+  u8 tag[4];
+};
+
+typedef PacketCodec<SiteUpdate,
+                    CodecBE<SiteUpdate,u16,&SiteUpdate::x>,
+                    CodecBE<SiteUpdate,u16,&SiteUpdate::y>,
+                    CodecBE<SiteUpdate,u64,&SiteUpdate::atom>,
+                    CodecBE<SiteUpdate,u32,&SiteUpdate::counter>,
+                    CodecBE<SiteUpdate,s16,&SiteUpdate::delta>,
+                    CodecBitGroup<CodecBits<SiteUpdate,u8,&SiteUpdate::type,4>,
+                                  CodecBits<SiteUpdate,u8,&SiteUpdate::face,3>,
+                                  CodecBits<SiteUpdate,u8,&SiteUpdate::flag,1> >,
+                    CodecArray<SiteUpdate,u8,4,&SiteUpdate::tag> >
+  SiteUpdateCodec;
+
+static u8 codecBuffer[4+MAX_PACKET_LENGTH+1];
+
+static SiteUpdate randomSiteUpdate() {
+  SiteUpdate su;
+  su.x = (u16) random();
+  su.y = (u16) random();
+  su.atom = ((u64) random()<<33) ^ random();
+  su.counter = (u32) random();
+  su.delta = (s16) random();
+  su.type = (u8) (random()&0xf);
+  su.face = (u8) (random()&0x7);
+  su.flag = (u8) (random()&0x1);
+  for (u32 i = 0; i < 4; ++i) su.tag[i] = (u8) random();
+  return su;
+}
+
+#endif
+
+#ifdef TEST_PACKET_CODEC
+
+static void die(const char * file, int line, const char * msg) {
+  fprintf(stderr,"%s:%d: %s\n",file, line, msg);
+  exit(100);
+}
+
+#define TEST(condition) do { if (!(condition)) die(__FILE__,__LINE__,#condition); } while (0)
+
+static bool same(const SiteUpdate & a, const SiteUpdate & b) {
+  return a.x == b.x && a.y == b.y && a.atom == b.atom && a.counter == b.counter &&
+    a.delta == b.delta && a.type == b.type && a.face == b.face && a.flag == b.flag &&
+    memcmp(a.tag, b.tag, 4) == 0;
+}
+
+static void test1() {           /* The layout is what packetRead expects, field by field */
+  TEST(SiteUpdateCodec::BYTES == 2+2+8+4+2+1+4);
+  for (u32 rep = 0; rep < 10000; ++rep) {
+    const SiteUpdate su = randomSiteUpdate();
+    PacketWriter w(codecBuffer, sizeof(codecBuffer), EAST);
+    TEST(SiteUpdateCodec::encode(w, su));
+    TEST(w.put('!'));
+    TEST(w.commit());
+    u8 * packet = w.getPacket();
+
+    int x, y, counter, delta, bits;
+    u64 atom;
+    u8 tag[4];
+    TEST(packetRead(packet,x,BESHORT) && (u32) x == su.x);
+    TEST(packetRead(packet,y,BESHORT) && (u32) y == su.y);
+    TEST(packetRead(packet,atom) && atom == su.atom);
+    TEST(packetRead(packet,counter,BELONG) && (u32) counter == su.counter);
+    TEST(packetRead(packet,delta,BESHORT) && (s16) delta == su.delta);
+    TEST(packetRead(packet,bits,BYTE) && bits == ((su.type<<4)|(su.face<<1)|su.flag));
+    TEST(packetRead(packet,tag,4) && memcmp(tag, su.tag, 4) == 0);
+
+    packetReread(packet);
+    SiteUpdate back;
+    TEST(SiteUpdateCodec::decode(packet, back));
+    TEST(same(su, back));
+    TEST(packetCursor(packet) == SiteUpdateCodec::BYTES);   /* Moved once, past the message */
+  }
+}
+
+static void test2() {           /* Short packets decode nothing */
+  const SiteUpdate su = randomSiteUpdate();
+  u8 raw[SiteUpdateCodec::BYTES+1];
+  raw[0] = 'z';
+  SiteUpdateCodec::encode(raw+1, su);
+  for (u32 len = 0; len < sizeof(raw); ++len) {
+    u8 * packet = makePacket(codecBuffer, sizeof(codecBuffer), WEST, raw, len);
+    u8 ch = 0;
+    TEST(packetRead(packet,&ch,1) == (len > 0) && ch == (len > 0 ? 'z' : 0));
+    SiteUpdate back = su;
+    back.x = (u16) ~su.x;
+    const u32 at = packetCursor(packet);
+    TEST(SiteUpdateCodec::decode(packet, back) == (len == sizeof(raw)));
+    if (len < sizeof(raw)) {
+      TEST(packetCursor(packet) == at);
+      TEST(back.x == (u16) ~su.x);
+    } else TEST(same(su, back) && packetReadEOF(packet));
+  }
+
+  u8 small[4+SiteUpdateCodec::BYTES];   /* One byte short of room */
+  PacketWriter w(small, sizeof(small), WEST);
+  TEST(!SiteUpdateCodec::encode(w, su));
+  TEST(w.length() == 0);
+}
+
+struct Wide { u32 a, b, c; u64 d; s8 e[3]; s32 f[2]; };
+
+typedef PacketCodec<Wide,
+                    CodecBitGroup<CodecBits<Wide,u32,&Wide::a,20>,
+                                  CodecBits<Wide,u32,&Wide::b,4> >,
+                    CodecBitGroup<CodecBits<Wide,u32,&Wide::c,1>,
+                                  CodecBits<Wide,u64,&Wide::d,63> >,
+                    CodecArray<Wide,s8,3,&Wide::e>,
+                    CodecArray<Wide,s32,2,&Wide::f> >
+  WideCodec;
+
+static void test3() {           /* Odd-sized bit groups, 64 bit members, and signed arrays */
+  TEST(WideCodec::BYTES == 3+8+3+8);
+  Wide w, back;
+  w.a = 0xabcde; w.b = 0x5; w.c = 1; w.d = U64_MAX>>1;
+  w.e[0] = -1; w.e[1] = 0; w.e[2] = -128;
+  w.f[0] = -2; w.f[1] = S32_MAX;
+  u8 raw[WideCodec::BYTES];
+  WideCodec::encode(raw, w);
+  TEST(raw[0] == 0xab && raw[1] == 0xcd && raw[2] == 0xe5);
+  TEST(raw[3] == 0xff && raw[10] == 0xff);
+  TEST(raw[14] == 0xff && raw[17] == 0xfe && raw[18] == 0x7f);
+
+  u8 * packet = makePacket(codecBuffer, sizeof(codecBuffer), NORTH, raw, sizeof(raw));
+  memset(&back, 0, sizeof(back));
+  TEST(WideCodec::decode(packet, back));
+  TEST(back.a == w.a && back.b == w.b && back.c == w.c && back.d == w.d);
+  TEST(memcmp(back.e, w.e, 3) == 0 && back.f[0] == -2 && back.f[1] == S32_MAX);
+}
+
+int main() {
+  test1();
+  test2();
+  test3();
+  return 0;
+}
+
+#endif /* TEST_PACKET_CODEC */
+
+#ifdef BENCH_PACKET_CODEC
+
+#include <time.h>   // for clock_gettime
+
+static double nowSeconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+/* The same message read the way handlers do it today, one field and one byte at a time */
+static bool perField(u8 * packet, SiteUpdate & su) {
+  int v;
+  if (!packetRead(packet,v,BESHORT)) return false;
+  su.x = (u16) v;
+  if (!packetRead(packet,v,BESHORT)) return false;
+  su.y = (u16) v;
+  if (!packetRead(packet,su.atom)) return false;
+  if (!packetRead(packet,v,BELONG)) return false;
+  su.counter = (u32) v;
+  if (!packetRead(packet,v,BESHORT)) return false;
+  su.delta = (s16) v;
+  if (!packetRead(packet,v,BYTE)) return false;
+  su.type = (u8) (v>>4);
+  su.face = (u8) ((v>>1)&0x7);
+  su.flag = (u8) (v&0x1);
+  return packetRead(packet,su.tag,4);
+}
+
+int main() {
+  const SiteUpdate su = randomSiteUpdate();
+  PacketWriter w(codecBuffer, sizeof(codecBuffer), EAST);
+  SiteUpdateCodec::encode(w, su);
+  w.commit();
+  u8 * packet = w.getPacket();
+
+  const u32 REPS = 5000000;
+  SiteUpdate back;
+  u32 sink = 0;
+
+  double start = nowSeconds();
+  for (u32 rep = 0; rep < REPS; ++rep) {
+    packetReread(packet);
+    if (perField(packet, back)) sink += back.x + back.counter + (u32) back.atom;
+  }
+  const double fields = nowSeconds()-start;
+
+  start = nowSeconds();
+  for (u32 rep = 0; rep < REPS; ++rep) {
+    packetReread(packet);
+    if (SiteUpdateCodec::decode(packet, back)) sink += back.x + back.counter + (u32) back.atom;
+  }
+  const double decoded = nowSeconds()-start;
+
+  u8 raw[SiteUpdateCodec::BYTES];
+  start = nowSeconds();
+  for (u32 rep = 0; rep < REPS; ++rep) {
+    SiteUpdate s = su;
+    s.counter = rep;
+    SiteUpdateCodec::encode(raw, s);
+    sink += raw[13];
+  }
+  const double encoded = nowSeconds()-start;
+
+  printf("%u reps of a %d byte SiteUpdate (sink %u)\n", REPS, (int) SiteUpdateCodec::BYTES, sink);
+  printf("%-24s %8.1f ns/packet\n", "packetRead per field", fields*1e9/REPS);
+  printf("%-24s %8.1f ns/packet\n", "PacketCodec::decode", decoded*1e9/REPS);
+  printf("%-24s %8.1f ns/packet\n", "PacketCodec::encode", encoded*1e9/REPS);
+  return 0;
+}
+
+#endif /* BENCH_PACKET_CODEC */
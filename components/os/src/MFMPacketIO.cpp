@@ -0,0 +1,398 @@
+/*                                              -*- mode:C++; fill-column:100 -*-
+  MFMPacketIO.cpp - Rolling packet buffer between interrupt level and background
+  Copyright (C) 2009-2013 The Regents of the University of New Mexico.  All rights reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301
+  USA
+*/
+
+/* Tests for this file live with the MFMPacket.cpp tests (see -DTEST_PACKET_BUFFER there). */
+
+#include <string.h>        /* For memcpy, memset */
+#include "MFMPacketIO.h"
+#include "MFMFraming.h"
+#include "MFMAssert.h"
+#include "MFMMacros.h"     /* For MEMORY_BARRIER */
+
+MFMPacketIO::MFMPacketIO(u8 * buffer)
+  : buf(buffer)
+  , inputFraming(PACKETS)
+  , outputFraming(PACKETS)
+{
+  API_ASSERT_NONNULL(buffer);
+  reset();
+}
+
+void MFMPacketIO::reset() {
+  newPHIndex = oldPHIndex = nextPHIndex = 0;
+  newPacketLength = 0;
+  flags = bflags = 0;
+  packetsIn = packetsOut = packetsReleased = slotsFreed = 0;
+  packetsDropped = packetsWrapped = packetsCopied = packetsInPlace = 0;
+  maxSlotsInUse = slotStalls = 0;
+  for (u32 i = 0; i < MFMPACKETIO_DISPATCH_SLOTS; ++i)
+    slots[i].held = false;
+  dispatching = 0;
+  holding = false;
+  at(0) = 0;                    /* The (nonexistent) previous packet's packet zero */
+}
+
+/****************** Producer side ******************/
+
+void MFMPacketIO::storeData(u8 dataByte) {
+#ifdef MFM_PACKET_TRACE
+  if (newPacketLength == 0) traceStarted = traceNow();
+#endif
+  if (newPacketLength >= MAX_PACKET_LENGTH || !canAddByte()) {
+    flags |= PK_BUFFER;         /* Drop the byte; the packet will be delivered as broken */
+    return;
+  }
+  at(newPHIndex+MFMPACKETIO_PREFIX_BYTES+newPacketLength) = dataByte;
+  ++newPacketLength;
+}
+
+void MFMPacketIO::storeEnd() {
+  const u32 used = newPHIndex - oldPHIndex;
+  const u32 next = newPHIndex + MFMPACKETIO_PREFIX_BYTES + newPacketLength;
+
+  if (MFMPACKETIO_BUFFER_SIZE_BYTES - used < 2*MFMPACKETIO_PREFIX_BYTES + newPacketLength) {
+    ++packetsDropped;           /* No room even for a broken empty packet */
+  } else {
+    const u32 ph = newPHIndex + PACKET_TRACE_BYTES;
+#ifdef MFM_PACKET_TRACE
+    storeTrace();
+#endif
+    at(ph+PacketHeader::SOURCE) = 0;
+    at(ph+PacketHeader::FLAGS) = flags;
+    at(ph+PacketHeader::CURSOR) = 0;
+    at(ph+PacketHeader::LENGTH) = (u8) newPacketLength;
+    at(next) = 0;               /* Our packet zero, and the next header's SOURCE */
+
+    MEMORY_BARRIER();           /* Packet contents before publication */
+    newPHIndex = next;
+    packetsIn = packetsIn + 1;
+  }
+  newPacketLength = 0;
+  flags = 0;
+}
+
+#ifdef MFM_PACKET_TRACE
+void MFMPacketIO::storeTrace() {
+  const TraceStamp now = traceNow();
+  PacketTrace trace;
+  memset(&trace, 0, sizeof(trace));
+  trace.set(TRACE_STARTED, newPacketLength > 0 ? traceStarted : now);   /* Else it's empty */
+  trace.set(TRACE_RECEIVED, now);
+  const u8 * bytes = (const u8 *) &trace;
+  for (u32 i = 1; i < PACKET_TRACE_BYTES; ++i)  /* Byte 0 is the previous packet's packet zero */
+    at(newPHIndex+i) = bytes[i];
+}
+#endif
+
+void MFMPacketIO::storeByte(u8 b) {
+  if (inputFraming == BYTES) {
+    storeData(b);
+    storeEnd();
+    return;
+  }
+
+  if (!(bflags&BFLAG_SYNCED)) { /* Discard until we see a packet boundary */
+    if (b == PFSC_END) bflags |= BFLAG_SYNCED;
+    return;
+  }
+
+  if (bflags&BFLAG_ESCAPE) {
+    bflags &= ~BFLAG_ESCAPE;
+    if (b == PFSC_EEND) storeData(PFSC_END);
+    else if (b == PFSC_EESC) storeData(PFSC_ESC);
+    else {
+      flags |= PK_BAD_ESCAPE;   /* An END still ends the packet; anything else is kept as data */
+      if (b == PFSC_END) storeEnd();
+      else storeData(b);
+    }
+    return;
+  }
+
+  if (b == PFSC_END) storeEnd();
+  else if (b == PFSC_ESC) bflags |= BFLAG_ESCAPE;
+  else storeData(b);
+}
+
+/* How many more data bytes the packet being received may hold, as storeData sees it */
+u32 MFMPacketIO::dataRoom() const {
+  const u32 free = MFMPACKETIO_BUFFER_SIZE_BYTES - (newPHIndex - oldPHIndex);
+  u32 room = free >= 2*MFMPACKETIO_PREFIX_BYTES + newPacketLength
+    ? free - 2*MFMPACKETIO_PREFIX_BYTES - newPacketLength : 0;
+  if (room > MAX_PACKET_LENGTH - newPacketLength) room = MAX_PACKET_LENGTH - newPacketLength;
+  return room;
+}
+
+void MFMPacketIO::storeBytes(const u8 * wire, u32 length) {
+  API_ASSERT(wire || !length, E_API_NULL_POINTER);
+
+  while (length > 0) {
+    if (inputFraming != PACKETS || !(bflags&BFLAG_SYNCED)) {
+      storeByte(*wire++);       /* Nothing to gain in bulk here */
+      --length;
+      continue;
+    }
+
+    /* Decode into the contiguous stretch up to the end of buf, or up to the room we have */
+    const u32 offset = (newPHIndex+MFMPACKETIO_PREFIX_BYTES+newPacketLength) & BYTE_BUFFER_MASK;
+    u32 room = dataRoom();
+    if (room > MFMPACKETIO_BUFFER_SIZE_BYTES - offset) room = MFMPACKETIO_BUFFER_SIZE_BYTES - offset;
+
+#ifdef MFM_PACKET_TRACE
+    if (newPacketLength == 0) traceStarted = traceNow();
+#endif
+    FrameDecodeState fds;
+    fds.escape = (bflags&BFLAG_ESCAPE) != 0;
+    u32 stored = room;
+    const u32 used = frameDecode(fds, &buf[offset], stored, wire, length);
+    newPacketLength += stored;
+    flags |= fds.flags;
+    if (fds.escape) bflags |= BFLAG_ESCAPE;
+    else bflags &= ~BFLAG_ESCAPE;
+    wire += used;
+    length -= used;
+
+    if (fds.end) storeEnd();
+    else if (used == 0) {       /* Out of room: Let storeByte drop the next byte and flag it */
+      storeByte(*wire++);
+      --length;
+    }
+  }
+}
+
+void MFMPacketIO::putByte(u8 b) {
+  if (outputFraming == PACKETS) {
+    if (b == PFSC_END) {
+      storeByte(PFSC_ESC);
+      b = PFSC_EEND;
+    } else if (b == PFSC_ESC) {
+      storeByte(PFSC_ESC);
+      b = PFSC_EESC;
+    }
+  }
+  storeByte(b);
+}
+
+void MFMPacketIO::terpri() {
+  if (outputFraming == PACKETS)
+    storeByte(PFSC_END);
+}
+
+u8 * MFMPacketIO::reserve(u32 & start, u32 & room) {
+  API_ASSERT(newPacketLength == 0 && !(bflags&BFLAG_ESCAPE), E_API_ILLEGAL_STATE);
+  if (MFMPACKETIO_BUFFER_SIZE_BYTES - (newPHIndex - oldPHIndex) < 2*MFMPACKETIO_PREFIX_BYTES)
+    return 0;
+#ifdef MFM_PACKET_TRACE
+  traceStarted = traceNow();
+#endif
+  start = newPHIndex+MFMPACKETIO_PREFIX_BYTES;
+  room = dataRoom();
+  return buf;
+}
+
+void MFMPacketIO::publishReserved(u32 length, u8 flags) {
+  API_ASSERT(newPacketLength == 0 && length <= dataRoom(), E_API_ILLEGAL_STATE);
+  newPacketLength = length;
+  this->flags |= flags;
+  storeEnd();
+}
+
+bool packetForward(const u8 * packet, MFMPacketIO & out, u32 from) {
+  API_ASSERT_VALID_PACKET(packet);
+  const u32 length = packetLength(packet);
+  API_ASSERT_MAX(from, length+1);
+  const u32 count = length - from;
+
+  u32 start, room;
+  u8 * buf = out.reserve(start, room);
+  if (!buf || room < count) return false;
+
+  const u32 at = start & BYTE_BUFFER_MASK;
+  const u32 first =             /* Up to the end of the ring, the rest from its start */
+    at + count <= MFMPACKETIO_BUFFER_SIZE_BYTES ? count : MFMPACKETIO_BUFFER_SIZE_BYTES - at;
+  memcpy(buf+at, packet+from, first);
+  memcpy(buf, packet+from+first, count-first);
+  out.publishReserved(count);
+  return true;
+}
+
+/****************** Consumer side ******************/
+
+/* Take the oldest waiting packet into the next dispatch slot, copying it into 'copy' if given, or
+   into the slot's own buffer if it can't be used in place.  Null if there is no packet or slot */
+MFMPacketIO::DispatchSlot * MFMPacketIO::takeSlot(u8 source, PacketBuffer * copy) {
+  if (isEmptyOfPackets()) return 0;
+  if (getSlotsInUse() >= MFMPACKETIO_DISPATCH_SLOTS) {
+    ++slotStalls;
+    return 0;
+  }
+
+  MEMORY_BARRIER();             /* packetsIn (read above) before packet contents */
+  DispatchSlot & s = slot(packetsOut);
+  const u32 start = nextPHIndex;
+  const u32 length = at(start+PACKET_TRACE_BYTES+PacketHeader::LENGTH);
+  const u32 total = MFMPACKETIO_PREFIX_BYTES + length + 1;   /* Header, data, packet zero */
+  const u32 offset = start & BYTE_BUFFER_MASK;
+  const bool wraps = offset + total > MFMPACKETIO_BUFFER_SIZE_BYTES;
+
+  /* Setting SOURCE in place would clobber the null of a packet held in place just before it */
+  bool shields = false;
+  if (PACKET_TRACE_BYTES == 0 && packetsOut != packetsReleased) {
+    const DispatchSlot & prev = slot(packetsOut-1);
+    shields = prev.held && !prev.copied;
+  }
+
+  PacketBuffer & dest = copy ? *copy : s.buffer;
+  if (copy || wraps || shields) {
+    u8 * to = dest.bbuf - MFMPACKETIO_PREFIX_BYTES;
+    for (u32 i = 0; i < total; ++i)
+      to[i] = at(start+i);
+    s.packet = dest.bbuf;
+    s.copied = true;
+    if (wraps) ++packetsWrapped;
+    if (!copy) ++packetsCopied;
+  } else {
+    s.packet = &buf[offset+MFMPACKETIO_PREFIX_BYTES];
+    s.copied = false;
+    ++packetsInPlace;
+  }
+  s.length = length;
+  s.held = true;
+
+  packetHeaderInternalUnsafe(s.packet).f[PacketHeader::SOURCE] = source;
+#ifdef MFM_PACKET_TRACE
+  packetTraceInternalUnsafe(s.packet).set(TRACE_DISPATCHED, traceNow());
+#endif
+
+  nextPHIndex = start + MFMPACKETIO_PREFIX_BYTES + length;
+  packetsOut = packetsOut + 1;
+  if (getSlotsInUse() > maxSlotsInUse) maxSlotsInUse = getSlotsInUse();
+  return &s;
+}
+
+void MFMPacketIO::finish(DispatchSlot & s) {
+#ifdef MFM_PACKET_TRACE
+  latency.record(packetTraceInternalUnsafeConst(s.packet), traceNow());
+#endif
+  s.held = false;
+  releaseSlots();
+}
+
+/* Release buffer space, oldest first, up to the first packet still held in place, and then free
+   slots, oldest first, up to the first packet still held at all */
+void MFMPacketIO::releaseSlots() {
+  const u32 out = packetsOut;
+  u32 count = packetsReleased;
+  u32 released = oldPHIndex;
+  for (; count != out; ++count) {
+    const DispatchSlot & s = slot(count);
+    if (s.held && !s.copied) break;
+    released += MFMPACKETIO_PREFIX_BYTES + s.length;
+  }
+  if (count != packetsReleased) {
+    packetsReleased = count;
+    MEMORY_BARRIER();           /* Done with packet contents before releasing the space */
+    oldPHIndex = released;
+  }
+
+  while (slotsFreed != count && !slot(slotsFreed).held)
+    ++slotsFreed;
+}
+
+bool MFMPacketIO::dispatchPacket(u8 source, PacketDispatcher * dispatcher) {
+  API_ASSERT_NONNULL(dispatcher);
+  API_ASSERT_VALID_EXTENDED_FACE(source);
+  DispatchSlot * s = takeSlot(source, 0);
+  if (!s) return false;
+
+  DispatchSlot * outer = dispatching;   /* In case the dispatcher dispatches */
+  const bool outerHolding = holding;
+  dispatching = s;
+  holding = false;
+  dispatcher(s->packet, source);
+  if (!holding) finish(*s);
+  dispatching = outer;
+  holding = outerHolding;
+  return true;
+}
+
+u8 * MFMPacketIO::holdPacket() {
+  API_ASSERT(dispatching != 0, E_API_ILLEGAL_STATE);
+  holding = true;
+  return dispatching->packet;
+}
+
+u8 * MFMPacketIO::takePacket(u8 source) {
+  API_ASSERT_VALID_EXTENDED_FACE(source);
+  DispatchSlot * s = takeSlot(source, 0);
+  return s ? s->packet : 0;
+}
+
+void MFMPacketIO::releasePacket(u8 * packet) {
+  for (u32 i = slotsFreed; i != packetsOut; ++i) {
+    DispatchSlot & s = slot(i);
+    if (s.held && s.packet == packet) {
+      finish(s);
+      return;
+    }
+  }
+  API_BUG(E_API_ILLEGAL_STATE);
+}
+
+u8 * MFMPacketIO::copyPacketAndDiscard(PacketBuffer & pb) {
+  DispatchSlot * s = takeSlot(0, &pb);
+  if (!s) return 0;
+  packetHeaderInternalUnsafe(pb.bbuf).f[PacketHeader::SOURCE] = 0;  /* As it was */
+#ifdef MFM_PACKET_TRACE
+  packetTraceInternalUnsafe(pb.bbuf).stages &= (u8) ~(1<<TRACE_DISPATCHED);
+#endif
+  s->held = false;
+  releaseSlots();
+  return pb.bbuf;
+}
+
+void MFMPacketIO::bufferCheck() {
+  const u32 used = newPHIndex - oldPHIndex;
+  API_ASSERT(used <= MFMPACKETIO_BUFFER_SIZE_BYTES - MFMPACKETIO_PREFIX_BYTES, E_BUG_INCONSISTENT_STATE);
+  API_ASSERT(newPacketLength <= MAX_PACKET_LENGTH, E_BUG_INCONSISTENT_STATE);
+
+  API_ASSERT(packetsReleased - slotsFreed <= packetsOut - slotsFreed, E_BUG_INCONSISTENT_STATE);
+  API_ASSERT(getSlotsInUse() <= MFMPACKETIO_DISPATCH_SLOTS, E_BUG_INCONSISTENT_STATE);
+
+  u32 idx = oldPHIndex;
+  for (u32 count = packetsIn - packetsReleased; count > 0; --count) {
+    const bool taken = count > packetsRemovable();
+    if (count == packetsRemovable())        /* The oldest packet not yet taken */
+      API_ASSERT(idx == nextPHIndex, E_BUG_INCONSISTENT_STATE);
+    API_ASSERT(newPHIndex - idx >= MFMPACKETIO_PREFIX_BYTES, E_BUG_INCONSISTENT_STATE);
+    const u32 ph = idx + PACKET_TRACE_BYTES;
+    const u32 len = at(ph+PacketHeader::LENGTH);
+    API_ASSERT(at(ph+PacketHeader::SOURCE) < MAX_FACE_INDEX, E_BUG_INCONSISTENT_STATE);
+    API_ASSERT(len <= MAX_PACKET_LENGTH, E_BUG_INCONSISTENT_STATE);
+    API_ASSERT(at(ph+PacketHeader::CURSOR) <= len, E_BUG_INCONSISTENT_STATE);
+    if (taken) {                /* Under dispatch, or done and waiting on an older one */
+      idx += MFMPACKETIO_PREFIX_BYTES + len;
+      continue;
+    }
+    API_ASSERT((at(ph+PacketHeader::FLAGS)&PK_CRC) == 0, E_BUG_INCONSISTENT_STATE);  /* Set only after dispatch */
+    idx += MFMPACKETIO_PREFIX_BYTES + len;
+    API_ASSERT(at(idx) == 0, E_BUG_INCONSISTENT_STATE);   /* Packet zero */
+  }
+  API_ASSERT(idx == newPHIndex, E_BUG_INCONSISTENT_STATE);
+}
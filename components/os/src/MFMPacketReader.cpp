@@ -0,0 +1,523 @@
+/*                                              -*- mode:C++; fill-column:100 -*-
+  MFMPacketReader.cpp - Validate-once cursor caching packet reader
+  Copyright (C) 2013 The Regents of the University of New Mexico.  All rights reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301
+  USA
+*/
+
+/* TO COMPILE FOR BENCHMARKING:
+  g++ -O2 -Wall -pedantic -Werror -Wundef -I../include -DHOST_MODE -DBENCH_PACKET_READER -o"./benchpacketreader" MFMPacketReader.cpp MFMPacket.cpp;./benchpacketreader
+*/
+
+#include <string.h>        /* For memcpy */
+#include "MFMPacketReader.h"
+#include "MFMAssert.h"
+
+#if defined(HOST_MODE) && defined(__SSE2__)
+#include <emmintrin.h>
+#define READ_ARRAY_SSE2 1
+#endif
+
+#if defined(HOST_MODE) && defined(__BYTE_ORDER__) && defined(__ORDER_LITTLE_ENDIAN__)
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define READ_ARRAY_SWAR64 1    /* Eight digits per u64, first digit in the low byte */
+#endif
+#endif
+
+#define REPEAT32(w) ((((u64) (w))<<32)|(w))   /* A u64 constant, without C++11 long long literals */
+
+PacketReader::PacketReader(u8 * p) : packet(p) {
+  API_ASSERT_VALID_PACKET(p);
+  const PacketHeader & ph = packetHeaderInternalUnsafeConst(p);
+  index = ph.f[PacketHeader::CURSOR];
+  limit = ph.f[PacketHeader::LENGTH];
+}
+
+bool PacketReader::read(int & result, int code, u32 maxLen) {
+  u32 maxPosition = index + maxLen;  // (Wraps exactly as the historical per-byte reader did)
+  if (maxPosition > limit) maxPosition = limit;
+
+  if (code <= BYTE && code >= BELONG)   // Handle BYTE, BESHORT, and BELONG
+    return readBigEndian(result, code, maxPosition);
+
+  // Here to read in base 2..36
+  API_ASSERT(code >= 2 && code <= 36, E_API_FORMAT_ARG);
+  return readDigits(result, maxPosition, VariableBase((u32) code));
+}
+
+bool PacketReader::readBigEndian(int & result, int code, u32 maxPosition) {
+  u32 i = index;
+  u32 num = 0;
+  for (int count = 1<<-code; count > 0; --count) {
+    if (i >= maxPosition) {
+      index = i;                        // Partial reads consume what they saw
+      return false;
+    }
+    num = (num<<8)|packet[i++];
+  }
+  index = i;
+  result = (int) num;
+  return true;
+}
+
+bool PacketReader::read(u64 & result) {
+  if (readLength() < 8) return false;
+  const u8 * p = packet+index;
+  u64 val = 0;
+  for (u32 i = 0; i < 8; ++i)
+    val = (val<<8)|p[i];
+  index += 8;
+  result = val;
+  return true;
+}
+
+bool PacketReader::read(u8 * buffer, u32 length) {
+  API_ASSERT_NONNULL(buffer);
+  if (readLength() < length)
+    return false;
+  memcpy((void*) buffer, (void*) &packet[index], length);
+  index += length;
+  return true;
+}
+
+/****************** Bulk number reading ******************/
+
+/* Where the spaces, and the digits of base 10 (or 16 if hex), are among packet bytes [base,limit) */
+class ByteClasses {
+public:
+  ByteClasses(const u8 * p, u32 base, u32 limit, bool hex) ;
+
+  /* The first position from i on that isn't a space; limit if none */
+  u32 nonSpace(u32 i) const ;
+
+  /* The first position from i on that isn't a digit; limit if none */
+  u32 nonDigit(u32 i) const ;
+
+#ifdef READ_ARRAY_SSE2
+  enum { WORDS = (MAX_PACKET_LENGTH+63)/64+1 };
+
+  /* Bit k%64 set for each byte base+k, k/64 == word, that begins a run of digits */
+  u64 runStarts(u32 word) const { return starts[word]; }
+#endif
+
+private:
+  const u8 * p;
+  u32 base;
+  u32 limit;
+  bool hex;
+#ifdef READ_ARRAY_SSE2
+  /* Bit k%64 of word k/64 is set if byte base+k is in the class; all zero from limit on */
+  u64 digits[WORDS];
+  u64 spaces[WORDS];
+  u64 starts[WORDS];
+
+  u32 firstClear(const u64 * bits, u32 i) const {
+    u32 k = i-base;
+    for (;;) {
+      const u64 w = ~bits[k>>6] >> (k&63);
+      if (w) return base+k+__builtin_ctzll(w);
+      k = (k|63)+1;
+    }
+  }
+#endif
+};
+
+#ifdef READ_ARRAY_SSE2
+
+/* Classify sixteen bytes at a time, once per readArray */
+ByteClasses::ByteClasses(const u8 * p, u32 base, u32 limit, bool hex)
+  : p(p), base(base), limit(limit), hex(hex)
+{
+  memset(digits, 0, sizeof(digits));
+  memset(spaces, 0, sizeof(spaces));
+  const __m128i zero = _mm_set1_epi8('0'), nine = _mm_set1_epi8(9), space = _mm_set1_epi8(' ');
+  const __m128i lower = _mm_set1_epi8(0x20), a = _mm_set1_epi8('a'), five = _mm_set1_epi8(5);
+  const u32 n = limit-base;
+  for (u32 k = 0; k < n; k += 16) {
+    __m128i x;
+    if (k+16 <= n) x = _mm_loadu_si128((const __m128i *) (p+base+k));
+    else {                      /* Don't read past the packet; nulls are in no class */
+      u8 tail[16];
+      memset(tail, 0, sizeof(tail));
+      memcpy(tail, p+base+k, n-k);
+      x = _mm_loadu_si128((const __m128i *) tail);
+    }
+    const __m128i d = _mm_sub_epi8(x, zero);
+    __m128i ok = _mm_cmpeq_epi8(_mm_min_epu8(d, nine), d);        /* d <= 9, unsigned */
+    if (hex) {
+      const __m128i l = _mm_sub_epi8(_mm_or_si128(x, lower), a);
+      ok = _mm_or_si128(ok, _mm_cmpeq_epi8(_mm_min_epu8(l, five), l));
+    }
+    digits[k>>6] |= (u64) (u32) _mm_movemask_epi8(ok) << (k&63);
+    spaces[k>>6] |= (u64) (u32) _mm_movemask_epi8(_mm_cmpeq_epi8(x, space)) << (k&63);
+  }
+  u64 carry = 0;
+  for (u32 w = 0; w < WORDS; ++w) {
+    starts[w] = digits[w] & ~((digits[w]<<1) | carry);
+    carry = digits[w]>>63;
+  }
+}
+
+u32 ByteClasses::nonSpace(u32 i) const { return firstClear(spaces, i); }
+
+u32 ByteClasses::nonDigit(u32 i) const { return firstClear(digits, i); }
+
+#else /* Byte at a time, unrolled */
+
+static inline bool isDigit(u8 ch, bool hex) {
+  return (u8) (ch-'0') <= 9 || (hex && (u8) ((ch|0x20)-'a') <= 5);
+}
+
+ByteClasses::ByteClasses(const u8 * p, u32 base, u32 limit, bool hex)
+  : p(p), base(base), limit(limit), hex(hex)
+{ }
+
+u32 ByteClasses::nonSpace(u32 i) const {
+  while (i < limit && p[i] == ' ') ++i;
+  return i;
+}
+
+u32 ByteClasses::nonDigit(u32 i) const {
+  for (; i+4 <= limit; i += 4) {
+    if (!isDigit(p[i], hex)) return i;
+    if (!isDigit(p[i+1], hex)) return i+1;
+    if (!isDigit(p[i+2], hex)) return i+2;
+    if (!isDigit(p[i+3], hex)) return i+3;
+  }
+  while (i < limit && isDigit(p[i], hex)) ++i;
+  return i;
+}
+
+#endif
+
+static inline u32 digitValue(u8 ch) {   /* Of a known base 10 or 16 digit */
+  return (ch&0xf) + 9*(ch>>6);
+}
+
+#ifdef READ_ARRAY_SWAR64
+/* The value of the first n (1..8) of the eight bytes loaded into w, all digits; junk in the rest */
+static inline u32 decimal8(u64 w, u32 n) {
+  w -= REPEAT32(0x30303030u);   /* Borrows only move up, into the junk */
+  w <<= 8*(8-n);                /* Junk out, leading zeros in */
+  w = (w*10 + (w>>8)) & REPEAT32(0x00ff00ffu);
+  w = (w*100 + (w>>16)) & REPEAT32(0x0000ffffu);
+  return (u32) (w*10000 + (w>>32));
+}
+#endif
+
+/* The value of the n digits at d, modulo 2^32, as the one-digit-at-a-time loop computes it.  Whole
+   words may be loaded from d as long as they end by 'end'. */
+static u32 decimalValue(const u8 * d, u32 n, const u8 * end) {
+  u32 num = 0;
+#ifdef READ_ARRAY_SWAR64
+  /* The leading one to eight digits, then whole chunks, so most numbers take one step */
+  const u32 head = ((n-1)&7)+1;
+  u64 w;
+  if (d+8 <= end) {
+    memcpy(&w, d, 8);
+    num = decimal8(w, head);
+  } else
+    for (u32 k = 0; k < head; ++k) num = num*10 + (d[k]-'0');
+  d += head;
+  n -= head;
+  for (; n > 0; d += 8, n -= 8) {
+    memcpy(&w, d, 8);
+    num = num*100000000u + decimal8(w, 8);
+  }
+#else /* Four digits per u32, assembled bytewise so it works either endian */
+  (void) end;
+  for (; n >= 4; d += 4, n -= 4) {
+    u32 w = d[0] | (d[1]<<8) | (d[2]<<16) | ((u32) d[3]<<24);
+    w -= 0x30303030u;
+    w = (w*10 + (w>>8)) & 0x00ff00ffu;
+    num = num*10000u + ((w*100 + (w>>16)) & 0xffffu);
+  }
+  while (n--) num = num*10 + (*d++ - '0');
+#endif
+  return num;
+}
+
+/* As decimalValue, for hex.  Only the last eight digits survive modulo 2^32. */
+static u32 hexValue(const u8 * d, u32 n, const u8 * end) {
+  if (n > 8) {
+    d += n-8;
+    n = 8;
+  }
+#ifdef READ_ARRAY_SWAR64
+  if (d+8 <= end) {
+    u64 w;
+    memcpy(&w, d, 8);
+    w = (w & REPEAT32(0x0f0f0f0fu)) + 9*((w>>6) & REPEAT32(0x01010101u));  /* Nibble values */
+    w <<= 8*(8-n);
+    w = ((w & REPEAT32(0x000f000fu))<<4) | ((w>>8) & REPEAT32(0x000f000fu));
+    w = ((w & REPEAT32(0x000000ffu))<<8) | ((w>>16) & REPEAT32(0x000000ffu));
+    return (u32) (((w & 0xffff)<<16) | ((w>>32) & 0xffff));
+  }
+#else
+  (void) end;
+#endif
+  u32 num = 0;
+  while (n--) num = (num<<4) | digitValue(*d++);
+  return num;
+}
+
+u32 PacketReader::readArray(int * results, u32 maxCount, int code, u32 maxLen) {
+  API_ASSERT(results || !maxCount, E_API_NULL_POINTER);
+  API_ASSERT((code <= BYTE && code >= BELONG) || (code >= 2 && code <= 36), E_API_FORMAT_ARG);
+
+  u32 count = 0;
+  if (code != DEC && code != HEX) {
+    while (count < maxCount && read(results[count], code, maxLen)) ++count;
+    return count;
+  }
+
+  /* Work in locals: stores through results could otherwise alias index and limit */
+  const bool hex = code == HEX;
+  const u8 * p = packet;
+  const u32 end = limit;
+  const ByteClasses classes(p, index, end, hex);
+  u32 at = index;
+
+#ifdef READ_ARRAY_SSE2
+  /* When maxLen can't cut any number short, take the digit runs straight from the classes, so
+     finding each number doesn't wait on the one before.  At anything but spaces and a sign
+     between runs, finish with the general loop below. */
+  if (maxLen >= end && maxLen <= ~0u - end) {
+    const u32 base = at;
+    bool clean = true;
+    for (u32 word = 0; clean && word < ByteClasses::WORDS && count < maxCount; ++word) {
+      for (u64 w = classes.runStarts(word); w && count < maxCount; w &= w-1) {
+        const u32 i = base + word*64 + __builtin_ctzll(w);
+        const u32 gap = classes.nonSpace(at);
+        if (gap != i && (gap+1 != i || (p[gap] != '-' && p[gap] != '+'))) {
+          clean = false;
+          break;
+        }
+        const u32 stop = classes.nonDigit(i);
+        const u32 num = hex ? hexValue(p+i, stop-i, p+end) : decimalValue(p+i, stop-i, p+end);
+        results[count++] = (int) (gap != i && p[gap] == '-' ? 0u-num : num);
+        at = stop;
+      }
+    }
+  }
+#endif
+
+  for (; count < maxCount; ++count) {
+    u32 maxPosition = at + maxLen;      // (Wraps exactly as read() does)
+    if (maxPosition > end) maxPosition = end;
+
+    u32 i = at;
+    if (i >= maxPosition) break;
+    i = classes.nonSpace(i);    // Skip leading spaces, as readDigits does
+    if (i >= maxPosition) {
+      at = maxPosition;
+      break;
+    }
+
+    const u8 ch = p[i++];
+    const bool negative = ch == '-';
+    if (negative || ch == '+') {
+      if (i >= maxPosition) {
+        at = i;
+        break;
+      }
+    } else
+      --i;                      // ch is the first digit, if any
+
+    u32 stop = classes.nonDigit(i);
+    if (stop > maxPosition) stop = maxPosition;
+    if (stop == i) {
+      at = i+1;                 // readDigits consumes the offending byte
+      break;
+    }
+    const u32 num = hex ? hexValue(p+i, stop-i, p+end) : decimalValue(p+i, stop-i, p+end);
+    at = stop;
+    results[count] = (int) (negative ? 0u-num : num);
+  }
+  index = at;
+  return count;
+}
+
+bool PacketReader::readPacket(u8 *& subp) {
+  u32 prl = readLength();
+  if (prl < 4+1) return false;  // 4 for header before, 1 for null after
+  u8 * possible = packet+index+4;
+  if (!validPacket(possible)) return false;
+  u32 len = packetHeaderInternalUnsafeConst(possible).f[PacketHeader::LENGTH];
+  if (prl-4-1 < len) return false;
+  subp = possible;
+  index += len+4+1;
+  return true;
+}
+
+bool PacketReader::readCheckByte() {
+  if (readLength() != 1 || !packetCheckByteValid(packet))
+    return false;
+  ++index;
+  return true;
+}
+
+#ifdef BENCH_PACKET_READER
+
+#include <stdio.h>
+#include <stdlib.h> // for exit
+#include <time.h>   // for clock_gettime
+
+void _apiError_(u32 code,const char * file, int lineno) {
+  fprintf(stderr,"APIERROR %d %s:%d\n",code,file,lineno);
+  exit(code);
+}
+
+/* The packetRead(int) implementation as of 0.9.20, retained here for comparison: Every byte goes
+   through packetCursor(), packetReadEOF(), and packetReread(), each revalidating the header. */
+static bool legacyReadByte(u8 * packet, u8 & result, u32 maxPosition) {
+  u32 position = packetCursor(packet);
+  if (position >= maxPosition || packetReadEOF(packet))
+    return false;
+  result = packet[position];
+  packetReread(packet,position+1);
+  return true;
+}
+
+static bool legacyRead(u8 * packet, int & result, int code, u32 maxLen = MAX_PACKET_LENGTH) {
+  API_ASSERT_VALID_PACKET(packet);
+  u32 maxPosition = packetCursor(packet) + maxLen;
+  u8 ch;
+  do {
+    if (!legacyReadByte(packet,ch,maxPosition))
+      return false;
+  } while (ch==' ');
+  bool negative;
+  if ((negative = ch=='-') || ch=='+') {
+    if (!legacyReadByte(packet,ch,maxPosition))
+      return false;
+  }
+  int num = 0;
+  bool readSome = false;
+  do {
+    bool valid = true;
+    u8 val = 0;
+    if (ch >= '0' && ch <= '9') val = ch-'0';
+    else {
+      ch |= 0x20;
+      if (ch >= 'a' && ch <= 'z') val = ch-('a'-10);
+      else
+        valid = false;
+    }
+    if (valid && val < code) {
+      num = num*code+val;
+      readSome = true;
+    } else if (readSome) {
+      packetReread(packet,packetCursor(packet)-1);
+      break;
+    } else
+      return false;
+  } while (legacyReadByte(packet,ch,maxPosition));
+  result = negative?-num:num;
+  return true;
+}
+
+static double nowSeconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+static u8 benchBuffer[4+MAX_PACKET_LENGTH+1];
+
+static u8 * makeBenchPacket(u32 & numbers) {
+  u8 * packet = makePacket(benchBuffer, sizeof(benchBuffer), 0,
+                           "3902831 7000 7 -12 65535 2147483647 0 1 22 333 4444 55555 666666 "
+                           "7777777 88888888 999999999 3 14 159 2653 58979 323846 2643383 "
+                           "27950288 419716939 9 37 510 5820 97494 459230 7816406 28620899 "
+                           "862803482 5 34 211 7067 98214");
+  PacketReader r(packet);
+  int val;
+  for (numbers = 0; r.read(val, DEC); ++numbers) ;
+  return packet;
+}
+
+int main() {
+  u32 numbers;
+  u8 * packet = makeBenchPacket(numbers);
+  const u32 len = packetLength(packet);
+  const u32 REPS = 200000;
+  int val;
+  u32 sink = 0;
+
+  double start = nowSeconds();
+  for (u32 rep = 0; rep < REPS; ++rep) {
+    packetReread(packet);
+    while (legacyRead(packet, val, DEC)) sink += val;
+  }
+  double legacy = nowSeconds() - start;
+
+  start = nowSeconds();
+  for (u32 rep = 0; rep < REPS; ++rep) {
+    packetReread(packet);
+    while (packetRead(packet, val, DEC)) sink += val;
+  }
+  double wrapped = nowSeconds() - start;
+
+  start = nowSeconds();
+  for (u32 rep = 0; rep < REPS; ++rep) {
+    PacketReader r(packet);
+    r.reread();
+    while (r.read(val, DEC)) sink += val;
+    r.commit();
+  }
+  double reader = nowSeconds() - start;
+
+  int vals[64];
+  start = nowSeconds();
+  for (u32 rep = 0; rep < REPS; ++rep) {
+    packetReread(packet);
+    const u32 count = packetReadArray(packet, vals, 64, DEC);
+    for (u32 i = 0; i < count; ++i) sink += vals[i];
+  }
+  double array = nowSeconds() - start;
+
+  const double nums = (double) numbers * REPS, bytes = (double) len * REPS;
+  printf("%u numbers in %u bytes per packet, %u reps (sink %u)\n", numbers, len, REPS, sink);
+  printf("%-24s %8.2f ns/number %8.2f MB/s\n", "legacy per-byte", legacy*1e9/nums, bytes/legacy/1e6);
+  printf("%-24s %8.2f ns/number %8.2f MB/s\n", "packetRead wrapper", wrapped*1e9/nums, bytes/wrapped/1e6);
+  printf("%-24s %8.2f ns/number %8.2f MB/s\n", "PacketReader", reader*1e9/nums, bytes/reader/1e6);
+  printf("%-24s %8.2f ns/number %8.2f MB/s\n", "packetReadArray", array*1e9/nums, bytes/array/1e6);
+
+  /* Where the bulk reader pays off most: long numbers */
+  packet = makePacket(benchBuffer, sizeof(benchBuffer), 0,
+                      "12345678 87654321 11111111 22222222 33333333 44444444 55555555 66666666 "
+                      "77777777 88888888 99999999 12121212 34343434 56565656 78787878 90909090");
+  const u32 longs = 16;
+  start = nowSeconds();
+  for (u32 rep = 0; rep < REPS; ++rep) {
+    PacketReader r(packet);
+    while (r.read(val, DEC)) sink += val;
+  }
+  reader = nowSeconds() - start;
+  start = nowSeconds();
+  for (u32 rep = 0; rep < REPS; ++rep) {
+    PacketReader r(packet);
+    const u32 count = r.readArray(vals, 64, DEC);
+    for (u32 i = 0; i < count; ++i) sink += vals[i];
+  }
+  array = nowSeconds() - start;
+  printf("%-24s %8.2f ns/number (8 digit numbers)\n", "PacketReader", reader*1e9/REPS/longs);
+  printf("%-24s %8.2f ns/number (8 digit numbers)\n", "packetReadArray", array*1e9/REPS/longs);
+  return 0;
+}
+
+#endif /* BENCH_PACKET_READER */
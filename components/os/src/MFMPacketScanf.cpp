@@ -0,0 +1,195 @@
+/*                                              -*- mode:C++; fill-column:100 -*-
+  MFMPacketScanf.cpp - Packet scanning with formats compiled at compile time
+  Copyright (C) 2013 The Regents of the University of New Mexico.  All rights reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301
+  USA
+*/
+
+/* packetScanf is entirely templates, in MFMPacketScanf.h; this file holds only its tests and
+   benchmark.
+
+   TO COMPILE FOR TESTING:
+  g++ -O0 -g3 -Wall -pedantic -Werror -Wundef -I../include -DHOST_MODE -DTEST_PACKET_SCANF -o"./testpacketscanf" MFMPacketScanf.cpp MFMPacketReader.cpp MFMPacket.cpp;./testpacketscanf
+
+   TO COMPILE FOR BENCHMARKING:
+  g++ -O2 -Wall -pedantic -Werror -Wundef -I../include -DHOST_MODE -DBENCH_PACKET_SCANF -o"./benchpacketscanf" MFMPacketScanf.cpp MFMPacketReader.cpp MFMPacket.cpp;./benchpacketscanf
+*/
+
+#include "MFMPacketScanf.h"
+
+#if defined(TEST_PACKET_SCANF) || defined(BENCH_PACKET_SCANF)
+
+#include <stdio.h>
+#include <stdlib.h> // for exit
+#include <string.h> // for strlen, memcpy
+
+void _apiError_(u32 code,const char * file, int lineno) {
+  fprintf(stderr,"APIERROR %d %s:%d\n",code,file,lineno);
+  exit(code);
+}
+
+static u8 scanBuffer[4+MAX_PACKET_LENGTH+1];
+
+/* Make a packet of 'text', followed by its check byte if 'checked' */
+static u8 * scanPacket(const char * text, bool checked = false) {
+  u8 data[MAX_PACKET_LENGTH];
+  u32 len = strlen(text);
+  memcpy(data, text, len);
+  if (checked) {
+    u8 checkByte = CHECK_BYTE_INIT_VALUE;
+    for (u32 i = 0; i < len; ++i)
+      CHECK_BYTE_UPDATE(checkByte,data[i]);
+    data[len++] = checkByte;
+  }
+  return makePacket(scanBuffer, sizeof(scanBuffer), 0, data, len);
+}
+
+#endif
+
+#ifdef TEST_PACKET_SCANF
+
+static void die(const char * file, int line, const char * msg) {
+  fprintf(stderr,"%s:%d: %s\n",file, line, msg);
+  exit(100);
+}
+
+#define TEST(condition) do { if (!(condition)) die(__FILE__,__LINE__,#condition); } while (0)
+
+static void test1() {           /* The documented usage */
+  u32 serialNumber, val;
+  u8 * packet = scanPacket("x123:0x1f");
+  TEST((packetScanf<ScanFormat<'x','%','d',':'> >(packet,&serialNumber)) == 3);
+  TEST(serialNumber == 123);
+  u32 index = packetCursor(packet);
+  TEST(index == 5);
+  TEST((packetScanf<ScanFormat<'0','x','%','x','\n'> >(packet,&val)) == 4);
+  TEST(val == 0x1f);
+  TEST(packetReadEOF(packet));
+
+  packet = scanPacket("x9:77");
+  TEST((packetScanf<ScanFormat<'x','%','d',':'> >(packet,&serialNumber)) == 3);
+  index = packetCursor(packet);
+  TEST((packetScanf<ScanFormat<'0','x','%','x','\n'> >(packet,&val)) == 0);
+  TEST(packetCursor(packet) == index);   // Failed literal consumed nothing
+  TEST((packetScanf<ScanFormat<'%','d','\n'> >(packet,&val)) == 2);
+  TEST(val == 77);
+}
+
+static void test2() {           /* Each conversion agrees with the packetRead chain */
+  int a, b, c, d;
+  u32 u;
+  u8 * packet = scanPacket("-42 ff 101 zz %17");
+  TEST((packetScanf<ScanFormat<'%','d','%','x','%','b','%','t',' ','%','%','1','7','\n'> >
+        (packet,&a,&b,&c,&u)) == 9);
+  TEST(a == -42 && b == 0xff && c == 5 && u == 35*36+35);
+
+  u8 * packet2 = scanPacket("-42 ff 101 zz");
+  int e, f, g, h;
+  TEST(packetRead(packet2,e,DEC) && packetRead(packet2,f,HEX) &&
+       packetRead(packet2,g,BIN) && packetRead(packet2,h,B36));
+  packet = scanPacket("-42 ff 101 zz");
+  TEST((packetScanf<ScanFormat<'%','d','%','x','%','b','%','t','\n'> >(packet,&a,&b,&c,&d)) == 5);
+  TEST(a == e && b == f && c == g && d == h);
+}
+
+static void test3() {           /* Binary codes, end of packet, and check bytes */
+  int c, h, l;
+  u8 * packet = scanPacket("A\001\002\003\004\005\006", true);
+  TEST((packetScanf<ScanFormat<'%','c','%','h','%','l','%','\n','\n'> >(packet,&c,&h,&l)) == 5);
+  TEST(c == 'A' && h == 0x0102 && l == 0x03040506);
+
+  packet = scanPacket("A\001\002\003\004\005\006", false);   // No check byte
+  TEST((packetScanf<ScanFormat<'%','c','%','h','%','l','%','\n','\n'> >(packet,&c,&h,&l)) == 3);
+
+  packet = scanPacket("12 34");
+  TEST((packetScanf<ScanFormat<'%','d','\n'> >(packet,&c)) == 1);      // Not at end
+  TEST((packetScanf<ScanFormat<'%','d','\n'> >(packet,&c)) == 2);
+  TEST(c == 34);
+  TEST((packetScanf<ScanFormat<'%','d'> >(packet,&c)) == 0);           // Nothing left
+}
+
+static void test4() {           /* Matches stop at the first failure */
+  int a = 0, b = 0;
+  u8 * packet = scanPacket("7,x");
+  TEST((packetScanf<ScanFormat<'%','d',',','%','d'> >(packet,&a,&b)) == 2);
+  TEST(a == 7 && b == 0);
+  TEST(packetReadEOF(packet));   // As with packetRead, the failed %d consumed the 'x'
+  packetReread(packet,2);
+  TEST((packetScanf<ScanFormat<'q'> >(packet)) == 0);
+  TEST((packetScanf<ScanFormat<'x','\n'> >(packet)) == 2);
+}
+
+int main() {
+  test1();
+  test2();
+  test3();
+  test4();
+  return 0;
+}
+
+#endif /* TEST_PACKET_SCANF */
+
+#ifdef BENCH_PACKET_SCANF
+
+#include <time.h>   // for clock_gettime
+
+static double nowSeconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+/* A typical hand-written handler body: 'm', three decimals, a space and a hex, and a check byte */
+static bool handChain(u8 * packet, int & a, int & b, int & c, int & d) {
+  u8 ch;
+  if (!packetRead(packet,&ch,1) || ch != 'm') return false;
+  if (!packetRead(packet,a,DEC)) return false;
+  if (!packetRead(packet,b,DEC)) return false;
+  if (!packetRead(packet,c,DEC)) return false;
+  if (!packetRead(packet,&ch,1) || ch != ' ') return false;
+  if (!packetRead(packet,d,HEX)) return false;
+  return packetReadCheckByte(packet);
+}
+
+typedef ScanFormat<'m','%','d','%','d','%','d',' ','%','x','%','\n'> BenchFormat;
+
+int main() {
+  u8 * packet = scanPacket("m12 -3456 789012 7fff", true);
+  const u32 REPS = 2000000;
+  int a, b, c, d;
+  u32 sink = 0;
+
+  double start = nowSeconds();
+  for (u32 rep = 0; rep < REPS; ++rep) {
+    packetReread(packet);
+    if (handChain(packet,a,b,c,d)) sink += a+b+c+d;
+  }
+  const double hand = nowSeconds()-start;
+
+  start = nowSeconds();
+  for (u32 rep = 0; rep < REPS; ++rep) {
+    packetReread(packet);
+    if (packetScanf<BenchFormat>(packet,&a,&b,&c,&d) == 7) sink += a+b+c+d;
+  }
+  const double scanned = nowSeconds()-start;
+
+  printf("%u reps of \"m12 -3456 789012 7fff%%\\n\" (sink %u)\n", REPS, sink);
+  printf("%-24s %8.1f ns/packet\n", "packetRead chain", hand*1e9/REPS);
+  printf("%-24s %8.1f ns/packet\n", "packetScanf", scanned*1e9/REPS);
+  return 0;
+}
+
+#endif /* BENCH_PACKET_SCANF */
@@ -0,0 +1,286 @@
+/*                                              -*- mode:C++; fill-column:100 -*-
+  MFMPacketTrace.cpp - Optional per-packet timestamps and latency histograms
+  Copyright (C) 2013 The Regents of the University of New Mexico.  All rights reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301
+  USA
+*/
+
+/* TO COMPILE FOR TESTING:
+  g++ -O0 -g3 -Wall -pedantic -Werror -Wundef -I../include -DHOST_MODE -DMFM_PACKET_TRACE -DTEST_PACKET_TRACE -o"./testpackettrace" MFMPacketTrace.cpp MFMPacketIO.cpp MFMPacketWriter.cpp MFMFraming.cpp MFMPacket.cpp MFMPacketReader.cpp;./testpackettrace
+
+   TO COMPILE FOR BENCHMARKING (with and without -DMFM_PACKET_TRACE, to see what tracing costs):
+  g++ -O2 -Wall -pedantic -Werror -Wundef -I../include -DHOST_MODE -DBENCH_PACKET_TRACE -o"./benchpackettrace" MFMPacketTrace.cpp MFMPacketIO.cpp MFMFraming.cpp MFMPacket.cpp MFMPacketReader.cpp;./benchpackettrace
+*/
+
+#include "MFMPacketTrace.h"
+
+void PacketLatency::reset() {
+  for (u32 i = 0; i < TRACE_INTERVAL_COUNT; ++i) {
+    for (u32 b = 0; b < PACKET_LATENCY_BINS; ++b)
+      bins[i][b] = 0;
+    counts[i] = maxima[i] = 0;
+  }
+}
+
+u32 PacketLatency::binOf(u32 ticks) {
+  u32 bin = 0;
+  while (ticks > 1 && bin < PACKET_LATENCY_BINS-1) {
+    ticks >>= 1;
+    ++bin;
+  }
+  return bin;
+}
+
+void PacketLatency::add(u32 interval, u32 ticks) {
+  if (interval >= TRACE_INTERVAL_COUNT) return;
+  ++bins[interval][binOf(ticks)];
+  ++counts[interval];
+  if (ticks > maxima[interval]) maxima[interval] = ticks;
+}
+
+void PacketLatency::record(const PacketTrace & trace, TraceStamp done) {
+  /* Stamps wrap modulo 2^32, so the unsigned differences are right across a wrap */
+  if (trace.has(TRACE_STARTED) && trace.has(TRACE_RECEIVED))
+    add(TRACE_ARRIVING, trace.get(TRACE_RECEIVED) - trace.get(TRACE_STARTED));
+  if (trace.has(TRACE_RECEIVED) && trace.has(TRACE_DISPATCHED))
+    add(TRACE_WAITING, trace.get(TRACE_DISPATCHED) - trace.get(TRACE_RECEIVED));
+  if (trace.has(TRACE_DISPATCHED))
+    add(TRACE_HANDLING, done - trace.get(TRACE_DISPATCHED));
+}
+
+u32 PacketLatency::getPercentile(u32 interval, u32 percent) const {
+  const u32 total = getCount(interval);
+  if (total == 0) return 0;
+  if (percent > 100) percent = 100;
+  const u32 need = (u32) (((u64) total*percent+99)/100);    /* Round up: at least percent% */
+  u32 seen = 0;
+  for (u32 b = 0; b < PACKET_LATENCY_BINS-1; ++b) {
+    seen += bins[interval][b];
+    if (seen >= need && seen > 0) {
+      const u32 top = (2u<<b)-1;                            /* The most bin b holds */
+      return top < maxima[interval] ? top : maxima[interval];
+    }
+  }
+  return maxima[interval];
+}
+
+#if defined(TEST_PACKET_TRACE) || defined(BENCH_PACKET_TRACE)
+
+#include <stdio.h>
+#include <stdlib.h> // for exit
+#include "MFMPacketIO.h"
+
+u32 reflexLibraryFlags = 0;
+
+void _apiError_(u32 code,const char * file, int lineno) {
+  fprintf(stderr,"APIERROR %d %s:%d\n",code,file,lineno);
+  exit(code);
+}
+
+#endif
+
+#ifdef TEST_PACKET_TRACE
+
+#ifndef MFM_PACKET_TRACE
+#error "TEST_PACKET_TRACE requires -DMFM_PACKET_TRACE"
+#endif
+
+#include <string.h> // for memset
+#include "MFMPacketWriter.h"
+
+static void die(const char * file, int line, const char * msg) {
+  fprintf(stderr,"%s:%d: %s\n",file, line, msg);
+  exit(100);
+}
+
+#define TEST(condition) do { if (!(condition)) die(__FILE__,__LINE__,#condition); } while (0)
+
+static void test1() {           /* Histogram bins and percentiles */
+  TEST(PacketLatency::binOf(0) == 0 && PacketLatency::binOf(1) == 0);
+  TEST(PacketLatency::binOf(2) == 1 && PacketLatency::binOf(3) == 1);
+  TEST(PacketLatency::binOf(1000) == 9);
+  TEST(PacketLatency::binOf(~0u) == PACKET_LATENCY_BINS-1);
+
+  PacketLatency pl;
+  TEST(pl.getPercentile(TRACE_WAITING, 50) == 0);
+  for (u32 i = 0; i < 90; ++i) pl.add(TRACE_WAITING, 5);
+  for (u32 i = 0; i < 10; ++i) pl.add(TRACE_WAITING, 3000);
+  TEST(pl.getCount(TRACE_WAITING) == 100 && pl.getCount(TRACE_ARRIVING) == 0);
+  TEST(pl.getBin(TRACE_WAITING, 2) == 90 && pl.getBin(TRACE_WAITING, 11) == 10);
+  TEST(pl.getMax(TRACE_WAITING) == 3000);
+  TEST(pl.getPercentile(TRACE_WAITING, 50) == 7);
+  TEST(pl.getPercentile(TRACE_WAITING, 90) == 7);
+  TEST(pl.getPercentile(TRACE_WAITING, 91) == 3000);          /* Capped by the max */
+  pl.add(TRACE_INTERVAL_COUNT, 1);                            /* Ignored */
+
+  PacketTrace t;                /* Only intervals stamped at both ends count */
+  memset(&t, 0, sizeof(t));
+  t.set(TRACE_RECEIVED, 0xfffffff0u);
+  t.set(TRACE_DISPATCHED, 0x10);                              /* Across the wrap */
+  TEST(t.has(TRACE_RECEIVED) && !t.has(TRACE_STARTED) && t.get(TRACE_STARTED) == 0);
+  pl.reset();
+  pl.record(t, 0x30);
+  TEST(pl.getCount(TRACE_ARRIVING) == 0);
+  TEST(pl.getCount(TRACE_WAITING) == 1 && pl.getMax(TRACE_WAITING) == 0x20);
+  TEST(pl.getCount(TRACE_HANDLING) == 1 && pl.getMax(TRACE_HANDLING) == 0x20);
+}
+
+static u8 ioBuffer[MFMPACKETIO_BUFFER_SIZE_BYTES];
+static u32 dispatched;
+static TraceStamp lastDispatched;
+
+static void checkTrace(u8 * packet, u8 source) {
+  TEST(validPacket(packet));    /* The header is where it always was */
+  TEST(packetSource(packet) == source && packetCursor(packet) == 0);
+  TEST(packet[packetLength(packet)] == 0);
+  const u8 expect = (u8) ('a' + dispatched%26);
+  for (u32 i = 0; i < packetLength(packet); ++i) TEST(packet[i] == expect);
+
+  const PacketTrace & t = packetTraceInternalUnsafeConst(packet);
+  TEST(t.has(TRACE_STARTED) && t.has(TRACE_RECEIVED) && t.has(TRACE_DISPATCHED));
+  TEST(t.get(TRACE_RECEIVED) - t.get(TRACE_STARTED) < 0x80000000u);
+  TEST(t.get(TRACE_DISPATCHED) - t.get(TRACE_RECEIVED) < 0x80000000u);
+  TEST(t.get(TRACE_DISPATCHED) - lastDispatched < 0x80000000u);
+  lastDispatched = t.get(TRACE_DISPATCHED);
+  ++dispatched;
+}
+
+static void test2() {           /* Traces survive the ring, wrapping, and the bulk paths */
+  MFMPacketIO pio(ioBuffer);
+  pio.forceSync();
+  dispatched = 0;
+  lastDispatched = traceNow();
+  u32 sent = 0;
+  for (u32 round = 0; round < 200; ++round) {
+    for (u32 k = 0; k < 3; ++k, ++sent) {
+      const u8 ch = (u8) ('a' + sent%26);
+      const u32 len = (round*7+k*31)%120;
+      if (k == 0) {             /* A byte at a time */
+        for (u32 i = 0; i < len; ++i) pio.putByte(ch);
+        pio.terpri();
+      } else if (k == 1) {      /* In bulk */
+        u8 wire[130];
+        memset(wire, ch, len);
+        wire[len] = PFSC_END;
+        pio.storeBytes(wire, len+1);
+      } else {                  /* Written in place */
+        PacketWriter w(pio);
+        for (u32 i = 0; i < len; ++i) TEST(w.put(ch));
+        TEST(w.commit());
+      }
+    }
+    pio.bufferCheck();
+    while (pio.dispatchPacket(WEST, checkTrace)) { }
+  }
+  TEST(dispatched == sent);
+  TEST(pio.getPacketsWrapped() > 0 && pio.getPacketsDropped() == 0);
+
+  const PacketLatency & pl = pio.getLatency();
+  for (u32 i = 0; i < TRACE_INTERVAL_COUNT; ++i) {
+    TEST(pl.getCount(i) == sent);
+    u32 sum = 0;
+    for (u32 b = 0; b < PACKET_LATENCY_BINS; ++b) sum += pl.getBin(i, b);
+    TEST(sum == sent);
+  }
+  pio.resetLatency();
+  TEST(pio.getLatency().getCount(TRACE_WAITING) == 0);
+}
+
+static void test3() {           /* Copied out packets keep their trace */
+  MFMPacketIO pio(ioBuffer);
+  pio.forceSync();
+  PacketBuffer pb;
+  for (u32 round = 0; round < 100; ++round) {
+    const TraceStamp before = traceNow();
+    for (u32 i = 0; i < 77; ++i) pio.putByte('x');
+    pio.terpri();
+    u8 * packet = pio.copyPacketAndDiscard(pb);
+    TEST(packet == pb.bbuf && validPacket(packet) && packetLength(packet) == 77);
+    TEST(packet[77] == 0 && pb.t.zero == 0);
+    const PacketTrace & t = packetTraceInternalUnsafeConst(packet);
+    TEST(t.has(TRACE_STARTED) && t.has(TRACE_RECEIVED) && !t.has(TRACE_DISPATCHED));
+    TEST(t.get(TRACE_STARTED) - before < 0x80000000u);
+  }
+  pio.putByte('y');             /* And a trace's zero byte still ends the packet before */
+  pio.terpri();
+  pio.terpri();                 /* An empty packet */
+  pio.bufferCheck();
+  TEST(packetLength(pio.copyPacketAndDiscard(pb)) == 1 && pb.bbuf[1] == 0);
+  TEST(packetLength(pio.copyPacketAndDiscard(pb)) == 0);
+  const PacketTrace & t = pb.t;
+  TEST(t.get(TRACE_STARTED) == t.get(TRACE_RECEIVED));
+}
+
+int main() {
+  test1();
+  test2();
+  test3();
+  return 0;
+}
+
+#endif /* TEST_PACKET_TRACE */
+
+#ifdef BENCH_PACKET_TRACE
+
+#include <string.h> // for memset
+#include <time.h>   // for clock_gettime
+
+static double nowSeconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+static u8 ioBuffer[MFMPACKETIO_BUFFER_SIZE_BYTES];
+static u32 sink;
+
+static void consume(u8 * packet, u8) {
+  sink += packetLength(packet);
+}
+
+int main() {
+  MFMPacketIO pio(ioBuffer);
+  pio.forceSync();
+  u8 wire[4*(32+1)];            /* Four short packets per burst */
+  memset(wire, 's', sizeof(wire));
+  for (u32 k = 1; k <= 4; ++k) wire[k*33-1] = PFSC_END;
+
+  const u32 REPS = 1000000;
+  const double start = nowSeconds();
+  for (u32 rep = 0; rep < REPS; ++rep) {
+    pio.storeBytes(wire, sizeof(wire));
+    while (pio.dispatchPacket(EAST, consume)) { }
+  }
+  const double secs = nowSeconds()-start;
+
+#ifdef MFM_PACKET_TRACE
+  const char * mode = "traced";
+#else
+  const char * mode = "untraced";
+#endif
+  printf("%s: %.1f ns per 32 byte packet received and dispatched (sink %u)\n",
+         mode, secs*1e9/(4.0*REPS), sink);
+#ifdef MFM_PACKET_TRACE
+  const PacketLatency & pl = pio.getLatency();
+  const char * names[] = { "arriving", "waiting", "handling" };
+  for (u32 i = 0; i < TRACE_INTERVAL_COUNT; ++i)
+    printf("  %-9s median <= %u, 99%% <= %u, max %u ticks\n", names[i],
+           pl.getPercentile(i, 50), pl.getPercentile(i, 99), pl.getMax(i));
+#endif
+  return 0;
+}
+
+#endif /* BENCH_PACKET_TRACE */
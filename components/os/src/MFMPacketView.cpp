@@ -0,0 +1,375 @@
+/*                                              -*- mode:C++; fill-column:100 -*-
+  MFMPacketView.cpp - Non-owning views of packet contents, and packets of packets
+  Copyright (C) 2013 The Regents of the University of New Mexico.  All rights reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301
+  USA
+*/
+
+/* TO COMPILE FOR TESTING:
+  g++ -O0 -g3 -Wall -pedantic -Werror -Wundef -I../include -DHOST_MODE -DTEST_PACKET_VIEW -o"./testpacketview" MFMPacketView.cpp MFMPacketWriter.cpp MFMPacketIO.cpp MFMFraming.cpp MFMPacketReader.cpp MFMPacket.cpp;./testpacketview
+
+   TO COMPILE FOR BENCHMARKING:
+  g++ -O2 -Wall -pedantic -Werror -Wundef -I../include -DHOST_MODE -DBENCH_PACKET_VIEW -o"./benchpacketview" MFMPacketView.cpp MFMPacketWriter.cpp MFMPacketIO.cpp MFMFraming.cpp MFMPacketReader.cpp MFMPacket.cpp;./benchpacketview
+*/
+
+#include "MFMPacketView.h"
+#include "MFMPacketWriter.h"
+#include "MFMAssert.h"
+
+PacketView::PacketView(u8 * packet)
+  : data(packet)
+  , length(packetLength(packet))
+{ }
+
+PacketView PacketView::unread(u8 * packet) {
+  const u32 cursor = packetCursor(packet);
+  return PacketView(packet+cursor, packetLength(packet)-cursor);
+}
+
+bool PacketView::startsWith(const char * prefix) const {
+  API_ASSERT_NONNULL(prefix);
+  u32 plen;
+  for (plen = 0; prefix[plen]; ++plen)
+    if (plen >= length) return false;
+  return packetBytesEqual(data, (const u8 *) prefix, plen);
+}
+
+void PacketView::iterator::settle() {
+  const u32 left = end-at;
+  if (left < SUBPACKET_OVERHEAD_BYTES) {
+    at = end;
+    return;
+  }
+  /* Just what PacketReader::readPacket accepts */
+  const u8 * sub = at+sizeof(PacketHeader);
+  if (!validPacket(sub) ||
+      packetHeaderInternalUnsafeConst(sub).f[PacketHeader::LENGTH] > left-SUBPACKET_OVERHEAD_BYTES)
+    at = end;
+}
+
+PacketView::iterator & PacketView::iterator::operator++() {
+  API_ASSERT(at != end, E_API_ILLEGAL_STATE);
+  at += packetHeaderInternalUnsafeConst(at+sizeof(PacketHeader)).f[PacketHeader::LENGTH] +
+    SUBPACKET_OVERHEAD_BYTES;
+  settle();
+  return *this;
+}
+
+bool PacketView::isContainer() const {
+  iterator i = begin();
+  const iterator e = end();
+  u8 * next = data;
+  for (; i != e; ++i)
+    next = *i + packetLength(*i) + 1;
+  return next == data+length;
+}
+
+u32 PacketView::subpacketCount() const {
+  u32 count = 0;
+  for (iterator i = begin(); i != end(); ++i) ++count;
+  return count;
+}
+
+bool ContainerWriter::append(const u8 * packet) {
+  API_ASSERT_VALID_PACKET(packet);
+  API_ASSERT(!open, E_API_ILLEGAL_STATE);
+  const PacketHeader & ph = packetHeaderInternalUnsafeConst(packet);
+  const u32 len = ph.f[PacketHeader::LENGTH];
+  if (w.room() < len+SUBPACKET_OVERHEAD_BYTES) {
+    w.put(packet, len+SUBPACKET_OVERHEAD_BYTES);  /* Overflows the writer, reading nothing */
+    return false;
+  }
+  w.put(ph.f[PacketHeader::SOURCE]);
+  w.put(ph.f[PacketHeader::FLAGS]);
+  w.put((u8) 0);
+  w.put((u8) len);
+  w.put(packet, len+1);         /* Data and null */
+  ++count;
+  return true;
+}
+
+bool ContainerWriter::begin(u8 source, u8 flags) {
+  API_ASSERT_VALID_EXTENDED_FACE(source);
+  API_ASSERT(!open, E_API_ILLEGAL_STATE);
+  header = w.length();
+  if (!(w.put(source) && w.put(flags) && w.put((u8) 0) && w.put((u8) 0)))
+    return false;
+  open = true;
+  return true;
+}
+
+bool ContainerWriter::end() {
+  API_ASSERT(open, E_API_ILLEGAL_STATE);
+  open = false;
+  const u32 len = w.length()-header-sizeof(PacketHeader);
+  if (w.overflowed() || !w.put((u8) 0))
+    return false;
+  w.patch(header+PacketHeader::LENGTH, (u8) len);
+  ++count;
+  return true;
+}
+
+#if defined(TEST_PACKET_VIEW) || defined(BENCH_PACKET_VIEW)
+
+#include <stdio.h>
+#include <stdlib.h> // for exit, random
+#include <string.h> // for memset
+#include "MFMPacketIO.h"
+
+void _apiError_(u32 code,const char * file, int lineno) {
+  fprintf(stderr,"APIERROR %d %s:%d\n",code,file,lineno);
+  exit(code);
+}
+
+#endif
+
+#ifdef TEST_PACKET_VIEW
+
+static void die(const char * file, int line, const char * msg) {
+  fprintf(stderr,"%s:%d: %s\n",file, line, msg);
+  exit(100);
+}
+
+#define TEST(condition) do { if (!(condition)) die(__FILE__,__LINE__,#condition); } while (0)
+
+static void test1() {           /* Word-wise comparison agrees with bytewise, at any alignment */
+  u8 a[300], b[300];
+  for (u32 rep = 0; rep < 20000; ++rep) {
+    const u32 oa = random()%8, ob = random()%8;
+    const u32 len = random()%(sizeof(a)-8);
+    for (u32 i = 0; i < len; ++i) a[oa+i] = b[ob+i] = (u8) random();
+    const bool differ = len > 0 && random()%2;
+    if (differ) b[ob+random()%len] ^= (u8) (1u<<(random()%8));
+    TEST(packetBytesEqual(a+oa, b+ob, len) == !differ);
+  }
+}
+
+static void test2() {           /* Views, slices, comparisons, and the old functions on top */
+  u8 buf1[64], buf2[64];
+  u8 * p1 = makePacket(buf1, sizeof(buf1), EAST, "foo bar baz");
+  u8 * p2 = makePacket(buf2, sizeof(buf2), WEST, "xfoo bar baz");
+  PacketView v1(p1), v2(p2);
+  TEST(v1.getLength() == 11 && v1[0] == 'f' && !v1.isEmpty());
+  TEST(v1 != v2 && v1 == v2.slice(1));
+  TEST(v1.startsWith("foo") && v1.startsWith("foo bar baz") && !v1.startsWith("foo bar baz!"));
+  TEST(v1.startsWith("") && PacketView().startsWith(""));
+  TEST(v1.startsWith(v1.slice(0,4)) && !v1.startsWith(v2));
+  TEST(v1.slice(4,7) == v2.slice(5,8) && v1.slice(4,4).isEmpty());
+  TEST(zpacketPrefix(p1,"foo") && !zpacketPrefix(p1,"fooo") && zpacketPrefix(p1,""));
+  TEST(!zpacketPrefix(p1,"foo bar baz!") && zpacketPrefix(p1,"foo bar baz"));
+
+  u32 word;
+  TEST(packetRead(p1, word, DEC) == false);
+  packetReread(p1, 4);
+  PacketView rest = PacketView::unread(p1);
+  TEST(rest == v1.slice(packetCursor(p1), packetLength(p1)) && rest.startsWith("bar"));
+
+  u8 buf3[64];
+  u8 * p3 = makePacket(buf3, sizeof(buf3), NORTH, "foo bar baz");
+  TEST(packetEqual(p1, p3) && !packetEqual(p1, p2));
+}
+
+static void test3() {           /* patch keeps the check byte right */
+  u8 buf[64];
+  for (u32 rep = 0; rep < 1000; ++rep) {
+    PacketWriter w(buf, sizeof(buf), NORTH);
+    const u32 len = 1+random()%40;
+    for (u32 i = 0; i < len; ++i) w.put((u8) random());
+    TEST(!w.patch(len, 0));
+    const u32 at = random()%len;
+    TEST(w.patch(at, (u8) random()));
+    TEST(w.putCheckByte() && w.commit());
+    TEST(packetCheckByteValid(w.getPacket()));
+  }
+}
+
+static u8 ring[MFMPACKETIO_BUFFER_SIZE_BYTES];
+static u8 children[20][64];
+static u32 childCount, received;
+
+static void dispatch(u8 * packet, u8) {
+  TEST(packet[0] == 'B');
+  PacketView batch = PacketView::unread(packet).slice(1);
+  TEST(batch.isContainer());
+  TEST(batch.subpacketCount() == childCount);
+  u32 n = 0;
+  for (PacketView::iterator i = batch.begin(); i != batch.end(); ++i, ++n) {
+    u8 * child = *i;
+    u8 * orig = children[n]+MFMPACKETIO_HEADER_BYTES;
+    TEST(packetEqual(child, orig));
+    TEST(packetSource(child) == packetSource(orig));
+    TEST(packetFlags(child) == packetFlags(orig));
+    TEST(packetCursor(child) == 0 && child[packetLength(child)] == 0);
+    u32 value;                  /* Children are ordinary packets in place */
+    TEST(packetRead(child, value, BYTE) == (packetLength(child) > 0));
+  }
+  TEST(n == childCount);
+  ++received;
+}
+
+static void test4() {           /* Build containers in a ring, wrapping, and fan them out */
+  MFMPacketIO pio(ring);
+  u32 sent = 0;
+  for (u32 rep = 0; rep < 5000; ++rep) {
+    PacketWriter w(pio);
+    w.put('B');
+    ContainerWriter c(w);
+    childCount = 1+random()%6;
+    for (u32 k = 0; k < childCount; ++k) {
+      const u32 len = random()%30;
+      const u8 src = (u8) (random()%MAX_FACE_INDEX);
+      u8 data[30];
+      for (u32 i = 0; i < len; ++i) data[i] = (u8) random();
+      u8 * child = makePacket(children[k], sizeof(children[k]), src, data, len);
+      if (random()%2) {
+        TEST(c.append(child));
+      } else {
+        TEST(c.begin(src));
+        TEST(w.put(data, len));
+        TEST(c.end());
+      }
+    }
+    TEST(c.getCount() == childCount);
+    TEST(w.commit());
+    ++sent;
+    while (pio.dispatchPacket(EAST, dispatch)) ;
+  }
+  TEST(received == sent);
+  printf("4 containers=%u wrapped=%u\n", received, pio.getPacketsWrapped());
+}
+
+static void test5() {           /* Overflow, and what isn't a container */
+  u8 buf[4+20+1], sub[64];
+  PacketWriter w(buf, sizeof(buf), NORTH);
+  ContainerWriter c(w);
+  TEST(c.append(makePacket(sub, sizeof(sub), EAST, "0123456789")));    /* 15 bytes */
+  TEST(!c.append(makePacket(sub, sizeof(sub), EAST, "0")));            /* 6 more don't fit */
+  TEST(w.overflowed() && !w.commit());
+
+  PacketWriter w2(buf, sizeof(buf), NORTH);
+  ContainerWriter c2(w2);
+  TEST(c2.begin(BRAIN));
+  w2.put("0123456789012345");
+  TEST(!c2.end() && !w2.commit());
+
+  PacketWriter w3(buf, sizeof(buf), NORTH);
+  ContainerWriter c3(w3);
+  TEST(c3.begin(BRAIN, PK_BUFFER) && w3.put("abc") && c3.end());
+  TEST(w3.put('x') && w3.commit());
+  PacketView v(w3.getPacket());
+  TEST(v.subpacketCount() == 1 && !v.isContainer());          /* Trailing 'x' */
+  TEST(v.slice(0, v.getLength()-1).isContainer());
+  TEST(packetFlags(*v.begin()) == PK_BUFFER && zpacketPrefix(*v.begin(), "abc"));
+  TEST(PacketView().isContainer() && PacketView().subpacketCount() == 0);
+
+  u8 * junk = makePacket(buf, sizeof(buf), NORTH, "\377\377\377\377\377\377");
+  TEST(PacketView(junk).subpacketCount() == 0 && !PacketView(junk).isContainer());
+}
+
+int main() {
+  test1();
+  test2();
+  test3();
+  test4();
+  test5();
+  return 0;
+}
+
+#endif /* TEST_PACKET_VIEW */
+
+#ifdef BENCH_PACKET_VIEW
+
+#include <time.h>   // for clock_gettime
+
+static double nowSeconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+static u8 ring[MFMPACKETIO_BUFFER_SIZE_BYTES];
+static u32 sink;
+
+static void handle(u8 * packet) { sink += packetLength(packet) + packet[0]; }
+
+static void singles(u8 * packet, u8) { handle(packet); }
+
+static void batched(u8 * packet, u8) {
+  PacketView batch(packet);
+  for (PacketView::iterator i = batch.begin(); i != batch.end(); ++i)
+    handle(*i);
+}
+
+/* The comparison packetEqual made as of 0.9.20 */
+static bool legacyEqual(const u8 * p1, const u8 * p2) {
+  if (packetLength(p1) != packetLength(p2)) return false;
+  for (u32 i = packetLength(p1); i > 0; --i)
+    if (*p1++ != *p2++) return false;
+  return true;
+}
+
+int main() {
+  const u32 REPS = 200000, SMALL = 20;
+  MFMPacketIO pio(ring);
+  const char * msg = "s1234";
+
+  double start = nowSeconds();
+  for (u32 rep = 0; rep < REPS; ++rep) {
+    for (u32 k = 0; k < SMALL; ++k) {
+      PacketWriter w(pio);
+      w.put(msg);
+      w.commit();
+      pio.dispatchPacket(EAST, singles);
+    }
+  }
+  const double single = nowSeconds()-start;
+
+  start = nowSeconds();
+  for (u32 rep = 0; rep < REPS; ++rep) {
+    PacketWriter w(pio);
+    ContainerWriter c(w);
+    for (u32 k = 0; k < SMALL; ++k) {
+      c.begin(BRAIN);
+      w.put(msg);
+      c.end();
+    }
+    w.commit();
+    pio.dispatchPacket(EAST, batched);
+  }
+  const double batch = nowSeconds()-start;
+
+  u8 b1[MAX_PACKET_LENGTH+4], b2[MAX_PACKET_LENGTH+4];
+  u8 data[MAX_PACKET_LENGTH];
+  for (u32 i = 0; i < sizeof(data); ++i) data[i] = (u8) random();
+  u8 * p1 = makePacket(b1, sizeof(b1), EAST, data, MAX_PACKET_LENGTH-3);
+  u8 * p2 = makePacket(b2, sizeof(b2), EAST, data, MAX_PACKET_LENGTH-3);
+
+  start = nowSeconds();
+  for (u32 rep = 0; rep < REPS; ++rep) { p1[rep&127] ^= 1; sink += legacyEqual(p1, p2); }
+  const double legacy = nowSeconds()-start;
+  start = nowSeconds();
+  for (u32 rep = 0; rep < REPS; ++rep) { p1[rep&127] ^= 1; sink += packetEqual(p1, p2); }
+  const double words = nowSeconds()-start;
+
+  printf("%u reps (sink %u)\n", REPS, sink);
+  printf("%-32s %8.1f ns/message\n", "20 packets, one per message", single*1e9/REPS/SMALL);
+  printf("%-32s %8.1f ns/message\n", "1 container of 20 subpackets", batch*1e9/REPS/SMALL);
+  printf("%-32s %8.1f ns/compare\n", "packetEqual 249B, bytewise", legacy*1e9/REPS);
+  printf("%-32s %8.1f ns/compare\n", "packetEqual 249B, word-wise", words*1e9/REPS);
+  return 0;
+}
+
+#endif /* BENCH_PACKET_VIEW */
@@ -0,0 +1,296 @@
+/*                                              -*- mode:C++; fill-column:100 -*-
+  MFMPacketWriter.cpp - Build packets in place in their final storage
+  Copyright (C) 2013 The Regents of the University of New Mexico.  All rights reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301
+  USA
+*/
+
+/* TO COMPILE FOR TESTING:
+  g++ -O0 -g3 -Wall -pedantic -Werror -Wundef -I../include -DHOST_MODE -DTEST_PACKET_WRITER -o"./testpacketwriter" MFMPacketWriter.cpp MFMPacketIO.cpp MFMFraming.cpp MFMPacketReader.cpp MFMPacket.cpp;./testpacketwriter
+*/
+
+#include <string.h>        /* For memcpy */
+#include "MFMPacketWriter.h"
+#include "MFMPacketIO.h"
+#include "MFMAssert.h"
+
+PacketWriter::PacketWriter(u8 * buffer, u32 bufferLength, u8 face)
+  : base(buffer+MFMPACKETIO_HEADER_BYTES)
+  , start(0)
+  , mask(~0u)
+  , index(0)
+  , limit(0)
+  , pio(0)
+  , packet(0)
+  , face(face)
+  , check()
+  , overflow(false)
+{
+  API_ASSERT_NONNULL(buffer);
+  API_ASSERT_VALID_EXTENDED_FACE(face);
+  if (bufferLength < MFMPACKETIO_HEADER_BYTES+1)  // 4 for header, 1 for null
+    overflow = true;
+  else {
+    limit = bufferLength-MFMPACKETIO_HEADER_BYTES-1;
+    if (limit > MAX_PACKET_LENGTH) limit = MAX_PACKET_LENGTH;
+  }
+}
+
+PacketWriter::PacketWriter(MFMPacketIO & pio)
+  : base(0)
+  , start(0)
+  , mask(BYTE_BUFFER_MASK)
+  , index(0)
+  , limit(0)
+  , pio(&pio)
+  , packet(0)
+  , face(0)
+  , check()
+  , overflow(false)
+{
+  base = pio.reserve(start, limit);
+  if (!base) overflow = true;
+}
+
+bool PacketWriter::putNumber(u32 num, int code) {
+  switch (code) {
+  case BYTE:
+    return put((u8) num);
+  case BESHORT:
+    return put((u8) (num>>8)) && put((u8) num);
+  case BELONG:
+    return put((u8) (num>>24)) && put((u8) (num>>16)) && put((u8) (num>>8)) && put((u8) num);
+  default:
+    break;
+  }
+  API_ASSERT(code >= 2 && code <= 36, E_API_FORMAT_ARG);
+
+  u8 digits[32];                // Enough for a u32 in binary
+  u32 count = 0;
+  const u32 b = (u32) code;
+  do {
+    const u32 d = num % b;
+    digits[count++] = (u8) (d < 10 ? '0'+d : 'A'-10+d);
+    num /= b;
+  } while (num);
+
+  if (count > room()) {
+    overflow = true;
+    return false;
+  }
+  while (count > 0)
+    put(digits[--count]);
+  return true;
+}
+
+bool PacketWriter::put(u64 value) {
+  if (room() < 8) {
+    overflow = true;
+    return false;
+  }
+  for (int shift = 56; shift >= 0; shift -= 8)
+    put((u8) (value>>shift));
+  return true;
+}
+
+bool PacketWriter::put(const u8 * bytes, u32 length) {
+  API_ASSERT(bytes || !length, E_API_NULL_POINTER);
+  if (length > room()) {
+    overflow = true;
+    return false;
+  }
+
+  /* Copy in at most two stretches, since a ring reservation may wrap once */
+  u32 done = 0;
+  while (done < length) {
+    const u32 at = (start+index)&mask;
+    u32 chunk = length-done;
+    if (pio && chunk > MFMPACKETIO_BUFFER_SIZE_BYTES-at)
+      chunk = MFMPACKETIO_BUFFER_SIZE_BYTES-at;
+    memcpy(&base[at], bytes+done, chunk);
+    check.update(bytes+done, chunk);
+    index += chunk;
+    done += chunk;
+  }
+  return true;
+}
+
+bool PacketWriter::put(const char * str) {
+  API_ASSERT_NONNULL(str);
+  u32 len;
+  for (len = 0; str[len]; ++len) ;
+  return put((const u8 *) str, len);
+}
+
+bool PacketWriter::commit() {
+  if (overflow) {
+    abort();
+    return false;
+  }
+  if (pio)
+    pio->publishReserved(index);
+  else {
+    packet = base;
+    PacketHeader & ph = packetHeaderInternalUnsafe(packet);
+    ph.f[PacketHeader::SOURCE] = face;
+    ph.f[PacketHeader::FLAGS] = 0;
+    ph.f[PacketHeader::CURSOR] = 0;
+    ph.f[PacketHeader::LENGTH] = (u8) index;
+    packet[index] = 0;
+  }
+  limit = index;                /* No more writing */
+  overflow = true;              /* ..and no committing again */
+  return true;
+}
+
+#ifdef TEST_PACKET_WRITER
+
+#include <stdio.h>
+#include <stdlib.h> // for exit, random
+#include "MFMPacketReader.h"
+
+void _apiError_(u32 code,const char * file, int lineno) {
+  fprintf(stderr,"APIERROR %d %s:%d\n",code,file,lineno);
+  exit(code);
+}
+
+static void die(const char * file, int line, const char * msg) {
+  fprintf(stderr,"%s:%d: %s\n",file, line, msg);
+  exit(100);
+}
+
+#define TEST(condition) do { if (!(condition)) die(__FILE__,__LINE__,#condition); } while (0)
+
+static void test1() {           /* A buffer packet is exactly what makePacket makes */
+  u8 buf1[4+MAX_PACKET_LENGTH+1], buf2[4+MAX_PACKET_LENGTH+1];
+  memset(buf1, 0x55, sizeof(buf1));
+  memset(buf2, 0x55, sizeof(buf2));
+  TEST(makePacket(buf1, sizeof(buf1), EAST, "f12 -34 Z") == buf1+4);
+  PacketWriter w(buf2, sizeof(buf2), EAST);
+  TEST(w.put('f') && w.put(12) && w.put(' ') && w.put(-34) && w.put(" Z"));
+  TEST(w.getPacket() == 0);
+  TEST(w.commit());
+  u8 * p2 = w.getPacket();
+  TEST(p2 == buf2+4);
+  TEST(memcmp(buf1, buf2, sizeof(buf1)) == 0);
+  TEST(!w.commit());            /* Only once */
+  TEST(!w.put('x'));
+  TEST(packetLength(p2) == 9);
+}
+
+static void test2() {           /* Every code reads back */
+  u8 buf[4+MAX_PACKET_LENGTH+1];
+  for (u32 rep = 0; rep < 10000; ++rep) {
+    const int codes[] = { BYTE, BESHORT, BELONG, DEC, HEX, OCT, BIN, B36 };
+    const int code = codes[random()%8];
+    int val = (int) random() - (int) random();
+    if (code == BYTE) val &= 0xff;
+    else if (code == BESHORT) val &= 0xffff;
+    const u64 big = ((u64) random()<<33) ^ random();
+
+    PacketWriter w(buf, sizeof(buf), WEST);
+    TEST(w.put(val, code));
+    if (code > BYTE) TEST(w.put(' '));       /* Delimit text numbers */
+    TEST(w.put(big));
+    TEST(w.putCheckByte());
+    TEST(w.commit());
+    u8 * packet = w.getPacket();
+    TEST(packetCheckByteValid(packet));
+
+    PacketReader r(packet);
+    int back;
+    u8 sp;
+    u64 bigBack;
+    TEST(r.read(back, code));
+    if (code > BYTE) TEST(r.readByte(sp) && sp == ' ');
+    TEST(code == DEC || code <= BYTE ? back == val : (u32) back == (u32) val);
+    TEST(r.read(bigBack) && bigBack == big);
+    TEST(r.readCheckByte());
+  }
+}
+
+static void test3() {           /* Overflow fails the commit */
+  u8 buf[4+10+1];
+  PacketWriter w(buf, sizeof(buf), NORTH);
+  TEST(w.room() == 10);
+  TEST(w.put("0123456789"));
+  TEST(!w.put('x'));
+  TEST(w.overflowed());
+  TEST(!w.commit());
+
+  PacketWriter w2(buf, sizeof(buf), NORTH);
+  TEST(w2.put("01234567"));
+  TEST(!w2.put(123456, DEC));   /* Doesn't partly write the number */
+  TEST(w2.length() == 8);
+
+  PacketWriter w3(buf, 4, NORTH);
+  TEST(w3.overflowed() && w3.room() == 0);
+}
+
+static u8 ring[MFMPACKETIO_BUFFER_SIZE_BYTES];
+static u32 dispatched;
+static u32 expectedSeq;
+
+static void dispatch(u8 * packet, u8 source) {
+  PacketReader r(packet);
+  int seq, len;
+  TEST(source == SOUTH);
+  TEST(r.read(seq, BELONG) && r.read(len, BYTE));
+  TEST((u32) seq == expectedSeq);
+  for (int i = 0; i < len; ++i) {
+    u8 b;
+    TEST(r.readByte(b) && b == (u8) (seq+i));
+  }
+  TEST(r.readCheckByte());
+  ++expectedSeq;
+  ++dispatched;
+}
+
+static void test4() {           /* Directly into a ring, with wraps and aborts */
+  MFMPacketIO pio(ring);
+  u32 seq = 0;
+  u8 data[MAX_PACKET_LENGTH];
+  for (u32 rep = 0; rep < 100000; ++rep) {
+    if (random()%3) {
+      const u32 len = random()%(MAX_PACKET_LENGTH-6);
+      for (u32 i = 0; i < len; ++i) data[i] = (u8) (seq+i);
+      PacketWriter w(pio);
+      w.put(seq, BELONG);
+      w.put(len, BYTE);
+      w.put(data, len);
+      w.putCheckByte();
+      if (random()%10 == 0) {   /* Change our mind */
+        w.abort();
+        TEST(!w.commit());
+      } else if (w.commit()) ++seq;
+    }
+    if (random()%2) pio.dispatchPacket(SOUTH, dispatch);
+    if (rep%1000 == 0) pio.bufferCheck();
+  }
+  while (pio.dispatchPacket(SOUTH, dispatch)) ;
+  TEST(dispatched == seq);
+  printf("4 packets=%u wrapped=%u\n", seq, pio.getPacketsWrapped());
+}
+
+int main() {
+  test1();
+  test2();
+  test3();
+  test4();
+  return 0;
+}
+
+#endif /* TEST_PACKET_WRITER */
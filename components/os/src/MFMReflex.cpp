@@ -0,0 +1,343 @@
+/*                                              -*- mode:C++; fill-column:100 -*-
+  MFMReflex.cpp - Selecting packet handlers by packet prefix and source face
+  Copyright (C) 2013 The Regents of the University of New Mexico.  All rights reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301
+  USA
+*/
+
+/* TO COMPILE FOR TESTING:
+  g++ -O0 -g3 -Wall -pedantic -Werror -Wundef -I../include -DHOST_MODE -DTEST_REFLEX -o"./testreflex" MFMReflex.cpp MFMPacketReader.cpp MFMPacket.cpp;./testreflex
+
+   TO COMPILE FOR BENCHMARKING:
+  g++ -O2 -Wall -pedantic -Werror -Wundef -I../include -DHOST_MODE -DBENCH_REFLEX -o"./benchreflex" MFMReflex.cpp MFMPacketReader.cpp MFMPacket.cpp;./benchreflex
+*/
+
+#include <string.h>        /* For memset */
+#include "MFMReflex.h"
+#include "MFMAssert.h"
+
+ReflexTable::ReflexTable()
+  : reflexCount(0)
+  , nodeCount(0)
+  , misses(0)
+{
+  memset(first, 0, sizeof(first));
+  memset(&nodes[0], 0, sizeof(nodes[0]));
+}
+
+u32 ReflexTable::newNode(u8 byte) {
+  API_ASSERT(nodeCount < MAX_REFLEX_NODES, E_API_REFLEX_FULL);
+  Node & n = nodes[++nodeCount];
+  n.byte = byte;
+  n.child = n.sibling = n.reflex = 0;
+  return nodeCount;
+}
+
+u32 ReflexTable::define(const u8 * prefix, u32 length, PacketHandler * handler,
+                        u64 faces, bool acceptBroken) {
+  API_ASSERT_NONNULL(prefix);
+  API_ASSERT(length > 0 && length <= MAX_PACKET_LENGTH, E_API_BAD_REFLEX);
+  API_ASSERT((faces & REFLEX_ANY_FACE) != 0, E_API_BAD_REFLEX);
+  API_ASSERT(handler != 0, E_API_NULL_HANDLER);
+  API_ASSERT(reflexCount < MAX_REFLEXES, E_API_REFLEX_FULL);
+
+  /* Walk the trie as far as the prefix is already there, then extend it */
+  u32 node = first[prefix[0]];
+  if (!node) node = first[prefix[0]] = (u8) newNode(prefix[0]);
+  for (u32 i = 1; i < length; ++i) {
+    u32 c;
+    for (c = nodes[node].child; c && nodes[c].byte != prefix[i]; c = nodes[c].sibling) ;
+    if (!c) {
+      c = newNode(prefix[i]);
+      nodes[c].sibling = nodes[node].child;
+      nodes[node].child = (u8) c;
+    }
+    node = c;
+  }
+
+  for (u32 r = nodes[node].reflex; r; r = reflexes[r-1].next)
+    API_ASSERT((reflexes[r-1].faces & faces) == 0, E_API_REFLEX_REDEF);
+
+  Reflex & rx = reflexes[reflexCount];
+  rx.handler = handler;
+  rx.faces = faces;
+  rx.hits = 0;
+  rx.reject = acceptBroken ? 0 : PK_BROKEN;
+  rx.next = nodes[node].reflex;
+  nodes[node].reflex = (u8) ++reflexCount;
+  return reflexCount-1;
+}
+
+u32 ReflexTable::define(const char * prefix, PacketHandler * handler, u64 faces,
+                        bool acceptBroken) {
+  API_ASSERT_NONNULL(prefix);
+  return define((const u8 *) prefix, strlen(prefix), handler, faces, acceptBroken);
+}
+
+u32 ReflexTable::define(u8 type, PacketHandler * handler, u64 faces, bool acceptBroken) {
+  return define(&type, 1, handler, faces, acceptBroken);
+}
+
+int ReflexTable::lookup(const u8 * packet, u8 source) const {
+  API_ASSERT_VALID_EXTENDED_FACE(source);
+  const u32 length = packetLength(packet);
+  if (length == 0) return -1;
+  const u64 face = REFLEX_FACE(source);
+  const u8 flags = packetFlags(packet);
+
+  int best = -1;
+  u32 node = first[packet[0]];
+  for (u32 i = 1; node; ++i) {
+    for (u32 r = nodes[node].reflex; r; r = reflexes[r-1].next) {
+      const Reflex & rx = reflexes[r-1];
+      if ((rx.faces & face) && !(flags & rx.reject)) {
+        best = (int) r-1;
+        break;
+      }
+    }
+    if (i >= length) break;
+    u32 c;
+    for (c = nodes[node].child; c && nodes[c].byte != packet[i]; c = nodes[c].sibling) ;
+    node = c;
+  }
+  return best;
+}
+
+bool ReflexTable::dispatch(u8 * packet, u8 source) {
+  const int r = lookup(packet, source);
+  if (r < 0) {
+    ++misses;
+    return false;
+  }
+  Reflex & rx = reflexes[r];
+  ++rx.hits;
+  rx.handler(packet);
+  return true;
+}
+
+u32 ReflexTable::getHits(u32 reflex) const {
+  API_ASSERT_MAX(reflex, reflexCount);
+  return reflexes[reflex].hits;
+}
+
+#if defined(TEST_REFLEX) || defined(BENCH_REFLEX)
+
+#include <stdio.h>
+#include <stdlib.h> // for exit, random
+
+void _apiError_(u32 code,const char * file, int lineno) {
+  fprintf(stderr,"APIERROR %d %s:%d\n",code,file,lineno);
+  exit(code);
+}
+
+#endif
+
+#ifdef TEST_REFLEX
+
+static void die(const char * file, int line, const char * msg) {
+  fprintf(stderr,"%s:%d: %s\n",file, line, msg);
+  exit(100);
+}
+
+#define TEST(condition) do { if (!(condition)) die(__FILE__,__LINE__,#condition); } while (0)
+
+static u8 reflexBuffer[4+MAX_PACKET_LENGTH+1];
+
+static u8 * reflexPacket(const char * text, u8 source = EAST) {
+  return makePacket(reflexBuffer, sizeof(reflexBuffer), source, text);
+}
+
+static const char * lastHandler;
+static void aHandler(u8 *)   { lastHandler = "a"; }
+static void fHandler(u8 *)   { lastHandler = "f"; }
+static void foHandler(u8 *)  { lastHandler = "fo"; }
+static void fooHandler(u8 *) { lastHandler = "foo"; }
+static void fooBHandler(u8 *) { lastHandler = "fooB"; }
+static void hiHandler(u8 *)  { lastHandler = "hi"; }
+
+static bool hits(ReflexTable & rt, const char * text, u8 source, const char * expect) {
+  lastHandler = 0;
+  const bool ret = rt.dispatch(reflexPacket(text, source), source);
+  if (!expect) return !ret && lastHandler == 0;
+  return ret && lastHandler && strcmp(lastHandler, expect) == 0;
+}
+
+static void test1() {           /* Longest prefix wins, by face */
+  ReflexTable rt;
+  const u32 a = rt.define('a', aHandler);
+  const u32 f = rt.define('f', fHandler);
+  rt.define("fo", foHandler, REFLEX_FACE(BRAIN));
+  const u32 foo = rt.define("foo", fooHandler, REFLEX_PHYSICAL_FACES);
+  rt.define("foo", fooBHandler, REFLEX_FACE(SPINE)|REFLEX_FACE(MIN_VIRTUAL_FACE));
+  rt.define("hi there", hiHandler);
+  TEST(rt.getCount() == 6);
+
+  TEST(hits(rt, "a", EAST, "a"));
+  TEST(hits(rt, "abc", WMEM, "a"));
+  TEST(hits(rt, "b", EAST, 0));
+  TEST(hits(rt, "", EAST, 0));
+  TEST(hits(rt, "f", EAST, "f"));
+  TEST(hits(rt, "fo", EAST, "f"));         /* "fo" is only for BRAIN */
+  TEST(hits(rt, "fo", BRAIN, "fo"));
+  TEST(hits(rt, "food", NORTH, "foo"));
+  TEST(hits(rt, "food", BRAIN, "fo"));
+  TEST(hits(rt, "food", SPINE, "fooB"));
+  TEST(hits(rt, "foo", MIN_VIRTUAL_FACE, "fooB"));
+  TEST(hits(rt, "foo", MIN_VIRTUAL_FACE+1, "f"));
+  TEST(hits(rt, "fxo", NORTH, "f"));
+  TEST(hits(rt, "hi ther", NORTH, 0));     /* A prefix of a prefix isn't a match */
+  TEST(hits(rt, "hi there!", NORTH, "hi"));
+
+  TEST(rt.getHits(a) == 2 && rt.getHits(f) == 4 && rt.getHits(foo) == 1);
+  TEST(rt.getMisses() == 3);
+}
+
+static void test2() {           /* Broken packets go only where accepted */
+  ReflexTable rt;
+  rt.define('x', aHandler);
+  rt.define("xy", fHandler, REFLEX_ANY_FACE, true);
+  u8 * packet = reflexPacket("xyz");
+  TEST(rt.lookup(packet, WEST) == 1);
+  packetHeaderInternalUnsafe(packet).f[PacketHeader::FLAGS] = PK_FRAMING;
+  TEST(rt.lookup(packet, WEST) == 1);
+  packet = reflexPacket("xz");
+  TEST(rt.lookup(packet, WEST) == 0);
+  packetHeaderInternalUnsafe(packet).f[PacketHeader::FLAGS] = PK_BAD_ESCAPE;
+  TEST(rt.lookup(packet, WEST) == -1);
+}
+
+static void test3() {           /* Agrees with a zpacketPrefix scan over random tables */
+  const char alphabet[] = "abc";
+  for (u32 rep = 0; rep < 200; ++rep) {
+    ReflexTable rt;
+    char prefixes[MAX_REFLEXES][6];
+    u64 faces[MAX_REFLEXES];
+    u32 count = 0;
+    for (u32 i = 0; i < 40; ++i) {
+      char p[6];
+      const u32 len = 1+random()%5;
+      for (u32 j = 0; j < len; ++j) p[j] = alphabet[random()%3];
+      p[len] = 0;
+      const u64 mask = REFLEX_FACE(random()%8) | REFLEX_FACE(random()%8);
+      bool clash = false;
+      for (u32 k = 0; k < count; ++k)
+        if (!strcmp(prefixes[k], p) && (faces[k] & mask)) clash = true;
+      if (clash) continue;
+      strcpy(prefixes[count], p);
+      faces[count] = mask;
+      TEST(rt.define(p, aHandler, mask) == count);
+      ++count;
+    }
+    for (u32 t = 0; t < 200; ++t) {
+      char text[8];
+      const u32 len = random()%7;
+      for (u32 j = 0; j < len; ++j) text[j] = alphabet[random()%3];
+      text[len] = 0;
+      const u8 source = random()%8;
+      u8 * packet = reflexPacket(text, source);
+      int expect = -1;
+      u32 expectLength = 0;
+      for (u32 k = 0; k < count; ++k)
+        if ((faces[k] & REFLEX_FACE(source)) && zpacketPrefix(packet, prefixes[k]) &&
+            strlen(prefixes[k]) > expectLength) {
+          expect = (int) k;
+          expectLength = strlen(prefixes[k]);
+        }
+      TEST(rt.lookup(packet, source) == expect);
+    }
+  }
+}
+
+int main() {
+  test1();
+  test2();
+  test3();
+  return 0;
+}
+
+#endif /* TEST_REFLEX */
+
+#ifdef BENCH_REFLEX
+
+#include <time.h>   // for clock_gettime
+
+static double nowSeconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+static u32 handled;
+static void benchHandler(u8 *) { ++handled; }
+
+/* Command words in the style of a tile's serial console, several sharing first bytes */
+static const char * const words[] = {
+  "a", "b", "c", "d", "e", "g", "h", "i", "j", "k",
+  "set", "seta", "setb", "show", "shows", "stat", "stats", "step",
+  "go", "gone", "goto", "ping", "pong", "print",
+};
+#define WORD_COUNT (sizeof(words)/sizeof(words[0]))
+
+/* The usual alternative: try each prefix, longest first, with zpacketPrefix */
+static int scan(u8 * packet, const u32 * order) {
+  for (u32 i = 0; i < WORD_COUNT; ++i)
+    if (zpacketPrefix(packet, words[order[i]])) return (int) order[i];
+  return -1;
+}
+
+int main() {
+  ReflexTable rt;
+  u32 order[WORD_COUNT];
+  for (u32 i = 0; i < WORD_COUNT; ++i) {
+    rt.define(words[i], benchHandler);
+    order[i] = i;
+  }
+  for (u32 i = 0; i < WORD_COUNT; ++i)          /* Longest first, so the first match is right */
+    for (u32 j = i+1; j < WORD_COUNT; ++j)
+      if (strlen(words[order[j]]) > strlen(words[order[i]])) {
+        const u32 t = order[i]; order[i] = order[j]; order[j] = t;
+      }
+
+  u8 buffers[WORD_COUNT][4+MAX_PACKET_LENGTH+1];
+  u8 * packets[WORD_COUNT];
+  for (u32 i = 0; i < WORD_COUNT; ++i) {
+    char text[32];
+    sprintf(text, "%s 123 456", words[i]);
+    packets[i] = makePacket(buffers[i], sizeof(buffers[i]), EAST, text);
+  }
+
+  const u32 REPS = 10000000;
+  u32 sink = 0;
+  double start = nowSeconds();
+  for (u32 rep = 0; rep < REPS; ++rep) sink += scan(packets[rep%WORD_COUNT], order);
+  const double scanned = nowSeconds()-start;
+
+  start = nowSeconds();
+  for (u32 rep = 0; rep < REPS; ++rep) sink += rt.lookup(packets[rep%WORD_COUNT], EAST);
+  const double looked = nowSeconds()-start;
+
+  start = nowSeconds();
+  for (u32 rep = 0; rep < REPS; ++rep) rt.dispatch(packets[rep%WORD_COUNT], EAST);
+  const double dispatched = nowSeconds()-start;
+
+  printf("%u reps over %u reflexes (sink %u, handled %u)\n", REPS, (u32) WORD_COUNT, sink, handled);
+  printf("%-24s %8.1f ns/packet\n", "zpacketPrefix scan", scanned*1e9/REPS);
+  printf("%-24s %8.1f ns/packet\n", "ReflexTable::lookup", looked*1e9/REPS);
+  printf("%-24s %8.1f ns/packet\n", "ReflexTable::dispatch", dispatched*1e9/REPS);
+  return 0;
+}
+
+#endif /* BENCH_REFLEX */
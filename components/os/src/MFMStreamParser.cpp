@@ -0,0 +1,364 @@
+/*                                              -*- mode:C++; fill-column:100 -*-
+  MFMStreamParser.cpp - Parsing text fields that run across packet boundaries
+  Copyright (C) 2013 The Regents of the University of New Mexico.  All rights reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301
+  USA
+*/
+
+/* TO COMPILE FOR TESTING:
+  g++ -O0 -g3 -Wall -pedantic -Werror -Wundef -I../include -DHOST_MODE -DTEST_STREAM_PARSER -o"./teststreamparser" MFMStreamParser.cpp MFMPacketReader.cpp MFMPacket.cpp;./teststreamparser
+
+   TO COMPILE FOR BENCHMARKING:
+  g++ -O2 -Wall -pedantic -Werror -Wundef -I../include -DHOST_MODE -DBENCH_STREAM_PARSER -o"./benchstreamparser" MFMStreamParser.cpp MFMPacketReader.cpp MFMPacket.cpp;./benchstreamparser
+*/
+
+#include "MFMStreamParser.h"
+#include "MFMAssert.h"
+
+StreamParser::StreamParser(StreamFieldHandler * fieldHandler, void * arg, int base,
+                           u8 terminator, StreamRecordHandler * recordHandler)
+  : fieldHandler(fieldHandler)
+  , recordHandler(recordHandler)
+  , arg(arg)
+  , base((u32) base)
+  , terminator(terminator)
+{
+  API_ASSERT(fieldHandler != 0, E_API_NULL_HANDLER);
+  API_ASSERT(base >= 2 && base <= 36, E_API_FORMAT_ARG);
+  reset();
+}
+
+void StreamParser::reset() {
+  record = index = num = 0;
+  field = numeric = digits = negative = signable = false;
+}
+
+void StreamParser::report(const u8 * bytes, u32 length, bool complete) {
+  StreamField f;
+  f.record = record;
+  f.index = index;
+  f.bytes = bytes;
+  f.length = length;
+  f.complete = complete;
+  f.number = complete && numeric && digits;
+  f.value = f.number ? (int) (negative ? 0u-num : num) : 0;
+  fieldHandler(f, arg);
+}
+
+void StreamParser::endField(const u8 * bytes, u32 length) {
+  field = false;
+  report(bytes, length, true);
+  ++index;
+}
+
+void StreamParser::endRecord() {
+  if (recordHandler) recordHandler(record, index, arg);
+  ++record;
+  index = 0;
+}
+
+void StreamParser::feed(const u8 * data, u32 length) {
+  API_ASSERT(data || !length, E_API_NULL_POINTER);
+  const u8 * start = data;      /* Where the current field's piece begins, if in a field */
+  for (u32 i = 0; i < length; ++i) {
+    const u8 ch = data[i];
+    if (ch == ' ' || ch == terminator) {
+      if (field) endField(start, data+i-start);
+      if (ch == terminator) endRecord();
+      continue;
+    }
+    if (!field) {
+      field = numeric = signable = true;
+      digits = negative = false;
+      num = 0;
+      start = data+i;
+    }
+    if (numeric) {              /* Digit values just as readDigits computes them */
+      u32 val;
+      if (ch >= '0' && ch <= '9') val = ch-'0';
+      else {
+        const u8 lc = ch|0x20;
+        val = lc >= 'a' && lc <= 'z' ? lc-('a'-10) : base;
+      }
+      if (val < base) {
+        num = num*base+val;
+        digits = true;
+      } else if (signable && (ch == '-' || ch == '+'))
+        negative = ch == '-';
+      else
+        numeric = false;
+    }
+    signable = false;
+  }
+  if (field && start < data+length)
+    report(start, data+length-start, false);
+}
+
+void StreamParser::feed(u8 * packet) {
+  const u32 cursor = packetCursor(packet);
+  const u32 length = packetLength(packet);
+  feed(packet+cursor, length-cursor);
+  packetReread(packet, length);
+}
+
+void StreamParser::finish() {
+  if (field) endField(0, 0);
+  if (index > 0) endRecord();
+}
+
+#if defined(TEST_STREAM_PARSER) || defined(BENCH_STREAM_PARSER)
+
+#include <stdio.h>
+#include <stdlib.h> // for exit, random
+#include <string.h> // for strlen, strcmp, memcpy
+
+void _apiError_(u32 code,const char * file, int lineno) {
+  fprintf(stderr,"APIERROR %d %s:%d\n",code,file,lineno);
+  exit(code);
+}
+
+#endif
+
+#ifdef TEST_STREAM_PARSER
+
+static void die(const char * file, int line, const char * msg) {
+  fprintf(stderr,"%s:%d: %s\n",file, line, msg);
+  exit(100);
+}
+
+#define TEST(condition) do { if (!(condition)) die(__FILE__,__LINE__,#condition); } while (0)
+
+/* Everything a parse reported, with each field's pieces glued back together */
+struct Log {
+  char text[2000];  /* Fields as "record.index=text[#value]|", records as "<fields>;" */
+  u32 used;
+  u32 pieces;
+  bool open;        /* A field has pieces but no complete one yet */
+  int base;
+
+  void add(const char * s) {
+    const u32 len = strlen(s);
+    TEST(used+len < sizeof(text));
+    memcpy(text+used, s, len+1);
+    used += len;
+  }
+};
+
+static void logField(const StreamField & f, void * arg) {
+  Log & log = *(Log *) arg;
+  char buf[64];
+  if (!log.open) {
+    sprintf(buf, "%u.%u=", f.record, f.index);
+    log.add(buf);
+  }
+  TEST(f.length < sizeof(buf));
+  if (f.length) memcpy(buf, f.bytes, f.length);
+  buf[f.length] = 0;
+  log.add(buf);
+  ++log.pieces;
+  log.open = !f.complete;
+  if (!f.complete) return;
+
+  if (f.number) {
+    /* The value packetRead gets from the field's text */
+    u8 pbuf[4+64+1];
+    const u32 start = log.used;
+    u32 at = start;
+    while (at > 0 && log.text[at-1] != '=') --at;
+    u8 * packet = makePacket(pbuf, sizeof(pbuf), NORTH, (const u8 *) log.text+at, start-at);
+    int expect;
+    TEST(packetRead(packet, expect, log.base));
+    TEST(packetReadEOF(packet));
+    TEST(f.value == expect);
+    sprintf(buf, "#%d", f.value);
+    log.add(buf);
+  }
+  log.add("|");
+}
+
+static void logRecord(u32 record, u32 fields, void * arg) {
+  char buf[32];
+  sprintf(buf, "<%u:%u>;", record, fields);
+  ((Log *) arg)->add(buf);
+}
+
+static void parse(Log & log, const char * text, int base, const u32 * splits, u32 count) {
+  log.used = log.pieces = 0;
+  log.text[0] = 0;
+  log.open = false;
+  log.base = base;
+  StreamParser sp(logField, &log, base, ';', logRecord);
+  const u32 len = strlen(text);
+  u32 at = 0;
+  for (u32 k = 0; k <= count; ++k) {
+    const u32 to = k < count ? splits[k] : len;
+    u8 buf[4+MAX_PACKET_LENGTH+1];
+    u8 * packet = makePacket(buf, sizeof(buf), EAST, (const u8 *) text+at, to-at);
+    sp.feed(packet);
+    TEST(packetReadEOF(packet));
+    at = to;
+  }
+  sp.finish();
+  TEST(!sp.inField());
+}
+
+static const char * texts[] = {
+  "temp 23 -5 1F;name foo;cnt +12 99999999999;; x - + -0 12a;tail 7",
+  "  lead   spaces 0 -2147483648 4294967295;;;",
+  "a;b;c",
+  "",
+  "-;+;--1;1-;+7 -7",
+};
+
+static void test1() {           /* Any split of the stream parses the same as no split */
+  Log whole, split;
+  for (u32 t = 0; t < sizeof(texts)/sizeof(texts[0]); ++t) {
+    const int bases[] = { DEC, HEX, 36 };
+    for (u32 b = 0; b < 3; ++b) {
+      const u32 len = strlen(texts[t]);
+      parse(whole, texts[t], bases[b], 0, 0);
+      for (u32 cut = 0; cut <= len; ++cut) {    /* Every single split */
+        parse(split, texts[t], bases[b], &cut, 1);
+        TEST(!strcmp(whole.text, split.text));
+      }
+      for (u32 rep = 0; rep < 2000; ++rep) {    /* Random splits, empty packets included */
+        u32 cuts[20];
+        const u32 count = random()%20;
+        for (u32 k = 0; k < count; ++k) cuts[k] = random()%(len+1);
+        for (u32 k = 1; k < count; ++k)         /* Insertion sort */
+          for (u32 j = k; j > 0 && cuts[j-1] > cuts[j]; --j) {
+            const u32 tmp = cuts[j];
+            cuts[j] = cuts[j-1];
+            cuts[j-1] = tmp;
+          }
+        parse(split, texts[t], bases[b], cuts, count);
+        TEST(!strcmp(whole.text, split.text));
+        TEST(split.pieces >= whole.pieces);
+      }
+    }
+  }
+}
+
+static void test2() {           /* What the fields come out as */
+  Log log;
+  parse(log, texts[0], DEC, 0, 0);
+  TEST(!strcmp(log.text,
+               "0.0=temp|0.1=23#23|0.2=-5#-5|0.3=1F|<0:4>;"
+               "1.0=name|1.1=foo|<1:2>;"
+               "2.0=cnt|2.1=+12#12|2.2=99999999999#1215752191|<2:3>;"
+               "<3:0>;"
+               "4.0=x|4.1=-|4.2=+|4.3=-0#0|4.4=12a|<4:5>;"
+               "5.0=tail|5.1=7#7|<5:2>;"));
+
+  TEST(log.pieces == 16+1);      /* "7" ends its packet; finish() completes it with no bytes */
+
+  u32 cut = 9;                  /* "temp 23 -|5;..": A number split after its sign */
+  parse(log, texts[0], DEC, &cut, 1);
+  TEST(log.pieces == 16+2);
+}
+
+static void test3() {           /* A packet's cursor is respected and consumed */
+  Log log;
+  log.used = log.pieces = 0;
+  log.open = false;
+  log.base = DEC;
+  StreamParser sp(logField, &log);
+  u8 buf[64];
+  u8 * packet = makePacket(buf, sizeof(buf), EAST, "L12 34");
+  int letter;
+  TEST(packetRead(packet, letter, BYTE) && letter == 'L');
+  sp.feed(packet);
+  TEST(packetReadEOF(packet) && sp.inField());
+  packet = makePacket(buf, sizeof(buf), EAST, "5 6");
+  sp.feed(packet);
+  sp.finish();
+  TEST(!strcmp(log.text, "0.0=12#12|0.1=345#345|0.2=6#6|"));
+  TEST(sp.getRecords() == 1);
+  sp.finish();                  /* Nothing in progress: no empty record */
+  TEST(sp.getRecords() == 1);
+}
+
+int main() {
+  test1();
+  test2();
+  test3();
+  return 0;
+}
+
+#endif /* TEST_STREAM_PARSER */
+
+#ifdef BENCH_STREAM_PARSER
+
+#include <time.h>   // for clock_gettime
+
+static double nowSeconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+static u32 sink;
+
+static void sumField(const StreamField & f, void *) {
+  if (f.number) sink += f.value;
+}
+
+int main() {
+  /* A report of numbers as long as a packet can hold, sent in 30 byte pieces */
+  char report[MAX_PACKET_LENGTH];
+  u32 len = 0;
+  while (len < MAX_PACKET_LENGTH-16) len += sprintf(report+len, "%ld ", random()%10000000);
+  report[len-1] = ';';
+  const u32 CHUNK = 30, packets = (len+CHUNK-1)/CHUNK;
+  static u8 bufs[16][4+CHUNK+1];
+  u8 * p[16];
+  for (u32 k = 0; k < packets; ++k) {
+    const u32 at = k*CHUNK, n = at+CHUNK <= len ? CHUNK : len-at;
+    p[k] = makePacket(bufs[k], sizeof(bufs[k]), EAST, (const u8 *) report+at, n);
+  }
+
+  const u32 REPS = 200000;
+  double start = nowSeconds();
+  for (u32 rep = 0; rep < REPS; ++rep) {     /* Copy the pieces together, then packetRead */
+    u8 data[MAX_PACKET_LENGTH], whole[4+MAX_PACKET_LENGTH+1];
+    u32 at = 0;
+    for (u32 k = 0; k < packets; ++k) {
+      memcpy(data+at, p[k], packetLength(p[k]));
+      at += packetLength(p[k]);
+    }
+    u8 * packet = makePacket(whole, sizeof(whole), EAST, data, at);
+    int val;
+    while (packetRead(packet, val, DEC)) sink += val;
+  }
+  const double copied = nowSeconds()-start;
+
+  StreamParser sp(sumField);
+  start = nowSeconds();
+  for (u32 rep = 0; rep < REPS; ++rep) {
+    for (u32 k = 0; k < packets; ++k) {
+      packetReread(p[k]);
+      sp.feed(p[k]);
+    }
+  }
+  const double streamed = nowSeconds()-start;
+
+  printf("%u byte report in %u packets, %u reps (sink %u)\n", len, packets, REPS, sink);
+  printf("%-28s %8.1f ns/report\n", "reassemble, then packetRead", copied*1e9/REPS);
+  printf("%-28s %8.1f ns/report\n", "StreamParser", streamed*1e9/REPS);
+  return 0;
+}
+
+#endif /* BENCH_STREAM_PARSER */
@@ -26,4 +26,27 @@ ISHW_TARGETS_HELP+="make tile\n\tbuild the sim tile simulator\n"
 # In addition, this file MAY set up any other variables that are
 # useful for internal operations within this subtree
 
-# 
\ No newline at end of file
+# 
+###
+# Host timings of the OS packet layer; see components/os/src/MFMBenchmark.cpp
+
+ISHW_TARGETS_HELP+="make bench\n\ttime the OS packet layer on this host, as CSV compared against bench-baseline.csv\n\t(BENCH_FLAGS='-json' for JSON, '-tolerance PERCENT' to change what fails)\n"
+ISHW_TARGETS_HELP+="make bench-baseline\n\ttime the OS packet layer and save the results as the new bench-baseline.csv\n"
+
+_TILES_SIM.BENCH_BUILD_DIR:=$(ISHW_BUILD_BASE_DIR)/components/tiles/sim
+_TILES_SIM.BENCH_BIN:=$(_TILES_SIM.BENCH_BUILD_DIR)/benchpackets
+_TILES_SIM.BENCH_BASELINE:=$(_TILES_SIM.DIR)/bench-baseline.csv
+_TILES_SIM.BENCH_OS_DIR:=$(ISHW_COMPONENT_DIR)/os
+_TILES_SIM.BENCH_SOURCES:=$(addprefix $(_TILES_SIM.BENCH_OS_DIR)/src/,MFMBenchmark.cpp MFMPacket.cpp \
+  MFMPacketReader.cpp MFMPacketWriter.cpp MFMPacketView.cpp MFMPacketIO.cpp MFMFraming.cpp)
+
+$(_TILES_SIM.BENCH_BIN):	$(_TILES_SIM.BENCH_BUILD_DIR)/.exists $(_TILES_SIM.BENCH_SOURCES) \
+			$(wildcard $(_TILES_SIM.BENCH_OS_DIR)/include/*.h) $(ISHW_ALL_DEP)
+	$(CROSS_CPP) -O2 -Wall -DHOST_MODE -DBENCH_PACKET_SUITE -I$(_TILES_SIM.BENCH_OS_DIR)/include \
+	  $(_TILES_SIM.BENCH_SOURCES) -o $@
+
+bench:	$(_TILES_SIM.BENCH_BIN)
+	$< -csv -baseline $(_TILES_SIM.BENCH_BASELINE) $(BENCH_FLAGS)
+
+bench-baseline:	$(_TILES_SIM.BENCH_BIN)
+	$< -csv $(BENCH_FLAGS) > $(_TILES_SIM.BENCH_BASELINE)
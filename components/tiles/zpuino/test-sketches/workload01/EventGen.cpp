@@ -41,6 +41,9 @@ unsigned int myMillis() {
 // when actually they wouldn't because only one side would hold the
 // lock between them at any given point.
 
+// The words an event sends to face f: 3/4 or 1/2 of 96 bit * 49 site event window
+static unsigned int eventWords(unsigned int f) { return (f&1)?111:74; }
+
 bool eventProcessingInitted = false;
 void eventProcessing() {
   static unsigned long eventCount = 0;
@@ -55,18 +58,27 @@ void eventProcessing() {
 
   static unsigned long badWords = 0;
   static unsigned long badPackets = 0;
+  static unsigned long blockedEvents = 0;
+
+  // Before anything wants buffers, take back the ones the TXes have
+  // finished with
+  for (int f = NT; f < FACE_COUNT; ++f) faceQueues[f].reclaimBG();
 
   // First, process inbound packets.  Here we spend O(n) resources per
-  // face checking the data of up to one n-word packet, and then toss
-  // the thing.
+  // face checking the data of up to one batch of n words of packets,
+  // and then toss the things.
+
+  for (unsigned int ready = facesReady(faceReadiness.inbound); ready; ready &= ready-1) {
+    PacketBuffer * batch[QUEUE_BATCH_MAX];
+    unsigned int n = faceQueues[nextFace(ready)].removeInboundBG(batch, QUEUE_BATCH_MAX);
 
-  for (int face = NT; face < FACE_COUNT; ++face) {
-    PacketBuffer * pb = faceQueues[face].inbound.remove();
+    for (unsigned int i = 0; i < n; ++i) {
+      PacketBuffer * pb = batch[i];
 
-    if (pb) {
       // Kill time and mem b/w proportional to packet size
       bool badPacket = false;
-      for (unsigned int w = 0; w < pb->trailer.length; ++w) {
+      unsigned int length = packetLength(pb);
+      for (unsigned int w = 0; w < length; ++w) {
         if (pb->words[w] != (w&0xf)*0x11111111) {
           ++badWords;
           badPacket = true;
@@ -74,25 +86,35 @@ void eventProcessing() {
       }
       if (badPacket) ++badPackets;
 
-      // Done
-      deletePacketBuffer(pb);
+      // Done (with this face's copy, anyway)
+      releasePacketBuffer(pb);
     }
   }
 
-  // Second, check if there's previous outbound stuff that hasn't
+  // Second, pick the next event, by selecting a random face, and
+  // check if there's previous outbound stuff on its faces that hasn't
   // shipped yet, and block if so.  This is a very bogus take on event
   // processing.
 
-  for (int face = NT; face < FACE_COUNT; ++face) {
-    if (!faceQueues[face].outbound.isEmpty()) { 
-      return;      // Blocked waiting for shipment, try again later
-    }
+  static int eventFace = -1;       // The next event's face, once picked
+  if (eventFace < 0) eventFace = random(FACE_COUNT);
+  int firstFaceM = eventFace;
+  int lastFaceM = eventFace;
+  if (eventFace&1) {
+    firstFaceM += FACE_COUNT-1;    // back one (in mod)
+    lastFaceM += FACE_COUNT+1;      // ahead one (ditto)
+  }
+  unsigned int eventFaces = 0;
+  for (int fm = firstFaceM; fm<=lastFaceM; ++fm) eventFaces |= 1u<<(fm%FACE_COUNT);
+
+  if (facesReady(faceReadiness.outbound, eventFaces)) {
+    return;      // Blocked waiting for shipment, try again later
   }
-  
-  // Sooner or later, we will find no more packets inbound or
-  // outbound.  At that point we'll declare the 'event' is over.  We
-  // increment the eventCount, and every so often, report some event
-  // statistics.
+
+  // Sooner or later, we will find no more packets outbound on those
+  // faces.  At that point we'll declare the previous 'event' there is
+  // over.  We increment the eventCount, and every so often, report
+  // some event statistics.
 
   const unsigned int PERIOD = 25000;
   if (++eventCount % PERIOD == 0) {
@@ -115,14 +137,16 @@ void eventProcessing() {
     for (int f = NT; f < FACE_COUNT; ++f) {
 
       // Assume face is unconnected if never rcvd packet
-      if (faceQueues[f].inbound.packetsIn == 0) continue;
+      if (faceQueues[f].inbound.inserted() == 0) continue;
 
       ++faceCount;
-      packetsInjected += faceQueues[f].inbound.packetsIn;
-      wordsInjected += faceQueues[f].inbound.wordsIn;
+      for (int p = 0; p < PRIORITY_CLASSES; ++p) {
+        packetsInjected += faceQueues[f].inbound.rings[p].packetsIn;
+        wordsInjected += faceQueues[f].inbound.rings[p].wordsIn;
 
-      packetsExtracted += faceQueues[f].outbound.packetsOut;
-      wordsExtracted += faceQueues[f].outbound.wordsOut;
+        packetsExtracted += faceQueues[f].outbound.rings[p].packetsOut;
+        wordsExtracted += faceQueues[f].outbound.rings[p].wordsOut;
+      }
     }
     if (faceCount > 0) {
       Serial.print(faceCount);
@@ -142,34 +166,144 @@ void eventProcessing() {
     }
 #endif /* PACKET_QUEUE_STATS */
 
+    unsigned long guaranteed = 0, granted = 0, starved = 0;
+    for (int f = NT; f < FACE_COUNT; ++f) {
+      guaranteed += poolStats(f).guaranteed;
+      granted += poolStats(f).granted;
+      starved += poolStats(f).starved;
+    }
+    Serial.print("; reserve ");
+    Serial.print(poolReserveUsed());
+    Serial.print("/");
+    Serial.print(poolReserveSize());
+    Serial.print(" (peak ");
+    Serial.print(poolReservePeak());
+    Serial.print("), ");
+    Serial.print(guaranteed);
+    Serial.print(",");
+    Serial.print(granted);
+    Serial.print(",");
+    Serial.print(starved);
+    Serial.print(" pb guaranteed,granted,starved; ");
+    for (int c = 0; c < PACKET_CLASSES; ++c) {
+      Serial.print(c ? "," : "");
+      Serial.print(classStats(c).peak);
+      Serial.print("/");
+      Serial.print(classStats(c).count);
+    }
+    Serial.print(" 32,64,256B peak; ");
+#if PACKET_QUEUE_STATS
+    for (int p = 0; p < PRIORITY_CLASSES; ++p) {
+      unsigned int peakDepth = 0;
+#if PACKET_QUEUE_WAITS
+      unsigned long waits = 0, waitTicks = 0;
+      unsigned int maxWait = 0;
+#endif
+      for (int f = NT; f < FACE_COUNT; ++f) {
+        const PriorityQueue & q = faceQueues[f].outbound;
+#if PACKET_QUEUE_WAITS
+        waits += q.waits[p];
+        waitTicks += q.waitTicks[p];
+        if (q.maxWait[p] > maxWait) maxWait = q.maxWait[p];
+#endif
+        if (q.peakDepth[p] > peakDepth) peakDepth = q.peakDepth[p];
+      }
+      Serial.print(p == PRIORITY_CONTROL ? "ctl " : ", bulk ");
+#if PACKET_QUEUE_WAITS
+      Serial.print(waits ? waitTicks*1.0/waits : 0.0);
+      Serial.print("/");
+      Serial.print(maxWait);
+      Serial.print(" wait avg/max, ");
+#endif
+      Serial.print("depth ");
+      Serial.print(peakDepth);
+    }
+    Serial.print("; ");
+#endif
+    Serial.print(blockedEvents);
+    Serial.print(" blocked evts");
+
     Serial.println();
   }
-  
 
-  // Finally, we start up another event by selecting a random face.
-  int eventFace = random(FACE_COUNT);
-  int firstFaceM = eventFace;
-  int lastFaceM = eventFace;
-  if (eventFace&1) {
-    firstFaceM += FACE_COUNT-1;    // back one (in mod)
-    lastFaceM += FACE_COUNT+1;      // ahead one (ditto)
+  // Every so often, and each time until no face is short, set the
+  // faces' pool minimums by who's connected
+  const unsigned int REBALANCE_PERIOD = 1000;
+  static unsigned int shortFaces = 0;
+  if (shortFaces || eventCount % REBALANCE_PERIOD == 0) shortFaces = rebalancePools();
+
+
+  // Finally, we start up the event.
+  int face = eventFace;
+  eventFace = -1;
+
+  // Backpressure: Don't start an event on faces that can't get the
+  // buffers for it: full size ones for the window (its tail may fit a
+  // smaller one, but needn't), and one of any size for the lock
+  // message.  Next time we'll try some other face.
+  for (unsigned int e = eventFaces; e; e &= e-1) {
+    unsigned int f = nextFace(e);
+    unsigned int full = (eventWords(f)+PACKET_MAX_WORDS-1)/PACKET_MAX_WORDS;
+    bool small = poolAvailable(f, CLASS_32) + poolAvailable(f, CLASS_64) > 0;
+    if (poolAvailable(f, CLASS_256) < full + !small) {
+      ++blockedEvents;
+      return;
+    }
   }
 
-  for (int fm = firstFaceM; fm<=lastFaceM; ++fm) {
-    unsigned int f = fm%FACE_COUNT;
-    unsigned int wordCount =  (f&1)?111:74;  // 3/4 or 1/2 of 96 bit * 49 site event window
-    while (wordCount > 0) {
-      int plen = wordCount > PACKET_MAX_WORDS ? PACKET_MAX_WORDS : wordCount;
-      wordCount -= plen;
-      PacketBuffer * pb = newPacketBuffer();
-      for (unsigned int w = 0; w < wordCount; ++w) {
-        pb->words[w] = (w&0xf)*0x11111111;  // sixteen data patterns, including 32 1's
+  // Lock the event window: one word of control traffic to each face
+  // involved, ahead of anything bulk they have queued
+  {
+    PacketWriter pw(faceQueues[face], 1, PRIORITY_CONTROL);
+    if (!pw.ok()) return;
+    pw.put(0);
+    if (!pw.commit(eventFaces)) {
+      ++blockedEvents;
+      return;
+    }
+  }
+
+  // Each stretch of the event window goes out once: the faces that
+  // get the same words of it share one multicast buffer.  (For a
+  // corner event, all three faces share the full size packets.)  The
+  // buffers are queued together, each face's share in one batch.
+  PacketBuffer * batch[QUEUE_BATCH_MAX];
+  unsigned int batchFaces[QUEUE_BATCH_MAX];
+  unsigned int batched = 0;
+  bool out = false;                  // Out of buffers after all (the faces share the reserve)
+  for (unsigned int start = 0; !out; start += PACKET_MAX_WORDS) {
+    unsigned int pending = 0;        // Bits of the faces wanting words past start
+    for (unsigned int e = eventFaces; e; e &= e-1) {
+      if (eventWords(nextFace(e)) > start) pending |= e&-e;
+    }
+    if (pending == 0) break;
+
+    while (pending) {
+      unsigned int f = nextFace(pending);
+      unsigned int plen = eventWords(f)-start;
+      if (plen > PACKET_MAX_WORDS) plen = PACKET_MAX_WORDS;
+      unsigned int faces = 0;        // f and every other face wanting the same
+      for (unsigned int p = pending; p; p &= p-1) {
+        unsigned int glen = eventWords(nextFace(p))-start;
+        if ((glen > PACKET_MAX_WORDS ? PACKET_MAX_WORDS : glen) == plen) faces |= p&-p;
       }
-      pb->trailer.length = wordCount;
+      pending &= ~faces;
 
-      faceQueues[f].insertOutboundBG(pb);
+      PacketWriter pw(faceQueues[f], plen);  // Formats in place in the outbound buffer
+      if (!pw.ok()) {
+        out = true;
+        break;
+      }
+      for (unsigned int w = 0; w < plen; ++w) {
+        pw.put((w&0xf)*0x11111111);    // sixteen data patterns, including 32 1's
+      }
+      batch[batched] = pw.finish();
+      batchFaces[batched++] = faces;
+      if (batched == QUEUE_BATCH_MAX) {
+        multicastOutboundBG(batch, batchFaces, batched);
+        batched = 0;
+      }
     }
   }
+  multicastOutboundBG(batch, batchFaces, batched);
 }
-
-
@@ -1,18 +1,455 @@
 #include "FaceQueue.h"
-#include "Arduino.h"  // For noInterrupts(), interrupts()
 
 FaceQueue faceQueues[FACE_COUNT];
+// No packets anywhere, and every TX starts out idle
+FaceReadiness faceReadiness = { { { 0 }, { 0 } }, { { 0 }, { 0 } }, ALL_FACE_BITS };
 
-void FaceQueue::insertOutboundBG(PacketBuffer * pb) {
-  noInterrupts();             // Brute force for now
-  outbound.insert(pb);
-  interrupts();
+typedef char OnePoolPerFace[PACKET_POOLS == FACE_COUNT ? 1 : -1];
+
+unsigned int rebalancePools() {
+  static const unsigned int minimums[PACKET_CLASSES] = {
+    POOL_MIN_32, POOL_MIN_64, POOL_MIN_BUFFERS
+  };
+  unsigned int shortFaces = 0;
+  for (int f = NT; f < FACE_COUNT; ++f) {
+    bool connected = faceQueues[f].inbound.inserted() != 0;
+    for (int c = 0; c < PACKET_CLASSES; ++c) {
+      unsigned int want = connected ? minimums[c] : 0;
+      if (poolStats(f, c).minimum != want && !setPoolMinimum(f, want, c)) shortFaces |= 1u<<f;
+    }
+  }
+  return shortFaces;
 }
 
-PacketBuffer * FaceQueue::removeInboundBG() {
-  noInterrupts();             // Ditto
-  PacketBuffer * ret = inbound.remove();
-  interrupts();
+unsigned int FaceQueue::reclaimBG() {
+  PacketBuffer * batch[QUEUE_BATCH_MAX];
+  unsigned int ret = 0;
+  for (unsigned int n; (n = done.remove(batch, QUEUE_BATCH_MAX)) > 0; ret += n)
+    for (unsigned int k = 0; k < n; ++k) deletePacketBuffer(batch[k]);
   return ret;
 }
 
+bool PriorityQueue::insert(PacketBuffer * pb, unsigned int priority) {
+  if (priority >= PRIORITY_CLASSES) priority = PRIORITY_BULK;
+  PacketRing & r = rings[priority];
+  if (!r.insert(pb)) return false;
+
+#if PACKET_QUEUE_STATS
+  unsigned int depth = r.depth();
+  if (depth > peakDepth[priority]) peakDepth[priority] = depth;
+#endif
+
+  return true;
+}
+
+unsigned int PriorityQueue::insert(PacketBuffer * const * pbs, unsigned int n,
+                                   unsigned int priority) {
+  if (priority >= PRIORITY_CLASSES) priority = PRIORITY_BULK;
+  PacketRing & r = rings[priority];
+  unsigned int ret = r.insert(pbs, n);
+
+#if PACKET_QUEUE_STATS
+  unsigned int depth = r.depth();
+  if (depth > peakDepth[priority]) peakDepth[priority] = depth;
+#endif
+
+  return ret;
+}
+
+void PriorityQueue::served(PacketBuffer * const * pbs, unsigned int n, unsigned int p) {
+#if PACKET_QUEUE_WAITS
+  unsigned short now = queueClock();
+  for (unsigned int k = 0; k < n; ++k) {
+    unsigned int waited = (unsigned short) (now - queuedAt[packetIndex(pbs[k])]);
+    waitTicks[p] += waited;
+    if (waited > maxWait[p]) maxWait[p] = waited;
+  }
+  waits[p] += n;
+#endif
+}
+
+PacketBuffer * PriorityQueue::remove(unsigned int * priority) {
+  PacketRing & bulk = rings[PRIORITY_BULK];
+  unsigned int p = PRIORITY_CONTROL;
+  if (burst >= CONTROL_BURST_LIMIT && !bulk.isEmpty()) p = PRIORITY_BULK;  // Bulk's turn
+  PacketBuffer * pb = rings[p].remove();
+  if (!pb) {
+    p = PRIORITY_CONTROL + PRIORITY_BULK - p;  // The other one
+    pb = rings[p].remove();
+    if (!pb) return 0;
+  }
+  if (p == PRIORITY_CONTROL && !bulk.isEmpty()) ++burst;
+  else burst = 0;
+
+  served(&pb, 1, p);
+  if (priority) *priority = p;
+  return pb;
+}
+
+unsigned int PriorityQueue::remove(PacketBuffer ** pbs, unsigned int n, unsigned int * priorities) {
+  PacketRing & control = rings[PRIORITY_CONTROL];
+  PacketRing & bulk = rings[PRIORITY_BULK];
+  unsigned int got = 0;
+  while (got < n) {
+    // As much control as bulk's turn allows, else bulk: just its one
+    // turn if there's control waiting, or all it can
+    bool bulkWaiting = !bulk.isEmpty();
+    unsigned int p = PRIORITY_CONTROL, k = 0;
+    if (!bulkWaiting || burst < CONTROL_BURST_LIMIT) {
+      unsigned int take = n - got;
+      if (bulkWaiting && take > CONTROL_BURST_LIMIT - burst) take = CONTROL_BURST_LIMIT - burst;
+      k = control.remove(pbs + got, take);
+      burst = bulkWaiting ? burst + k : 0;
+    }
+    if (k == 0) {
+      p = PRIORITY_BULK;
+      k = bulk.remove(pbs + got, control.isEmpty() ? n - got : 1);
+      if (k == 0) break;
+      burst = 0;
+    }
+    served(pbs + got, k, p);
+    for (unsigned int i = got; priorities && i < got + k; ++i) priorities[i] = p;
+    got += k;
+  }
+  return got;
+}
+
+unsigned int multicastOutboundBG(PacketBuffer * pb, unsigned int faces, unsigned int priority) {
+  unsigned int count = 0;
+  for (unsigned int f = NT; f < FACE_COUNT; ++f) count += (faces>>f)&1;
+
+  // Every reference has to be in place before the first face can
+  // send it and release one, and it's stamped once, for all of them
+  retainPacketBuffer(pb, count);
+  faceQueues[NT].outbound.stamp(pb);  // (Outbound stamps are shared by all faces)
+  unsigned int queued = 0;
+  for (unsigned int f = NT; f < FACE_COUNT; ++f) {
+    if (!((faces>>f)&1)) continue;
+    if (!faceQueues[f].outbound.insert(pb, priority)) {
+      releasePacketBuffer(pb);
+      continue;
+    }
+    readyAdd(faceReadiness.outbound.inserted, f, 1);
+    queued |= 1u<<f;
+  }
+  releasePacketBuffer(pb);  // The caller's
+  return queued;
+}
+
+unsigned int multicastOutboundBG(PacketBuffer * const * pbs, const unsigned int * faces,
+                                 unsigned int n, unsigned int priority) {
+  // As for one buffer: all the references, and the stamps, first
+  unsigned int all = 0;
+  for (unsigned int k = 0; k < n; ++k) {
+    unsigned int count = 0;
+    for (unsigned int f = faces[k]&ALL_FACE_BITS; f; f &= f-1) ++count;
+    retainPacketBuffer(pbs[k], count);
+    all |= faces[k];
+  }
+  faceQueues[NT].outbound.stamp(pbs, n);
+
+  unsigned int complete = 0;
+  for (unsigned int fs = all&ALL_FACE_BITS; fs; fs &= fs-1) {
+    unsigned int f = nextFace(fs);
+    PacketBuffer * batch[QUEUE_BATCH_MAX];
+    bool whole = true;
+    for (unsigned int k = 0; k < n; ) {
+      unsigned int want = 0;
+      for (; k < n && want < QUEUE_BATCH_MAX; ++k)
+        if ((faces[k]>>f)&1) batch[want++] = pbs[k];
+      unsigned int got = faceQueues[f].outbound.insert(batch, want, priority);
+      if (got > 0) readyAdd(faceReadiness.outbound.inserted, f, got);
+      for (unsigned int i = got; i < want; ++i) releasePacketBuffer(batch[i]);
+      whole = whole && got == want;
+    }
+    if (whole) complete |= 1u<<f;
+  }
+  for (unsigned int k = 0; k < n; ++k) releasePacketBuffer(pbs[k]);  // The caller's
+  return complete;
+}
+
+// Host sim stress benchmark: an 'interrupt level' thread and a
+// 'background' thread pass every buffer in the pool around all eight
+// faces' rings as fast as they can, visiting just the ready faces and
+// checking every word of every packet -- and that every face found
+// ready has a packet, that no packet goes unnoticed for long, and that
+// at the end the ready faces are just the ones with packets -- and the
+// same is timed with the old queues under one global lock, standing
+// in for noInterrupts()/interrupts().  Then, single
+// threaded, it checks that control packets go out ahead of any bulk
+// backlog, and that bulk still gets its turns under nonstop control.
+//
+// TO COMPILE FOR BENCHMARKING:
+//
+// g++ -O2 -Wall -Werror -DHOST_MODE -DBENCH_FACE_QUEUE -o"./benchfacequeue" FaceQueue.cpp Packets.cpp -lpthread;./benchfacequeue
+
+#ifdef BENCH_FACE_QUEUE
+
+#include <stdio.h>
+#include <stdlib.h>    // For exit, atoi
+#include <pthread.h>
+#include <sched.h>     // For sched_yield
+#include <time.h>      // For clock_gettime
+
+// The old queues, locked as the old FaceQueue.cpp did, for comparison
+static pthread_mutex_t interruptLock = PTHREAD_MUTEX_INITIALIZER;
+
+struct LockedFaceQueue {
+  PacketQueue inbound;
+  PacketQueue outbound;
+
+  bool locked(PacketQueue & q, PacketBuffer * pb) {
+    pthread_mutex_lock(&interruptLock);
+    q.insert(pb);
+    pthread_mutex_unlock(&interruptLock);
+    return true;
+  }
+  PacketBuffer * locked(PacketQueue & q) {
+    pthread_mutex_lock(&interruptLock);
+    PacketBuffer * ret = q.remove();
+    pthread_mutex_unlock(&interruptLock);
+    return ret;
+  }
+
+  bool insertInboundIL(PacketBuffer * pb) { return locked(inbound, pb); }
+  bool insertOutboundBG(PacketBuffer * pb) { return locked(outbound, pb); }
+  PacketBuffer * removeOutboundIL() { return locked(outbound); }
+  PacketBuffer * removeInboundBG() { return locked(inbound); }
+};
+
+static LockedFaceQueue lockedQueues[FACE_COUNT];
+
+// The faces worth visiting: the ready ones, or for the old queues all
+static unsigned int ready(FaceQueue *, ReadyCounts & counts) { return facesReady(counts); }
+static unsigned int ready(LockedFaceQueue *, ReadyCounts &) { return ALL_FACE_BITS; }
+static bool exact(FaceQueue *) { return true; }         // A ready face has packets
+static bool exact(LockedFaceQueue *) { return false; }
+
+// The faces whose 'q' has packets, going by the queues themselves
+static unsigned int pending(FaceQueue * queues, PriorityQueue FaceQueue::* q) {
+  unsigned int ret = 0;
+  for (int f = NT; f < FACE_COUNT; ++f) if (!(queues[f].*q).isEmpty()) ret |= 1u<<f;
+  return ret;
+}
+static unsigned int pending(LockedFaceQueue *, PriorityQueue FaceQueue::*) { return 0; }
+
+// How long a queue may have packets with its face not ready before
+// it counts as a lost wakeup.  (Past the moment between an insert and
+// its count, only the host descheduling the producer could do it.)
+#define STALL_SECONDS 2
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+static unsigned long totalPackets = 2000000;
+
+// words[0] of each packet is its face's sequence number; the rest
+// are derived from it
+static unsigned long pattern(unsigned long seq, unsigned int w) {
+  return (seq*0x9e3779b1ul)^(w*0x11111111ul);
+}
+
+template <class Q>
+struct Stress {
+  Q * queues;
+  unsigned long sent[FACE_COUNT];     // Owned by the IL thread
+  unsigned long checked[FACE_COUNT];  // Owned by the BG thread
+  unsigned long total;
+  volatile bool failed;
+
+  // A consumer found face f ready but its queue empty: the readiness
+  // counts are wrong.  (The old queues' faces are all 'ready'.)
+  void readyEmpty(int f, const char * dir) {
+    if (!exact(queues)) return;
+    fprintf(stderr, "Face %d ready with no %s packets\n", f, dir);
+    failed = true;
+  }
+
+  // A consumer found no face with work: fine, unless its queues have
+  // had packets all along for STALL_SECONDS
+  void idle(double & stalled, PriorityQueue FaceQueue::* q, const char * dir) {
+    unsigned int missed = pending(queues, q);
+    if (!missed) stalled = 0;
+    else if (stalled == 0) stalled = now();
+    else if (now() - stalled > STALL_SECONDS) {
+      fprintf(stderr, "Lost wakeup: %s packets on faces %02x, none ready\n", dir, missed);
+      failed = true;
+    }
+    sched_yield();
+  }
+
+  // Whether each direction's ready faces are the ones with packets
+  bool consistent() {
+    return !exact(queues) ||
+      (ready(queues, faceReadiness.inbound) == pending(queues, &FaceQueue::inbound) &&
+       ready(queues, faceReadiness.outbound) == pending(queues, &FaceQueue::outbound));
+  }
+
+  // Interrupt level: Take each outbound packet the background queued,
+  // and bring it 'in' again as the next packet on that face
+  static void * il(void * arg) {
+    Stress & s = *(Stress *) arg;
+    unsigned long count = 0;
+    double stalled = 0;
+    while (count < s.total && !s.failed) {
+      bool idle = true;
+      unsigned int faces = ready(s.queues, faceReadiness.outbound);
+      for (; faces && count < s.total; faces &= faces-1) {
+        int f = nextFace(faces);
+        PacketBuffer * pb = s.queues[f].removeOutboundIL();
+        if (!pb) {
+          s.readyEmpty(f, "outbound");
+          continue;
+        }
+        unsigned long seq = s.sent[f]++;
+        unsigned int len = 1 + (seq*7+f)%PACKET_MAX_WORDS;
+        pb->words[0] = seq;
+        for (unsigned int w = 1; w < len; ++w) pb->words[w] = pattern(seq, w);
+        setPacketLength(pb, len);
+        if (!s.queues[f].insertInboundIL(pb)) s.failed = true;
+        ++count;
+        idle = false;
+      }
+      if (idle) s.idle(stalled, &FaceQueue::outbound, "outbound");
+      else stalled = 0;
+    }
+    return 0;
+  }
+
+  // Background: Check each inbound packet and queue it outbound again
+  static void * bg(void * arg) {
+    Stress & s = *(Stress *) arg;
+    unsigned long count = 0;
+    double stalled = 0;
+    while (count < s.total && !s.failed) {
+      bool idle = true;
+      unsigned int faces = ready(s.queues, faceReadiness.inbound);
+      for (; faces && count < s.total; faces &= faces-1) {
+        int f = nextFace(faces);
+        PacketBuffer * pb = s.queues[f].removeInboundBG();
+        if (!pb) {
+          s.readyEmpty(f, "inbound");
+          continue;
+        }
+        unsigned long seq = s.checked[f]++;
+        unsigned int len = 1 + (seq*7+f)%PACKET_MAX_WORDS;
+        bool ok = packetLength(pb) == len && pb->words[0] == seq;
+        for (unsigned int w = 1; ok && w < len; ++w) ok = pb->words[w] == pattern(seq, w);
+        if (!ok) {
+          fprintf(stderr, "Face %d packet %lu corrupt\n", f, seq);
+          s.failed = true;
+        }
+        if (!s.queues[f].insertOutboundBG(pb)) s.failed = true;
+        ++count;
+        idle = false;
+      }
+      if (idle) s.idle(stalled, &FaceQueue::inbound, "inbound");
+      else stalled = 0;
+    }
+    return 0;
+  }
+
+  double run(Q * q) {
+    queues = q;
+    total = totalPackets;
+    failed = false;
+    for (int f = NT; f < FACE_COUNT; ++f) sent[f] = checked[f] = 0;
+
+    // Deal the whole pool out to the faces, to start
+    int f = 0;
+    for (PacketBuffer * pb; (pb = newPacketBuffer(f)) != 0; f = (f+1)%FACE_COUNT)
+      queues[f].insertOutboundBG(pb);
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    pthread_t ilThread, bgThread;
+    pthread_create(&ilThread, 0, il, this);
+    pthread_create(&bgThread, 0, bg, this);
+    pthread_join(ilThread, 0);
+    pthread_join(bgThread, 0);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    // Everything the IL side sent must have been checked, and every
+    // buffer must come home.  With both sides stopped, the faces
+    // ready must be just the ones with packets, before and after
+    bool agreed = consistent();
+    unsigned long s = 0, c = 0;
+    for (int g = NT; g < FACE_COUNT; ++g) {
+      s += sent[g];
+      c += checked[g];
+      for (PacketBuffer * pb; (pb = queues[g].removeInboundBG()) != 0; ) deletePacketBuffer(pb);
+      for (PacketBuffer * pb; (pb = queues[g].removeOutboundIL()) != 0; ) deletePacketBuffer(pb);
+    }
+    if (!agreed || !consistent()) {
+      fprintf(stderr, "FAILED: readiness disagrees with the queues\n");
+      exit(1);
+    }
+    unsigned int pool = poolFreeCount();
+    initPackets();
+    if (failed || s != total || c != total || pool != BUFFER_COUNT) {
+      fprintf(stderr, "FAILED: sent %lu checked %lu of %lu, %u of %d buffers returned\n",
+              s, c, total, pool, BUFFER_COUNT);
+      exit(1);
+    }
+    return (t1.tv_sec-t0.tv_sec) + (t1.tv_nsec-t0.tv_nsec)/1e9;
+  }
+};
+
+int main(int argc, char ** argv) {
+  if (argc > 1) totalPackets = atoi(argv[1]);
+  initPackets();
+
+  static Stress<FaceQueue> rings;
+  static Stress<LockedFaceQueue> locks;
+  double ringSecs = rings.run(faceQueues);
+  double lockSecs = locks.run(lockedQueues);
+
+  printf("%lu packets each way through %d faces, all words checked\n", totalPackets, FACE_COUNT);
+  printf("  %-24s %8.1f ns/packet\n", "SPSC rings", ringSecs*1e9/totalPackets);
+  printf("  %-24s %8.1f ns/packet\n", "global lock", lockSecs*1e9/totalPackets);
+#if !PACKET_QUEUE_WAITS
+  printf("  (no wait time stamps on the rings; -DPACKET_QUEUE_WAITS=1 to time them too)\n");
+#endif
+
+  FaceQueue & fq = faceQueues[NT];
+  printf("Control packet behind a bulk backlog of");
+  for (unsigned int backlog = 0; backlog <= 64; backlog += 32) {
+    for (unsigned int i = 0; i < backlog; ++i) fq.insertOutboundBG(newPacketBuffer(NT));
+    PacketBuffer * control = newPacketBuffer(NT, 1);
+    fq.insertOutboundBG(control, PRIORITY_CONTROL);
+    unsigned int ahead = 0;
+    for (PacketBuffer * pb; (pb = fq.removeOutboundIL()) != control; ++ahead)
+      deletePacketBuffer(pb);
+    deletePacketBuffer(control);
+    for (PacketBuffer * pb; (pb = fq.removeOutboundIL()) != 0; ) deletePacketBuffer(pb);
+    printf(" %u: %u ahead%s", backlog, ahead, backlog < 64 ? "," : "\n");
+    if (ahead != 0) return 1;
+  }
+
+  // Keep both classes queued, and see how long bulk goes unserved
+  for (unsigned int i = 0; i < 32; ++i) fq.insertOutboundBG(newPacketBuffer(NT));
+  for (unsigned int i = 0; i < 4; ++i)
+    fq.insertOutboundBG(newPacketBuffer(NT, 1), PRIORITY_CONTROL);
+  unsigned int run = 0, longest = 0;
+  for (unsigned int i = 0; i < 10000; ++i) {
+    unsigned int priority;
+    PacketBuffer * pb = fq.removeOutboundIL(&priority);
+    fq.insertOutboundBG(pb, priority);  // Keep it coming
+    if (priority == PRIORITY_CONTROL) ++run;
+    else run = 0;
+    if (run > longest) longest = run;
+  }
+  printf("Under nonstop control traffic, bulk waited at most %u packets (limit %d)\n",
+         longest, CONTROL_BURST_LIMIT);
+#if PACKET_QUEUE_STATS
+  printf("  control: %lu packets, peak depth %u; bulk peak depth %u\n",
+         fq.outbound.rings[PRIORITY_CONTROL].packetsOut, fq.outbound.peakDepth[PRIORITY_CONTROL],
+         fq.outbound.peakDepth[PRIORITY_BULK]);
+#endif
+  return longest == CONTROL_BURST_LIMIT ? 0 : 1;
+}
+
+#endif /* BENCH_FACE_QUEUE */
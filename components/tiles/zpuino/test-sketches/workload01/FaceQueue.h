@@ -3,23 +3,349 @@
 
 #include "Packets.h"
 
-struct FaceQueue {
-  PacketQueue inbound;
-  PacketQueue outbound;
+// Priority classes.  Control traffic (locks, acks) is served ahead of
+// bulk event data, so it never waits behind a face's backlog; but
+// after CONTROL_BURST_LIMIT control packets in a row with bulk
+// waiting, a bulk packet goes next, so bulk can't starve either.
+enum PacketPriority { PRIORITY_CONTROL, PRIORITY_BULK, PRIORITY_CLASSES };
+
+#ifndef CONTROL_BURST_LIMIT
+#define CONTROL_BURST_LIMIT 8
+#endif
+
+#define QUEUE_BATCH_MAX 16  /* Packets a TX, or a batched multicast, takes at a time */
+
+// The time, for wait times: ticks of 1024 TSC clocks (of 1024ns in a
+// host sim without one), modulo 2^16
+#ifndef HOST_MODE
+inline unsigned short queueClock() { return (unsigned short) (TIMERTSC>>10); }
+#elif defined(__i386__) || defined(__x86_64__)
+inline unsigned short queueClock() { return (unsigned short) (__builtin_ia32_rdtsc()>>10); }
+#else
+#include <time.h>      // For clock_gettime
+inline unsigned short queueClock() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned short) ((ts.tv_sec*1000000000ul + ts.tv_nsec)>>10);
+}
+#endif
+
+// A PacketRing per priority class, so still one producer and one
+// consumer, and never a lock.  With PACKET_QUEUE_WAITS, each direction
+// also has its own time stamps, written only by its producer, for
+// wait times.  The consumer's state comes first and the producer's
+// last, to keep them on separate cache lines in the host sim.
+enum QueueDirection { QUEUE_INBOUND, QUEUE_OUTBOUND };
+
+struct PriorityQueue {
+#if PACKET_QUEUE_WAITS
+  // Consumer side
+  unsigned long waits[PRIORITY_CLASSES];      // Packets removed
+  unsigned long waitTicks[PRIORITY_CLASSES];  // Their total queueClock() ticks queued
+  unsigned int maxWait[PRIORITY_CLASSES];     // The longest of them
+#endif
+  unsigned int burst;                         // Control served in a row with bulk waiting
+
+  PacketRing rings[PRIORITY_CLASSES];
+
+  // Producer side
+#if PACKET_QUEUE_STATS
+  unsigned int peakDepth[PRIORITY_CLASSES];   // Most packets queued at once
+#endif
+#if PACKET_QUEUE_WAITS
+  unsigned short * queuedAt;                  // This direction's time stamps
+#endif
 
-  void insertInboundIL(PacketBuffer * pb) {   // Called at Interrupt Level
-    inbound.insert(pb);
+  bool insert(PacketBuffer *, unsigned int priority) ;  // Producer only.  False if full
+  PacketBuffer * remove(unsigned int * priority = 0) ;  // Consumer only.  Null if empty
+
+  // Batches, as for PacketRing, served in the same order as one at a time
+  unsigned int insert(PacketBuffer * const * pbs, unsigned int n, unsigned int priority) ;
+  unsigned int remove(PacketBuffer ** pbs, unsigned int n, unsigned int * priorities = 0) ;
+
+  // Consumer only: account for removing pbs[0..n) from class p, at the
+  // one clock read for the lot
+  void served(PacketBuffer * const * pbs, unsigned int n, unsigned int priority) ;
+
+  // Producer only: stamp packets with the time before inserting them
+  void stamp(PacketBuffer * const * pbs, unsigned int n = 1) {
+#if PACKET_QUEUE_WAITS
+    unsigned short now = queueClock();
+    for (unsigned int k = 0; k < n; ++k) queuedAt[packetIndex(pbs[k])] = now;
+#endif
+  }
+  void stamp(PacketBuffer * pb) { stamp(&pb); }
+
+  bool isEmpty() { return rings[PRIORITY_CONTROL].isEmpty() && rings[PRIORITY_BULK].isEmpty(); }
+  unsigned int inserted() {    // Ever, mod 2^32
+    return rings[PRIORITY_CONTROL].inserted() + rings[PRIORITY_BULK].inserted();
   }
-  void insertOutboundBG(PacketBuffer * pb) ;  // Called by BackGround processing
 
-  PacketBuffer * removeOutboundIL() {      // Called at Interrupt Level
-    return outbound.remove();
+  PriorityQueue(QueueDirection d) : burst(0)
+#if PACKET_QUEUE_WAITS
+    , queuedAt(packetDescriptors.queuedAt[d])
+#endif
+  {
+    for (int p = 0; p < PRIORITY_CLASSES; ++p) {
+#if PACKET_QUEUE_WAITS
+      waits[p] = waitTicks[p] = 0;
+      maxWait[p] = 0;
+#endif
+#if PACKET_QUEUE_STATS
+      peakDepth[p] = 0;
+#endif
+    }
   }
-  PacketBuffer * removeInboundBG() ;       // Called by BackGround processing
 };
 
 enum FaceCode { NT = 0, NE, ET, SE, ST, SW, WT, NW, FACE_COUNT };
 
+// Face readiness, kept up to date by the FaceQueue operations, so
+// finding the faces with work is a loop over set bits (see
+// nextFace()) rather than a scan of all eight.  Readiness isn't a
+// mask that both sides set and clear: each direction keeps a count
+// of packets inserted, written only by its producer, and one of
+// packets removed, written only by its consumer, 15 bits a face, two
+// faces a word.  So no word is ever written from both sides (all
+// interrupt handlers are one side: they don't interrupt each other),
+// and nothing needs interrupts masked.  A face is ready when its two
+// counts differ.  The producer counts after inserting and the
+// consumer after removing, so a consumer never sees a face ready
+// with its queue empty, and may see one not ready only for the
+// moment between the producer's insert and its count -- after which
+// the count catches up, so no packet is ever left unnoticed.
+struct ReadyCounts {
+  volatile unsigned int inserted[FACE_COUNT/2];  // Written only by the producer
+  volatile unsigned int removed[FACE_COUNT/2];   // Written only by the consumer
+};
+
+// Add n to face f's count, in one of those arrays.  For its one
+// writer only.
+inline void readyAdd(volatile unsigned int * counts, unsigned int f, unsigned int n) {
+  unsigned int shift = (f&1)*16;
+  volatile unsigned int & w = counts[f>>1];
+  ringRelease(w, (w + (n<<shift)) & ~(0x8000u<<shift));  // Never carry into the other face
+}
+
+struct FaceReadiness {
+  ReadyCounts inbound;             // Inbound packets waiting
+  ReadyCounts outbound;            // Outbound packets waiting
+  volatile unsigned int txIdle;    // Bit f: TX asked for a packet and got none; IL only
+};
+
+extern FaceReadiness faceReadiness;
+
+// The bits of the faces of 'faces' that are ready, say
+// facesReady(faceReadiness.outbound, eventFaces) to check whether any
+// of an event's faces still have outbound packets queued
+inline unsigned int facesReady(ReadyCounts & counts, unsigned int faces = ~0u) {
+  unsigned int ready = 0;
+  for (unsigned int w = 0; w < FACE_COUNT/2; ++w) {
+    unsigned int x = ringAcquire(counts.inserted[w]) ^ ringAcquire(counts.removed[w]);
+    x = (x + 0x7fff7fff) & 0x80008000;  // Bit 15 and bit 31: each half nonzero
+    ready |= ((x>>15 | x>>30) & 3) << 2*w;
+  }
+  return ready & faces;
+}
+inline unsigned int facesReady(volatile unsigned int & mask, unsigned int faces = ~0u) {
+  return ringAcquire(mask) & faces;
+}
+
+// The lowest face in 'faces', which must not be 0.  To visit each:
+//   for (unsigned int f = facesReady(mask); f; f &= f-1) ..nextFace(f)..
+inline unsigned int nextFace(unsigned int faces) { return __builtin_ctz(faces); }
+
+// Each face's queues have exactly one producer and one consumer, so
+// they never need interrupts masked: inbound packets go from
+// interrupt level to the background, outbound packets from the
+// background to interrupt level, and sent buffers whose last
+// reference is gone go back from interrupt level to the background,
+// on 'done', to be deleted.
+struct FaceQueue {
+  PriorityQueue inbound;
+  PriorityQueue outbound;
+  PacketRing done;
+
+  FaceQueue() : inbound(QUEUE_INBOUND), outbound(QUEUE_OUTBOUND) { }
+
+  unsigned int face() const ;  // This face's FaceCode
+
+  // Called at Interrupt Level
+  bool insertInboundIL(PacketBuffer * pb, unsigned int priority = PRIORITY_BULK) {
+    inbound.stamp(pb);
+    if (!inbound.insert(pb, priority)) return false;
+    readyAdd(faceReadiness.inbound.inserted, face(), 1);
+    return true;
+  }
+  // Called by BackGround processing
+  bool insertOutboundBG(PacketBuffer * pb, unsigned int priority = PRIORITY_BULK) {
+    outbound.stamp(pb);
+    if (!outbound.insert(pb, priority)) return false;
+    readyAdd(faceReadiness.outbound.inserted, face(), 1);
+    return true;
+  }
+
+  // Called at Interrupt Level, by the TX asking for its next packet
+  PacketBuffer * removeOutboundIL(unsigned int * priority = 0) {
+    PacketBuffer * pb = outbound.remove(priority);
+    txRemoved(pb != 0);
+    return pb;
+  }
+  // Called by BackGround processing
+  PacketBuffer * removeInboundBG(unsigned int * priority = 0) {
+    PacketBuffer * pb = inbound.remove(priority);
+    if (pb) readyAdd(faceReadiness.inbound.removed, face(), 1);
+    return pb;
+  }
+
+  // Batches of up to n, with one index update per ring and one
+  // readiness update for the lot.  So a TX can take several packets
+  // and program the transfers back to back.
+  unsigned int insertInboundIL(PacketBuffer * const * pbs, unsigned int n,
+                               unsigned int priority = PRIORITY_BULK) {
+    inbound.stamp(pbs, n);
+    unsigned int ret = inbound.insert(pbs, n, priority);
+    if (ret > 0) readyAdd(faceReadiness.inbound.inserted, face(), ret);
+    return ret;
+  }
+  unsigned int insertOutboundBG(PacketBuffer * const * pbs, unsigned int n,
+                                unsigned int priority = PRIORITY_BULK) {
+    outbound.stamp(pbs, n);
+    unsigned int ret = outbound.insert(pbs, n, priority);
+    if (ret > 0) readyAdd(faceReadiness.outbound.inserted, face(), ret);
+    return ret;
+  }
+  unsigned int removeOutboundIL(PacketBuffer ** pbs, unsigned int n,
+                                unsigned int * priorities = 0) {
+    unsigned int ret = outbound.remove(pbs, n, priorities);
+    txRemoved(ret);
+    return ret;
+  }
+  unsigned int removeInboundBG(PacketBuffer ** pbs, unsigned int n, unsigned int * priorities = 0) {
+    unsigned int ret = inbound.remove(pbs, n, priorities);
+    if (ret > 0) readyAdd(faceReadiness.inbound.removed, face(), ret);
+    return ret;
+  }
+
+  // Called at Interrupt Level, when the TX has sent 'pb': drop this
+  // face's reference, and if it was the last, leave the buffer for
+  // reclaimBG() (the pools are background only).  'done' never fills:
+  // it has a slot for every buffer.
+  void txDoneIL(PacketBuffer * pb) {
+    if (unrefPacketBuffer(pb)) done.insert(pb);
+  }
+  // Called by BackGround processing: delete every buffer txDoneIL()
+  // left, returning how many
+  unsigned int reclaimBG() ;
+
+  // At Interrupt Level, after the TX asked for packets and got 'got'
+  void txRemoved(unsigned int got) {
+    if (got > 0) readyAdd(faceReadiness.outbound.removed, face(), got);
+    unsigned int idle = faceReadiness.txIdle;
+    unsigned int now = got ? idle & ~(1u<<face()) : idle | 1u<<face();
+    if (now != idle) ringRelease(faceReadiness.txIdle, now);
+  }
+};
+
 extern FaceQueue faceQueues[FACE_COUNT];
 
+inline unsigned int FaceQueue::face() const { return this - faceQueues; }
+
+#define ALL_FACE_BITS ((1u<<FACE_COUNT)-1)  /* Bit f for each face f */
+
+// Queue one buffer outbound on every face whose bit is set in 'faces',
+// with a reference for each, and release the caller's.  Returns the
+// bits of the faces it was queued on.
+unsigned int multicastOutboundBG(PacketBuffer * pb, unsigned int faces,
+                                 unsigned int priority = PRIORITY_BULK) ;
+
+// The same for n buffers at once, buffer k going to the faces in
+// faces[k], each face getting its buffers in order in one batch.
+// Returns the bits of the faces that got all of theirs.
+unsigned int multicastOutboundBG(PacketBuffer * const * pbs, const unsigned int * faces,
+                                 unsigned int n, unsigned int priority = PRIORITY_BULK) ;
+
+// Each face's buffer pool is the one with its FaceCode.  A face that
+// has ever received anything is guaranteed POOL_MIN_BUFFERS full size
+// buffers, POOL_MIN_64 64 byte ones and POOL_MIN_32 32 byte ones; one
+// that never has is taken to be unconnected, and donates its minimums
+// to the shared reserves until it hears something.  (Not hearing
+// anything lately doesn't count: a face busy sending, and so using
+// its pool, may well be hearing nothing back.)
+#ifndef POOL_MIN_BUFFERS
+#define POOL_MIN_BUFFERS 8
+#endif
+#ifndef POOL_MIN_64
+#define POOL_MIN_64 2
+#endif
+#ifndef POOL_MIN_32
+#define POOL_MIN_32 8
+#endif
+
+// Set each face's minimums as above.  Raising one fails while the
+// reserve it comes out of is in use (see setPoolMinimum()), so this
+// returns the bits of the faces still short of their minimums, to be
+// tried again as buffers come back.
+unsigned int rebalancePools() ;
+
+// Build an outbound packet in place: The constructor reserves a
+// PacketBuffer for up to 'words' words of 'priority' traffic -- from
+// the smallest size class that has one, else from the face's pool --
+// put() writes straight into it, and commit() queues it on the face
+// -- or, given face bits, on each of those faces, sharing the one
+// buffer -- or finish() hands it over, to be queued in a batch.  Going
+// out of scope without either returns the buffer to the pool.  (Same
+// idea as the os PacketWriter in MFMPacketWriter.h, but for this
+// sketch's word oriented PacketBuffers.)
+struct PacketWriter {
+  FaceQueue & fq;
+  PacketBuffer * pb;
+  unsigned int capacity;
+  unsigned int length;
+  unsigned int priority;
+
+  PacketWriter(FaceQueue & fq, unsigned int words = PACKET_MAX_WORDS,
+               unsigned int priority = PRIORITY_BULK)
+    : fq(fq), pb(newPacketBuffer(&fq - faceQueues, words)),
+      capacity(pb ? packetCapacity(pb) : 0), length(0), priority(priority) { }
+  ~PacketWriter() { abort(); }
+
+  bool ok() { return pb != 0; }   // False if no buffer could be had
+
+  bool put(unsigned long word) {
+    if (!pb || length >= capacity) return false;
+    pb->words[length++] = word;
+    return true;
+  }
+
+  bool commit() {
+    if (!pb) return false;
+    setPacketLength(pb, length);
+    if (!fq.insertOutboundBG(pb, priority)) return false;  // abort() will free it
+    pb = 0;
+    return true;
+  }
+
+  bool commit(unsigned int faces) {  // True if queued on every one of 'faces', and there are some
+    if (!pb || !faces) return false; // abort() will free it
+    setPacketLength(pb, length);
+    PacketBuffer * shared = pb;
+    pb = 0;                          // The faces' references own it now
+    return multicastOutboundBG(shared, faces, priority) == faces;
+  }
+
+  PacketBuffer * finish() {          // Hand over the packet, and its reference, unqueued
+    if (!pb) return 0;
+    setPacketLength(pb, length);
+    PacketBuffer * ret = pb;
+    pb = 0;
+    return ret;
+  }
+
+  void abort() {
+    if (pb) deletePacketBuffer(pb);
+    pb = 0;
+  }
+};
+
 #endif /* _FACEQUEUE_H_ */
@@ -1,55 +1,511 @@
 #include "Packets.h"
 
-#define BUFFER_COUNT 100
-static PacketBuffer buffers[BUFFER_COUNT] __attribute__((aligned(256)));
+PacketArena packetArena __attribute__((aligned(256)));
+PacketDescriptors packetDescriptors;
 
-static PacketQueue _freeList;
+static PacketQueue _freeLists[PACKET_CLASSES];
+
+// Compile-time checks that each class lies where packetIndex() looks
+// for it, that every index fits with NO_PACKET to spare, and that a
+// ring can hold every buffer at once
+typedef char PacketBufferIs256[sizeof(PacketBuffer) == 256 ? 1 : -1];
+typedef char PacketArenaIsPacked[sizeof(PacketArena) ==
+                                 PACKET_ARENA_32 + CLASS_32_COUNT*32 ? 1 : -1];
+typedef char PacketIndexFits[PACKET_BUFFER_TOTAL <= NO_PACKET ? 1 : -1];
+typedef char PacketRingHoldsThePool[PACKET_RING_SLOTS > PACKET_BUFFER_TOTAL ? 1 : -1];
+
+static PoolStats _pools[PACKET_CLASSES][PACKET_POOLS];
+static unsigned int _reserveSize[PACKET_CLASSES], _reserveUsed[PACKET_CLASSES];
+static unsigned int _reservePeak[PACKET_CLASSES];
+static ClassStats _classes[PACKET_CLASSES];
 
 void initPackets() {
-  for (int i = 0; i < BUFFER_COUNT; ++i) {
-    buffers[i].trailer.next = 0;
-    deletePacketBuffer(&buffers[i]);
+  for (int c = 0; c < PACKET_CLASSES; ++c) {
+    for (int p = 0; p < PACKET_POOLS; ++p) _pools[c][p] = PoolStats();
+    _reserveSize[c] = _reserveUsed[c] = _reservePeak[c] = 0;
+    _freeLists[c] = PacketQueue();
+    _classes[c] = ClassStats();
+  }
+  for (int i = 0; i < PACKET_BUFFER_TOTAL; ++i) {
+    PacketBuffer * pb = packetBuffer(i);
+    packetDescriptors.pool[i] = NO_POOL;
+    packetDescriptors.refs[i] = 0;
+    setPacketLength(pb, 0);
+    unsigned int c = packetClass(i);
+    _freeLists[c].insert(pb);
+    ++_classes[c].count;
+    ++_reserveSize[c];         // Nothing guaranteed to anybody yet
+  }
+}
+
+// The buffers a pool holding 'held' with minimum 'minimum' has from the reserve
+static unsigned int excess(unsigned int held, unsigned int minimum) {
+  return held > minimum ? held - minimum : 0;
+}
+
+// The smallest class holding 'words' words
+static unsigned int classFor(unsigned int words) {
+  if (words <= classWords(CLASS_32)) return CLASS_32;
+  if (words <= classWords(CLASS_64)) return CLASS_64;
+  return CLASS_256;
+}
+
+// A buffer of class c charged to 'pool', or 0 if the pool can't have one
+static PacketBuffer * take(unsigned int c, unsigned int pool) {
+  PoolStats & p = _pools[c][pool];
+  bool own = p.held < p.minimum;
+  if (!own && _reserveUsed[c] >= _reserveSize[c]) {
+    ++p.starved;
+    return 0;
+  }
+  // Every pool's unused minimum, and the unused reserve, are always
+  // on the free list (setPoolMinimum() sees to that), so this works
+  PacketBuffer * pb = _freeLists[c].remove();
+  if (own) ++p.guaranteed;
+  else {
+    ++p.granted;
+    if (++_reserveUsed[c] > _reservePeak[c]) _reservePeak[c] = _reserveUsed[c];
+  }
+  ++p.held;
+  PacketIndex i = packetIndex(pb);
+  packetDescriptors.pool[i] = (unsigned char) pool;
+  packetDescriptors.refs[i] = 1;
+  ClassStats & cs = _classes[c];
+  ++cs.allocated;
+  if (++cs.inUse > cs.peak) cs.peak = cs.inUse;
+  return pb;
+}
+
+PacketBuffer * newPacketBuffer(unsigned int pool, unsigned int words) {
+  if (pool >= PACKET_POOLS || words > PACKET_MAX_WORDS) return 0;
+  for (unsigned int c = classFor(words); c < CLASS_256; ++c) {
+    PacketBuffer * pb = take(c, pool);
+    if (pb) return pb;
+    ++_classes[c].overflowed;
   }
+  return take(CLASS_256, pool);
 }
 
-PacketBuffer * newPacketBuffer() {
-  return _freeList.remove();
+bool releasePacketBuffer(PacketBuffer * pb) {
+  if (!unrefPacketBuffer(pb)) return false;
+  deletePacketBuffer(pb);
+  return true;
 }
 
 void deletePacketBuffer(PacketBuffer * pb) {
-  _freeList.insert(pb);
+  PacketIndex i = packetIndex(pb);
+  unsigned int c = packetClass(i);
+  unsigned int pool = packetDescriptors.pool[i];
+  if (pool != NO_POOL) {
+    PoolStats & p = _pools[c][pool];
+    if (p.held > p.minimum) --_reserveUsed[c];
+    --p.held;
+    packetDescriptors.pool[i] = NO_POOL;
+  }
+  packetDescriptors.refs[i] = 0;
+  setPacketLength(pb, 0);
+  _freeLists[c].insert(pb);
+  --_classes[c].inUse;
 }
 
-void PacketQueue::insert(PacketBuffer * pb) {
-  if (first==0) first = pb;
-  if (last==0) last = pb;
-  else { 
-    last->trailer.next = pb;
-    last = pb;
+unsigned int poolAvailable(unsigned int pool, unsigned int c) {
+  if (pool >= PACKET_POOLS || c >= PACKET_CLASSES) return 0;
+  const PoolStats & p = _pools[c][pool];
+  unsigned int own = p.held < p.minimum ? p.minimum - p.held : 0;
+  unsigned int spare = _reserveUsed[c] < _reserveSize[c] ? _reserveSize[c] - _reserveUsed[c] : 0;
+  return own + spare;
+}
+
+bool setPoolMinimum(unsigned int pool, unsigned int minimum, unsigned int c) {
+  if (pool >= PACKET_POOLS || c >= PACKET_CLASSES) return false;
+  PoolStats & p = _pools[c][pool];
+  unsigned int size = _reserveSize[c] + p.minimum - minimum;
+  unsigned int used = _reserveUsed[c] - excess(p.held, p.minimum) + excess(p.held, minimum);
+  if (minimum > p.minimum + _reserveSize[c] || (minimum > p.minimum && used > size)) {
+    ++p.raisesRefused;
+    return false;
   }
-  last->trailer.next = 0;
+  _reserveSize[c] = size;
+  _reserveUsed[c] = used;
+  p.minimum = minimum;
+  return true;
+}
+
+// Out of range classes are taken to be the full size one
+static unsigned int validClass(unsigned int c) { return c < PACKET_CLASSES ? c : CLASS_256; }
+
+const PoolStats & poolStats(unsigned int pool, unsigned int c) {
+  return _pools[validClass(c)][pool < PACKET_POOLS ? pool : 0];
+}
+unsigned int poolReserveSize(unsigned int c) { return _reserveSize[validClass(c)]; }
+unsigned int poolReserveUsed(unsigned int c) { return _reserveUsed[validClass(c)]; }
+unsigned int poolReservePeak(unsigned int c) { return _reservePeak[validClass(c)]; }
+unsigned int poolFreeCount(unsigned int c) {
+  const ClassStats & cs = _classes[validClass(c)];
+  return cs.count - cs.inUse;
+}
+
+const ClassStats & classStats(unsigned int c) { return _classes[validClass(c)]; }
+
+void PacketQueue::insert(PacketBuffer * pb) {
+  PacketIndex i = packetIndex(pb);
+  if (first==NO_PACKET) first = i;
+  else packetDescriptors.next[last] = i;
+  last = i;
+  packetDescriptors.next[i] = NO_PACKET;
 
 #if PACKET_QUEUE_STATS
   ++packetsIn;
-  wordsIn += pb->trailer.length;
+  wordsIn += packetDescriptors.length[i];
 #endif
 
 }
 
 PacketBuffer * PacketQueue::remove() {
-  if (first==0) return 0;
-  PacketBuffer * ret = first;
-  if (first==last) {
-    first = last = 0;
-  } else {
-    first = first->trailer.next;
+  if (first==NO_PACKET) return 0;
+  PacketIndex i = first;
+  first = packetDescriptors.next[i];
+  if (first==NO_PACKET) last = NO_PACKET;
+
+#if PACKET_QUEUE_STATS
+  ++packetsOut;
+  wordsOut += packetDescriptors.length[i];
+#endif
+
+  return packetBuffer(i);
+}
+
+void PacketQueue::insertChain(PacketQueue & chain) {
+  if (chain.first==NO_PACKET) return;
+  if (first==NO_PACKET) first = chain.first;
+  else packetDescriptors.next[last] = chain.first;
+  last = chain.last;
+
+#if PACKET_QUEUE_STATS
+  unsigned long packets = chain.packetsIn - chain.packetsOut;
+  unsigned long words = chain.wordsIn - chain.wordsOut;
+  packetsIn += packets;
+  wordsIn += words;
+  chain.packetsOut += packets;
+  chain.wordsOut += words;
+#endif
+
+  chain.first = chain.last = NO_PACKET;
+}
+
+unsigned int PacketQueue::removeUpTo(unsigned int n, PacketQueue & into) {
+  if (n == 0 || first==NO_PACKET) return 0;
+  PacketQueue chain;
+  chain.first = chain.last = first;
+  unsigned int count = 1;
+  unsigned long words = packetDescriptors.length[first];  // (Counted on the walk, for stats)
+  while (count < n && packetDescriptors.next[chain.last] != NO_PACKET) {
+    chain.last = packetDescriptors.next[chain.last];
+    words += packetDescriptors.length[chain.last];
+    ++count;
   }
-  ret->trailer.next = 0;
+  first = packetDescriptors.next[chain.last];
+  if (first==NO_PACKET) last = NO_PACKET;
+  packetDescriptors.next[chain.last] = NO_PACKET;
+
+#if PACKET_QUEUE_STATS
+  packetsOut += count;
+  wordsOut += words;
+  chain.packetsIn = count;
+  chain.wordsIn = words;
+#else
+  (void) words;
+#endif
+
+  into.insertChain(chain);
+  return count;
+}
+
+#define PACKET_RING_MASK (PACKET_RING_SLOTS-1)
+
+bool PacketRing::insert(PacketBuffer * pb) {
+  unsigned int t = tail;
+  if (t - ringAcquire(head) >= PACKET_RING_SLOTS) return false;
+  PacketIndex i = packetIndex(pb);
+  slots[t&PACKET_RING_MASK] = i;
+
+#if PACKET_QUEUE_STATS
+  ++packetsIn;
+  wordsIn += packetDescriptors.length[i];
+#endif
+
+  ringRelease(tail, t+1);      // Publish the slot, and the packet, to the consumer
+  return true;
+}
+
+PacketBuffer * PacketRing::remove() {
+  unsigned int h = head;
+  if (h == ringAcquire(tail)) return 0;
+  PacketIndex i = slots[h&PACKET_RING_MASK];
 
 #if PACKET_QUEUE_STATS
   ++packetsOut;
-  wordsOut += ret->trailer.length;
+  wordsOut += packetDescriptors.length[i];
+#endif
+
+  ringRelease(head, h+1);      // Hand the slot back to the producer
+  return packetBuffer(i);
+}
+
+unsigned int PacketRing::insert(PacketBuffer * const * pbs, unsigned int n) {
+  unsigned int t = tail;
+  unsigned int room = PACKET_RING_SLOTS - (t - ringAcquire(head));
+  if (n > room) n = room;
+  for (unsigned int k = 0; k < n; ++k) {
+    PacketIndex i = packetIndex(pbs[k]);
+    slots[(t+k)&PACKET_RING_MASK] = i;
+
+#if PACKET_QUEUE_STATS
+    wordsIn += packetDescriptors.length[i];
+#endif
+
+  }
+
+#if PACKET_QUEUE_STATS
+  packetsIn += n;
+#endif
+
+  if (n > 0) ringRelease(tail, t+n);  // Publish them all at once
+  return n;
+}
+
+unsigned int PacketRing::remove(PacketBuffer ** pbs, unsigned int n) {
+  unsigned int h = head;
+  unsigned int there = ringAcquire(tail) - h;
+  if (n > there) n = there;
+  for (unsigned int k = 0; k < n; ++k) {
+    PacketIndex i = slots[(h+k)&PACKET_RING_MASK];
+    pbs[k] = packetBuffer(i);
+
+#if PACKET_QUEUE_STATS
+    wordsOut += packetDescriptors.length[i];
+#endif
+
+  }
+
+#if PACKET_QUEUE_STATS
+  packetsOut += n;
 #endif
 
-  return ret;
+  if (n > 0) ringRelease(head, h+n);  // Hand them all back at once
+  return n;
 }
+
+// Host sim microbenchmark: cycle every buffer through the free list
+// and a face ring and back, timing just the queue operations, both as
+// they are and with the intrusive, pointer based queues they replaced
+// (kept here for comparison).  The 'cold' rounds flush the buffers
+// from the cache first, as happens when a packet has been sitting in
+// a queue while the background worked on everything else, and with
+// the chain and batch operations moving eight at a time.  Then it
+// fills the arena with one word messages, to count how many the size
+// classes keep in flight, and times allocating from each class.
+//
+// TO COMPILE FOR BENCHMARKING:
+//
+// g++ -O2 -Wall -Werror -DHOST_MODE -DBENCH_PACKET_QUEUES -o"./benchpacketqueues" Packets.cpp;./benchpacketqueues
+
+#ifdef BENCH_PACKET_QUEUES
+
+#include <stdio.h>
+#include <time.h>      // For clock_gettime
+
+struct LegacyBuffer;
+
+struct LegacyTrailer {
+  unsigned char length;
+  unsigned char reserved[3];
+  LegacyBuffer * next;
+};
+
+struct LegacyBuffer {
+  unsigned long words[(256-sizeof(LegacyTrailer))/sizeof(unsigned long)];
+  LegacyTrailer trailer;
+};
+
+static LegacyBuffer legacyBuffers[BUFFER_COUNT] __attribute__((aligned(256)));
+
+struct LegacyQueue {
+  LegacyBuffer * first;
+  LegacyBuffer * last;
+  unsigned long packetsIn, packetsOut, wordsIn, wordsOut;
+
+  LegacyQueue() : first(0), last(0), packetsIn(0), packetsOut(0), wordsIn(0), wordsOut(0) { }
+
+  void insert(LegacyBuffer * pb) {
+    if (first==0) first = pb;
+    if (last==0) last = pb;
+    else {
+      last->trailer.next = pb;
+      last = pb;
+    }
+    last->trailer.next = 0;
+    ++packetsIn;
+    wordsIn += pb->trailer.length;
+  }
+
+  LegacyBuffer * remove() {
+    if (first==0) return 0;
+    LegacyBuffer * ret = first;
+    if (first==last) first = last = 0;
+    else first = first->trailer.next;
+    ret->trailer.next = 0;
+    ++packetsOut;
+    wordsOut += ret->trailer.length;
+    return ret;
+  }
+};
+
+struct LegacyRing {
+  volatile unsigned int head;
+  unsigned long packetsOut, wordsOut;
+  LegacyBuffer * slots[PACKET_RING_SLOTS];
+  volatile unsigned int tail;
+  unsigned long packetsIn, wordsIn;
+
+  LegacyRing() : head(0), packetsOut(0), wordsOut(0), tail(0), packetsIn(0), wordsIn(0) { }
+
+  bool insert(LegacyBuffer * pb) {
+    unsigned int t = tail;
+    if (t - ringAcquire(head) >= PACKET_RING_SLOTS) return false;
+    pb->trailer.next = 0;
+    slots[t&PACKET_RING_MASK] = pb;
+    ++packetsIn;
+    wordsIn += pb->trailer.length;
+    ringRelease(tail, t+1);
+    return true;
+  }
+
+  LegacyBuffer * remove() {
+    unsigned int h = head;
+    if (h == ringAcquire(tail)) return 0;
+    LegacyBuffer * ret = slots[h&PACKET_RING_MASK];
+    ++packetsOut;
+    wordsOut += ret->trailer.length;
+    ringRelease(head, h+1);
+    return ret;
+  }
+};
+
+static double nowSeconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+static void flush(const void * buffers, unsigned int bytes) {
+#ifdef __SSE2__
+  for (unsigned int b = 0; b < bytes; b += 64)
+    __builtin_ia32_clflush((const char *) buffers + b);
+  __builtin_ia32_mfence();
+#endif
+}
+
+// One round: every buffer out of the free list into the ring, then
+// out of the ring back to the free list.  Returns the seconds taken.
+template <class Buffer, class Queue, class Ring>
+static double cycle(Queue & freeList, Ring & ring, Buffer * buffers, bool cold) {
+  if (cold) flush(buffers, BUFFER_COUNT*sizeof(Buffer));
+  double start = nowSeconds();
+  for (Buffer * pb; (pb = freeList.remove()) != 0; ) ring.insert(pb);
+  for (Buffer * pb; (pb = ring.remove()) != 0; ) freeList.insert(pb);
+  return nowSeconds()-start;
+}
+
+// The same round in batches: chains off the free list, arrays into
+// and out of the ring, and chains back onto the free list
+static double batchCycle(PacketQueue & freeList, PacketRing & ring, bool cold) {
+  const unsigned int BATCH = 8;
+  if (cold) flush(packetArena.buffers256, sizeof(packetArena.buffers256));
+  double start = nowSeconds();
+  PacketBuffer * pbs[BATCH];
+  PacketQueue chain;
+  while (freeList.removeUpTo(BATCH, chain) > 0) {
+    unsigned int n = 0;
+    for (PacketBuffer * pb; (pb = chain.remove()) != 0; ) pbs[n++] = pb;
+    ring.insert(pbs, n);
+  }
+  for (unsigned int n; (n = ring.remove(pbs, BATCH)) > 0; freeList.insertChain(chain))
+    for (unsigned int k = 0; k < n; ++k) chain.insert(pbs[k]);
+  return nowSeconds()-start;
+}
+
+int main() {
+  initPackets();
+  static PacketRing ring, batchRing;
+  static LegacyQueue legacyFree;
+  static LegacyRing legacyRing;
+  for (int i = 0; i < BUFFER_COUNT; ++i) {
+    legacyBuffers[i].trailer.length = 0;
+    legacyFree.insert(&legacyBuffers[i]);
+  }
+
+  printf("Queue metadata: ring %u bytes (was %u), free list %u bytes (was %u), "
+         "descriptors %u bytes\n",
+         (unsigned) sizeof(PacketRing), (unsigned) sizeof(LegacyRing),
+         (unsigned) sizeof(PacketQueue), (unsigned) sizeof(LegacyQueue),
+         (unsigned) sizeof(PacketDescriptors));
+
+  const unsigned int OPS = 4*BUFFER_COUNT;   // Per round
+  for (int cold = 0; cold < 2; ++cold) {
+    const unsigned int ROUNDS = cold ? 20000 : 200000;
+    double indexed = 0, batched = 0, legacy = 0;
+    for (unsigned int r = 0; r < ROUNDS; ++r) {
+      indexed += cycle(_freeLists[CLASS_256], ring, packetArena.buffers256, cold);
+      batched += batchCycle(_freeLists[CLASS_256], batchRing, cold);
+      legacy += cycle(legacyFree, legacyRing, legacyBuffers, cold);
+    }
+    if (ring.packetsOut != legacyRing.packetsOut || batchRing.packetsOut != ring.packetsOut ||
+        batchRing.wordsOut != ring.wordsOut || _freeLists[CLASS_256].first == NO_PACKET) {
+      fprintf(stderr, "FAILED: rings moved %lu and %lu packets\n",
+              ring.packetsOut, legacyRing.packetsOut);
+      return 1;
+    }
+    printf("%s payload:\n", cold ? "Cold" : "Hot");
+    printf("  %-24s %8.2f ns/op\n", "index, descriptors", indexed*1e9/ROUNDS/OPS);
+    printf("  %-24s %8.2f ns/op\n", "index, batches of 8", batched*1e9/ROUNDS/OPS);
+    printf("  %-24s %8.2f ns/op\n", "pointer, intrusive", legacy*1e9/ROUNDS/OPS);
+  }
+
+  // Pool 0 has no minimums, so everything it gets comes from the
+  // reserves, which are every buffer of every class
+  static PacketBuffer * inFlight[PACKET_BUFFER_TOTAL+1];
+  unsigned int held = 0;
+  while (held <= PACKET_BUFFER_TOTAL && (inFlight[held] = newPacketBuffer(0, 1)) != 0) ++held;
+  printf("Size classes: %u one word messages in flight in %u bytes (%u with full size "
+         "buffers only)\n", held, (unsigned) sizeof(PacketArena),
+         (unsigned) (sizeof(PacketArena)/sizeof(PacketBuffer)));
+  bool ok = held == PACKET_BUFFER_TOTAL;
+  for (int c = 0; c < PACKET_CLASSES; ++c) ok = ok && classStats(c).peak == classStats(c).count;
+  while (held > 0) deletePacketBuffer(inFlight[--held]);
+  for (int c = 0; c < PACKET_CLASSES; ++c) {
+    ok = ok && classStats(c).inUse == 0 && poolReserveUsed(c) == 0 &&
+      poolReservePeak(c) == classStats(c).count && poolFreeCount(c) == classStats(c).count;
+  }
+  if (!ok) {
+    fprintf(stderr, "FAILED: %u messages in flight, size class accounting off\n", held);
+    return 1;
+  }
+
+  const unsigned int PAIRS = 10000000;
+  for (int c = 0; c < PACKET_CLASSES; ++c) {
+    unsigned int words = classWords(c);
+    double start = nowSeconds();
+    for (unsigned int i = 0; i < PAIRS; ++i) {
+      PacketBuffer * pb = newPacketBuffer(i%PACKET_POOLS, words);
+      if (!pb || packetCapacity(pb) < words) return 1;
+      deletePacketBuffer(pb);
+    }
+    double secs = nowSeconds()-start;
+    printf("  %3u byte class %8.2f ns/new+delete, %u buffers\n",
+           (unsigned) (words*sizeof(unsigned long)), secs*1e9/PAIRS, classStats(c).count);
+  }
+  return 0;
+}
+
+#endif /* BENCH_PACKET_QUEUES */
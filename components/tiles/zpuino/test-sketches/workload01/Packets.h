@@ -5,28 +5,113 @@
 #define PACKET_QUEUE_STATS 1  /* For now, default to having stats */
 #endif
 
+// Of the stats, wait times cost a clock read as each packet is queued
+// and another as it's served.  That's a register read on the tile,
+// but in a host sim in a VM it can be a trapped rdtsc, dearer than
+// the queue operation itself; so the face queue bench, which times
+// the queues against the old ones, that had no wait times, leaves
+// them out.
+#ifndef PACKET_QUEUE_WAITS
+#ifdef BENCH_FACE_QUEUE
+#define PACKET_QUEUE_WAITS 0
+#else
+#define PACKET_QUEUE_WAITS PACKET_QUEUE_STATS
+#endif
+#endif
+
 void initPackets() ;
 
-struct PacketBuffer; // Forward
+// Buffers come in three size classes: full size ones for payload,
+// and two smaller ones for short packets -- lock traffic, the tails of
+// events -- so the same RAM holds more packets in flight.  Each
+// class's buffers are its size apart and aligned to it, so a buffer's
+// index is still a compare or two and a shift away from its address.
+enum PacketClass { CLASS_32, CLASS_64, CLASS_256, PACKET_CLASSES };
 
-struct PacketTrailer {
-  unsigned char length;
-  unsigned char reserved[3];
-  PacketBuffer * next;
+#define BUFFER_COUNT 76        /* Full size (256 byte) PacketBuffers */
+#define CLASS_64_COUNT 32      /* 64 byte buffers */
+#define CLASS_32_COUNT 128     /* 32 byte buffers */
+#define PACKET_BUFFER_TOTAL (BUFFER_COUNT+CLASS_64_COUNT+CLASS_32_COUNT)
 
-  PacketTrailer() : length(0), next(0) { }
-};
-
-#define PACKET_MAX_WORDS ((256-sizeof(PacketTrailer))/sizeof(unsigned long))
+#define PACKET_MAX_WORDS (256/sizeof(unsigned long))
 
+// A PacketBuffer is all payload.  Everything the queues need to know
+// about it lives in the descriptor table below, so queueing and
+// dequeueing never touch a packet's own cache lines.  A buffer from a
+// smaller class is the start of one: only its first packetCapacity()
+// words exist.
 struct PacketBuffer {
   unsigned long words[PACKET_MAX_WORDS];
-  PacketTrailer trailer;
 };
 
+// All the buffers, biggest class first so each lands on its alignment
+struct PacketArena {
+  PacketBuffer buffers256[BUFFER_COUNT];
+  unsigned long buffers64[CLASS_64_COUNT][64/sizeof(unsigned long)];
+  unsigned long buffers32[CLASS_32_COUNT][32/sizeof(unsigned long)];
+};
+
+extern PacketArena packetArena;
+
+#define PACKET_ARENA_64 (BUFFER_COUNT*256)                   /* Offset of buffers64 */
+#define PACKET_ARENA_32 (PACKET_ARENA_64 + CLASS_64_COUNT*64)  /* Offset of buffers32 */
+
+// Buffers are named by index: the 256 byte class first, then the 64
+// and the 32
+typedef unsigned char PacketIndex;
+#define NO_PACKET ((PacketIndex) 0xff)
+
+inline PacketIndex packetIndex(const PacketBuffer * pb) {
+  unsigned long at = (const char *) pb - (const char *) &packetArena;
+  if (at < PACKET_ARENA_64) return (PacketIndex) (at>>8);
+  if (at < PACKET_ARENA_32) return (PacketIndex) (BUFFER_COUNT + ((at-PACKET_ARENA_64)>>6));
+  return (PacketIndex) (BUFFER_COUNT + CLASS_64_COUNT + ((at-PACKET_ARENA_32)>>5));
+}
+inline PacketBuffer * packetBuffer(PacketIndex i) {
+  char * arena = (char *) &packetArena;
+  if (i < BUFFER_COUNT) return (PacketBuffer *) (arena + (i<<8));
+  i -= BUFFER_COUNT;
+  if (i < CLASS_64_COUNT) return (PacketBuffer *) (arena + PACKET_ARENA_64 + (i<<6));
+  i -= CLASS_64_COUNT;
+  return (PacketBuffer *) (arena + PACKET_ARENA_32 + (i<<5));
+}
+
+inline unsigned int packetClass(PacketIndex i) {
+  return i < BUFFER_COUNT ? CLASS_256 : i < BUFFER_COUNT+CLASS_64_COUNT ? CLASS_64 : CLASS_32;
+}
+
+// The words a buffer of class c holds
+inline unsigned int classWords(unsigned int c) {
+  return (c == CLASS_32 ? 32 : c == CLASS_64 ? 64 : 256)/sizeof(unsigned long);
+}
+inline unsigned int packetCapacity(const PacketBuffer * pb) {
+  return classWords(packetClass(packetIndex(pb)));
+}
+
+// The descriptor table, one entry per buffer, as separate arrays
+struct PacketDescriptors {
+  unsigned char length[PACKET_BUFFER_TOTAL];  // Words of the buffer in use
+  PacketIndex next[PACKET_BUFFER_TOTAL];      // The next buffer in its PacketQueue
+  unsigned char pool[PACKET_BUFFER_TOTAL];    // The pool it's charged to, or NO_POOL
+  volatile unsigned char refs[PACKET_BUFFER_TOTAL];  // Queues (and writers) holding it
+#if PACKET_QUEUE_WAITS
+  unsigned short queuedAt[2][PACKET_BUFFER_TOTAL];   // When it was queued, inbound and
+#endif                                               // outbound, for wait times
+};
+
+extern PacketDescriptors packetDescriptors;
+
+inline unsigned int packetLength(const PacketBuffer * pb) {
+  return packetDescriptors.length[packetIndex(pb)];
+}
+inline void setPacketLength(PacketBuffer * pb, unsigned int words) {
+  packetDescriptors.length[packetIndex(pb)] = (unsigned char) words;
+}
+
+// A PacketQueue is a list linked through packetDescriptors.next
 struct PacketQueue {
-  PacketBuffer * first;
-  PacketBuffer * last;
+  PacketIndex first;
+  PacketIndex last;
 
 #if PACKET_QUEUE_STATS
   unsigned long packetsIn, packetsOut, wordsIn, wordsOut;
@@ -34,16 +119,211 @@ struct PacketQueue {
 
   void insert(PacketBuffer *) ;
   PacketBuffer * remove() ;
-  bool isEmpty() { return first==0; }
+  bool isEmpty() { return first==NO_PACKET; }
+
+  // Chains: whole lists spliced from one PacketQueue to another, with
+  // the stats of both updated in aggregate.  insertChain() and
+  // removeAll() are O(1).  removeUpTo() is O(n): the list keeps no
+  // count, so it walks the n packets it moves to find where to split,
+  // and only the splice itself is O(1).
+  void insertChain(PacketQueue & chain) ;  // Append all of chain, emptying it
+  void removeAll(PacketQueue & into) { into.insertChain(*this); }
+  unsigned int removeUpTo(unsigned int n, PacketQueue & into) ;  // Returns how many moved
 
-  PacketQueue() : first(0), last(0)
+  PacketQueue() : first(NO_PACKET), last(NO_PACKET)
 #if PACKET_QUEUE_STATS
     , packetsIn(0), packetsOut(0), wordsIn(0), wordsOut(0)
 #endif
  { }
 };
 
-PacketBuffer * newPacketBuffer() ;
+// Reading the other side's PacketRing index, and publishing our own.
+// Everything written before a ringRelease() is visible to the side
+// whose ringAcquire() sees the released value.  On the tile the two
+// sides are background and interrupt level on one core, so it's
+// enough to stop the compiler from reordering; in the host sim
+// they're real threads, so it takes acquire and release atomics.
+#ifndef HOST_MODE
+inline unsigned int ringAcquire(volatile unsigned int & index) {
+  unsigned int ret = index;
+  __asm__ __volatile__ ("" : : : "memory");
+  return ret;
+}
+inline void ringRelease(volatile unsigned int & index, unsigned int value) {
+  __asm__ __volatile__ ("" : : : "memory");
+  index = value;
+}
+#else
+inline unsigned int ringAcquire(volatile unsigned int & index) {
+  return __atomic_load_n(&index, __ATOMIC_ACQUIRE);
+}
+inline void ringRelease(volatile unsigned int & index, unsigned int value) {
+  __atomic_store_n(&index, value, __ATOMIC_RELEASE);
+}
+#endif
+
+// Changing a buffer's reference count from either side.  On the tile
+// that means masking interrupts for the read-modify-write (restoring
+// whatever they were, so it works at interrupt level too); in the
+// host sim it's an atomic operation, and a full barrier.  refAdd()
+// returns the new count.  A holder of the only reference needn't pay
+// for that: nobody else can be changing the count, so refLoad()
+// seeing 1 means it's free to refStore() the new count outright -- a
+// plain read and write, on the tile.
+#ifndef HOST_MODE
+#include "register.h"  // For INTRCTL
+inline unsigned int refAdd(volatile unsigned char & refs, int delta) {
+  unsigned int was = INTRCTL;
+  INTRCTL = 0;
+  unsigned int ret = refs = (unsigned char) (refs + delta);
+  INTRCTL = was;
+  return ret;
+}
+inline unsigned int refLoad(volatile unsigned char & refs) { return refs; }
+inline void refStore(volatile unsigned char & refs, unsigned int value) {
+  refs = (unsigned char) value;
+}
+#else
+inline unsigned int refAdd(volatile unsigned char & refs, int delta) {
+  return __atomic_add_fetch(&refs, delta, __ATOMIC_ACQ_REL);
+}
+inline unsigned int refLoad(volatile unsigned char & refs) {
+  return __atomic_load_n(&refs, __ATOMIC_ACQUIRE);
+}
+inline void refStore(volatile unsigned char & refs, unsigned int value) {
+  __atomic_store_n(&refs, (unsigned char) value, __ATOMIC_RELAXED);
+}
+#endif
+
+#ifndef PACKET_RING_SLOTS
+#define PACKET_RING_SLOTS 256  /* Power of two, more than every buffer so a ring never fills */
+#endif
+
+// A PacketRing is a single-producer, single-consumer queue: one side
+// only ever inserts and the other only ever removes, and each writes
+// only its own index, so neither ever has to lock the other out.
+// (The slots sit between the two indices to keep them off each
+// other's cache lines in the host sim.)
+struct PacketRing {
+  volatile unsigned int head;  // Next slot to remove; written only by the consumer
+#if PACKET_QUEUE_STATS
+  unsigned long packetsOut, wordsOut;
+#endif
+
+  PacketIndex slots[PACKET_RING_SLOTS];
+
+  volatile unsigned int tail;  // Next slot to fill; written only by the producer
+#if PACKET_QUEUE_STATS
+  unsigned long packetsIn, wordsIn;
+#endif
+
+  bool insert(PacketBuffer *) ;  // Producer only.  False if full
+  PacketBuffer * remove() ;      // Consumer only.  Null if empty
+
+  // Batches: up to n at once, for one index update, returning how
+  // many were inserted (as many as fit) or removed (as many as there were)
+  unsigned int insert(PacketBuffer * const * pbs, unsigned int n) ;  // Producer only
+  unsigned int remove(PacketBuffer ** pbs, unsigned int n) ;         // Consumer only
+
+  bool isEmpty() { return ringAcquire(head) == ringAcquire(tail); }
+  unsigned int depth() { return ringAcquire(tail) - ringAcquire(head); }
+  unsigned int inserted() { return ringAcquire(tail); }  // Ever, mod 2^32
+
+  PacketRing() : head(0)
+#if PACKET_QUEUE_STATS
+    , packetsOut(0), wordsOut(0)
+#endif
+    , tail(0)
+#if PACKET_QUEUE_STATS
+    , packetsIn(0), wordsIn(0)
+#endif
+ { }
+};
+
+// Buffer pools.  Each size class's buffers are shared out among
+// PACKET_POOLS pools (one per face): in each class, each pool has a
+// guaranteed minimum, and everything not guaranteed to some pool is a
+// shared reserve that any pool can be granted buffers from, first
+// come first served.  So one congested face can use up a class's
+// reserve, but never another face's minimum -- of the small buffers
+// that carry control traffic any more than of full size ones.  A
+// short packet takes a buffer of the smallest class that fits and
+// that its pool can have, and only comes to the full size class when
+// its pool can have none of the smaller ones.
+// Pool operations are for background processing only.
+
+#define PACKET_POOLS 8
+#define NO_POOL ((unsigned char) 0xff)
+
+struct PoolStats {             // Of one pool, in one class
+  unsigned int minimum;        // Buffers guaranteed to this pool
+  unsigned int held;           // Buffers now charged to it
+  unsigned long guaranteed;    // Buffers handed out within its minimum
+  unsigned long granted;       // Buffers handed out from the reserve
+  unsigned long starved;       // Requests refused (in the full size class, outright)
+  unsigned long raisesRefused; // setPoolMinimum() raises refused for want of buffers
+};
+
+struct ClassStats {
+  unsigned int count;          // Buffers in the class
+  unsigned int inUse;          // Buffers now allocated
+  unsigned int peak;           // The most inUse has been
+  unsigned long allocated;     // Buffers handed out
+  unsigned long overflowed;    // Requests that fit but went to a bigger class
+};
+
+// A buffer of at least 'words' words, or 0 if 'pool' has used its
+// minimum, and the reserve is used up, in every class that fits.  Its
+// length is 0, and it has one reference, the caller's.
+PacketBuffer * newPacketBuffer(unsigned int pool, unsigned int words = PACKET_MAX_WORDS) ;
+
+// Return a buffer to its class's free list, and uncharge its pool,
+// whatever references it has
 void deletePacketBuffer(PacketBuffer *) ;
 
+// Multicast: A buffer queued on several faces at once carries a
+// reference for each.  Whoever is done with it -- a face's TX
+// completing, or the background after checking a packet -- drops
+// one, and whoever drops the last deletes it.  Either side can retain
+// or drop a reference; but the delete, like any, is a pool operation,
+// so background only.  The background releases, dropping its
+// reference and deleting the buffer if that was the last; interrupt
+// level only unrefs, and hands a buffer that reports its last
+// reference gone to the background (see FaceQueue::txDoneIL()).
+// Both take the caller's reference as given, so only a buffer that
+// really is multicast costs a refAdd().
+inline void retainPacketBuffer(PacketBuffer * pb, unsigned int count = 1) {
+  volatile unsigned char & refs = packetDescriptors.refs[packetIndex(pb)];
+  if (refLoad(refs) == 1) refStore(refs, 1 + count);
+  else refAdd(refs, count);
+}
+inline bool unrefPacketBuffer(PacketBuffer * pb) {  // True if that was the last reference
+  volatile unsigned char & refs = packetDescriptors.refs[packetIndex(pb)];
+  if (refLoad(refs) != 1) return refAdd(refs, -1) == 0;
+  refStore(refs, 0);
+  return true;
+}
+bool releasePacketBuffer(PacketBuffer *) ;  // Background only.  True if that was the last
+
+// How many buffers of class 'c' newPacketBuffer(pool) could hand out
+// right now.  Zero is the backpressure signal: stop producing that
+// size for that pool.
+unsigned int poolAvailable(unsigned int pool, unsigned int c = CLASS_256) ;
+
+// Change 'pool's guaranteed minimum in class 'c'.  Raising it takes
+// the buffers out of the unused reserve, and fails, changing nothing
+// but the pool's raisesRefused, if there aren't enough.  Lowering it
+// always works.
+bool setPoolMinimum(unsigned int pool, unsigned int minimum, unsigned int c = CLASS_256) ;
+
+const PoolStats & poolStats(unsigned int pool, unsigned int c = CLASS_256) ;
+
+// Of class 'c':
+unsigned int poolReserveSize(unsigned int c = CLASS_256) ;  // Buffers not guaranteed to any pool
+unsigned int poolReserveUsed(unsigned int c = CLASS_256) ;  // Granted, and not yet returned
+unsigned int poolReservePeak(unsigned int c = CLASS_256) ;  // The most poolReserveUsed() has been
+unsigned int poolFreeCount(unsigned int c = CLASS_256) ;    // Buffers in no pool
+
+const ClassStats & classStats(unsigned int packetClass) ;
+
 #endif /* _PACKETS_H_ */
@@ -29,32 +29,48 @@ void setup() {
 
     // Called when an outbound packet has been completely transmitted
     void ISHW_class::handleTXInterrupt() {
+      int faceCode = this->getFaceCode();
       PacketBuffer * oldpb = this->getJustFinishedTXPointer();
-      if (oldpb) deletePacketBuffer(oldpb);  // Return TX'd packetbuffer to pool
+      if (oldpb) faceQueue[faceCode].txDoneIL(oldpb);
+      // Only drops this face's reference.  Never release (or delete)
+      // at interrupt level: that's a pool operation, and the
+      // background may be in the middle of one.  If this face was the
+      // last to send it, the buffer waits on the face's done ring for
+      // eventProcessing() to return it to its pool.
 
-      int faceCode = this->getFaceCode();
       PacketBuffer * pb = supplyOutbound(faceQueue[faceCode]);  // code below
       if (pb) this->setNextTXPointer(pb);
-      // else device idles
+      // else device idles, and removeOutboundIL() has set its bit in
+      // faceReadiness.txIdle
+      //
+      // (With a DMA that can chain transfers, take a batch with
+      // removeOutboundIL(batch, n) instead, and program them all
+      // back to back -- as the demo supplyOutbound() below does.)
       //
       // Note that some other code (not running at interrupt level)
       // must know how to prime the TX pump when the TX side has gone
-      // idle and another outbound packet is produced.
+      // idle and another outbound packet is produced: the faces
+      // needing that are facesReady(faceReadiness.txIdle) &
+      // facesReady(faceReadiness.outbound).
     }
 */
 
-void handleInbound(FaceQueue& fq, PacketBuffer * pb) {
-  fq.insertInboundIL(pb);
+void handleInbound(FaceQueue& fq, PacketBuffer * pb, unsigned int priority = PRIORITY_BULK) {
+  fq.insertInboundIL(pb, priority);
 }
 
 void supplyOutbound(FaceQueue& fq) {
-  PacketBuffer * pb = fq.removeOutboundIL();
-  if (pb) {
-    // Supply pb to the device.  Here, just for a demo, we are
-    // pretending the packet we are about to send just arrived on the
-    // same face
+  PacketBuffer * batch[QUEUE_BATCH_MAX];
+  unsigned int priorities[QUEUE_BATCH_MAX];
+  unsigned int n = fq.removeOutboundIL(batch, QUEUE_BATCH_MAX, priorities);  // Control first
 
-    handleInbound(fq, pb);
+  // Supply the batch to the device, to send back to back.  Here, just
+  // for a demo, we are pretending the packets we are about to send
+  // just arrived on the same face, in the same priority classes, a
+  // run of each class at a time
+  for (unsigned int i = 0, j; i < n; i = j) {
+    for (j = i+1; j < n && priorities[j] == priorities[i]; ++j) { }
+    fq.insertInboundIL(batch+i, j-i, priorities[i]);
   }
 }
 
@@ -62,8 +78,11 @@ void loop() {
 
   eventProcessing();  // Do business
 
-  // Fake stub covering the missing IO devices and interconnect
-  for (int f = NT; f < FACE_COUNT; ++f) {
-    supplyOutbound(faceQueues[f]);
+  // Fake stub covering the missing IO devices and interconnect: each
+  // busy TX finishes its packet at once and asks for the next, and
+  // each idle one with something queued gets primed
+  unsigned int faces = ~facesReady(faceReadiness.txIdle) | facesReady(faceReadiness.outbound);
+  for (faces &= ALL_FACE_BITS; faces; faces &= faces-1) {
+    supplyOutbound(faceQueues[nextFace(faces)]);
   }
 }